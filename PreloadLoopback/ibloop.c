@@ -0,0 +1,2122 @@
+/*
+ * ibloop - loopback verbs provider for hardware-free benchmarking
+ *
+ * Implements the subset of libibverbs and librdmacm that
+ * qemu/migration-rdma.c and ibechoExample/ibtcp.c use, on top of Unix
+ * domain sockets and threads, so that a source and a destination process
+ * on the same host can run the real RDMA migration code paths without an
+ * HCA.  Preload it in front of both processes:
+ *
+ *   LD_PRELOAD=./libibloop.so qemu ... -incoming rdma:0:4444
+ *   LD_PRELOAD=./libibloop.so qemu ... (qemu) migrate rdma:127.0.0.1:4444
+ *
+ * or link a test program against it instead of -libverbs -lrdmacm.
+ *
+ * The link can be shaped through the environment:
+ *
+ *   IBLOOP_LATENCY_US   one-way latency added to every message and ack
+ *   IBLOOP_GBPS         port rate in Gbit/s, shared by all QPs of a process
+ *   IBLOOP_DROP_MB      every time this process has put another N MB on
+ *                       the wire, the link of the QP sending drops: its
+ *                       requests still unacked complete with
+ *                       IBV_WC_RETRY_EXC_ERR and both ends go to the error
+ *                       state, to test recovery from link failures
+ *
+ * All default to 0 (no delay, unlimited rate, no drops).
+ *
+ * Emulated: RC QPs with RDMA_WRITE[_WITH_IMM] and SEND[_WITH_IMM], CQs with
+ * completion channels, memory keys (rkey/lkey and access checks) and the
+ * CM connect/accept/reject/disconnect handshake.  Every QP has a tx thread
+ * that plays the role of the HCA reading the send queue, an rx thread that
+ * lands incoming payloads straight into the target MR and an ack thread
+ * that turns the peer's acks into send completions.  Not emulated:
+ * RDMA_READ, atomics, SRQs, UD QPs, memory windows and async events.
+ * Nothing is pinned, so registration cost is not representative.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <endian.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <infiniband/verbs.h>
+#include <rdma/rdma_cma.h>
+
+#define IBLOOP_MAX_SGE          4
+#define IBLOOP_MAX_INLINE       256
+#define IBLOOP_PRIVATE_DATA_MAX 256
+#define IBLOOP_SOCKBUF          (4 * 1024 * 1024)
+#define IBLOOP_POLL_MS          100
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+/*
+ * On the wire every request is an ibloop_msg followed by 'len' bytes of
+ * payload, and every request is answered by one ibloop_ack on the same
+ * stream, in order.
+ */
+struct ibloop_msg {
+	uint32_t opcode;	/* enum ibv_wr_opcode */
+	uint32_t len;
+	uint64_t remote_addr;
+	uint32_t rkey;
+	uint32_t imm_data;
+	uint32_t acks;		/* acks the sender had written before this */
+	uint32_t pad;
+	int64_t deliver;	/* CLOCK_MONOTONIC ns, 0 = now */
+};
+
+struct ibloop_ack {
+	uint32_t status;	/* enum ibv_wc_status */
+	uint32_t pad;
+	int64_t deliver;
+};
+
+enum {
+	IBLOOP_CM_REQ,
+	IBLOOP_CM_REP,
+	IBLOOP_CM_REJ,
+	IBLOOP_CM_DREQ,
+};
+
+struct ibloop_cm_msg {
+	uint32_t type;
+	uint32_t qp_num;
+	uint32_t private_data_len;
+	uint8_t private_data[IBLOOP_PRIVATE_DATA_MAX];
+};
+
+struct ibloop_mr {
+	struct ibv_mr mr;
+	int access;
+};
+
+struct ibloop_channel {
+	struct ibv_comp_channel channel;
+	int wfd;
+};
+
+struct ibloop_cq {
+	struct ibv_cq cq;
+	pthread_mutex_t lock;
+	struct ibv_wc *wc;
+	int head, count, size;
+	int armed;
+};
+
+struct ibloop_send {
+	uint64_t wr_id;
+	struct ibloop_msg msg;
+	int num_sge;
+	struct ibv_sge sg_list[IBLOOP_MAX_SGE];
+	uint8_t *inline_data;
+	int signaled;
+};
+
+struct ibloop_recv {
+	uint64_t wr_id;
+	int num_sge;
+	struct ibv_sge sg_list[IBLOOP_MAX_SGE];
+};
+
+struct ibloop_qp {
+	struct ibv_qp qp;
+	pthread_mutex_t lock;	/* guards everything below */
+	pthread_cond_t cond;
+	int stopping;
+	int sig_all;
+	uint32_t remote_qpn;
+	int listen_fd;		/* the peer connects here ... */
+	int in_fd;		/* ... giving its requests and our acks */
+	int out_fd;		/* our requests and the peer's acks */
+	pthread_t rx_thread, tx_thread, ack_thread;
+	int connected;
+	/* send queue: [sq_head, +sq_count) posted, the last sq_tx not taken by tx */
+	struct ibloop_send *sq;
+	int sq_head, sq_count, sq_tx, sq_size;
+	struct ibloop_recv *rq;
+	int rq_head, rq_count, rq_size;
+	/* acks written on in_fd, acks read from out_fd and completed */
+	uint32_t acks_sent, acks_seen;
+	int acks_eof;		/* the peer closed out_fd */
+};
+
+struct ibloop_cm_channel {
+	struct rdma_event_channel channel;
+	int wfd;
+};
+
+struct ibloop_cm_event {
+	struct rdma_cm_event event;
+	uint8_t private_data[IBLOOP_PRIVATE_DATA_MAX];
+};
+
+struct ibloop_cm_id {
+	struct rdma_cm_id id;
+	pthread_mutex_t lock;
+	pthread_mutex_t disc_lock;	/* held while the QP is flushed */
+	int fd;			/* listening socket or connection stream */
+	pthread_t thread;
+	int thread_started;
+	int stopping;
+	int established;
+	int disconnected;
+	uint32_t remote_qpn;
+};
+
+static struct ibv_device ibloop_device;
+static struct ibv_context ibloop_context;
+
+static int64_t ibloop_latency_ns;
+static double ibloop_ns_per_byte;
+static pthread_mutex_t ibloop_link_lock = PTHREAD_MUTEX_INITIALIZER;
+static int64_t ibloop_link_free;
+static uint64_t ibloop_drop_bytes;
+static uint64_t ibloop_link_sent;
+
+static pthread_mutex_t ibloop_mr_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ibloop_mr **ibloop_mrs;
+static uint32_t ibloop_nb_mrs;
+static uint8_t ibloop_mr_gen;
+
+static pthread_mutex_t ibloop_qpn_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t ibloop_next_qpn;
+
+static int ibloop_poll_cq(struct ibv_cq *ibcq, int num_entries,
+			  struct ibv_wc *wc);
+static int ibloop_req_notify_cq(struct ibv_cq *ibcq, int solicited_only);
+static int ibloop_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			    struct ibv_send_wr **bad_wr);
+static int ibloop_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+			    struct ibv_recv_wr **bad_wr);
+
+/**********Helpers**********/
+
+static int64_t ibloop_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void ibloop_wait_until(int64_t deadline)
+{
+	struct timespec ts;
+
+	if (!deadline || deadline <= ibloop_now()) {
+		return;
+	}
+	ts.tv_sec = deadline / 1000000000LL;
+	ts.tv_nsec = deadline % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/*
+ * Book 'len' bytes on this process's port and return when the last byte
+ * reaches the peer.  Messages from all QPs serialise on the same port,
+ * just like rails sharing one HCA.
+ */
+static int64_t ibloop_link_reserve(uint32_t len)
+{
+	int64_t now, start, done;
+
+	if (!ibloop_ns_per_byte && !ibloop_latency_ns) {
+		return 0;
+	}
+	now = ibloop_now();
+	pthread_mutex_lock(&ibloop_link_lock);
+	start = ibloop_link_free > now ? ibloop_link_free : now;
+	done = start + (int64_t)(len * ibloop_ns_per_byte);
+	ibloop_link_free = done;
+	pthread_mutex_unlock(&ibloop_link_lock);
+	return done + ibloop_latency_ns;
+}
+
+/* IBLOOP_DROP_MB: does sending 'len' more bytes cross the next mark? */
+static int ibloop_link_drops(uint32_t len)
+{
+	uint64_t before;
+
+	if (!ibloop_drop_bytes) {
+		return 0;
+	}
+	pthread_mutex_lock(&ibloop_link_lock);
+	before = ibloop_link_sent;
+	ibloop_link_sent += len + sizeof(struct ibloop_msg);
+	pthread_mutex_unlock(&ibloop_link_lock);
+	return before / ibloop_drop_bytes !=
+	       (before + len + sizeof(struct ibloop_msg)) / ibloop_drop_bytes;
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Pointer-sized pipe writes are atomic, so channels carry pointers. */
+static void ibloop_notify(int wfd, void *ptr)
+{
+	ssize_t n;
+
+	do {
+		n = write(wfd, &ptr, sizeof ptr);
+	} while (n < 0 && errno == EINTR);
+}
+
+static int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	struct msghdr mh;
+	ssize_t n;
+
+	while (iovcnt) {
+		memset(&mh, 0, sizeof mh);
+		mh.msg_iov = iov;
+		mh.msg_iovlen = iovcnt;
+		n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		while (iovcnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int drain(int fd, size_t len)
+{
+	uint8_t buf[4096];
+	size_t n;
+
+	while (len) {
+		n = len < sizeof buf ? len : sizeof buf;
+		if (read_full(fd, buf, n)) {
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/* Sockets live in the abstract namespace, so nothing is left behind. */
+static socklen_t ibloop_sockaddr(struct sockaddr_un *sun, const char *kind,
+				 unsigned int n)
+{
+	int len;
+
+	memset(sun, 0, sizeof *sun);
+	sun->sun_family = AF_UNIX;
+	len = snprintf(sun->sun_path + 1, sizeof sun->sun_path - 1,
+		       "ibloop/%s/%u", kind, n);
+	return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static int ibloop_connect(const char *kind, unsigned int n)
+{
+	struct sockaddr_un sun;
+	socklen_t len = ibloop_sockaddr(&sun, kind, n);
+	int size = IBLOOP_SOCKBUF;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+	if (connect(fd, (struct sockaddr *)&sun, len)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int ibloop_listen(const char *kind, unsigned int n)
+{
+	struct sockaddr_un sun;
+	socklen_t len = ibloop_sockaddr(&sun, kind, n);
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (bind(fd, (struct sockaddr *)&sun, len) || listen(fd, 16)) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * accept() that gives up once '*stopping' is set, so that destroy paths
+ * never have to unblock a thread parked in accept().
+ */
+static int ibloop_accept(int listen_fd, pthread_mutex_t *lock, int *stopping)
+{
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+	int size = IBLOOP_SOCKBUF;
+	int stop, fd;
+
+	for (;;) {
+		pthread_mutex_lock(lock);
+		stop = *stopping;
+		pthread_mutex_unlock(lock);
+		if (stop) {
+			return -1;
+		}
+		if (poll(&pfd, 1, IBLOOP_POLL_MS) <= 0) {
+			continue;
+		}
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd >= 0) {
+			setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+			return fd;
+		}
+		if (errno != EINTR && errno != EAGAIN) {
+			return -1;
+		}
+	}
+}
+
+static void __attribute__((constructor)) ibloop_init(void)
+{
+	const char *env;
+	double gbps;
+
+	strcpy(ibloop_device.name, "ibloop0");
+	strcpy(ibloop_device.dev_name, "uverbs0");
+	strcpy(ibloop_device.dev_path, "/sys/class/infiniband_verbs/uverbs0");
+	strcpy(ibloop_device.ibdev_path, "/sys/class/infiniband/ibloop0");
+	ibloop_device.node_type = IBV_NODE_CA;
+	ibloop_device.transport_type = IBV_TRANSPORT_IB;
+
+	ibloop_context.device = &ibloop_device;
+	ibloop_context.ops.poll_cq = ibloop_poll_cq;
+	ibloop_context.ops.req_notify_cq = ibloop_req_notify_cq;
+	ibloop_context.ops.post_send = ibloop_post_send;
+	ibloop_context.ops.post_recv = ibloop_post_recv;
+	ibloop_context.cmd_fd = -1;
+	ibloop_context.async_fd = -1;
+	ibloop_context.num_comp_vectors = 1;
+	pthread_mutex_init(&ibloop_context.mutex, NULL);
+
+	env = getenv("IBLOOP_LATENCY_US");
+	if (env) {
+		ibloop_latency_ns = (int64_t)(strtod(env, NULL) * 1000);
+	}
+	env = getenv("IBLOOP_GBPS");
+	if (env) {
+		gbps = strtod(env, NULL);
+		ibloop_ns_per_byte = gbps > 0 ? 8 / gbps : 0;
+	}
+	env = getenv("IBLOOP_DROP_MB");
+	if (env && strtod(env, NULL) > 0) {
+		ibloop_drop_bytes = (uint64_t)(strtod(env, NULL) * 1024 * 1024);
+	}
+
+	ibloop_next_qpn = (getpid() & 0xfff) << 12;
+}
+
+/**********Memory Regions**********/
+
+/*
+ * Keys are the MR's slot in ibloop_mrs plus an 8-bit generation, so a
+ * stale rkey fails the check instead of hitting a recycled slot.
+ */
+static struct ibloop_mr *ibloop_mr_find(uint32_t key)
+{
+	uint32_t slot = key >> 8;
+
+	if (slot >= ibloop_nb_mrs || !ibloop_mrs[slot] ||
+	    ibloop_mrs[slot]->mr.lkey != key) {
+		return NULL;
+	}
+	return ibloop_mrs[slot];
+}
+
+static int ibloop_mr_check(uint32_t key, uint64_t addr, uint64_t len,
+			   int access)
+{
+	struct ibloop_mr *mr;
+	int ret = -1;
+
+	pthread_mutex_lock(&ibloop_mr_lock);
+	mr = ibloop_mr_find(key);
+	if (mr && (mr->access & access) == access &&
+	    addr >= (uintptr_t)mr->mr.addr &&
+	    addr + len <= (uintptr_t)mr->mr.addr + mr->mr.length) {
+		ret = 0;
+	}
+	pthread_mutex_unlock(&ibloop_mr_lock);
+	return ret;
+}
+
+struct ibv_mr *(ibv_reg_mr)(struct ibv_pd *pd, void *addr, size_t length,
+			    int access)
+{
+	struct ibloop_mr *mr;
+	uint32_t slot;
+
+	if (!pd || (!addr && length)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mr = calloc(1, sizeof *mr);
+	if (!mr) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&ibloop_mr_lock);
+	for (slot = 1; slot < ibloop_nb_mrs && ibloop_mrs[slot]; slot++)
+		;
+	if (slot >= ibloop_nb_mrs) {
+		uint32_t nb = ibloop_nb_mrs ? ibloop_nb_mrs * 2 : 64;
+		struct ibloop_mr **mrs = realloc(ibloop_mrs, nb * sizeof *mrs);
+
+		if (!mrs || nb > (1 << 24)) {
+			pthread_mutex_unlock(&ibloop_mr_lock);
+			free(mrs == ibloop_mrs ? NULL : mrs);
+			free(mr);
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(mrs + ibloop_nb_mrs, 0,
+		       (nb - ibloop_nb_mrs) * sizeof *mrs);
+		ibloop_mrs = mrs;
+		ibloop_nb_mrs = nb;
+	}
+	mr->mr.context = pd->context;
+	mr->mr.pd = pd;
+	mr->mr.addr = addr;
+	mr->mr.length = length;
+	mr->mr.handle = slot;
+	mr->mr.lkey = mr->mr.rkey = (slot << 8) | ibloop_mr_gen++;
+	mr->access = access | IBV_ACCESS_LOCAL_WRITE;
+	ibloop_mrs[slot] = mr;
+	pthread_mutex_unlock(&ibloop_mr_lock);
+
+	return &mr->mr;
+}
+
+struct ibv_mr *ibv_reg_mr_iova2(struct ibv_pd *pd, void *addr, size_t length,
+				uint64_t iova, unsigned int access)
+{
+	if (iova != (uintptr_t)addr) {
+		errno = EOPNOTSUPP;
+		return NULL;
+	}
+	return (ibv_reg_mr)(pd, addr, length, access);
+}
+
+int ibv_dereg_mr(struct ibv_mr *ibmr)
+{
+	struct ibloop_mr *mr = container_of(ibmr, struct ibloop_mr, mr);
+
+	pthread_mutex_lock(&ibloop_mr_lock);
+	if (ibloop_mr_find(ibmr->lkey) != mr) {
+		pthread_mutex_unlock(&ibloop_mr_lock);
+		return EINVAL;
+	}
+	ibloop_mrs[ibmr->handle] = NULL;
+	pthread_mutex_unlock(&ibloop_mr_lock);
+	free(mr);
+	return 0;
+}
+
+/**********Devices and Protection Domains**********/
+
+struct ibv_device **ibv_get_device_list(int *num_devices)
+{
+	struct ibv_device **list = calloc(2, sizeof *list);
+
+	if (!list) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	list[0] = &ibloop_device;
+	if (num_devices) {
+		*num_devices = 1;
+	}
+	return list;
+}
+
+void ibv_free_device_list(struct ibv_device **list)
+{
+	free(list);
+}
+
+const char *ibv_get_device_name(struct ibv_device *device)
+{
+	return device->name;
+}
+
+/* There is one port and one context; every open returns the same one. */
+struct ibv_context *ibv_open_device(struct ibv_device *device)
+{
+	if (device != &ibloop_device) {
+		errno = ENODEV;
+		return NULL;
+	}
+	return &ibloop_context;
+}
+
+int ibv_close_device(struct ibv_context *context)
+{
+	return 0;
+}
+
+int ibv_query_device(struct ibv_context *context,
+		     struct ibv_device_attr *device_attr)
+{
+	memset(device_attr, 0, sizeof *device_attr);
+	strcpy(device_attr->fw_ver, "ibloop");
+	device_attr->node_guid = htobe64(0x0200000000000000ULL | getpid());
+	device_attr->sys_image_guid = device_attr->node_guid;
+	device_attr->max_mr_size = UINT64_MAX;
+	device_attr->page_size_cap = 4096;
+	device_attr->vendor_id = 0xffffff;
+	device_attr->max_qp = 1 << 16;
+	device_attr->max_qp_wr = 1 << 14;
+	device_attr->max_sge = IBLOOP_MAX_SGE;
+	device_attr->max_cq = 1 << 16;
+	device_attr->max_cqe = 1 << 22;
+	device_attr->max_mr = 1 << 24;
+	device_attr->max_pd = 1 << 16;
+	device_attr->max_qp_rd_atom = 16;
+	device_attr->max_qp_init_rd_atom = 16;
+	device_attr->phys_port_cnt = 1;
+	return 0;
+}
+
+/*
+ * Newer verbs.h turns ibv_query_port() into an inline that falls back to
+ * this symbol with the compat (prefix) layout; only prefix fields are set.
+ */
+#ifdef ibv_query_port
+int (ibv_query_port)(struct ibv_context *context, uint8_t port_num,
+		     struct _compat_ibv_port_attr *compat_attr)
+{
+	struct ibv_port_attr *port_attr = (struct ibv_port_attr *)compat_attr;
+#else
+int ibv_query_port(struct ibv_context *context, uint8_t port_num,
+		   struct ibv_port_attr *port_attr)
+{
+#endif
+	if (port_num != 1) {
+		return EINVAL;
+	}
+	port_attr->state = IBV_PORT_ACTIVE;
+	port_attr->max_mtu = IBV_MTU_4096;
+	port_attr->active_mtu = IBV_MTU_4096;
+	port_attr->gid_tbl_len = 1;
+	port_attr->max_msg_sz = 1U << 31;
+	port_attr->pkey_tbl_len = 1;
+	port_attr->lid = 1;
+	port_attr->sm_lid = 1;
+	port_attr->max_vl_num = 1;
+	port_attr->active_width = 2;	/* 4x */
+	port_attr->active_speed = 8;	/* FDR10 */
+	port_attr->phys_state = 5;	/* LinkUp */
+	port_attr->link_layer = IBV_LINK_LAYER_INFINIBAND;
+	return 0;
+}
+
+int ibv_query_gid(struct ibv_context *context, uint8_t port_num, int index,
+		  union ibv_gid *gid)
+{
+	if (port_num != 1 || index != 0) {
+		return -1;
+	}
+	gid->global.subnet_prefix = htobe64(0xfe80000000000000ULL);
+	gid->global.interface_id = htobe64(0x0200000000000000ULL | getpid());
+	return 0;
+}
+
+struct ibv_pd *ibv_alloc_pd(struct ibv_context *context)
+{
+	struct ibv_pd *pd = calloc(1, sizeof *pd);
+
+	if (!pd) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pd->context = context;
+	return pd;
+}
+
+int ibv_dealloc_pd(struct ibv_pd *pd)
+{
+	free(pd);
+	return 0;
+}
+
+/**********Completion Queues**********/
+
+struct ibv_comp_channel *ibv_create_comp_channel(struct ibv_context *context)
+{
+	struct ibloop_channel *ch = calloc(1, sizeof *ch);
+	int fds[2];
+
+	if (!ch) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (pipe2(fds, O_CLOEXEC)) {
+		free(ch);
+		return NULL;
+	}
+	ch->channel.context = context;
+	ch->channel.fd = fds[0];
+	ch->wfd = fds[1];
+	return &ch->channel;
+}
+
+int ibv_destroy_comp_channel(struct ibv_comp_channel *channel)
+{
+	struct ibloop_channel *ch =
+		container_of(channel, struct ibloop_channel, channel);
+
+	close(ch->channel.fd);
+	close(ch->wfd);
+	free(ch);
+	return 0;
+}
+
+struct ibv_cq *ibv_create_cq(struct ibv_context *context, int cqe,
+			     void *cq_context, struct ibv_comp_channel *channel,
+			     int comp_vector)
+{
+	struct ibloop_cq *cq;
+
+	if (cqe <= 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	cq = calloc(1, sizeof *cq);
+	if (cq) {
+		cq->wc = calloc(cqe, sizeof *cq->wc);
+	}
+	if (!cq || !cq->wc) {
+		free(cq);
+		errno = ENOMEM;
+		return NULL;
+	}
+	cq->size = cqe;
+	pthread_mutex_init(&cq->lock, NULL);
+	cq->cq.context = context;
+	cq->cq.channel = channel;
+	cq->cq.cq_context = cq_context;
+	cq->cq.cqe = cqe;
+	pthread_mutex_init(&cq->cq.mutex, NULL);
+	pthread_cond_init(&cq->cq.cond, NULL);
+	return &cq->cq;
+}
+
+int ibv_destroy_cq(struct ibv_cq *ibcq)
+{
+	struct ibloop_cq *cq = container_of(ibcq, struct ibloop_cq, cq);
+
+	pthread_mutex_destroy(&cq->lock);
+	free(cq->wc);
+	free(cq);
+	return 0;
+}
+
+/* Called from the emulation threads; never blocks. */
+static void ibloop_cq_push(struct ibv_cq *ibcq, const struct ibv_wc *wc)
+{
+	struct ibloop_cq *cq = container_of(ibcq, struct ibloop_cq, cq);
+	struct ibloop_channel *ch;
+	int notify;
+
+	pthread_mutex_lock(&cq->lock);
+	if (cq->count == cq->size) {
+		pthread_mutex_unlock(&cq->lock);
+		fprintf(stderr, "ibloop: CQ %p overrun, completion for wr_id %llu "
+			"lost\n", (void *)ibcq, (unsigned long long)wc->wr_id);
+		return;
+	}
+	cq->wc[(cq->head + cq->count) % cq->size] = *wc;
+	cq->count++;
+	notify = cq->armed && ibcq->channel;
+	cq->armed = 0;
+	pthread_mutex_unlock(&cq->lock);
+
+	if (notify) {
+		ch = container_of(ibcq->channel, struct ibloop_channel, channel);
+		ibloop_notify(ch->wfd, ibcq);
+	}
+}
+
+static int ibloop_poll_cq(struct ibv_cq *ibcq, int num_entries,
+			  struct ibv_wc *wc)
+{
+	struct ibloop_cq *cq = container_of(ibcq, struct ibloop_cq, cq);
+	int n;
+
+	pthread_mutex_lock(&cq->lock);
+	for (n = 0; n < num_entries && cq->count; n++) {
+		wc[n] = cq->wc[cq->head];
+		cq->head = (cq->head + 1) % cq->size;
+		cq->count--;
+	}
+	pthread_mutex_unlock(&cq->lock);
+	return n;
+}
+
+static int ibloop_req_notify_cq(struct ibv_cq *ibcq, int solicited_only)
+{
+	struct ibloop_cq *cq = container_of(ibcq, struct ibloop_cq, cq);
+
+	pthread_mutex_lock(&cq->lock);
+	cq->armed = 1;
+	pthread_mutex_unlock(&cq->lock);
+	return 0;
+}
+
+int ibv_get_cq_event(struct ibv_comp_channel *channel, struct ibv_cq **cq,
+		     void **cq_context)
+{
+	struct ibv_cq *ibcq;
+
+	if (read_full(channel->fd, &ibcq, sizeof ibcq)) {
+		return -1;
+	}
+	*cq = ibcq;
+	*cq_context = ibcq->cq_context;
+	return 0;
+}
+
+void ibv_ack_cq_events(struct ibv_cq *cq, unsigned int nevents)
+{
+}
+
+const char *ibv_wc_status_str(enum ibv_wc_status status)
+{
+	static const char *const str[] = {
+		[IBV_WC_SUCCESS]		= "success",
+		[IBV_WC_LOC_LEN_ERR]		= "local length error",
+		[IBV_WC_LOC_QP_OP_ERR]		= "local QP operation error",
+		[IBV_WC_LOC_EEC_OP_ERR]		= "local EE context operation error",
+		[IBV_WC_LOC_PROT_ERR]		= "local protection error",
+		[IBV_WC_WR_FLUSH_ERR]		= "Work Request Flushed Error",
+		[IBV_WC_MW_BIND_ERR]		= "memory management operation error",
+		[IBV_WC_BAD_RESP_ERR]		= "bad response error",
+		[IBV_WC_LOC_ACCESS_ERR]		= "local access error",
+		[IBV_WC_REM_INV_REQ_ERR]	= "remote invalid request error",
+		[IBV_WC_REM_ACCESS_ERR]		= "remote access error",
+		[IBV_WC_REM_OP_ERR]		= "remote operation error",
+		[IBV_WC_RETRY_EXC_ERR]		= "transport retry counter exceeded",
+		[IBV_WC_RNR_RETRY_EXC_ERR]	= "RNR retry counter exceeded",
+		[IBV_WC_LOC_RDD_VIOL_ERR]	= "local RDD violation error",
+		[IBV_WC_REM_INV_RD_REQ_ERR]	= "remote invalid RD request",
+		[IBV_WC_REM_ABORT_ERR]		= "aborted error",
+		[IBV_WC_INV_EECN_ERR]		= "invalid EE context number",
+		[IBV_WC_INV_EEC_STATE_ERR]	= "invalid EE context state",
+		[IBV_WC_FATAL_ERR]		= "fatal error",
+		[IBV_WC_RESP_TIMEOUT_ERR]	= "response timeout error",
+		[IBV_WC_GENERAL_ERR]		= "general error",
+	};
+
+	if ((unsigned int)status < sizeof str / sizeof str[0] && str[status]) {
+		return str[status];
+	}
+	return "unknown";
+}
+
+/**********Queue Pairs**********/
+
+static void ibloop_qp_wc(struct ibloop_qp *qp, struct ibv_wc *wc,
+			 uint64_t wr_id, enum ibv_wc_status status,
+			 enum ibv_wc_opcode opcode, uint32_t byte_len,
+			 uint32_t imm_data, int with_imm)
+{
+	memset(wc, 0, sizeof *wc);
+	wc->wr_id = wr_id;
+	wc->status = status;
+	wc->opcode = opcode;
+	wc->byte_len = byte_len;
+	wc->qp_num = qp->qp.qp_num;
+	wc->src_qp = qp->remote_qpn;
+	if (with_imm) {
+		wc->imm_data = imm_data;
+		wc->wc_flags = IBV_WC_WITH_IMM;
+	}
+}
+
+static void ibloop_qp_complete(struct ibloop_qp *qp, struct ibv_cq *cq,
+			       uint64_t wr_id, enum ibv_wc_status status,
+			       enum ibv_wc_opcode opcode, uint32_t byte_len,
+			       uint32_t imm_data, int with_imm)
+{
+	struct ibv_wc wc;
+
+	ibloop_qp_wc(qp, &wc, wr_id, status, opcode, byte_len, imm_data,
+		     with_imm);
+	ibloop_cq_push(cq, &wc);
+}
+
+/*
+ * Move to the error state: posted receives and sends that never made it
+ * to the wire complete with IBV_WC_WR_FLUSH_ERR.  Called with qp->lock.
+ */
+static void ibloop_qp_flush(struct ibloop_qp *qp)
+{
+	struct ibloop_send *s;
+	struct ibloop_recv *r;
+
+	qp->qp.state = IBV_QPS_ERR;
+
+	while (qp->rq_count) {
+		r = &qp->rq[qp->rq_head];
+		qp->rq_head = (qp->rq_head + 1) % qp->rq_size;
+		qp->rq_count--;
+		ibloop_qp_complete(qp, qp->qp.recv_cq, r->wr_id,
+				   IBV_WC_WR_FLUSH_ERR, IBV_WC_RECV, 0, 0, 0);
+	}
+
+	while (qp->sq_tx) {
+		s = &qp->sq[(qp->sq_head + qp->sq_count - qp->sq_tx) % qp->sq_size];
+		ibloop_qp_complete(qp, qp->qp.send_cq, s->wr_id,
+				   IBV_WC_WR_FLUSH_ERR, IBV_WC_SEND, 0, 0, 0);
+		free(s->inline_data);
+		s->inline_data = NULL;
+		qp->sq_count--;
+		qp->sq_tx--;
+	}
+
+	pthread_cond_broadcast(&qp->cond);
+}
+
+/*
+ * The link went away: the requests on the wire are never acked, so the
+ * oldest times out with IBV_WC_RETRY_EXC_ERR and everything else is
+ * flushed.  Unless the QP is being destroyed or already in the error
+ * state anyway.  Called with qp->lock.
+ */
+static void ibloop_qp_lost(struct ibloop_qp *qp)
+{
+	struct ibloop_send *s;
+	int status = IBV_WC_RETRY_EXC_ERR;
+
+	if (qp->stopping || qp->qp.state == IBV_QPS_ERR) {
+		return;
+	}
+
+	while (qp->sq_count > qp->sq_tx) {
+		s = &qp->sq[qp->sq_head];
+		ibloop_qp_complete(qp, qp->qp.send_cq, s->wr_id, status,
+				   s->msg.opcode == IBV_WR_SEND ||
+				   s->msg.opcode == IBV_WR_SEND_WITH_IMM ?
+				   IBV_WC_SEND : IBV_WC_RDMA_WRITE, 0, 0, 0);
+		free(s->inline_data);
+		s->inline_data = NULL;
+		qp->sq_head = (qp->sq_head + 1) % qp->sq_size;
+		qp->sq_count--;
+		status = IBV_WC_WR_FLUSH_ERR;
+	}
+	ibloop_qp_flush(qp);
+}
+
+/* Wait for the receive a SEND or WRITE_WITH_IMM consumes. */
+static int ibloop_qp_take_recv(struct ibloop_qp *qp, struct ibloop_recv *r)
+{
+	pthread_mutex_lock(&qp->lock);
+	while (!qp->rq_count && !qp->stopping &&
+	       qp->qp.state != IBV_QPS_ERR) {
+		pthread_cond_wait(&qp->cond, &qp->lock);
+	}
+	if (!qp->rq_count) {
+		pthread_mutex_unlock(&qp->lock);
+		return -1;
+	}
+	*r = qp->rq[qp->rq_head];
+	qp->rq_head = (qp->rq_head + 1) % qp->rq_size;
+	qp->rq_count--;
+	pthread_mutex_unlock(&qp->lock);
+	return 0;
+}
+
+/*
+ * Land one incoming request.  Returns the status to ack with, or -1 if
+ * the stream is gone.  A receive it consumed is left in 'wc', opcode
+ * IBV_WC_RECV*, to be completed once the ack is out: an HCA acks before
+ * the consumer can react, and migration-rdma.c drops completions that
+ * arrive out of that order.
+ */
+static int ibloop_qp_deliver(struct ibloop_qp *qp, int fd,
+			     struct ibloop_msg *msg, struct ibv_wc *wc)
+{
+	struct ibloop_recv r;
+	uint32_t left = msg->len, n;
+	int status = IBV_WC_SUCCESS;
+	int i;
+
+	switch (msg->opcode) {
+	case IBV_WR_RDMA_WRITE:
+	case IBV_WR_RDMA_WRITE_WITH_IMM:
+		if (ibloop_mr_check(msg->rkey, msg->remote_addr, msg->len,
+				    IBV_ACCESS_REMOTE_WRITE)) {
+			return drain(fd, msg->len) ? -1 : IBV_WC_REM_ACCESS_ERR;
+		}
+		if (read_full(fd, (void *)(uintptr_t)msg->remote_addr, msg->len)) {
+			return -1;
+		}
+		if (msg->opcode == IBV_WR_RDMA_WRITE) {
+			return IBV_WC_SUCCESS;
+		}
+		if (ibloop_qp_take_recv(qp, &r)) {
+			return IBV_WC_RNR_RETRY_EXC_ERR;
+		}
+		ibloop_qp_wc(qp, wc, r.wr_id, IBV_WC_SUCCESS,
+			     IBV_WC_RECV_RDMA_WITH_IMM, msg->len,
+			     msg->imm_data, 1);
+		return IBV_WC_SUCCESS;
+
+	case IBV_WR_SEND:
+	case IBV_WR_SEND_WITH_IMM:
+		if (ibloop_qp_take_recv(qp, &r)) {
+			return drain(fd, msg->len) ? -1 : IBV_WC_RNR_RETRY_EXC_ERR;
+		}
+		for (i = 0; i < r.num_sge && left; i++) {
+			n = left < r.sg_list[i].length ? left : r.sg_list[i].length;
+			if (ibloop_mr_check(r.sg_list[i].lkey, r.sg_list[i].addr, n,
+					    IBV_ACCESS_LOCAL_WRITE)) {
+				status = IBV_WC_LOC_PROT_ERR;
+				break;
+			}
+			if (read_full(fd, (void *)(uintptr_t)r.sg_list[i].addr, n)) {
+				return -1;
+			}
+			left -= n;
+		}
+		if (left) {
+			if (drain(fd, left)) {
+				return -1;
+			}
+			if (status == IBV_WC_SUCCESS) {
+				status = IBV_WC_LOC_LEN_ERR;
+			}
+		}
+		ibloop_qp_wc(qp, wc, r.wr_id, status, IBV_WC_RECV, msg->len,
+			     msg->imm_data, msg->opcode == IBV_WR_SEND_WITH_IMM);
+		return status == IBV_WC_SUCCESS ? IBV_WC_SUCCESS
+						: IBV_WC_REM_INV_REQ_ERR;
+	}
+
+	return drain(fd, msg->len) ? -1 : IBV_WC_REM_INV_REQ_ERR;
+}
+
+/* The responder side: accept the peer's stream and land its requests. */
+static void *ibloop_rx_thread(void *opaque)
+{
+	struct ibloop_qp *qp = opaque;
+	struct ibloop_msg msg;
+	struct ibloop_ack ack;
+	struct ibv_wc wc;
+	int fd, status;
+
+	fd = ibloop_accept(qp->listen_fd, &qp->lock, &qp->stopping);
+	if (fd < 0) {
+		return NULL;
+	}
+	pthread_mutex_lock(&qp->lock);
+	qp->in_fd = fd;
+	if (qp->stopping) {
+		shutdown(fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&qp->lock);
+
+	while (!read_full(fd, &msg, sizeof msg)) {
+		ibloop_wait_until(msg.deliver);
+
+		/*
+		 * The peer's acks travel on the other stream; have the ones it
+		 * sent before this request completed first, as on one wire.
+		 */
+		pthread_mutex_lock(&qp->lock);
+		while ((int32_t)(qp->acks_seen - msg.acks) < 0 && !qp->acks_eof &&
+		       !qp->stopping && qp->qp.state != IBV_QPS_ERR) {
+			pthread_cond_wait(&qp->cond, &qp->lock);
+		}
+		pthread_mutex_unlock(&qp->lock);
+
+		wc.opcode = IBV_WC_SEND;
+		status = ibloop_qp_deliver(qp, fd, &msg, &wc);
+		if (status < 0) {
+			break;
+		}
+		memset(&ack, 0, sizeof ack);
+		ack.status = status;
+		ack.deliver = ibloop_latency_ns ? ibloop_now() + ibloop_latency_ns : 0;
+		if (write_full(fd, &ack, sizeof ack)) {
+			break;
+		}
+		pthread_mutex_lock(&qp->lock);
+		qp->acks_sent++;
+		pthread_mutex_unlock(&qp->lock);
+		if (wc.opcode & IBV_WC_RECV) {
+			ibloop_cq_push(qp->qp.recv_cq, &wc);
+		}
+	}
+	return NULL;
+}
+
+/* The HCA side of the send queue: put posted requests on the wire. */
+static void *ibloop_tx_thread(void *opaque)
+{
+	struct ibloop_qp *qp = opaque;
+	struct ibloop_send s;
+	struct iovec iov[1 + IBLOOP_MAX_SGE];
+	int i, n;
+
+	for (;;) {
+		pthread_mutex_lock(&qp->lock);
+		while (!qp->sq_tx && !qp->stopping) {
+			pthread_cond_wait(&qp->cond, &qp->lock);
+		}
+		if (qp->stopping) {
+			pthread_mutex_unlock(&qp->lock);
+			return NULL;
+		}
+		s = qp->sq[(qp->sq_head + qp->sq_count - qp->sq_tx) % qp->sq_size];
+		qp->sq_tx--;
+		s.msg.acks = qp->acks_sent;
+		pthread_mutex_unlock(&qp->lock);
+
+		if (ibloop_link_drops(s.msg.len)) {
+			pthread_mutex_lock(&qp->lock);
+			ibloop_qp_lost(qp);
+			if (qp->in_fd >= 0) {
+				shutdown(qp->in_fd, SHUT_RDWR);
+			}
+			shutdown(qp->out_fd, SHUT_RDWR);
+			pthread_mutex_unlock(&qp->lock);
+			return NULL;
+		}
+
+		s.msg.deliver = ibloop_link_reserve(s.msg.len);
+		iov[0].iov_base = &s.msg;
+		iov[0].iov_len = sizeof s.msg;
+		n = 1;
+		if (s.inline_data) {
+			iov[n].iov_base = s.inline_data;
+			iov[n++].iov_len = s.msg.len;
+		} else {
+			for (i = 0; i < s.num_sge; i++) {
+				iov[n].iov_base = (void *)(uintptr_t)s.sg_list[i].addr;
+				iov[n++].iov_len = s.sg_list[i].length;
+			}
+		}
+		if (writev_full(qp->out_fd, iov, n)) {
+			pthread_mutex_lock(&qp->lock);
+			ibloop_qp_lost(qp);
+			pthread_mutex_unlock(&qp->lock);
+			return NULL;
+		}
+	}
+}
+
+/* Called with qp->lock. */
+static void ibloop_qp_ack_seen(struct ibloop_qp *qp)
+{
+	qp->acks_seen++;
+	pthread_cond_broadcast(&qp->cond);
+}
+
+/* Turn the peer's acks into send completions, in posting order. */
+static void *ibloop_ack_thread(void *opaque)
+{
+	struct ibloop_qp *qp = opaque;
+	struct ibloop_send s;
+	struct ibloop_ack ack;
+
+	while (!read_full(qp->out_fd, &ack, sizeof ack)) {
+		ibloop_wait_until(ack.deliver);
+
+		pthread_mutex_lock(&qp->lock);
+		if (!qp->sq_count) {
+			ibloop_qp_ack_seen(qp);
+			pthread_mutex_unlock(&qp->lock);
+			continue;
+		}
+		s = qp->sq[qp->sq_head];
+		qp->sq[qp->sq_head].inline_data = NULL;
+		qp->sq_head = (qp->sq_head + 1) % qp->sq_size;
+		qp->sq_count--;
+		if (ack.status != IBV_WC_SUCCESS) {
+			ibloop_qp_flush(qp);
+		}
+		pthread_mutex_unlock(&qp->lock);
+
+		free(s.inline_data);
+		if (s.signaled || ack.status != IBV_WC_SUCCESS) {
+			ibloop_qp_complete(qp, qp->qp.send_cq, s.wr_id, ack.status,
+					   s.msg.opcode == IBV_WR_SEND ||
+					   s.msg.opcode == IBV_WR_SEND_WITH_IMM ?
+					   IBV_WC_SEND : IBV_WC_RDMA_WRITE,
+					   s.msg.len, 0, 0);
+		}
+
+		pthread_mutex_lock(&qp->lock);
+		ibloop_qp_ack_seen(qp);
+		pthread_mutex_unlock(&qp->lock);
+	}
+
+	pthread_mutex_lock(&qp->lock);
+	qp->acks_eof = 1;
+	ibloop_qp_lost(qp);
+	pthread_cond_broadcast(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+	return NULL;
+}
+
+/*
+ * Wait for the acks of the requests already on the wire, which an HCA
+ * would have seen before the peer's DREQ.
+ */
+static void ibloop_qp_drain_acks(struct ibloop_qp *qp)
+{
+	pthread_mutex_lock(&qp->lock);
+	while (qp->sq_count > qp->sq_tx && !qp->acks_eof && !qp->stopping &&
+	       qp->qp.state != IBV_QPS_ERR) {
+		pthread_cond_wait(&qp->cond, &qp->lock);
+	}
+	pthread_mutex_unlock(&qp->lock);
+}
+
+static int ibloop_qp_connect(struct ibloop_qp *qp, uint32_t dest_qpn)
+{
+	int fd;
+
+	if (qp->connected) {
+		return qp->remote_qpn == dest_qpn ? 0 : EINVAL;
+	}
+	fd = ibloop_connect("qp", dest_qpn);
+	if (fd < 0) {
+		return errno;
+	}
+	qp->out_fd = fd;
+	qp->remote_qpn = dest_qpn;
+	if (pthread_create(&qp->tx_thread, NULL, ibloop_tx_thread, qp)) {
+		close(fd);
+		qp->out_fd = -1;
+		return EAGAIN;
+	}
+	if (pthread_create(&qp->ack_thread, NULL, ibloop_ack_thread, qp)) {
+		pthread_mutex_lock(&qp->lock);
+		qp->stopping = 1;
+		pthread_cond_broadcast(&qp->cond);
+		pthread_mutex_unlock(&qp->lock);
+		pthread_join(qp->tx_thread, NULL);
+		qp->stopping = 0;
+		close(fd);
+		qp->out_fd = -1;
+		return EAGAIN;
+	}
+	qp->connected = 1;
+	return 0;
+}
+
+struct ibv_qp *ibv_create_qp(struct ibv_pd *pd,
+			     struct ibv_qp_init_attr *qp_init_attr)
+{
+	struct ibloop_qp *qp;
+	uint32_t qpn;
+	int tries;
+
+	if (qp_init_attr->qp_type != IBV_QPT_RC || qp_init_attr->srq ||
+	    qp_init_attr->cap.max_send_sge > IBLOOP_MAX_SGE ||
+	    qp_init_attr->cap.max_recv_sge > IBLOOP_MAX_SGE ||
+	    qp_init_attr->cap.max_inline_data > IBLOOP_MAX_INLINE ||
+	    !qp_init_attr->send_cq || !qp_init_attr->recv_cq) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	qp = calloc(1, sizeof *qp);
+	if (!qp) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	qp->sq_size = qp_init_attr->cap.max_send_wr ?: 1;
+	qp->rq_size = qp_init_attr->cap.max_recv_wr ?: 1;
+	qp->sq = calloc(qp->sq_size, sizeof *qp->sq);
+	qp->rq = calloc(qp->rq_size, sizeof *qp->rq);
+	if (!qp->sq || !qp->rq) {
+		goto err;
+	}
+
+	/* QP numbers double as the name the peer connects to at RTR. */
+	qp->listen_fd = -1;
+	for (tries = 0; tries < (1 << 12) && qp->listen_fd < 0; tries++) {
+		pthread_mutex_lock(&ibloop_qpn_lock);
+		qpn = ibloop_next_qpn++ & 0xffffff;
+		pthread_mutex_unlock(&ibloop_qpn_lock);
+		if (qpn) {
+			qp->listen_fd = ibloop_listen("qp", qpn);
+		}
+		if (qp->listen_fd < 0 && errno != EADDRINUSE && qpn) {
+			goto err;
+		}
+	}
+	if (qp->listen_fd < 0) {
+		goto err;
+	}
+
+	pthread_mutex_init(&qp->lock, NULL);
+	pthread_cond_init(&qp->cond, NULL);
+	qp->in_fd = -1;
+	qp->out_fd = -1;
+	qp->sig_all = qp_init_attr->sq_sig_all;
+	qp->qp.context = pd->context;
+	qp->qp.qp_context = qp_init_attr->qp_context;
+	qp->qp.pd = pd;
+	qp->qp.send_cq = qp_init_attr->send_cq;
+	qp->qp.recv_cq = qp_init_attr->recv_cq;
+	qp->qp.qp_num = qpn;
+	qp->qp.handle = qpn;
+	qp->qp.state = IBV_QPS_RESET;
+	qp->qp.qp_type = IBV_QPT_RC;
+	pthread_mutex_init(&qp->qp.mutex, NULL);
+	pthread_cond_init(&qp->qp.cond, NULL);
+
+	if (pthread_create(&qp->rx_thread, NULL, ibloop_rx_thread, qp)) {
+		close(qp->listen_fd);
+		goto err;
+	}
+
+	qp_init_attr->cap.max_inline_data = IBLOOP_MAX_INLINE;
+	return &qp->qp;
+
+err:
+	free(qp->sq);
+	free(qp->rq);
+	free(qp);
+	errno = errno ?: ENOMEM;
+	return NULL;
+}
+
+int ibv_destroy_qp(struct ibv_qp *ibqp)
+{
+	struct ibloop_qp *qp = container_of(ibqp, struct ibloop_qp, qp);
+	int i;
+
+	pthread_mutex_lock(&qp->lock);
+	qp->stopping = 1;
+	pthread_cond_broadcast(&qp->cond);
+	if (qp->in_fd >= 0) {
+		shutdown(qp->in_fd, SHUT_RDWR);
+	}
+	if (qp->out_fd >= 0) {
+		shutdown(qp->out_fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&qp->lock);
+
+	pthread_join(qp->rx_thread, NULL);
+	if (qp->connected) {
+		pthread_join(qp->tx_thread, NULL);
+		pthread_join(qp->ack_thread, NULL);
+	}
+
+	close(qp->listen_fd);
+	if (qp->in_fd >= 0) {
+		close(qp->in_fd);
+	}
+	if (qp->out_fd >= 0) {
+		close(qp->out_fd);
+	}
+	for (i = 0; i < qp->sq_size; i++) {
+		free(qp->sq[i].inline_data);
+	}
+	pthread_mutex_destroy(&qp->lock);
+	pthread_cond_destroy(&qp->cond);
+	free(qp->sq);
+	free(qp->rq);
+	free(qp);
+	return 0;
+}
+
+/*
+ * Only the state machine and the destination QP number matter here; path
+ * and timer attributes are accepted and ignored.
+ */
+int ibv_modify_qp(struct ibv_qp *ibqp, struct ibv_qp_attr *attr,
+		  int attr_mask)
+{
+	struct ibloop_qp *qp = container_of(ibqp, struct ibloop_qp, qp);
+	int ret = 0;
+
+	if (!(attr_mask & IBV_QP_STATE)) {
+		return 0;
+	}
+
+	switch (attr->qp_state) {
+	case IBV_QPS_RESET:
+	case IBV_QPS_INIT:
+		break;
+	case IBV_QPS_RTR:
+		if (!(attr_mask & IBV_QP_DEST_QPN)) {
+			return EINVAL;
+		}
+		ret = ibloop_qp_connect(qp, attr->dest_qp_num);
+		break;
+	case IBV_QPS_RTS:
+		if (!qp->connected) {
+			return EINVAL;
+		}
+		break;
+	case IBV_QPS_SQD:
+	case IBV_QPS_SQE:
+		return EOPNOTSUPP;
+	case IBV_QPS_ERR:
+		pthread_mutex_lock(&qp->lock);
+		ibloop_qp_flush(qp);
+		pthread_mutex_unlock(&qp->lock);
+		return 0;
+	default:
+		return EINVAL;
+	}
+
+	if (!ret) {
+		pthread_mutex_lock(&qp->lock);
+		qp->qp.state = attr->qp_state;
+		pthread_mutex_unlock(&qp->lock);
+	}
+	return ret;
+}
+
+static int ibloop_post_one(struct ibloop_qp *qp, struct ibv_send_wr *wr)
+{
+	struct ibloop_send *s;
+	uint64_t len = 0;
+	int i;
+
+	if (wr->opcode != IBV_WR_RDMA_WRITE &&
+	    wr->opcode != IBV_WR_RDMA_WRITE_WITH_IMM &&
+	    wr->opcode != IBV_WR_SEND && wr->opcode != IBV_WR_SEND_WITH_IMM) {
+		return EINVAL;
+	}
+	if (wr->num_sge < 0 || wr->num_sge > IBLOOP_MAX_SGE) {
+		return EINVAL;
+	}
+	for (i = 0; i < wr->num_sge; i++) {
+		if (!(wr->send_flags & IBV_SEND_INLINE) &&
+		    ibloop_mr_check(wr->sg_list[i].lkey, wr->sg_list[i].addr,
+				    wr->sg_list[i].length, 0)) {
+			return EINVAL;
+		}
+		len += wr->sg_list[i].length;
+	}
+	if (len > UINT32_MAX ||
+	    ((wr->send_flags & IBV_SEND_INLINE) && len > IBLOOP_MAX_INLINE)) {
+		return EINVAL;
+	}
+
+	if (qp->qp.state == IBV_QPS_ERR) {
+		ibloop_qp_complete(qp, qp->qp.send_cq, wr->wr_id,
+				   IBV_WC_WR_FLUSH_ERR, IBV_WC_SEND, 0, 0, 0);
+		return 0;
+	}
+	if (qp->qp.state != IBV_QPS_RTS) {
+		return EINVAL;
+	}
+	if (qp->sq_count == qp->sq_size) {
+		return ENOMEM;
+	}
+
+	s = &qp->sq[(qp->sq_head + qp->sq_count) % qp->sq_size];
+	s->wr_id = wr->wr_id;
+	s->msg.opcode = wr->opcode;
+	s->msg.len = len;
+	s->msg.remote_addr = wr->wr.rdma.remote_addr;
+	s->msg.rkey = wr->wr.rdma.rkey;
+	s->msg.imm_data = wr->imm_data;
+	s->num_sge = wr->num_sge;
+	memcpy(s->sg_list, wr->sg_list, wr->num_sge * sizeof *wr->sg_list);
+	s->signaled = qp->sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+	s->inline_data = NULL;
+	if (wr->send_flags & IBV_SEND_INLINE) {
+		uint8_t *p = malloc(len ?: 1);
+
+		if (!p) {
+			return ENOMEM;
+		}
+		s->inline_data = p;
+		for (i = 0; i < wr->num_sge; i++) {
+			memcpy(p, (void *)(uintptr_t)wr->sg_list[i].addr,
+			       wr->sg_list[i].length);
+			p += wr->sg_list[i].length;
+		}
+	}
+	qp->sq_count++;
+	qp->sq_tx++;
+	return 0;
+}
+
+static int ibloop_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			    struct ibv_send_wr **bad_wr)
+{
+	struct ibloop_qp *qp = container_of(ibqp, struct ibloop_qp, qp);
+	int ret = 0;
+
+	pthread_mutex_lock(&qp->lock);
+	for (; wr; wr = wr->next) {
+		ret = ibloop_post_one(qp, wr);
+		if (ret) {
+			*bad_wr = wr;
+			break;
+		}
+	}
+	pthread_cond_broadcast(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+	return ret;
+}
+
+static int ibloop_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+			    struct ibv_recv_wr **bad_wr)
+{
+	struct ibloop_qp *qp = container_of(ibqp, struct ibloop_qp, qp);
+	struct ibloop_recv *r;
+	int ret = 0;
+
+	pthread_mutex_lock(&qp->lock);
+	for (; wr; wr = wr->next) {
+		if (wr->num_sge < 0 || wr->num_sge > IBLOOP_MAX_SGE ||
+		    qp->qp.state == IBV_QPS_RESET) {
+			ret = EINVAL;
+		} else if (qp->rq_count == qp->rq_size) {
+			ret = ENOMEM;
+		}
+		if (ret) {
+			*bad_wr = wr;
+			break;
+		}
+		if (qp->qp.state == IBV_QPS_ERR) {
+			ibloop_qp_complete(qp, qp->qp.recv_cq, wr->wr_id,
+					   IBV_WC_WR_FLUSH_ERR, IBV_WC_RECV, 0, 0, 0);
+			continue;
+		}
+		r = &qp->rq[(qp->rq_head + qp->rq_count) % qp->rq_size];
+		r->wr_id = wr->wr_id;
+		r->num_sge = wr->num_sge;
+		memcpy(r->sg_list, wr->sg_list, wr->num_sge * sizeof *wr->sg_list);
+		qp->rq_count++;
+	}
+	pthread_cond_broadcast(&qp->cond);
+	pthread_mutex_unlock(&qp->lock);
+	return ret;
+}
+
+/**********Connection Manager**********/
+
+struct rdma_event_channel *rdma_create_event_channel(void)
+{
+	struct ibloop_cm_channel *ch = calloc(1, sizeof *ch);
+	int fds[2];
+
+	if (!ch) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (pipe2(fds, O_CLOEXEC)) {
+		free(ch);
+		return NULL;
+	}
+	ch->channel.fd = fds[0];
+	ch->wfd = fds[1];
+	return &ch->channel;
+}
+
+void rdma_destroy_event_channel(struct rdma_event_channel *channel)
+{
+	struct ibloop_cm_channel *ch =
+		container_of(channel, struct ibloop_cm_channel, channel);
+
+	close(ch->channel.fd);
+	close(ch->wfd);
+	free(ch);
+}
+
+static void ibloop_cm_queue(struct rdma_cm_id *id, struct rdma_cm_id *listen_id,
+			    enum rdma_cm_event_type type, int status,
+			    const void *private_data, uint32_t len)
+{
+	struct ibloop_cm_channel *ch =
+		container_of(id->channel, struct ibloop_cm_channel, channel);
+	struct ibloop_cm_event *ev = calloc(1, sizeof *ev);
+	struct rdma_cm_event *event;
+
+	if (!ev) {
+		fprintf(stderr, "ibloop: dropping CM event %s\n",
+			rdma_event_str(type));
+		return;
+	}
+	event = &ev->event;
+	event->id = id;
+	event->listen_id = listen_id;
+	event->event = type;
+	event->status = status;
+	if (len > IBLOOP_PRIVATE_DATA_MAX) {
+		len = IBLOOP_PRIVATE_DATA_MAX;
+	}
+	if (len) {
+		memcpy(ev->private_data, private_data, len);
+		event->param.conn.private_data = ev->private_data;
+		event->param.conn.private_data_len = len;
+	}
+	ibloop_notify(ch->wfd, event);
+}
+
+int rdma_get_cm_event(struct rdma_event_channel *channel,
+		      struct rdma_cm_event **event)
+{
+	ssize_t n;
+
+	do {
+		n = read(channel->fd, event, sizeof *event);
+	} while (n < 0 && errno == EINTR);
+	if (n != sizeof *event) {
+		if (n >= 0) {
+			errno = ENODATA;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+int rdma_ack_cm_event(struct rdma_cm_event *event)
+{
+	free(container_of(event, struct ibloop_cm_event, event));
+	return 0;
+}
+
+const char *rdma_event_str(enum rdma_cm_event_type event)
+{
+	static const char *const str[] = {
+		[RDMA_CM_EVENT_ADDR_RESOLVED]	= "RDMA_CM_EVENT_ADDR_RESOLVED",
+		[RDMA_CM_EVENT_ADDR_ERROR]	= "RDMA_CM_EVENT_ADDR_ERROR",
+		[RDMA_CM_EVENT_ROUTE_RESOLVED]	= "RDMA_CM_EVENT_ROUTE_RESOLVED",
+		[RDMA_CM_EVENT_ROUTE_ERROR]	= "RDMA_CM_EVENT_ROUTE_ERROR",
+		[RDMA_CM_EVENT_CONNECT_REQUEST]	= "RDMA_CM_EVENT_CONNECT_REQUEST",
+		[RDMA_CM_EVENT_CONNECT_RESPONSE] = "RDMA_CM_EVENT_CONNECT_RESPONSE",
+		[RDMA_CM_EVENT_CONNECT_ERROR]	= "RDMA_CM_EVENT_CONNECT_ERROR",
+		[RDMA_CM_EVENT_UNREACHABLE]	= "RDMA_CM_EVENT_UNREACHABLE",
+		[RDMA_CM_EVENT_REJECTED]	= "RDMA_CM_EVENT_REJECTED",
+		[RDMA_CM_EVENT_ESTABLISHED]	= "RDMA_CM_EVENT_ESTABLISHED",
+		[RDMA_CM_EVENT_DISCONNECTED]	= "RDMA_CM_EVENT_DISCONNECTED",
+		[RDMA_CM_EVENT_DEVICE_REMOVAL]	= "RDMA_CM_EVENT_DEVICE_REMOVAL",
+		[RDMA_CM_EVENT_MULTICAST_JOIN]	= "RDMA_CM_EVENT_MULTICAST_JOIN",
+		[RDMA_CM_EVENT_MULTICAST_ERROR]	= "RDMA_CM_EVENT_MULTICAST_ERROR",
+		[RDMA_CM_EVENT_ADDR_CHANGE]	= "RDMA_CM_EVENT_ADDR_CHANGE",
+		[RDMA_CM_EVENT_TIMEWAIT_EXIT]	= "RDMA_CM_EVENT_TIMEWAIT_EXIT",
+	};
+
+	if ((unsigned int)event < sizeof str / sizeof str[0] && str[event]) {
+		return str[event];
+	}
+	return "UNKNOWN EVENT";
+}
+
+struct ibv_context **rdma_get_devices(int *num_devices)
+{
+	struct ibv_context **list = calloc(2, sizeof *list);
+
+	if (!list) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	list[0] = &ibloop_context;
+	if (num_devices) {
+		*num_devices = 1;
+	}
+	return list;
+}
+
+void rdma_free_devices(struct ibv_context **list)
+{
+	free(list);
+}
+
+int rdma_create_id(struct rdma_event_channel *channel, struct rdma_cm_id **id,
+		   void *context, enum rdma_port_space ps)
+{
+	struct ibloop_cm_id *cm = calloc(1, sizeof *cm);
+
+	if (!cm) {
+		errno = ENOMEM;
+		return -1;
+	}
+	pthread_mutex_init(&cm->lock, NULL);
+	pthread_mutex_init(&cm->disc_lock, NULL);
+	cm->fd = -1;
+	cm->id.channel = channel;
+	cm->id.context = context;
+	cm->id.ps = ps;
+	cm->id.qp_type = IBV_QPT_RC;
+	*id = &cm->id;
+	return 0;
+}
+
+int rdma_destroy_id(struct rdma_cm_id *id)
+{
+	struct ibloop_cm_id *cm = container_of(id, struct ibloop_cm_id, id);
+
+	pthread_mutex_lock(&cm->lock);
+	cm->stopping = 1;
+	cm->disconnected = 1;
+	if (cm->fd >= 0) {
+		shutdown(cm->fd, SHUT_RDWR);
+	}
+	pthread_mutex_unlock(&cm->lock);
+
+	if (cm->thread_started) {
+		pthread_join(cm->thread, NULL);
+	}
+	if (cm->fd >= 0) {
+		close(cm->fd);
+	}
+	pthread_mutex_destroy(&cm->lock);
+	pthread_mutex_destroy(&cm->disc_lock);
+	free(cm);
+	return 0;
+}
+
+static uint16_t ibloop_port_of(const struct sockaddr *addr)
+{
+	/* sin_port and sin6_port sit at the same offset */
+	return ntohs(((const struct sockaddr_in *)addr)->sin_port);
+}
+
+static socklen_t ibloop_addr_len(const struct sockaddr *addr)
+{
+	return addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6)
+					   : sizeof(struct sockaddr_in);
+}
+
+static void ibloop_cm_bind_device(struct rdma_cm_id *id)
+{
+	id->verbs = &ibloop_context;
+	id->port_num = 1;
+	ibv_query_gid(&ibloop_context, 1, 0, &id->route.addr.addr.ibaddr.sgid);
+	id->route.addr.addr.ibaddr.pkey = 0xffff;
+}
+
+int rdma_bind_addr(struct rdma_cm_id *id, struct sockaddr *addr)
+{
+	if (addr->sa_family != AF_INET && addr->sa_family != AF_INET6) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	memcpy(&id->route.addr.src_storage, addr, ibloop_addr_len(addr));
+	ibloop_cm_bind_device(id);
+	return 0;
+}
+
+int rdma_resolve_addr(struct rdma_cm_id *id, struct sockaddr *src_addr,
+		      struct sockaddr *dst_addr, int timeout_ms)
+{
+	if (dst_addr->sa_family != AF_INET && dst_addr->sa_family != AF_INET6) {
+		errno = EAFNOSUPPORT;
+		return -1;
+	}
+	if (src_addr) {
+		memcpy(&id->route.addr.src_storage, src_addr,
+		       ibloop_addr_len(src_addr));
+	}
+	memcpy(&id->route.addr.dst_storage, dst_addr, ibloop_addr_len(dst_addr));
+	ibloop_cm_bind_device(id);
+	id->route.addr.addr.ibaddr.dgid = id->route.addr.addr.ibaddr.sgid;
+	ibloop_cm_queue(id, NULL, RDMA_CM_EVENT_ADDR_RESOLVED, 0, NULL, 0);
+	return 0;
+}
+
+int rdma_resolve_route(struct rdma_cm_id *id, int timeout_ms)
+{
+	ibloop_cm_queue(id, NULL, RDMA_CM_EVENT_ROUTE_RESOLVED, 0, NULL, 0);
+	return 0;
+}
+
+int rdma_set_option(struct rdma_cm_id *id, int level, int optname,
+		    void *optval, size_t optlen)
+{
+	return 0;
+}
+
+int rdma_create_qp(struct rdma_cm_id *id, struct ibv_pd *pd,
+		   struct ibv_qp_init_attr *qp_init_attr)
+{
+	struct ibv_qp_attr attr = { .qp_state = IBV_QPS_INIT };
+	struct ibv_qp *qp;
+
+	if (!pd) {
+		errno = EINVAL;
+		return -1;
+	}
+	qp = ibv_create_qp(pd, qp_init_attr);
+	if (!qp) {
+		return -1;
+	}
+	ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+	id->qp = qp;
+	id->pd = pd;
+	id->send_cq = qp_init_attr->send_cq;
+	id->recv_cq = qp_init_attr->recv_cq;
+	return 0;
+}
+
+void rdma_destroy_qp(struct rdma_cm_id *id)
+{
+	if (id->qp) {
+		ibv_destroy_qp(id->qp);
+		id->qp = NULL;
+	}
+}
+
+static int ibloop_cm_send(struct ibloop_cm_id *cm, uint32_t type,
+			  const void *private_data, uint32_t len)
+{
+	struct ibloop_cm_msg msg;
+
+	memset(&msg, 0, sizeof msg);
+	msg.type = type;
+	msg.qp_num = cm->id.qp ? cm->id.qp->qp_num : 0;
+	if (len > IBLOOP_PRIVATE_DATA_MAX) {
+		len = IBLOOP_PRIVATE_DATA_MAX;
+	}
+	if (len) {
+		memcpy(msg.private_data, private_data, len);
+	}
+	msg.private_data_len = len;
+	return write_full(cm->fd, &msg, sizeof msg);
+}
+
+static int ibloop_cm_connect_qp(struct ibloop_cm_id *cm)
+{
+	struct ibv_qp_attr attr;
+
+	if (!cm->id.qp) {
+		return 0;
+	}
+	memset(&attr, 0, sizeof attr);
+	attr.qp_state = IBV_QPS_RTR;
+	attr.dest_qp_num = cm->remote_qpn;
+	if (ibv_modify_qp(cm->id.qp, &attr, IBV_QP_STATE | IBV_QP_DEST_QPN)) {
+		return -1;
+	}
+	attr.qp_state = IBV_QPS_RTS;
+	return ibv_modify_qp(cm->id.qp, &attr, IBV_QP_STATE) ? -1 : 0;
+}
+
+static void ibloop_cm_disconnected(struct ibloop_cm_id *cm)
+{
+	struct ibv_qp_attr attr = { .qp_state = IBV_QPS_ERR };
+	int notify;
+
+	pthread_mutex_lock(&cm->disc_lock);
+	pthread_mutex_lock(&cm->lock);
+	notify = cm->established && !cm->disconnected;
+	cm->disconnected = 1;
+	pthread_mutex_unlock(&cm->lock);
+
+	if (notify) {
+		if (cm->id.qp) {
+			ibloop_qp_drain_acks(container_of(cm->id.qp,
+							  struct ibloop_qp, qp));
+			ibv_modify_qp(cm->id.qp, &attr, IBV_QP_STATE);
+		}
+		ibloop_cm_queue(&cm->id, NULL, RDMA_CM_EVENT_DISCONNECTED, 0,
+				NULL, 0);
+	}
+	pthread_mutex_unlock(&cm->disc_lock);
+}
+
+/* Follows a connection for its lifetime: the reply, then the DREQ. */
+static void *ibloop_cm_conn_thread(void *opaque)
+{
+	struct ibloop_cm_id *cm = opaque;
+	struct ibloop_cm_msg msg;
+
+	while (!read_full(cm->fd, &msg, sizeof msg)) {
+		switch (msg.type) {
+		case IBLOOP_CM_REP:
+			cm->remote_qpn = msg.qp_num;
+			if (ibloop_cm_connect_qp(cm)) {
+				ibloop_cm_queue(&cm->id, NULL,
+						RDMA_CM_EVENT_CONNECT_ERROR,
+						-ECONNABORTED, NULL, 0);
+				return NULL;
+			}
+			pthread_mutex_lock(&cm->lock);
+			cm->established = 1;
+			pthread_mutex_unlock(&cm->lock);
+			ibloop_cm_queue(&cm->id, NULL, RDMA_CM_EVENT_ESTABLISHED, 0,
+					msg.private_data, msg.private_data_len);
+			break;
+		case IBLOOP_CM_REJ:
+			/* 28 is the IB CM "consumer defined" reject reason */
+			ibloop_cm_queue(&cm->id, NULL, RDMA_CM_EVENT_REJECTED, 28,
+					msg.private_data, msg.private_data_len);
+			return NULL;
+		case IBLOOP_CM_DREQ:
+			ibloop_cm_disconnected(cm);
+			return NULL;
+		}
+	}
+	ibloop_cm_disconnected(cm);
+	return NULL;
+}
+
+static void *ibloop_cm_listen_thread(void *opaque)
+{
+	struct ibloop_cm_id *listen = opaque;
+	struct ibloop_cm_id *cm;
+	struct rdma_cm_id *id;
+	struct ibloop_cm_msg msg;
+	int fd;
+
+	for (;;) {
+		fd = ibloop_accept(listen->fd, &listen->lock, &listen->stopping);
+		if (fd < 0) {
+			return NULL;
+		}
+		if (read_full(fd, &msg, sizeof msg) || msg.type != IBLOOP_CM_REQ ||
+		    rdma_create_id(listen->id.channel, &id, listen->id.context,
+				   listen->id.ps)) {
+			close(fd);
+			continue;
+		}
+		cm = container_of(id, struct ibloop_cm_id, id);
+		cm->fd = fd;
+		cm->remote_qpn = msg.qp_num;
+		id->route = listen->id.route;
+		ibloop_cm_bind_device(id);
+		ibloop_cm_queue(id, &listen->id, RDMA_CM_EVENT_CONNECT_REQUEST, 0,
+				msg.private_data, msg.private_data_len);
+	}
+}
+
+int rdma_listen(struct rdma_cm_id *id, int backlog)
+{
+	struct ibloop_cm_id *cm = container_of(id, struct ibloop_cm_id, id);
+
+	if (!id->verbs) {
+		errno = EINVAL;
+		return -1;
+	}
+	cm->fd = ibloop_listen("cm", ibloop_port_of(&id->route.addr.src_addr));
+	if (cm->fd < 0) {
+		return -1;
+	}
+	if (pthread_create(&cm->thread, NULL, ibloop_cm_listen_thread, cm)) {
+		close(cm->fd);
+		cm->fd = -1;
+		errno = EAGAIN;
+		return -1;
+	}
+	cm->thread_started = 1;
+	return 0;
+}
+
+int rdma_connect(struct rdma_cm_id *id, struct rdma_conn_param *conn_param)
+{
+	struct ibloop_cm_id *cm = container_of(id, struct ibloop_cm_id, id);
+
+	cm->fd = ibloop_connect("cm", ibloop_port_of(&id->route.addr.dst_addr));
+	if (cm->fd < 0) {
+		return -1;
+	}
+	if (ibloop_cm_send(cm, IBLOOP_CM_REQ,
+			   conn_param ? conn_param->private_data : NULL,
+			   conn_param ? conn_param->private_data_len : 0) ||
+	    pthread_create(&cm->thread, NULL, ibloop_cm_conn_thread, cm)) {
+		close(cm->fd);
+		cm->fd = -1;
+		errno = ECONNABORTED;
+		return -1;
+	}
+	cm->thread_started = 1;
+	return 0;
+}
+
+int rdma_accept(struct rdma_cm_id *id, struct rdma_conn_param *conn_param)
+{
+	struct ibloop_cm_id *cm = container_of(id, struct ibloop_cm_id, id);
+
+	if (cm->fd < 0 || ibloop_cm_connect_qp(cm)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (ibloop_cm_send(cm, IBLOOP_CM_REP,
+			   conn_param ? conn_param->private_data : NULL,
+			   conn_param ? conn_param->private_data_len : 0)) {
+		errno = ECONNABORTED;
+		return -1;
+	}
+	pthread_mutex_lock(&cm->lock);
+	cm->established = 1;
+	pthread_mutex_unlock(&cm->lock);
+	if (pthread_create(&cm->thread, NULL, ibloop_cm_conn_thread, cm)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	cm->thread_started = 1;
+	ibloop_cm_queue(id, NULL, RDMA_CM_EVENT_ESTABLISHED, 0, NULL, 0);
+	return 0;
+}
+
+int rdma_reject(struct rdma_cm_id *id, const void *private_data,
+		uint8_t private_data_len)
+{
+	struct ibloop_cm_id *cm = container_of(id, struct ibloop_cm_id, id);
+
+	if (cm->fd < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	ibloop_cm_send(cm, IBLOOP_CM_REJ, private_data, private_data_len);
+	shutdown(cm->fd, SHUT_RDWR);
+	return 0;
+}
+
+/*
+ * Both ends see RDMA_CM_EVENT_DISCONNECTED exactly once; disconnecting an
+ * id that already saw it fails with EINVAL instead of queueing another.
+ * Either way the QP has been flushed on return: callers tear down its
+ * CQs right after.
+ */
+int rdma_disconnect(struct rdma_cm_id *id)
+{
+	struct ibloop_cm_id *cm = container_of(id, struct ibloop_cm_id, id);
+	int live;
+
+	pthread_mutex_lock(&cm->disc_lock);
+	pthread_mutex_lock(&cm->lock);
+	live = cm->established && !cm->disconnected;
+	pthread_mutex_unlock(&cm->lock);
+	pthread_mutex_unlock(&cm->disc_lock);
+	if (!live) {
+		errno = EINVAL;
+		return -1;
+	}
+	ibloop_cm_send(cm, IBLOOP_CM_DREQ, NULL, 0);
+	ibloop_cm_disconnected(cm);
+	return 0;
+}
+
+int rdma_getaddrinfo(const char *node, const char *service,
+		     const struct rdma_addrinfo *hints,
+		     struct rdma_addrinfo **res)
+{
+	struct addrinfo ai_hints, *ai, *e;
+	struct rdma_addrinfo *head = NULL, **tail = &head, *r;
+	int ret;
+
+	memset(&ai_hints, 0, sizeof ai_hints);
+	ai_hints.ai_socktype = SOCK_STREAM;
+	ai_hints.ai_family = hints ? hints->ai_family : AF_UNSPEC;
+	if (hints && (hints->ai_flags & RAI_PASSIVE)) {
+		ai_hints.ai_flags = AI_PASSIVE;
+	}
+	ret = getaddrinfo(node, service, &ai_hints, &ai);
+	if (ret) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	for (e = ai; e; e = e->ai_next) {
+		r = calloc(1, sizeof *r);
+		if (r) {
+			r->ai_dst_addr = malloc(e->ai_addrlen);
+		}
+		if (!r || !r->ai_dst_addr) {
+			free(r);
+			rdma_freeaddrinfo(head);
+			freeaddrinfo(ai);
+			errno = ENOMEM;
+			return -1;
+		}
+		r->ai_flags = hints ? hints->ai_flags : 0;
+		r->ai_family = e->ai_family;
+		r->ai_qp_type = IBV_QPT_RC;
+		r->ai_port_space = RDMA_PS_TCP;
+		r->ai_dst_len = e->ai_addrlen;
+		memcpy(r->ai_dst_addr, e->ai_addr, e->ai_addrlen);
+		*tail = r;
+		tail = &r->ai_next;
+	}
+	freeaddrinfo(ai);
+	*res = head;
+	return 0;
+}
+
+void rdma_freeaddrinfo(struct rdma_addrinfo *res)
+{
+	struct rdma_addrinfo *next;
+
+	for (; res; res = next) {
+		next = res->ai_next;
+		free(res->ai_dst_addr);
+		free(res);
+	}
+}
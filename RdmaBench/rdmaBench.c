@@ -0,0 +1,1116 @@
+/*
+ * rdma-bench: drive the RDMA migration protocol engine without a VM
+ *
+ * Links migration-rdma.c against a small shim of the QEMU services it
+ * uses (shim.c) and runs it over synthetic RAM blocks: a bulk round
+ * sending every page, then --iterations rounds re-sending the pages a
+ * dirty pattern touched, the last one as the stop-and-copy round.  The
+ * stream framing is the one ram_save_*() and ram_load() use, so the
+ * engine sees the same sequence of hooks as in a real migration.
+ *
+ *   dest:   rdmaBench -d 0.0.0.0:4444 --ram 1G
+ *   source: rdmaBench -s 192.168.1.2:4444 --ram 1G --iterations 5
+ *
+ * With --replay the source saves the pages of a trace recorded by a real
+ * migration with ",record=PATH" instead, and both sides take the RAM
+ * blocks from it:
+ *
+ *   dest:   rdmaBench -d 0.0.0.0:4444 --replay vm.trace
+ *   source: rdmaBench -s 192.168.1.2:4444 --replay vm.trace --realtime
+ *
+ * With --local the two sides run on one host and -s/-d take the path
+ * of a unix socket: the source RAM is a memfd the dest maps, as with
+ * "local:PATH".
+ *
+ * With --disk the source also sends a synthetic disk the way block
+ * migration would, in 1M chunks through rdma_migration_save_disk(), or
+ * in the stream where the transport has no disk writes.
+ *
+ * Both sides must be given the same --ram and --blocks, or the same
+ * trace.  Any verbs device works; on a machine without one use soft-RoCE
+ * or PreloadLoopback/libibloop.so.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "block/block.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "migration-rdma.h"
+#include "shim.h"
+#include <endian.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+/*
+ * Not a RAM_SAVE_FLAG_*: closes the stream, followed by the bytes of RAM
+ * sent and the RAM hash
+ */
+#define BENCH_FLAG_DONE 0x100
+/* A disk chunk in the stream, followed by its sector and length */
+#define BENCH_FLAG_DISK 0x200
+
+/* What blk_mig_save_bulked_block() reads at once */
+#define BENCH_DISK_CHUNK (1 << 20)
+
+enum {
+    PATTERN_RANDOM,
+    PATTERN_SEQ,
+    PATTERN_HOT,
+};
+
+static const char *pattern_names[] = {
+    [PATTERN_RANDOM] = "random",
+    [PATTERN_SEQ] = "seq",
+    [PATTERN_HOT] = "hot",
+};
+
+static struct {
+    const char *source;
+    const char *dest;
+    bool tcp_bootstrap;
+    bool local;
+    uint64_t ram_size;
+    uint64_t disk_size;
+    int nb_blocks;
+    int iterations;
+    int dirty_pct;
+    int pattern;
+    int zero_pct;
+    int free_pct;
+    bool batch;
+    bool prefill;
+    bool verify;
+    uint64_t seed;
+    const char *replay;
+    bool realtime;
+} opts = {
+    .ram_size = 256 << 20,
+    .nb_blocks = 1,
+    .iterations = 3,
+    .dirty_pct = 10,
+    .pattern = PATTERN_RANDOM,
+    .zero_pct = 25,
+    .seed = 1,
+};
+
+static uint64_t nb_pages;      /* up to the end of the last block */
+static unsigned long *dirty;
+static unsigned long *filled;   /* --replay: pages given content */
+static uint64_t rng_state;
+
+/* --free: pages free in the guest, under 'free_lock' */
+static unsigned long *free_pages;
+static QemuMutex free_lock;
+
+/* --replay: the trace, positioned after 'trace_next' */
+static FILE *trace;
+static RDMATraceRecord trace_next;
+static bool trace_eof;
+
+static uint64_t rng(void)
+{
+    /* xorshift64*, so a seed reproduces the same run everywhere */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static double now_sec(void)
+{
+    return qemu_clock_get_ns(QEMU_CLOCK_REALTIME) / 1e9;
+}
+
+static double cpu_sec(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static bool parse_size(const char *str, uint64_t *size)
+{
+    char *end;
+    uint64_t v = strtoull(str, &end, 0);
+
+    switch (*end) {
+    case 'G': case 'g':
+        v <<= 10;
+        /* fall through */
+    case 'M': case 'm':
+        v <<= 10;
+        /* fall through */
+    case 'K': case 'k':
+        v <<= 10;
+        end++;
+        break;
+    }
+    if (*end || !v) {
+        return false;
+    }
+    *size = v;
+    return true;
+}
+
+static BenchBlock *ram_add_block(ram_addr_t offset, ram_addr_t length)
+{
+    BenchBlock *block;
+
+    bench_blocks = g_renew(BenchBlock, bench_blocks, bench_nb_blocks + 1);
+    block = &bench_blocks[bench_nb_blocks];
+    if (opts.local && opts.source) {
+        /* local: shares RAM that is a shared mapping of a file */
+        int fd = memfd_create("bench ram", MFD_CLOEXEC);
+
+        if (fd < 0 || ftruncate(fd, length) < 0) {
+            fprintf(stderr, "bench: cannot create a memfd: %s\n",
+                    strerror(errno));
+            return NULL;
+        }
+        block->host = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        close(fd);
+    } else {
+        block->host = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           -1, 0);
+    }
+    if (block->host == MAP_FAILED) {
+        fprintf(stderr, "bench: cannot allocate %" PRIu64 " bytes: %s\n",
+                (uint64_t)length, strerror(errno));
+        return NULL;
+    }
+    block->offset = offset;
+    block->length = length;
+    bench_nb_blocks++;
+    nb_pages = MAX(nb_pages, (offset + length) >> TARGET_PAGE_BITS);
+    return block;
+}
+
+/*
+ * Split the RAM into --blocks blocks at page granularity, laid out
+ * back to back in ram_addr_t space as the RAM block allocator would.
+ */
+static bool ram_alloc(void)
+{
+    uint64_t pages = opts.ram_size >> TARGET_PAGE_BITS;
+    uint64_t per_block, left;
+    ram_addr_t offset = 0;
+    int i;
+
+    if (opts.nb_blocks < 1 || pages < opts.nb_blocks) {
+        fprintf(stderr, "bench: --ram too small for %d blocks\n",
+                opts.nb_blocks);
+        return false;
+    }
+
+    per_block = pages / opts.nb_blocks;
+    left = pages;
+    for (i = 0; i < opts.nb_blocks; i++) {
+        uint64_t n = i == opts.nb_blocks - 1 ? left : per_block;
+
+        if (!ram_add_block(offset, n << TARGET_PAGE_BITS)) {
+            return false;
+        }
+        offset += n << TARGET_PAGE_BITS;
+        left -= n;
+    }
+    return true;
+}
+
+static uint8_t *ram_host(ram_addr_t addr, BenchBlock **pblock)
+{
+    int i;
+
+    for (i = 0; i < bench_nb_blocks; i++) {
+        BenchBlock *block = &bench_blocks[i];
+
+        if (addr - block->offset < block->length) {
+            if (pblock) {
+                *pblock = block;
+            }
+            return block->host + (addr - block->offset);
+        }
+    }
+    return NULL;
+}
+
+static uint8_t *page_host(uint64_t page, BenchBlock **pblock)
+{
+    uint8_t *host = ram_host(page << TARGET_PAGE_BITS, pblock);
+
+    if (!host) {
+        abort();
+    }
+    return host;
+}
+
+/*
+ * Pages get random content, except for --zero percent of the RAM.  The
+ * zero pages come in 1M runs, the RDMA chunk size: only whole zero
+ * chunks are sent compressed.
+ */
+#define ZERO_RUN_PAGES (1 << (20 - TARGET_PAGE_BITS))
+
+static bool page_is_zero(uint64_t page)
+{
+    /* splitmix64 of the run, so pages can be filled in any order */
+    uint64_t x = opts.seed + (page / ZERO_RUN_PAGES) * 0x9e3779b97f4a7c15ULL;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (x ^ (x >> 31)) % 100 < opts.zero_pct;
+}
+
+/*
+ * --free percent of the RAM is free in the guest initially, in 64K runs.
+ * Free pages are zero, as with init_on_free, and allocated when written.
+ */
+#define FREE_RUN_PAGES (1 << (16 - TARGET_PAGE_BITS))
+
+static bool page_starts_free(uint64_t page)
+{
+    uint64_t x = opts.seed + (page / FREE_RUN_PAGES) * 0xd1b54a32d192ed03ULL;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (x ^ (x >> 31)) % 100 < opts.free_pct;
+}
+
+static void page_fill(uint64_t page)
+{
+    uint64_t *p = (uint64_t *)page_host(page, NULL);
+    int i;
+
+    if (page_is_zero(page) || (free_pages && test_bit(page, free_pages))) {
+        return;
+    }
+    for (i = 0; i < TARGET_PAGE_SIZE / sizeof(*p); i++) {
+        p[i] = rng();
+    }
+}
+
+static void ram_fill(void)
+{
+    uint64_t page;
+
+    for (page = 0; page < nb_pages; page++) {
+        page_fill(page);
+    }
+}
+
+/* A guest write */
+static void page_write(uint64_t page)
+{
+    uint64_t *p = (uint64_t *)page_host(page, NULL);
+
+    p[rng() % (TARGET_PAGE_SIZE / sizeof(*p))] = rng() | 1;
+}
+
+static void page_touch(uint64_t page)
+{
+    if (free_pages) {
+        qemu_mutex_lock(&free_lock);
+        clear_bit(page, free_pages);
+        qemu_mutex_unlock(&free_lock);
+    }
+    page_write(page);
+    set_bit(page, dirty);
+}
+
+/*
+ * What the guest writes between two rounds.  "seq" sweeps a window
+ * through RAM, "hot" sends 90% of the writes to the first 10% of it.
+ */
+static void ram_dirty(int round)
+{
+    uint64_t count = nb_pages * opts.dirty_pct / 100;
+    uint64_t hot = MAX(nb_pages / 10, 1);
+    uint64_t i;
+
+    for (i = 0; i < count; i++) {
+        switch (opts.pattern) {
+        case PATTERN_SEQ:
+            page_touch((round * count + i) % nb_pages);
+            break;
+        case PATTERN_HOT:
+            page_touch(rng() % 10 ? rng() % hot : rng() % nb_pages);
+            break;
+        default:
+            page_touch(rng() % nb_pages);
+            break;
+        }
+    }
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *p, uint64_t len)
+{
+    uint64_t i;
+
+    for (i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* and the disk's, if there is one */
+static uint64_t ram_hash(void)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < bench_nb_blocks; i++) {
+        hash = hash_bytes(hash, bench_blocks[i].host, bench_blocks[i].length);
+    }
+    return hash_bytes(hash, bench_disk, bench_disk_size);
+}
+
+static void disk_fill(void)
+{
+    uint64_t *p = (uint64_t *)bench_disk;
+    uint64_t i;
+
+    for (i = 0; i < bench_disk_size / sizeof(*p); i++) {
+        p[i] = rng();
+    }
+}
+
+/*
+ * blk_mig_save_bulked_block() over the whole disk.  Returns the bytes
+ * sent or -1.
+ */
+static int64_t save_disk(QEMUFile *f)
+{
+    uint64_t pos, stream = 0;
+
+    for (pos = 0; pos < bench_disk_size; pos += BENCH_DISK_CHUNK) {
+        int len = MIN(BENCH_DISK_CHUNK, bench_disk_size - pos);
+        int ret;
+
+        ret = rdma_migration_save_disk(f, BENCH_DISK_NAME,
+                                       pos >> BDRV_SECTOR_BITS,
+                                       bench_disk + pos,
+                                       len >> BDRV_SECTOR_BITS);
+        if (ret == -ENOTSUP) {
+            qemu_put_be64(f, BENCH_FLAG_DISK);
+            qemu_put_be64(f, pos);
+            qemu_put_be64(f, len);
+            qemu_put_buffer(f, bench_disk + pos, len);
+            stream += len;
+        } else if (ret < 0) {
+            fprintf(stderr, "bench: disk chunk at %" PRIu64 " failed: %s\n",
+                    pos, strerror(-ret));
+            return -1;
+        }
+    }
+    if (stream) {
+        printf("bench: disk          %.3f GB in the stream\n", stream / 1e9);
+    }
+    return bench_disk_size;
+}
+
+static int load_disk(QEMUFile *f)
+{
+    uint64_t pos = qemu_get_be64(f);
+    uint64_t len = qemu_get_be64(f);
+
+    if (pos > bench_disk_size || len > bench_disk_size - pos) {
+        fprintf(stderr, "bench: disk chunk at %" PRIu64 " beyond --disk\n",
+                pos);
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, bench_disk + pos, len);
+    return 0;
+}
+
+/*
+ * --free: the free page agent, answering the engine's requests with the
+ * runs of 'free_pages', guest physical addresses being ram_addr_ts here.
+ * See RDMAFreePages for the protocol.
+ */
+#define FREE_MAGIC 0x46524545
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    for (; len; buf = (uint8_t *)buf + n, len -= n) {
+        n = read(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    for (; len; buf = (const uint8_t *)buf + n, len -= n) {
+        n = write(fd, buf, len);
+        if (n <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void *free_agent(void *opaque)
+{
+    int sock = (intptr_t)opaque, conn;
+    /* the reply header, then the ranges: written at once, not to wait
+     * for the delayed ACK of the header */
+    uint64_t *reply = g_new(uint64_t, 2 + 2 * (nb_pages / 2 + 1));
+    uint64_t page, end, nb;
+    uint32_t req[2];
+
+    conn = accept(sock, NULL, NULL);
+    while (conn >= 0 && !read_full(conn, req, sizeof(req)) &&
+           be32toh(req[0]) == FREE_MAGIC) {
+        nb = 2;
+        qemu_mutex_lock(&free_lock);
+        for (page = find_next_bit(free_pages, nb_pages, 0); page < nb_pages;
+             page = find_next_bit(free_pages, nb_pages, end)) {
+            end = find_next_zero_bit(free_pages, nb_pages, page);
+            reply[nb++] = htobe64(page << TARGET_PAGE_BITS);
+            reply[nb++] = htobe64((end - page) << TARGET_PAGE_BITS);
+        }
+        qemu_mutex_unlock(&free_lock);
+
+        ((uint32_t *)reply)[0] = htobe32(FREE_MAGIC);
+        ((uint32_t *)reply)[1] = req[1];
+        reply[1] = htobe64(nb / 2 - 1);
+        if (write_full(conn, reply, nb * sizeof(uint64_t))) {
+            break;
+        }
+    }
+    if (conn >= 0) {
+        close(conn);
+    }
+    close(sock);
+    g_free(reply);
+    return NULL;
+}
+
+/*
+ * Mark the --free pages and start the agent on a loopback port, which
+ * the source's options then point the engine to.
+ */
+static bool free_agent_start(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET,
+                                .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t len = sizeof(addr);
+    QemuThread thread;
+    uint64_t page;
+    int sock;
+
+    free_pages = bitmap_new(nb_pages);
+    for (page = 0; page < nb_pages; page++) {
+        if (page_starts_free(page)) {
+            set_bit(page, free_pages);
+        }
+    }
+    qemu_mutex_init(&free_lock);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+        listen(sock, 1) ||
+        getsockname(sock, (struct sockaddr *)&addr, &len)) {
+        perror("bench: free page agent");
+        return false;
+    }
+
+    opts.source = g_strdup_printf("%s,free-page-agent=127.0.0.1:%d",
+                                  opts.source, ntohs(addr.sin_port));
+    qemu_thread_create(&thread, "free agent", free_agent,
+                       (void *)(intptr_t)sock, QEMU_THREAD_DETACHED);
+    return true;
+}
+
+/*
+ * --batch: hand each RAM block's dirty pages to the engine in one
+ * rdma_migration_save_pages() call.
+ */
+static uint64_t save_round_batch(QEMUFile *f)
+{
+    uint64_t first, last, sent = 0;
+    long pages;
+    int i;
+
+    for (i = 0; i < bench_nb_blocks; i++) {
+        first = bench_blocks[i].offset >> TARGET_PAGE_BITS;
+        last = first + (bench_blocks[i].length >> TARGET_PAGE_BITS);
+
+        pages = rdma_migration_save_pages(f, bench_blocks[i].offset, dirty,
+                                          first, last);
+        if (pages < 0) {
+            qemu_file_set_error(f, pages);
+            break;
+        }
+        bitmap_clear(dirty, first, last - first);
+        sent += (uint64_t)pages << TARGET_PAGE_BITS;
+    }
+    return sent;
+}
+
+/*
+ * One ram_save_iterate() / ram_save_complete(), minus the bookkeeping.
+ * Returns the bytes of RAM saved.
+ */
+static uint64_t save_round(QEMUFile *f, uint64_t flags)
+{
+    uint64_t page, sent = 0;
+
+    ram_control_before_iterate(f, flags);
+    if (opts.batch) {
+        sent = save_round_batch(f);
+    }
+    for (page = find_next_bit(dirty, nb_pages, 0); page < nb_pages;
+         page = find_next_bit(dirty, nb_pages, page + 1)) {
+        BenchBlock *block;
+        int bytes_sent = 0;
+
+        clear_bit(page, dirty);
+        page_host(page, &block);
+        ram_control_save_page(f, block->offset,
+                              (page << TARGET_PAGE_BITS) - block->offset,
+                              TARGET_PAGE_SIZE, &bytes_sent);
+        sent += TARGET_PAGE_SIZE;
+    }
+    ram_control_after_iterate(f, flags);
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    return sent;
+}
+
+static uint64_t save_synthetic(QEMUFile *f)
+{
+    uint64_t sent = 0, flags;
+    int round;
+
+    /* ram_save_setup() */
+    rdma_migration_bitmap_synced();
+    ram_control_before_iterate(f, RAM_CONTROL_SETUP);
+    ram_control_after_iterate(f, RAM_CONTROL_SETUP);
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    bitmap_set(dirty, 0, nb_pages);
+    for (round = 0; round <= opts.iterations; round++) {
+        if (round) {
+            ram_dirty(round);
+        }
+        rdma_migration_bitmap_synced();
+        flags = round == opts.iterations ? RAM_CONTROL_FINISH
+                                         : RAM_CONTROL_ROUND;
+        sent += save_round(f, flags);
+        if (qemu_file_get_error(f)) {
+            fprintf(stderr, "bench: round %d failed\n", round);
+            break;
+        }
+    }
+    return sent;
+}
+
+static bool trace_read(RDMATraceRecord *rec)
+{
+    return fread(rec, sizeof(*rec), 1, trace) == 1;
+}
+
+/* Open the --replay trace and allocate the RAM blocks it lists. */
+static bool trace_open(void)
+{
+    RDMATraceHeader head;
+    ram_addr_t length;
+
+    trace = fopen(opts.replay, "rb");
+    if (!trace) {
+        fprintf(stderr, "bench: cannot open %s: %s\n", opts.replay,
+                strerror(errno));
+        return false;
+    }
+    if (fread(&head, sizeof(head), 1, trace) != 1 ||
+        head.magic != RDMA_TRACE_MAGIC ||
+        head.version != RDMA_TRACE_VERSION ||
+        head.page_bits != TARGET_PAGE_BITS) {
+        fprintf(stderr, "bench: %s is not a page trace this build can "
+                "replay\n", opts.replay);
+        return false;
+    }
+
+    opts.ram_size = 0;
+    while (!(trace_eof = !trace_read(&trace_next)) &&
+           trace_next.type == RDMA_TRACE_BLOCK) {
+        length = (ram_addr_t)trace_next.len << TARGET_PAGE_BITS;
+        if (!ram_add_block(trace_next.addr, length)) {
+            return false;
+        }
+        opts.ram_size += length;
+    }
+    if (!bench_nb_blocks) {
+        fprintf(stderr, "bench: %s has no RAM blocks\n", opts.replay);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Save the pages of the trace, iteration by iteration, as ram_save_*()
+ * did when it was recorded; with --realtime no earlier than they were.
+ * A page gets its content the first time it is saved, and is written to
+ * before it is saved again.
+ */
+static uint64_t save_replay(QEMUFile *f)
+{
+    RDMATraceRecord *rec = &trace_next;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t sent = 0, page;
+    BenchBlock *block;
+    int bytes_sent;
+
+    for (; !trace_eof && !qemu_file_get_error(f);
+         trace_eof = !trace_read(rec)) {
+        if (opts.realtime) {
+            int64_t wait = start + rec->time -
+                           qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+            if (wait > 0) {
+                struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        switch (rec->type) {
+        case RDMA_TRACE_BEGIN:
+            rdma_migration_bitmap_synced();
+            ram_control_before_iterate(f, rec->addr);
+            break;
+        case RDMA_TRACE_PAGE:
+            if (!ram_host(rec->addr, &block) ||
+                rec->addr + rec->len > block->offset + block->length) {
+                fprintf(stderr, "bench: trace saves 0x%" PRIx64 " outside "
+                        "its RAM blocks\n", rec->addr);
+                qemu_file_set_error(f, -EINVAL);
+                break;
+            }
+            for (page = rec->addr >> TARGET_PAGE_BITS;
+                 page << TARGET_PAGE_BITS < rec->addr + rec->len; page++) {
+                if (test_and_set_bit(page, filled)) {
+                    page_write(page);
+                } else {
+                    page_fill(page);
+                }
+            }
+            bytes_sent = 0;
+            ram_control_save_page(f, block->offset, rec->addr - block->offset,
+                                  rec->len, &bytes_sent);
+            sent += rec->len;
+            break;
+        case RDMA_TRACE_END:
+            ram_control_after_iterate(f, rec->addr);
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            break;
+        }
+    }
+    return sent;
+}
+
+static void report_hist(const char *name, const RDMAHistogram *h)
+{
+    if (!h->count) {
+        return;
+    }
+    printf("bench: %-13s %10" PRIu64 " x  mean %8.1f us  max %8.1f us\n",
+           name, h->count, h->sum_ns / 1e3 / h->count, h->max_ns / 1e3);
+}
+
+static void report(const char *side, uint64_t logical, double secs,
+                   double cpu, const RDMAStats *st)
+{
+    double gb = logical / 1e9;
+
+    printf("bench: %s: %.3f GB in %.3f s\n", side, gb, secs);
+    /* only the source counts the bytes it writes */
+    if (st->write_bytes) {
+        printf("bench: throughput    %.3f GB/s logical, %.3f GB/s on the "
+               "wire\n", gb / secs, st->write_bytes / 1e9 / secs);
+    } else {
+        printf("bench: throughput    %.3f GB/s logical\n", gb / secs);
+    }
+    printf("bench: writes        %" PRIu64 " (%" PRIu64
+           " chunks sent as zero)\n", st->writes, st->zero_chunks);
+    printf("bench: registrations %" PRIu64 " (%.0f/s), %" PRIu64
+           " unregistrations\n", st->registrations,
+           st->registrations / secs, st->unregistrations);
+    printf("bench: control       %" PRIu64 " sent, %" PRIu64
+           " received, %" PRIu64 " round trips\n", st->control_sends,
+           st->control_recvs, st->control.count);
+    if (st->kept) {
+        printf("bench: kept          %" PRIu64 " pages the dest had\n",
+               st->kept);
+    }
+    if (st->discarded) {
+        printf("bench: discarded     %" PRIu64 " pages free in the guest\n",
+               st->discarded);
+    }
+    if (st->lz4_writes) {
+        printf("bench: lz4           %" PRIu64 " writes, %.3f GB of RAM\n",
+               st->lz4_writes, st->lz4_bytes / 1e9);
+    }
+    if (st->disk_writes) {
+        printf("bench: disk          %" PRIu64 " writes, %.3f GB\n",
+               st->disk_writes, st->disk_bytes / 1e9);
+    }
+    if (st->resumes) {
+        printf("bench: resumed       %" PRIu64 " times\n", st->resumes);
+    }
+    if (st->deferred) {
+        printf("bench: deferred      %" PRIu64 " pages, %" PRIu64
+               " sends saved\n", st->deferred, st->defer_saved);
+    }
+    printf("bench: cpu           %.3f s, %.3f s/GB\n", cpu,
+           gb ? cpu / gb : 0);
+    report_hist("registration", &st->registration);
+    report_hist("reg round trip", &st->reg_rtt);
+    report_hist("write", &st->write);
+    report_hist("control", &st->control);
+    report_hist("cq wait", &st->cq_wait);
+}
+
+static int run_source(void)
+{
+    MigrationState s = { .state = 0 };
+    Error *err = NULL;
+    RDMAStats st = { 0 };
+    uint64_t sent;
+    int64_t disk = 0;
+    double start, cpu;
+    int ret;
+
+    if (!opts.replay) {
+        ram_fill();
+    }
+    disk_fill();
+
+    s.enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL] = bench_pin_all;
+    s.enabled_capabilities[MIGRATION_CAPABILITY_X_RDMA_READY] = bench_ready;
+    if (bench_ready) {
+        /* as migrate-set-capabilities would on a running VM */
+        rdma_migration_ready_update();
+    }
+    if (opts.local) {
+        local_start_outgoing_migration(&s, opts.source, &err);
+    } else if (opts.tcp_bootstrap) {
+        rdma_start_outgoing_migration2(&s, opts.source, &err);
+    } else {
+        rdma_start_outgoing_migration(&s, opts.source, &err);
+    }
+    if (err || !bench_connected) {
+        fprintf(stderr, "bench: connect to %s failed: %s\n", opts.source,
+                err ? error_get_pretty(err) : "unknown error");
+        return 1;
+    }
+
+    start = now_sec();
+    cpu = cpu_sec();
+
+    qemu_put_be64(s.file, opts.ram_size | RAM_SAVE_FLAG_MEM_SIZE);
+    sent = opts.replay ? save_replay(s.file) : save_synthetic(s.file);
+    if (bench_disk) {
+        disk = save_disk(s.file);
+    }
+    if (disk < 0 || qemu_file_get_error(s.file)) {
+        fprintf(stderr, "bench: migration failed: %d\n",
+                qemu_file_get_error(s.file));
+        return 1;
+    }
+
+    /* what is left of qemu_savevm_state_complete() */
+    qemu_put_be64(s.file, BENCH_FLAG_DONE);
+    qemu_put_be64(s.file, sent + disk);
+    qemu_put_be64(s.file, opts.verify ? ram_hash() : 0);
+    qemu_fflush(s.file);
+    ret = rdma_migration_finish();
+
+    rdma_migration_get_stats(false, &st);
+    report("source", sent + disk, now_sec() - start,
+           cpu_sec() - cpu, &st);
+    printf("bench: pages         %" PRIu64 " zero bytes, %" PRIu64
+           " written\n", bench_zero_bytes, bench_normal_bytes);
+
+    if (qemu_fclose(s.file) < 0 || ret < 0 || bench_failed) {
+        fprintf(stderr, "bench: migration failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int run_dest(void)
+{
+    Error *err = NULL;
+    RDMAStats st = { 0 };
+    uint64_t addr, flags, received = 0, hash = 0;
+    double start = 0, cpu = 0;
+    int rounds = 0, ret;
+
+    if (opts.prefill) {
+        ram_fill();
+    }
+
+    if (opts.local) {
+        local_start_incoming_migration(opts.dest, &err);
+    } else if (opts.tcp_bootstrap) {
+        rdma_start_incoming_migration2(opts.dest, &err);
+    } else {
+        rdma_start_incoming_migration(opts.dest, &err);
+    }
+    if (err) {
+        fprintf(stderr, "bench: listen on %s failed: %s\n", opts.dest,
+                error_get_pretty(err));
+        return 1;
+    }
+
+    while (!bench_incoming) {
+        if (!main_loop_wait_once(1000)) {
+            fprintf(stderr, "bench: nothing left to wait for\n");
+            return 1;
+        }
+    }
+
+    /* ram_load() */
+    do {
+        addr = qemu_get_be64(bench_incoming);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
+            if (addr != opts.ram_size) {
+                fprintf(stderr, "bench: source has %" PRIu64 " bytes of RAM,"
+                        " not %" PRIu64 "\n", addr, opts.ram_size);
+                return 1;
+            }
+            start = now_sec();
+            cpu = cpu_sec();
+        } else if (flags & RAM_SAVE_FLAG_HOOK) {
+            ram_control_load_hook(bench_incoming, flags);
+        } else if (flags & RAM_SAVE_FLAG_EOS) {
+            rounds++;
+        } else if (flags & BENCH_FLAG_DISK) {
+            if (load_disk(bench_incoming) < 0) {
+                return 1;
+            }
+        } else if (flags & BENCH_FLAG_DONE) {
+            received = qemu_get_be64(bench_incoming);
+            hash = qemu_get_be64(bench_incoming);
+        } else {
+            fprintf(stderr, "bench: unexpected flags 0x%" PRIx64 "\n", flags);
+            return 1;
+        }
+        ret = qemu_file_get_error(bench_incoming);
+    } while (!ret && !(flags & BENCH_FLAG_DONE));
+
+    if (!ret) {
+        rdma_migration_get_stats(true, &st);
+    }
+    /* waits for the writes still in flight */
+    if (qemu_fclose(bench_incoming) < 0 || ret) {
+        fprintf(stderr, "bench: migration failed: %d\n", ret);
+        return 1;
+    }
+    report("dest", received, now_sec() - start, cpu_sec() - cpu, &st);
+    printf("bench: %d rounds received\n", rounds - 1);
+
+    if (hash) {
+        if (hash != ram_hash()) {
+            fprintf(stderr, "bench: RAM differs from the source\n");
+            return 1;
+        }
+        printf("bench: RAM verified\n");
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+"usage: %s -s|-d HOST:PORT[,option...] [options]\n"
+"  -s, --source HOST:PORT    migrate to the dest listening there\n"
+"  -d, --dest HOST:PORT      listen there\n"
+"  -t, --rdmat               bootstrap over TCP (rdmat:) instead of rdma_cm\n"
+"  -L, --local               same host: -s/-d take a unix socket path and\n"
+"                            the dest maps the source RAM (local:)\n"
+"  -m, --ram SIZE            synthetic RAM, K/M/G suffixes (256M)\n"
+"  -D, --disk SIZE           also migrate a synthetic disk that size\n"
+"  -b, --blocks N            split it into N RAM blocks (1)\n"
+"  -i, --iterations N        rounds after the bulk round (3)\n"
+"  -p, --dirty PCT           pages written between rounds (10)\n"
+"  -P, --pattern NAME        random, seq or hot (random)\n"
+"  -z, --zero PCT            RAM left zero initially, in 1M runs (25)\n"
+"  -f, --free PCT            source: RAM free in the guest, in 64K runs,\n"
+"                            reported by a stand-in free page agent (0)\n"
+"  -a, --pin-all             x-rdma-pin-all\n"
+"  -M, --ready               source: x-rdma-ready, register the RAM before\n"
+"                            connecting\n"
+"  -B, --batch               save a block's dirty pages in one call\n"
+"  -F, --prefill             dest: start with the source's initial RAM\n"
+"  -v, --verify              compare the RAM hashes at the end\n"
+"  -S, --seed N              seed of the fill and dirty patterns (1)\n"
+"  -r, --replay PATH         save the pages of a ,record=PATH trace\n"
+"  -R, --realtime            at the pace they were recorded\n"
+"HOST:PORT options are the ones of rdma:, e.g. ,rails=2\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option longopts[] = {
+        { "source", required_argument, NULL, 's' },
+        { "dest", required_argument, NULL, 'd' },
+        { "rdmat", no_argument, NULL, 't' },
+        { "local", no_argument, NULL, 'L' },
+        { "ram", required_argument, NULL, 'm' },
+        { "disk", required_argument, NULL, 'D' },
+        { "blocks", required_argument, NULL, 'b' },
+        { "iterations", required_argument, NULL, 'i' },
+        { "dirty", required_argument, NULL, 'p' },
+        { "pattern", required_argument, NULL, 'P' },
+        { "zero", required_argument, NULL, 'z' },
+        { "free", required_argument, NULL, 'f' },
+        { "pin-all", no_argument, NULL, 'a' },
+        { "ready", no_argument, NULL, 'M' },
+        { "batch", no_argument, NULL, 'B' },
+        { "prefill", no_argument, NULL, 'F' },
+        { "verify", no_argument, NULL, 'v' },
+        { "seed", required_argument, NULL, 'S' },
+        { "replay", required_argument, NULL, 'r' },
+        { "realtime", no_argument, NULL, 'R' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c, i;
+
+    while ((c = getopt_long(argc, argv, "s:d:tLm:D:b:i:p:P:z:f:aMBFvS:r:R",
+                            longopts, NULL)) != -1) {
+        switch (c) {
+        case 's':
+            opts.source = optarg;
+            break;
+        case 'd':
+            opts.dest = optarg;
+            break;
+        case 't':
+            opts.tcp_bootstrap = true;
+            break;
+        case 'L':
+            opts.local = true;
+            break;
+        case 'm':
+            if (!parse_size(optarg, &opts.ram_size)) {
+                fprintf(stderr, "bench: bad size '%s'\n", optarg);
+                return 1;
+            }
+            opts.ram_size = QEMU_ALIGN_UP(opts.ram_size, TARGET_PAGE_SIZE);
+            break;
+        case 'D':
+            if (!parse_size(optarg, &opts.disk_size)) {
+                fprintf(stderr, "bench: bad size '%s'\n", optarg);
+                return 1;
+            }
+            opts.disk_size = QEMU_ALIGN_UP(opts.disk_size, BDRV_SECTOR_SIZE);
+            break;
+        case 'b':
+            opts.nb_blocks = atoi(optarg);
+            break;
+        case 'i':
+            opts.iterations = MAX(atoi(optarg), 0);
+            break;
+        case 'p':
+            opts.dirty_pct = MIN(MAX(atoi(optarg), 0), 100);
+            break;
+        case 'P':
+            for (i = 0; i < ARRAY_SIZE(pattern_names); i++) {
+                if (!strcmp(optarg, pattern_names[i])) {
+                    break;
+                }
+            }
+            if (i == ARRAY_SIZE(pattern_names)) {
+                fprintf(stderr, "bench: unknown pattern '%s'\n", optarg);
+                return 1;
+            }
+            opts.pattern = i;
+            break;
+        case 'z':
+            opts.zero_pct = MIN(MAX(atoi(optarg), 0), 100);
+            break;
+        case 'f':
+            opts.free_pct = MIN(MAX(atoi(optarg), 0), 100);
+            break;
+        case 'a':
+            bench_pin_all = true;
+            break;
+        case 'M':
+            bench_ready = true;
+            break;
+        case 'B':
+            opts.batch = true;
+            break;
+        case 'F':
+            opts.prefill = true;
+            break;
+        case 'v':
+            opts.verify = true;
+            break;
+        case 'S':
+            opts.seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'r':
+            opts.replay = optarg;
+            break;
+        case 'R':
+            opts.realtime = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!opts.source == !opts.dest || optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opts.local && (opts.tcp_bootstrap || opts.free_pct)) {
+        fprintf(stderr, "bench: --local sends no pages, --rdmat and --free "
+                "do not apply\n");
+        return 1;
+    }
+
+    rng_state = opts.seed ?: 1;
+    if (!(opts.replay ? trace_open() : ram_alloc())) {
+        return 1;
+    }
+    if (opts.disk_size) {
+        bench_disk = g_malloc0(opts.disk_size);
+        bench_disk_size = opts.disk_size;
+    }
+    dirty = bitmap_new(nb_pages);
+    filled = bitmap_new(nb_pages);
+    if (opts.source && opts.free_pct) {
+        if (opts.replay) {
+            fprintf(stderr, "bench: --free needs the synthetic RAM\n");
+            return 1;
+        }
+        if (!free_agent_start()) {
+            return 1;
+        }
+    }
+    return opts.source ? run_source() : run_dest();
+}
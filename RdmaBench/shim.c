@@ -0,0 +1,869 @@
+/*
+ * rdma-bench: the QEMU services migration-rdma.c depends on
+ *
+ * Buffered QEMUFile and RAM control hooks as in savevm.c, a poll() based
+ * stand-in for the main loop, and the migration core entry points, which
+ * only record what happened for rdmaBench.c to pick up.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "block/block.h"
+#include "block/coroutine.h"
+#include "exec/cpu-common.h"
+#include "exec/address-spaces.h"
+#include "sysemu/sysemu.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "shim.h"
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+BenchBlock *bench_blocks;
+int bench_nb_blocks;
+bool bench_pin_all;
+bool bench_ready;
+bool bench_connected;
+bool bench_failed;
+QEMUFile *bench_incoming;
+uint64_t bench_zero_bytes;
+uint64_t bench_normal_bytes;
+
+/**********Errors**********/
+
+struct Error {
+    char *msg;
+};
+
+void error_setg(Error **errp, const char *fmt, ...)
+{
+    Error *err;
+    va_list ap;
+
+    if (!errp) {
+        return;
+    }
+    err = g_malloc0(sizeof(*err));
+    va_start(ap, fmt);
+    if (vasprintf(&err->msg, fmt, ap) < 0) {
+        err->msg = NULL;
+    }
+    va_end(ap);
+    *errp = err;
+}
+
+void error_propagate(Error **dst_err, Error *local_err)
+{
+    if (dst_err && !*dst_err) {
+        *dst_err = local_err;
+    } else if (local_err) {
+        error_free(local_err);
+    }
+}
+
+const char *error_get_pretty(Error *err)
+{
+    return err->msg ? err->msg : "unknown error";
+}
+
+void error_free(Error *err)
+{
+    if (err) {
+        free(err->msg);
+        g_free(err);
+    }
+}
+
+/**********Clocks, threads, zero detection**********/
+
+int64_t qemu_clock_get_ns(QEMUClockType type)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void qemu_mutex_init(QemuMutex *mutex)
+{
+    pthread_mutex_init(&mutex->lock, NULL);
+}
+
+void qemu_mutex_destroy(QemuMutex *mutex)
+{
+    pthread_mutex_destroy(&mutex->lock);
+}
+
+void qemu_mutex_lock(QemuMutex *mutex)
+{
+    pthread_mutex_lock(&mutex->lock);
+}
+
+void qemu_mutex_unlock(QemuMutex *mutex)
+{
+    pthread_mutex_unlock(&mutex->lock);
+}
+
+void qemu_cond_init(QemuCond *cond)
+{
+    pthread_cond_init(&cond->cond, NULL);
+}
+
+void qemu_cond_destroy(QemuCond *cond)
+{
+    pthread_cond_destroy(&cond->cond);
+}
+
+void qemu_cond_signal(QemuCond *cond)
+{
+    pthread_cond_signal(&cond->cond);
+}
+
+void qemu_cond_broadcast(QemuCond *cond)
+{
+    pthread_cond_broadcast(&cond->cond);
+}
+
+void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex)
+{
+    pthread_cond_wait(&cond->cond, &mutex->lock);
+}
+
+void qemu_thread_create(QemuThread *thread, const char *name,
+                        void *(*start_routine)(void *),
+                        void *arg, int mode)
+{
+    int err = pthread_create(&thread->thread, NULL, start_routine, arg);
+
+    if (err) {
+        fprintf(stderr, "rdma-bench: cannot create thread %s: %s\n",
+                name, strerror(err));
+        abort();
+    }
+    if (mode == QEMU_THREAD_DETACHED) {
+        pthread_detach(thread->thread);
+    }
+}
+
+void *qemu_thread_join(QemuThread *thread)
+{
+    void *ret = NULL;
+
+    pthread_join(thread->thread, &ret);
+    return ret;
+}
+
+bool qemu_thread_is_self(QemuThread *thread)
+{
+    return pthread_equal(pthread_self(), thread->thread);
+}
+
+#define BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR 8
+
+bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    return (len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR
+                   * sizeof(unsigned long)) == 0
+            && ((uintptr_t) buf) % sizeof(unsigned long) == 0);
+}
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    const unsigned long *p = buf;
+    size_t i;
+
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+    for (i = 0; i < len / sizeof(unsigned long); i++) {
+        if (p[i]) {
+            break;
+        }
+    }
+    return i * sizeof(unsigned long);
+}
+
+/**********Main loop**********/
+
+typedef struct IOHandlerRecord {
+    int fd;
+    IOHandler *fd_read;
+    void *opaque;
+} IOHandlerRecord;
+
+#define MAX_IO_HANDLERS 16
+
+static IOHandlerRecord io_handlers[MAX_IO_HANDLERS];
+static int nb_io_handlers;
+
+/* Only read handlers: that is all migration-rdma.c registers. */
+int qemu_set_fd_handler2(int fd, IOCanReadHandler *fd_read_poll,
+                         IOHandler *fd_read, IOHandler *fd_write,
+                         void *opaque)
+{
+    int i;
+
+    for (i = 0; i < nb_io_handlers; i++) {
+        if (io_handlers[i].fd == fd) {
+            break;
+        }
+    }
+    if (!fd_read) {
+        if (i < nb_io_handlers) {
+            io_handlers[i] = io_handlers[--nb_io_handlers];
+        }
+        return 0;
+    }
+    if (i == MAX_IO_HANDLERS) {
+        return -ENOSPC;
+    }
+    io_handlers[i].fd = fd;
+    io_handlers[i].fd_read = fd_read;
+    io_handlers[i].opaque = opaque;
+    if (i == nb_io_handlers) {
+        nb_io_handlers++;
+    }
+    return 0;
+}
+
+bool main_loop_wait_once(int timeout_ms)
+{
+    struct pollfd pfd[MAX_IO_HANDLERS];
+    IOHandlerRecord ready[MAX_IO_HANDLERS];
+    int i, n = nb_io_handlers, nb_ready = 0;
+
+    if (n <= 0) {
+        return false;
+    }
+    for (i = 0; i < n; i++) {
+        pfd[i].fd = io_handlers[i].fd;
+        pfd[i].events = POLLIN;
+        pfd[i].revents = 0;
+    }
+    if (poll(pfd, n, timeout_ms) <= 0) {
+        return true;
+    }
+    /* handlers may unregister themselves, so snapshot first */
+    for (i = 0; i < n; i++) {
+        if (pfd[i].revents) {
+            ready[nb_ready++] = io_handlers[i];
+        }
+    }
+    for (i = 0; i < nb_ready; i++) {
+        ready[i].fd_read(ready[i].opaque);
+    }
+    return true;
+}
+
+static pthread_mutex_t iothread_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void qemu_mutex_lock_iothread(void)
+{
+    pthread_mutex_lock(&iothread_lock);
+}
+
+void qemu_mutex_unlock_iothread(void)
+{
+    pthread_mutex_unlock(&iothread_lock);
+}
+
+void yield_until_fd_readable(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR) {
+        /* retry */
+    }
+}
+
+InetSocketAddress *inet_parse(const char *str, Error **errp)
+{
+    InetSocketAddress *addr;
+    const char *host, *port, *end;
+    size_t host_len;
+
+    if (str[0] == '[') {
+        host = str + 1;
+        end = strchr(host, ']');
+        if (!end || end[1] != ':') {
+            error_setg(errp, "error parsing IPv6 address '%s'", str);
+            return NULL;
+        }
+        host_len = end - host;
+        port = end + 2;
+    } else {
+        host = str;
+        end = strchr(host, ':');
+        if (!end) {
+            error_setg(errp, "error parsing address '%s'", str);
+            return NULL;
+        }
+        host_len = end - host;
+        port = end + 1;
+    }
+
+    end = strchr(port, ',');
+    addr = g_malloc0(sizeof(*addr));
+    addr->host = g_strndup(host, host_len);
+    addr->port = end ? g_strndup(port, end - port) : g_strdup(port);
+    return addr;
+}
+
+void qapi_free_InetSocketAddress(InetSocketAddress *obj)
+{
+    if (obj) {
+        g_free(obj->host);
+        g_free(obj->port);
+        g_free(obj);
+    }
+}
+
+static int unix_socket(const char *path, struct sockaddr_un *un,
+                       Error **errp)
+{
+    int fd;
+
+    memset(un, 0, sizeof(*un));
+    un->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(un->sun_path)) {
+        error_setg(errp, "socket path '%s' too long", path);
+        return -1;
+    }
+    strcpy(un->sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        error_setg(errp, "cannot create a unix socket: %s", strerror(errno));
+    }
+    return fd;
+}
+
+int unix_listen(const char *path, char *ostr, int olen, Error **errp)
+{
+    struct sockaddr_un un;
+    int fd = unix_socket(path, &un, errp);
+
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &un, sizeof(un)) || listen(fd, 1)) {
+        error_setg(errp, "cannot listen on %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int unix_connect(const char *path, Error **errp)
+{
+    struct sockaddr_un un;
+    int fd = unix_socket(path, &un, errp);
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &un, sizeof(un))) {
+        error_setg(errp, "cannot connect to %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**********Guest RAM and VM state**********/
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
+{
+    int i;
+
+    for (i = 0; i < bench_nb_blocks; i++) {
+        func(bench_blocks[i].host, bench_blocks[i].offset,
+             bench_blocks[i].length, opaque);
+    }
+}
+
+static MemoryRegion system_memory;
+
+MemoryRegion *get_system_memory(void)
+{
+    return &system_memory;
+}
+
+MemoryRegionSection memory_region_find(MemoryRegion *mr, hwaddr addr,
+                                       uint64_t size)
+{
+    MemoryRegionSection section = { .mr = NULL };
+    BenchBlock *first = NULL;
+    hwaddr start, end;
+    int i;
+
+    for (i = 0; i < bench_nb_blocks; i++) {
+        BenchBlock *block = &bench_blocks[i];
+
+        if (block->offset < addr + size &&
+            block->offset + block->length > addr &&
+            (!first || block->offset < first->offset)) {
+            first = block;
+        }
+    }
+    if (first) {
+        start = MAX(addr, first->offset);
+        end = MIN(addr + size, first->offset + first->length);
+        section.mr = mr;
+        section.offset_within_region = start;
+        section.offset_within_address_space = start;
+        section.size = int128_make64(end - start);
+    }
+    return section;
+}
+
+VMChangeStateEntry *qemu_add_vm_change_state_handler(VMChangeStateHandler *cb,
+                                                     void *opaque)
+{
+    return NULL;
+}
+
+/* as far as migration-ready mode is concerned, the synthetic guest runs */
+int runstate_is_running(void)
+{
+    return true;
+}
+
+void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+{
+    if (ch != 0 || !can_use_buffer_find_nonzero_offset(host, size) ||
+        buffer_find_nonzero_offset(host, size) != size) {
+        memset(host, ch, size);
+    }
+}
+
+/**********Disk**********/
+
+uint8_t *bench_disk;
+uint64_t bench_disk_size;
+
+struct BlockDriverState {
+    int unused;
+};
+
+static BlockDriverState bench_bs;
+
+/* requests not completed yet, under 'disk_lock' */
+static QemuMutex disk_lock = { PTHREAD_MUTEX_INITIALIZER };
+static QemuCond disk_idle = { PTHREAD_COND_INITIALIZER };
+static int disk_inflight;
+
+typedef struct BenchDiskReq {
+    int64_t sector;
+    QEMUIOVector *qiov;
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+} BenchDiskReq;
+
+void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov,
+                              int niov)
+{
+    int i;
+
+    qiov->iov = iov;
+    qiov->niov = niov;
+    qiov->nalloc = -1;
+    qiov->size = 0;
+    for (i = 0; i < niov; i++) {
+        qiov->size += iov[i].iov_len;
+    }
+}
+
+BlockDriverState *bdrv_find(const char *name)
+{
+    return bench_disk && !strcmp(name, BENCH_DISK_NAME) ? &bench_bs : NULL;
+}
+
+static void *bench_disk_write(void *opaque)
+{
+    BenchDiskReq *req = opaque;
+    uint64_t pos = req->sector << BDRV_SECTOR_BITS;
+    int i, ret = 0;
+
+    for (i = 0; i < req->qiov->niov; i++) {
+        struct iovec *iov = &req->qiov->iov[i];
+
+        if (pos + iov->iov_len > bench_disk_size) {
+            ret = -EIO;
+            break;
+        }
+        memcpy(bench_disk + pos, iov->iov_base, iov->iov_len);
+        pos += iov->iov_len;
+    }
+
+    /* on this thread rather than in the main loop, there is none */
+    req->cb(req->opaque, ret);
+    g_free(req);
+
+    qemu_mutex_lock(&disk_lock);
+    if (!--disk_inflight) {
+        qemu_cond_broadcast(&disk_idle);
+    }
+    qemu_mutex_unlock(&disk_lock);
+    return NULL;
+}
+
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *iov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb,
+                                  void *opaque)
+{
+    BenchDiskReq *req = g_new(BenchDiskReq, 1);
+    QemuThread thread;
+
+    req->sector = sector_num;
+    req->qiov = iov;
+    req->cb = cb;
+    req->opaque = opaque;
+
+    qemu_mutex_lock(&disk_lock);
+    disk_inflight++;
+    qemu_mutex_unlock(&disk_lock);
+    qemu_thread_create(&thread, "bench disk", bench_disk_write, req,
+                       QEMU_THREAD_DETACHED);
+    return (BlockDriverAIOCB *) req;
+}
+
+void bdrv_drain_all(void)
+{
+    qemu_mutex_lock(&disk_lock);
+    while (disk_inflight) {
+        qemu_cond_wait(&disk_idle, &disk_lock);
+    }
+    qemu_mutex_unlock(&disk_lock);
+}
+
+/**********Migration core**********/
+
+bool migrate_rdma_pin_all(void)
+{
+    return bench_pin_all;
+}
+
+bool migrate_rdma_ready(void)
+{
+    return bench_ready;
+}
+
+void migrate_fd_connect(MigrationState *s)
+{
+    bench_connected = true;
+}
+
+void migrate_fd_error(MigrationState *s)
+{
+    bench_failed = true;
+}
+
+void process_incoming_migration(QEMUFile *f)
+{
+    bench_incoming = f;
+}
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    if (zero) {
+        bench_zero_bytes += size;
+    } else {
+        bench_normal_bytes += size;
+    }
+    qemu_update_position(f, size);
+}
+
+/**********QEMUFile**********/
+
+#define IO_BUF_SIZE 32768
+
+struct QEMUFile {
+    const QEMUFileOps *ops;
+    void *opaque;
+
+    int64_t pos; /* start of buffer when writing, end of buffer
+                    when reading */
+    int buf_index;
+    int buf_size; /* 0 when writing */
+    uint8_t buf[IO_BUF_SIZE];
+
+    int last_error;
+};
+
+QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
+{
+    QEMUFile *f = g_malloc0(sizeof(QEMUFile));
+
+    f->opaque = opaque;
+    f->ops = ops;
+    return f;
+}
+
+int qemu_file_mode_is_not_valid(const char *mode)
+{
+    if (mode == NULL ||
+        (mode[0] != 'r' && mode[0] != 'w') ||
+        mode[1] != 'b' || mode[2] != 0) {
+        fprintf(stderr, "qemu_fopen: Argument validity check failed\n");
+        return 1;
+    }
+    return 0;
+}
+
+int qemu_file_get_error(QEMUFile *f)
+{
+    return f->last_error;
+}
+
+void qemu_file_set_error(QEMUFile *f, int ret)
+{
+    if (f->last_error == 0) {
+        f->last_error = ret;
+    }
+}
+
+void qemu_fflush(QEMUFile *f)
+{
+    int ret = 0;
+
+    if (!f->ops->put_buffer) {
+        return;
+    }
+    if (f->buf_index > 0) {
+        ret = f->ops->put_buffer(f->opaque, f->buf, f->pos, f->buf_index);
+        if (ret >= 0) {
+            f->pos += f->buf_index;
+        }
+        f->buf_index = 0;
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+static void qemu_fill_buffer(QEMUFile *f)
+{
+    int len;
+    int pending;
+
+    pending = f->buf_size - f->buf_index;
+    if (pending > 0) {
+        memmove(f->buf, f->buf + f->buf_index, pending);
+    }
+    f->buf_index = 0;
+    f->buf_size = pending;
+
+    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
+                             IO_BUF_SIZE - pending);
+    if (len > 0) {
+        f->buf_size += len;
+        f->pos += len;
+    } else if (len == 0) {
+        qemu_file_set_error(f, -EIO);
+    } else if (len != -EAGAIN) {
+        qemu_file_set_error(f, len);
+    }
+}
+
+int qemu_fclose(QEMUFile *f)
+{
+    int ret;
+
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+
+    if (f->ops->close) {
+        int ret2 = f->ops->close(f->opaque);
+        if (ret >= 0) {
+            ret = ret2;
+        }
+    }
+    g_free(f);
+    return ret;
+}
+
+void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
+{
+    int l;
+
+    if (f->last_error) {
+        return;
+    }
+
+    while (size > 0) {
+        l = IO_BUF_SIZE - f->buf_index;
+        if (l > size) {
+            l = size;
+        }
+        memcpy(f->buf + f->buf_index, buf, l);
+        f->buf_index += l;
+        buf += l;
+        size -= l;
+        if (f->buf_index >= IO_BUF_SIZE) {
+            qemu_fflush(f);
+            if (qemu_file_get_error(f)) {
+                break;
+            }
+        }
+    }
+}
+
+void qemu_put_byte(QEMUFile *f, int v)
+{
+    if (f->last_error) {
+        return;
+    }
+
+    f->buf[f->buf_index++] = v;
+    if (f->buf_index >= IO_BUF_SIZE) {
+        qemu_fflush(f);
+    }
+}
+
+void qemu_put_be32(QEMUFile *f, unsigned int v)
+{
+    qemu_put_byte(f, v >> 24);
+    qemu_put_byte(f, v >> 16);
+    qemu_put_byte(f, v >> 8);
+    qemu_put_byte(f, v);
+}
+
+void qemu_put_be64(QEMUFile *f, uint64_t v)
+{
+    qemu_put_be32(f, v >> 32);
+    qemu_put_be32(f, v);
+}
+
+int qemu_get_buffer(QEMUFile *f, uint8_t *buf, int size)
+{
+    int pending = size;
+    int done = 0;
+
+    while (pending > 0) {
+        int l = f->buf_size - f->buf_index;
+
+        if (l == 0) {
+            qemu_fill_buffer(f);
+            l = f->buf_size - f->buf_index;
+            if (l == 0) {
+                break;
+            }
+        }
+        if (l > pending) {
+            l = pending;
+        }
+        memcpy(buf, f->buf + f->buf_index, l);
+        f->buf_index += l;
+        buf += l;
+        pending -= l;
+        done += l;
+    }
+    return done;
+}
+
+int qemu_get_byte(QEMUFile *f)
+{
+    if (f->buf_index >= f->buf_size) {
+        qemu_fill_buffer(f);
+        if (f->buf_index >= f->buf_size) {
+            return 0;
+        }
+    }
+    return f->buf[f->buf_index++];
+}
+
+unsigned int qemu_get_be32(QEMUFile *f)
+{
+    unsigned int v;
+
+    v = qemu_get_byte(f) << 24;
+    v |= qemu_get_byte(f) << 16;
+    v |= qemu_get_byte(f) << 8;
+    v |= qemu_get_byte(f);
+    return v;
+}
+
+uint64_t qemu_get_be64(QEMUFile *f)
+{
+    uint64_t v;
+
+    v = (uint64_t)qemu_get_be32(f) << 32;
+    v |= qemu_get_be32(f);
+    return v;
+}
+
+int64_t qemu_ftell(QEMUFile *f)
+{
+    qemu_fflush(f);
+    return f->pos;
+}
+
+void qemu_update_position(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+}
+
+void ram_control_before_iterate(QEMUFile *f, uint64_t flags)
+{
+    int ret = 0;
+
+    if (f->ops->before_ram_iterate) {
+        ret = f->ops->before_ram_iterate(f, f->opaque, flags);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
+void ram_control_after_iterate(QEMUFile *f, uint64_t flags)
+{
+    int ret = 0;
+
+    if (f->ops->after_ram_iterate) {
+        ret = f->ops->after_ram_iterate(f, f->opaque, flags);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+}
+
+void ram_control_load_hook(QEMUFile *f, uint64_t flags)
+{
+    int ret = -EINVAL;
+
+    if (f->ops->hook_ram_load) {
+        ret = f->ops->hook_ram_load(f, f->opaque, flags);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+        }
+    } else {
+        qemu_file_set_error(f, ret);
+    }
+}
+
+size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
+                             ram_addr_t offset, size_t size, int *bytes_sent)
+{
+    if (f->ops->save_page) {
+        int ret = f->ops->save_page(f, f->opaque, block_offset,
+                                    offset, size, bytes_sent);
+
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent && *bytes_sent > 0) {
+                qemu_update_position(f, *bytes_sent);
+            } else if (ret < 0) {
+                qemu_file_set_error(f, ret);
+            }
+        }
+
+        return ret;
+    }
+
+    return RAM_SAVE_CONTROL_NOT_SUPP;
+}
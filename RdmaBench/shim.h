@@ -0,0 +1,45 @@
+/*
+ * rdma-bench: what the shim hands back to the benchmark driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef RDMA_BENCH_SHIM_H
+#define RDMA_BENCH_SHIM_H
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+
+/* The synthetic guest RAM, walked by qemu_ram_foreach_block() */
+typedef struct BenchBlock {
+    uint8_t *host;
+    ram_addr_t offset;
+    ram_addr_t length;
+} BenchBlock;
+
+extern BenchBlock *bench_blocks;
+extern int bench_nb_blocks;
+
+/* The synthetic disk, the only one bdrv_find() knows */
+#define BENCH_DISK_NAME "bench-disk"
+extern uint8_t *bench_disk;
+extern uint64_t bench_disk_size;
+
+/* migrate_rdma_pin_all() */
+extern bool bench_pin_all;
+
+/* migrate_rdma_ready() */
+extern bool bench_ready;
+
+/* Set by migrate_fd_connect() / migrate_fd_error() on the source */
+extern bool bench_connected;
+extern bool bench_failed;
+
+/* Set by process_incoming_migration() on the dest */
+extern QEMUFile *bench_incoming;
+
+/* acct_update_position(), in bytes */
+extern uint64_t bench_zero_bytes;
+extern uint64_t bench_normal_bytes;
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * rdma-bench shim: one synthetic disk, written by a thread per request
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "qemu-common.h"
+#include <sys/uio.h>
+
+#define BDRV_SECTOR_BITS 9
+#define BDRV_SECTOR_SIZE (1ULL << BDRV_SECTOR_BITS)
+
+/* in qemu-common.h in QEMU */
+typedef struct QEMUIOVector {
+    struct iovec *iov;
+    int niov;
+    int nalloc;
+    size_t size;
+} QEMUIOVector;
+
+void qemu_iovec_init_external(QEMUIOVector *qiov, struct iovec *iov,
+                              int niov);
+
+typedef struct BlockDriverState BlockDriverState;
+typedef struct BlockDriverAIOCB BlockDriverAIOCB;
+typedef void BlockDriverCompletionFunc(void *opaque, int ret);
+
+BlockDriverState *bdrv_find(const char *name);
+BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
+                                  QEMUIOVector *iov, int nb_sectors,
+                                  BlockDriverCompletionFunc *cb,
+                                  void *opaque);
+void bdrv_drain_all(void);
+
+#endif
@@ -0,0 +1,12 @@
+/*
+ * rdma-bench shim: there are no coroutines, yielding blocks in poll()
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_COROUTINE_H
+#define QEMU_COROUTINE_H
+
+void yield_until_fd_readable(int fd);
+
+#endif
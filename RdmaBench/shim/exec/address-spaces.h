@@ -0,0 +1,14 @@
+/*
+ * rdma-bench shim: the system memory root
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef EXEC_MEMORY_H
+#define EXEC_MEMORY_H
+
+#include "exec/memory.h"
+
+MemoryRegion *get_system_memory(void);
+
+#endif
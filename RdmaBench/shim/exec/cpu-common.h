@@ -0,0 +1,17 @@
+/*
+ * rdma-bench shim: the RAM block list is rdma-bench's synthetic RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef CPU_COMMON_H
+#define CPU_COMMON_H
+
+#include "qemu-common.h"
+
+typedef void (RAMBlockIterFunc)(void *host_addr,
+    ram_addr_t offset, ram_addr_t length, void *opaque);
+
+void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque);
+
+#endif
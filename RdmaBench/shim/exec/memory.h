@@ -0,0 +1,64 @@
+/*
+ * rdma-bench shim: the guest physical address space is the synthetic RAM,
+ * each address the same as its ram_addr_t
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include "qemu-common.h"
+
+typedef uint64_t hwaddr;
+
+typedef struct Int128 {
+    uint64_t lo;
+    int64_t hi;
+} Int128;
+
+static inline Int128 int128_make64(uint64_t a)
+{
+    return (Int128) { a, 0 };
+}
+
+static inline uint64_t int128_get64(Int128 a)
+{
+    return a.lo;
+}
+
+/* Only one, get_system_memory(), RAM from ram_addr_t 0 */
+typedef struct MemoryRegion {
+    ram_addr_t ram_addr;
+} MemoryRegion;
+
+typedef struct MemoryRegionSection {
+    MemoryRegion *mr;
+    hwaddr offset_within_region;
+    Int128 size;
+    hwaddr offset_within_address_space;
+    bool readonly;
+} MemoryRegionSection;
+
+/*
+ * The first block at or after 'addr' that overlaps 'size' bytes from it,
+ * cut to that range; 'mr' is NULL if there is none.
+ */
+MemoryRegionSection memory_region_find(MemoryRegion *mr, hwaddr addr,
+                                       uint64_t size);
+
+static inline bool memory_region_is_ram(MemoryRegion *mr)
+{
+    return true;
+}
+
+static inline ram_addr_t memory_region_get_ram_addr(MemoryRegion *mr)
+{
+    return mr->ram_addr;
+}
+
+static inline void memory_region_unref(MemoryRegion *mr)
+{
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ * rdma-bench shim: the migration core as seen by migration-rdma.c
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_MIGRATION_H
+#define QEMU_MIGRATION_H
+
+#include "qemu-common.h"
+#include "migration/qemu-file.h"
+
+enum {
+    MIGRATION_CAPABILITY_XBZRLE,
+    MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+    MIGRATION_CAPABILITY_AUTO_CONVERGE,
+    MIGRATION_CAPABILITY_ZERO_BLOCKS,
+    MIGRATION_CAPABILITY_X_RDMA_READY,
+    MIGRATION_CAPABILITY_MAX,
+};
+
+typedef struct MigrationState {
+    QEMUFile *file;
+    int state;
+    bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+} MigrationState;
+
+void process_incoming_migration(QEMUFile *f);
+void migrate_fd_error(MigrationState *s);
+void migrate_fd_connect(MigrationState *s);
+
+void rdma_start_outgoing_migration(void *opaque, const char *host_port,
+                                   Error **errp);
+void rdma_start_incoming_migration(const char *host_port, Error **errp);
+void rdma_start_outgoing_migration2(void *opaque, const char *host_port,
+                                    Error **errp);
+void rdma_start_incoming_migration2(const char *host_port, Error **errp);
+
+bool migrate_rdma_pin_all(void);
+bool migrate_rdma_ready(void);
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero);
+void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
+
+/* arch_init.c's page flags, as far as the bench stream uses them */
+#define RAM_SAVE_FLAG_MEM_SIZE 0x04
+#define RAM_SAVE_FLAG_EOS      0x10
+
+/* Whenever this is found in the data stream, the flags
+ * will be passed to ram_control_load_hook in the incoming-migration
+ * side. This lets before_ram_iterate/after_ram_iterate add
+ * transport-specific sections to the RAM migration data.
+ */
+#define RAM_SAVE_FLAG_HOOK     0x80
+
+void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
+void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
+void ram_control_load_hook(QEMUFile *f, uint64_t flags);
+
+#define RAM_CONTROL_SETUP    0
+#define RAM_CONTROL_ROUND    1
+#define RAM_CONTROL_HOOK     2
+#define RAM_CONTROL_FINISH   3
+
+#define RAM_SAVE_CONTROL_NOT_SUPP -1000
+#define RAM_SAVE_CONTROL_DELAYED  -2000
+
+size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
+                             ram_addr_t offset, size_t size,
+                             int *bytes_sent);
+
+#endif
@@ -0,0 +1,18 @@
+/*
+ * rdma-bench shim: QEMU's Error API, reduced to a formatted message
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef ERROR_H
+#define ERROR_H
+
+typedef struct Error Error;
+
+void error_setg(Error **errp, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void error_propagate(Error **dst_err, Error *local_err);
+const char *error_get_pretty(Error *err);
+void error_free(Error *err);
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * rdma-bench shim: the parts of qemu-common.h that migration-rdma.c uses
+ *
+ * The headers under RdmaBench/shim stand in for QEMU's include/ tree so
+ * that qemu/migration-rdma.c builds unmodified outside of QEMU.  They only
+ * declare what the RDMA engine needs; shim.c implements it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_COMMON_H
+#define QEMU_COMMON_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "qapi/error.h"
+#include "qemu/timer.h"
+
+#define QEMU_PACKED __attribute__((packed))
+
+#ifndef MIN
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#endif
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define QEMU_ALIGN_UP(n, m) (((n) + (m) - 1) / (m) * (m))
+
+/* x86 guests: the bench works in 4k pages like the target would */
+#define TARGET_PAGE_BITS 12
+#define TARGET_PAGE_SIZE (1 << TARGET_PAGE_BITS)
+#define TARGET_PAGE_MASK ~(TARGET_PAGE_SIZE - 1)
+
+typedef uint64_t ram_addr_t;
+
+bool can_use_buffer_find_nonzero_offset(const void *buf, size_t len);
+size_t buffer_find_nonzero_offset(const void *buf, size_t len);
+
+#endif
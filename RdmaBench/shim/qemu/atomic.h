@@ -0,0 +1,25 @@
+/*
+ * rdma-bench shim: the qemu/atomic.h primitives migration-rdma.c uses
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_ATOMIC_H
+#define QEMU_ATOMIC_H
+
+#define barrier()   ({ asm volatile("" ::: "memory"); (void)0; })
+#define smp_mb()    __sync_synchronize()
+#define smp_wmb()   barrier()
+#define smp_rmb()   barrier()
+
+#define atomic_read(ptr)       (*(__typeof__(*ptr) volatile *) (ptr))
+#define atomic_set(ptr, i)     ((*(__typeof__(*ptr) volatile *) (ptr)) = (i))
+#define atomic_mb_set(ptr, i)  ((void)__sync_lock_test_and_set(ptr, i))
+
+#define atomic_fetch_add(ptr, n)  __sync_fetch_and_add(ptr, n)
+#define atomic_fetch_sub(ptr, n)  __sync_fetch_and_add(ptr, -(n))
+#define atomic_inc(ptr)           ((void) __sync_fetch_and_add(ptr, 1))
+#define atomic_dec(ptr)           ((void) __sync_fetch_and_add(ptr, -1))
+#define atomic_cmpxchg(ptr, old, new) __sync_val_compare_and_swap(ptr, old, new)
+
+#endif
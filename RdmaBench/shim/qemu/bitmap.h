@@ -0,0 +1,104 @@
+/*
+ * rdma-bench shim: qemu/bitmap.h and the qemu/bitops.h it pulls in
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "qemu-common.h"
+
+#define BITS_PER_BYTE       CHAR_BIT
+#define BITS_PER_LONG       (sizeof(unsigned long) * BITS_PER_BYTE)
+#define BIT_MASK(nr)        (1UL << ((nr) % BITS_PER_LONG))
+#define BIT_WORD(nr)        ((nr) / BITS_PER_LONG)
+#define BITS_TO_LONGS(nr)   (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+
+static inline void set_bit(long nr, unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void clear_bit(long nr, unsigned long *addr)
+{
+    addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int test_bit(long nr, const unsigned long *addr)
+{
+    return 1UL & (addr[BIT_WORD(nr)] >> (nr & (BITS_PER_LONG - 1)));
+}
+
+static inline int test_and_set_bit(long nr, unsigned long *addr)
+{
+    int old = test_bit(nr, addr);
+
+    set_bit(nr, addr);
+    return old;
+}
+
+static inline int test_and_clear_bit(long nr, unsigned long *addr)
+{
+    int old = test_bit(nr, addr);
+
+    clear_bit(nr, addr);
+    return old;
+}
+
+static inline unsigned long *bitmap_new(long nbits)
+{
+    return g_malloc0(BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline void bitmap_zero(unsigned long *dst, long nbits)
+{
+    memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+
+static inline void bitmap_clear(unsigned long *map, long start, long nr)
+{
+    while (nr--) {
+        clear_bit(start++, map);
+    }
+}
+
+static inline void bitmap_set(unsigned long *map, long start, long nr)
+{
+    while (nr--) {
+        set_bit(start++, map);
+    }
+}
+
+static inline unsigned long find_next_bit(const unsigned long *addr,
+                                          unsigned long size,
+                                          unsigned long offset)
+{
+    while (offset < size) {
+        unsigned long word = addr[BIT_WORD(offset)] >> (offset % BITS_PER_LONG);
+
+        if (word) {
+            return MIN(offset + __builtin_ctzl(word), size);
+        }
+        offset = (BIT_WORD(offset) + 1) * BITS_PER_LONG;
+    }
+    return size;
+}
+
+static inline unsigned long find_next_zero_bit(const unsigned long *addr,
+                                               unsigned long size,
+                                               unsigned long offset)
+{
+    while (offset < size) {
+        unsigned long word = ~addr[BIT_WORD(offset)] >>
+                             (offset % BITS_PER_LONG);
+
+        if (word) {
+            return MIN(offset + __builtin_ctzl(word), size);
+        }
+        offset = (BIT_WORD(offset) + 1) * BITS_PER_LONG;
+    }
+    return size;
+}
+
+#endif
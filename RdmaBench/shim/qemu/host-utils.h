@@ -0,0 +1,17 @@
+/*
+ * rdma-bench shim: qemu/host-utils.h
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef HOST_UTILS_H
+#define HOST_UTILS_H
+
+#include <stdint.h>
+
+static inline int clz64(uint64_t val)
+{
+    return val ? __builtin_clzll(val) : 64;
+}
+
+#endif
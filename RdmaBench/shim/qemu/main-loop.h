@@ -0,0 +1,26 @@
+/*
+ * rdma-bench shim: fd handlers, run by rdma-bench's own poll() loop
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_MAIN_LOOP_H
+#define QEMU_MAIN_LOOP_H
+
+typedef int IOCanReadHandler(void *opaque);
+typedef void IOHandler(void *opaque);
+
+int qemu_set_fd_handler2(int fd, IOCanReadHandler *fd_read_poll,
+                         IOHandler *fd_read, IOHandler *fd_write,
+                         void *opaque);
+
+/*
+ * Wait for one round of fd handlers and run them; returns false if no
+ * handler is registered.
+ */
+bool main_loop_wait_once(int timeout_ms);
+
+void qemu_mutex_lock_iothread(void);
+void qemu_mutex_unlock_iothread(void);
+
+#endif
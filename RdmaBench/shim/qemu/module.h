@@ -0,0 +1,16 @@
+/*
+ * rdma-bench shim: module init hooks run as constructors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_MODULE_H
+#define QEMU_MODULE_H
+
+#define machine_init(function)                                      \
+static void __attribute__((constructor)) do_qemu_init_ ## function(void) \
+{                                                                   \
+    function();                                                     \
+}
+
+#endif
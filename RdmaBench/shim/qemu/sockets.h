@@ -0,0 +1,23 @@
+/*
+ * rdma-bench shim: host:port parsing, unix sockets
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_SOCKET_H
+#define QEMU_SOCKET_H
+
+#include "qemu-common.h"
+
+typedef struct InetSocketAddress {
+    char *host;
+    char *port;
+} InetSocketAddress;
+
+InetSocketAddress *inet_parse(const char *str, Error **errp);
+void qapi_free_InetSocketAddress(InetSocketAddress *obj);
+
+int unix_listen(const char *path, char *ostr, int olen, Error **errp);
+int unix_connect(const char *path, Error **errp);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * rdma-bench shim: QEMU threads, mutexes and conditions over pthreads
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_THREAD_H
+#define QEMU_THREAD_H
+
+#include <pthread.h>
+
+typedef struct QemuMutex {
+    pthread_mutex_t lock;
+} QemuMutex;
+
+typedef struct QemuCond {
+    pthread_cond_t cond;
+} QemuCond;
+
+typedef struct QemuThread {
+    pthread_t thread;
+} QemuThread;
+
+#define QEMU_THREAD_JOINABLE 0
+#define QEMU_THREAD_DETACHED 1
+
+void qemu_mutex_init(QemuMutex *mutex);
+void qemu_mutex_destroy(QemuMutex *mutex);
+void qemu_mutex_lock(QemuMutex *mutex);
+void qemu_mutex_unlock(QemuMutex *mutex);
+
+void qemu_cond_init(QemuCond *cond);
+void qemu_cond_destroy(QemuCond *cond);
+void qemu_cond_signal(QemuCond *cond);
+void qemu_cond_broadcast(QemuCond *cond);
+void qemu_cond_wait(QemuCond *cond, QemuMutex *mutex);
+
+void qemu_thread_create(QemuThread *thread, const char *name,
+                        void *(*start_routine)(void *),
+                        void *arg, int mode);
+void *qemu_thread_join(QemuThread *thread);
+bool qemu_thread_is_self(QemuThread *thread);
+
+#endif
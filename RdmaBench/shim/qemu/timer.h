@@ -0,0 +1,27 @@
+/*
+ * rdma-bench shim: QEMU clocks; all of them read CLOCK_MONOTONIC
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef QEMU_TIMER_H
+#define QEMU_TIMER_H
+
+#include <stdint.h>
+
+#define SCALE_MS 1000000
+
+typedef enum {
+    QEMU_CLOCK_REALTIME = 0,
+    QEMU_CLOCK_VIRTUAL = 1,
+    QEMU_CLOCK_HOST = 2,
+} QEMUClockType;
+
+int64_t qemu_clock_get_ns(QEMUClockType type);
+
+static inline int64_t qemu_clock_get_ms(QEMUClockType type)
+{
+    return qemu_clock_get_ns(type) / SCALE_MS;
+}
+
+#endif
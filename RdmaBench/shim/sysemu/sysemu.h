@@ -0,0 +1,23 @@
+/*
+ * rdma-bench shim: VM run state; the bench never runs a VM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+#ifndef SYSEMU_H
+#define SYSEMU_H
+
+typedef enum RunState {
+    RUN_STATE_RUNNING,
+    RUN_STATE_PAUSED,
+    RUN_STATE_FINISH_MIGRATE,
+} RunState;
+
+typedef struct VMChangeStateEntry VMChangeStateEntry;
+typedef void VMChangeStateHandler(void *opaque, int running, RunState state);
+
+VMChangeStateEntry *qemu_add_vm_change_state_handler(VMChangeStateHandler *cb,
+                                                     void *opaque);
+int runstate_is_running(void);
+
+#endif
@@ -5,6 +5,7 @@
 #include <errno.h>
 
 #include <netdb.h>
+#include <arpa/inet.h>
 #include <infiniband/verbs.h>
 #include "ibtcp.h"
 
@@ -138,52 +139,192 @@ int qp_change_state_init(struct ibv_qp *qp){
  */
 int set_local_ib_connection(struct app_context *context, struct app_data *data){
 
-	// First get local lid
-	struct ibv_port_attr attr;
-	int err = ibv_query_port(context->ib_context, DEFAULT_IB_PORT, &attr);
-	if (err) {
-		fprintf(stderr, "Could not get port attributes, ibv_query_port\n");
-		return err;
-	}
-	
-	union ibv_gid gid;
-	err = ibv_query_gid(context->ib_context, DEFAULT_IB_PORT, 0, &gid);
+	int err;
+
+	// lid, gid and link parameters
+	err = ib_query_link_params(context->ib_context, DEFAULT_IB_PORT, &data->local_connection);
 	if (err) {
-		fprintf(stderr, "Could not get port gid, ibv_query_gid\n");
 		return err;
 	}
 	
-	data->local_connection.lid = attr.lid;
 	data->local_connection.qpn = context->qp->qp_num;
 	data->local_connection.psn = lrand48() & 0xffffff;
 	data->local_connection.rkey = context->mr->rkey;
 	data->local_connection.vaddr = (uintptr_t)context->buf + DEFAULT_BUF_SIZE;
-	data->local_connection.gid = gid;
 	
 	return 0;
 }
 
+/*
+ *  gid_is_roce_v2
+ * ****************
+ *	The GID type is only exported through sysfs:
+ *	/sys/class/infiniband/<dev>/ports/<port>/gid_attrs/types/<index>
+ */
+static int gid_is_roce_v2(struct ibv_context *ctx, int port, int index)
+{
+	char path[256], type[32] = "";
+	FILE *f;
+
+	snprintf(path, sizeof path, "/sys/class/infiniband/%s/ports/%d/gid_attrs/types/%d",
+			ibv_get_device_name(ctx->device), port, index);
+	f = fopen(path, "r");
+	if (!f) {
+		return 0;
+	}
+	if (!fgets(type, sizeof type, f)) {
+		type[0] = 0;
+	}
+	fclose(f);
+
+	return !strncmp(type, "RoCE v2", 7);
+}
+
+/*
+ *  ib_query_link_params
+ * **********************
+ *	Fills in lid, gid and the link parameters of 'conn' for the given port.
+ *	On RoCE the first RoCE v2 GID is used (an IPv4 mapped one if there is one),
+ *	as v2 is routable and what our fabric runs. Otherwise GID index 0.
+ */
+int ib_query_link_params(struct ibv_context *ctx, int port, struct ib_connection *conn)
+{
+	struct ibv_port_attr attr;
+	struct ibv_device_attr dev_attr;
+	union ibv_gid gid;
+	int err, i;
+
+	err = ibv_query_port(ctx, port, &attr);
+	if (err) {
+		fprintf(stderr, "Could not get port attributes, ibv_query_port\n");
+		return err;
+	}
+
+	err = ibv_query_device(ctx, &dev_attr);
+	if (err) {
+		fprintf(stderr, "Could not get device attributes, ibv_query_device\n");
+		return err;
+	}
+
+	memset(&conn->link, 0, sizeof conn->link);
+	conn->lid = attr.lid;
+	conn->link.port = port;
+	conn->link.mtu = attr.active_mtu;
+	conn->link.sl = DEFAULT_SL;
+	conn->link.is_roce = attr.link_layer == IBV_LINK_LAYER_ETHERNET;
+	conn->link.hop_limit = conn->link.is_roce ? DEFAULT_HOP_LIMIT : 1;
+	conn->link.rd_atomic = dev_attr.max_qp_rd_atom < dev_attr.max_qp_init_rd_atom ?
+			dev_attr.max_qp_rd_atom : dev_attr.max_qp_init_rd_atom;
+	if (conn->link.rd_atomic > 16) {
+		conn->link.rd_atomic = 16;
+	}
+	// must not be below what the subnet needs to deliver a packet
+	conn->link.timeout = attr.subnet_timeout + 2 > DEFAULT_QP_TIMEOUT ?
+			attr.subnet_timeout + 2 : DEFAULT_QP_TIMEOUT;
+	if (conn->link.timeout > 31) {
+		conn->link.timeout = 31;
+	}
+
+	if (conn->link.is_roce) {
+		int found = -1;
+
+		for (i = 0; i < attr.gid_tbl_len; i++) {
+			if (ibv_query_gid(ctx, port, i, &gid) || !gid.global.interface_id) {
+				continue;
+			}
+			if (!gid_is_roce_v2(ctx, port, i)) {
+				continue;
+			}
+			if (found < 0) {
+				found = i;
+			}
+			// ::ffff:a.b.c.d
+			if (!gid.global.subnet_prefix &&
+					((uint32_t *)gid.raw)[2] == htonl(0x0000ffff)) {
+				found = i;
+				break;
+			}
+		}
+		if (found >= 0) {
+			conn->link.gid_index = found;
+		}
+	}
+
+	err = ibv_query_gid(ctx, port, conn->link.gid_index, &conn->gid);
+	if (err) {
+		fprintf(stderr, "Could not get port gid, ibv_query_gid\n");
+		return err;
+	}
+
+	return 0;
+}
+
+/*
+ *  ib_negotiate_link_params
+ * **************************
+ *	Combines our link parameters with the peer's into data->link.
+ *	A peer that did not send any (zero mtu) gets the old defaults.
+ */
+void ib_negotiate_link_params(struct app_data *data)
+{
+	struct ib_link_params *local = &data->local_connection.link;
+	struct ib_link_params *remote = &data->remote_connection->link;
+
+	data->link = *local;
+	if (!remote->mtu) {
+		data->link.mtu = local->mtu < DEFAULT_MTU ? local->mtu : DEFAULT_MTU;
+		data->link.rd_atomic = 0;
+		return;
+	}
+
+	if (remote->mtu < data->link.mtu) {
+		data->link.mtu = remote->mtu;
+	}
+	if (remote->rd_atomic < data->link.rd_atomic) {
+		data->link.rd_atomic = remote->rd_atomic;
+	}
+	if (remote->timeout > data->link.timeout) {
+		data->link.timeout = remote->timeout;
+	}
+}
+
+/*
+ *  tcp_exch_ib_connection_info
+ * *****************************
+ *	The connection details are the same NUL terminated text ibecho sends.
+ *	The link parameters follow it as a second NUL terminated string, in the
+ *	same write, so that a peer that only knows the first part still reads it
+ *	whole and ignores the rest. Such a peer is negotiated with defaults.
+ */
+#define IB_CONN_MSG "0000:000000:000000:00000000:0000000000000000:0000000000000000:0000000000000000"
+#define IB_LINK_MSG "0:00:00"
+
 int tcp_exch_ib_connection_info(struct app_data *data){
 
-	char msg[sizeof "0000:000000:000000:00000000:0000000000000000:0000000000000000:0000000000000000"];
+	char msg[sizeof IB_CONN_MSG + sizeof IB_LINK_MSG];
+	char *link = msg + sizeof IB_CONN_MSG;
+	ssize_t len;
 	int parsed;
+	unsigned mtu, rd_atomic, timeout;
 
 	struct ib_connection *local = &data->local_connection;
 
 	sprintf(msg, "%04x:%06x:%06x:%08x:%016Lx:%016Lx:%016Lx", 
 				local->lid, local->qpn, local->psn, local->rkey, local->vaddr, local->gid.global.interface_id, local->gid.global.subnet_prefix);
+	sprintf(link, "%01x:%02x:%02x", local->link.mtu, local->link.rd_atomic, local->link.timeout);
 
 	if (write(data->sockfd, msg, sizeof msg) != sizeof msg){
 		fprintf(stderr, "Could not send connection_details to peer\n");
 		return -1;
 	}	
 
-	if (read(data->sockfd, msg, sizeof msg) != sizeof msg){
+	len = read(data->sockfd, msg, sizeof msg);
+	if (len != sizeof msg && len != sizeof IB_CONN_MSG){
 		fprintf(stderr, "Could not receive connection_details to peer\n");
 		return -1;
 	}
 
-	data->remote_connection = malloc(sizeof(struct ib_connection));
+	data->remote_connection = calloc(1, sizeof(struct ib_connection));
 	if (!data->remote_connection) {
 		fprintf(stderr, "Could not allocate memory for remote_connection connection\n");
 		return -ENOMEM;
@@ -197,6 +338,15 @@ int tcp_exch_ib_connection_info(struct app_data *data){
 	if(parsed != 7){
 		fprintf(stderr, "Could not parse message from peer, items parsed: %d\n", parsed);
 	}
+
+	// an old peer sends no link parameters
+	if (len == sizeof msg && sscanf(link, "%x:%x:%x", &mtu, &rd_atomic, &timeout) == 3) {
+		remote->link.mtu = mtu;
+		remote->link.rd_atomic = rd_atomic;
+		remote->link.timeout = timeout;
+	}
+
+	ib_negotiate_link_params(data);
 	
 	return 0;
 }
@@ -225,22 +375,22 @@ int qp_change_state_rtr(struct ibv_qp *qp, struct app_data *data) {
     memset(attr, 0, sizeof *attr);
 
     attr->qp_state              = IBV_QPS_RTR;
-    attr->path_mtu              = IBV_MTU_1024;
+    attr->path_mtu              = data->link.mtu;
     attr->dest_qp_num           = data->remote_connection->qpn;
     attr->rq_psn                = data->remote_connection->psn;
-    attr->max_dest_rd_atomic    = 0;
+    attr->max_dest_rd_atomic    = data->link.rd_atomic;
     attr->min_rnr_timer         = 2;
     attr->ah_attr.is_global     = 1;
     attr->ah_attr.dlid          = data->remote_connection->lid;
-    attr->ah_attr.sl            = DEFAULT_SL;
+    attr->ah_attr.sl            = data->link.sl;
     attr->ah_attr.src_path_bits = 0;
-    attr->ah_attr.port_num      = DEFAULT_IB_PORT;
+    attr->ah_attr.port_num      = data->link.port;
 	
 	attr->ah_attr.grh.dgid = data->remote_connection->gid;
 	attr->ah_attr.grh.flow_label = 0;
-	attr->ah_attr.grh.sgid_index = 0;
-	attr->ah_attr.grh.hop_limit = 1;
-	attr->ah_attr.grh.traffic_class = 0;
+	attr->ah_attr.grh.sgid_index = data->link.gid_index;
+	attr->ah_attr.grh.hop_limit = data->link.hop_limit;
+	attr->ah_attr.grh.traffic_class = data->link.traffic_class;
 
     err = ibv_modify_qp(qp, attr,
                 IBV_QP_STATE                |
@@ -274,11 +424,11 @@ int qp_change_state_rts(struct ibv_qp *qp, struct app_data *data) {
     memset(attr, 0, sizeof *attr);
 
 	attr->qp_state              = IBV_QPS_RTS;
-    attr->timeout               = 14;
-    attr->retry_cnt             = 7;
-    attr->rnr_retry             = 7;    /* infinite retry */
+    attr->timeout               = data->link.timeout;
+    attr->retry_cnt             = DEFAULT_RETRY_CNT;
+    attr->rnr_retry             = DEFAULT_RNR_RETRY;
     attr->sq_psn                = data->local_connection.psn;
-    attr->max_rd_atomic         = 1;
+    attr->max_rd_atomic         = data->link.rd_atomic;
 
     err = ibv_modify_qp(qp, attr,
                 IBV_QP_STATE            |
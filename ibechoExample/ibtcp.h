@@ -15,6 +15,13 @@
 #define DEFAULT_SL 1
 #define RDMA_WRID 3
 
+/* Used when the peer does not tell us its link parameters */
+#define DEFAULT_MTU IBV_MTU_1024
+#define DEFAULT_QP_TIMEOUT 14
+#define DEFAULT_RETRY_CNT 7
+#define DEFAULT_RNR_RETRY 7	/* infinite retry */
+#define DEFAULT_HOP_LIMIT 64
+
 
 
 struct app_context{
@@ -30,6 +37,22 @@ struct app_context{
 	struct ibv_send_wr  	wr;
 };
 
+/*
+ * Link parameters, discovered by ib_query_link_params() and exchanged
+ * with the peer together with the rest of the connection details.
+ */
+struct ib_link_params {
+	int					port;		/* local port number */
+	enum ibv_mtu		mtu;		/* active MTU of the port */
+	int					gid_index;	/* local GID table index */
+	int					rd_atomic;	/* outstanding RDMA reads/atomics */
+	int					timeout;	/* local ACK timeout exponent */
+	int					hop_limit;
+	int					is_roce;	/* ethernet link layer */
+	int					sl;			/* service level, local choice */
+	int					traffic_class;	/* GRH traffic class, local choice */
+};
+
 struct ib_connection {
     int             	lid;
     int            	 	qpn;
@@ -37,6 +60,7 @@ struct ib_connection {
 	unsigned 			rkey;
 	unsigned long long 	vaddr;
 	union ibv_gid		gid;
+	struct ib_link_params link;
 };
 
 struct app_data {
@@ -46,6 +70,7 @@ struct app_data {
 	struct ib_connection		local_connection;
 	struct ib_connection 		*remote_connection;
 	struct ibv_device			*ib_dev;
+	struct ib_link_params		link;		/* negotiated, see ib_negotiate_link_params() */
 
 };
 
@@ -60,6 +85,9 @@ static void print_ib_connection(char *conn_name, struct ib_connection *conn);
 
 int tcp_exch_ib_connection_info(struct app_data *data);
 
+int ib_query_link_params(struct ibv_context *ctx, int port, struct ib_connection *conn);
+void ib_negotiate_link_params(struct app_data *data);
+
 int qp_change_state_init(struct ibv_qp *qp);
 int qp_change_state_rtr(struct ibv_qp *qp, struct app_data *data);
 int qp_change_state_rts(struct ibv_qp *qp, struct app_data *data);
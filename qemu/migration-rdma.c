@@ -15,13 +15,31 @@
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "exec/cpu-common.h"
+#include "exec/memory.h"
+#include "exec/address-spaces.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
 #include "qemu/bitmap.h"
+#include "qemu/host-utils.h"
+#include "block/block.h"
 #include "block/coroutine.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "sysemu/sysemu.h"
+#include "migration-rdma.h"
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <string.h>
@@ -29,12 +47,16 @@
 #include <time.h>
 #include <ibtcp.h>
 #include <stdlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
 
 #define DEBUG_RDMA
-#define DEBUG_TRACE
-#define DEBUG_TIME
+//#define DEBUG_TRACE
+//#define DEBUG_TIME
 //#define DEBUG_RDMA_VERBOSE
 //#define DEBUG_RDMA_REALLY_VERBOSE
+//#define DEBUG_RDMA_EVENTS
 
 #ifdef DEBUG_TRACE
 #define DTPRINTF(fmt, ...) \
@@ -76,6 +98,202 @@
     do { } while (0)
 #endif
 
+/*
+ * Hot path events: post, poll, register, unregister, compress and
+ * control send/recv.  With DEBUG_RDMA_EVENTS each thread appends fixed
+ * size records to its own ring, which only it writes; a separate thread
+ * drains all rings every RDMA_EVENT_DRAIN_US to $QEMU_RDMA_EVENTS, or
+ * stderr.  A probe costs a clock read and a few stores, and events are
+ * dropped rather than waited for when a ring is full.  Without it the
+ * probes compile to nothing.
+ */
+enum {
+    RDMA_EVENT_POST,            /* length, wrid */
+    RDMA_EVENT_POLL,            /* wrid, status */
+    RDMA_EVENT_REGISTER,        /* address, length */
+    RDMA_EVENT_UNREGISTER,      /* block, chunk */
+    RDMA_EVENT_COMPRESS,        /* offset, length */
+    RDMA_EVENT_KEEP,            /* offset, length */
+    RDMA_EVENT_DISCARD,         /* offset, length */
+    RDMA_EVENT_LZ4,             /* offset, compressed length */
+    RDMA_EVENT_DISK,            /* sector, length */
+    RDMA_EVENT_SEND,            /* control type, length */
+    RDMA_EVENT_RECV,            /* control type, length */
+    RDMA_EVENT_MAX
+};
+
+#ifdef DEBUG_RDMA_EVENTS
+static const char *rdma_event_desc[RDMA_EVENT_MAX] = {
+    [RDMA_EVENT_POST] = "post",
+    [RDMA_EVENT_POLL] = "poll",
+    [RDMA_EVENT_REGISTER] = "register",
+    [RDMA_EVENT_UNREGISTER] = "unregister",
+    [RDMA_EVENT_COMPRESS] = "compress",
+    [RDMA_EVENT_KEEP] = "keep",
+    [RDMA_EVENT_DISCARD] = "discard",
+    [RDMA_EVENT_LZ4] = "lz4",
+    [RDMA_EVENT_DISK] = "disk",
+    [RDMA_EVENT_SEND] = "send",
+    [RDMA_EVENT_RECV] = "recv",
+};
+
+#define RDMA_EVENT_RING_SIZE 4096           /* records, power of 2 */
+#define RDMA_EVENT_DRAIN_US  (10 * 1000)
+
+typedef struct RDMAEventRecord {
+    int64_t ns;
+    uint64_t event;
+    uint64_t a;
+    uint64_t b;
+} RDMAEventRecord;
+
+typedef struct RDMAEventRing {
+    RDMAEventRecord rec[RDMA_EVENT_RING_SIZE];
+    unsigned long head;         /* written by the owning thread */
+    unsigned long tail;         /* written by the drain thread */
+    unsigned long dropped;      /* written by the owning thread */
+    long tid;
+    bool unused;                /* the owning thread has exited */
+    struct RDMAEventRing *next;
+} RDMAEventRing;
+
+static RDMAEventRing *rdma_event_rings;
+static __thread RDMAEventRing *rdma_event_ring;
+static pthread_key_t rdma_event_key;
+static pthread_once_t rdma_event_once = PTHREAD_ONCE_INIT;
+
+/* Thread exit: leave the ring to the next thread that logs an event. */
+static void rdma_event_ring_release(void *opaque)
+{
+    RDMAEventRing *ring = opaque;
+
+    atomic_mb_set(&ring->unused, true);
+}
+
+static void rdma_event_key_init(void)
+{
+    pthread_key_create(&rdma_event_key, rdma_event_ring_release);
+}
+
+static void *rdma_event_drain_thread(void *opaque)
+{
+    const char *path = getenv("QEMU_RDMA_EVENTS");
+    FILE *out = path ? fopen(path, "w") : NULL;
+    RDMAEventRing *ring;
+
+    if (!out) {
+        out = stderr;
+    }
+
+    for (;;) {
+        for (ring = atomic_read(&rdma_event_rings); ring; ring = ring->next) {
+            unsigned long tail = ring->tail;
+            unsigned long head = atomic_read(&ring->head);
+            unsigned long dropped = atomic_read(&ring->dropped);
+
+            smp_rmb();
+            for (; tail != head; tail++) {
+                RDMAEventRecord *rec =
+                    &ring->rec[tail & (RDMA_EVENT_RING_SIZE - 1)];
+
+                fprintf(out, "%" PRId64 " %ld %s 0x%" PRIx64 " 0x%" PRIx64
+                        "\n", rec->ns, ring->tid,
+                        rdma_event_desc[rec->event], rec->a, rec->b);
+            }
+            /* the records must be read before the owner reuses them */
+            atomic_mb_set(&ring->tail, tail);
+
+            if (dropped) {
+                fprintf(out, "# %ld: %lu events dropped so far\n",
+                        ring->tid, dropped);
+            }
+        }
+        fflush(out);
+        g_usleep(RDMA_EVENT_DRAIN_US);
+    }
+
+    return NULL;
+}
+
+/*
+ * The first event of a thread takes over the drained ring of a thread
+ * that has exited, or else links a new ring into the list; the thread
+ * that finds the list empty starts the drain thread.  Rings are never
+ * freed, the drain thread walks the list without a lock, but there are
+ * never more of them than threads logging at the same time.
+ */
+static RDMAEventRing *rdma_event_ring_new(void)
+{
+    RDMAEventRing *ring, *old;
+    QemuThread thread;
+
+    pthread_once(&rdma_event_once, rdma_event_key_init);
+
+    for (ring = atomic_read(&rdma_event_rings); ring; ring = ring->next) {
+        if (atomic_read(&ring->unused) &&
+            atomic_cmpxchg(&ring->unused, true, false)) {
+            if (atomic_read(&ring->tail) == ring->head) {
+                break;
+            }
+            atomic_set(&ring->unused, true);
+        }
+    }
+
+    if (ring) {
+        atomic_set(&ring->dropped, 0);
+        ring->tid = syscall(SYS_gettid);
+    } else {
+        ring = g_malloc0(sizeof(*ring));
+        ring->tid = syscall(SYS_gettid);
+        do {
+            old = atomic_read(&rdma_event_rings);
+            ring->next = old;
+        } while (atomic_cmpxchg(&rdma_event_rings, old, ring) != old);
+
+        if (!old) {
+            qemu_thread_create(&thread, "rdma-events",
+                               rdma_event_drain_thread, NULL,
+                               QEMU_THREAD_DETACHED);
+        }
+    }
+
+    pthread_setspecific(rdma_event_key, ring);
+    rdma_event_ring = ring;
+    return ring;
+}
+
+static void rdma_event(int event, uint64_t a, uint64_t b)
+{
+    RDMAEventRing *ring = rdma_event_ring;
+    RDMAEventRecord *rec;
+    unsigned long head;
+
+    if (!ring) {
+        ring = rdma_event_ring_new();
+    }
+
+    head = ring->head;
+    if (head - atomic_read(&ring->tail) >= RDMA_EVENT_RING_SIZE) {
+        atomic_set(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+
+    rec = &ring->rec[head & (RDMA_EVENT_RING_SIZE - 1)];
+    rec->ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    rec->event = event;
+    rec->a = a;
+    rec->b = b;
+    smp_wmb();
+    atomic_set(&ring->head, head + 1);
+}
+
+#define RDMA_EVENT(event, a, b) \
+    rdma_event(RDMA_EVENT_##event, (uint64_t) (a), (uint64_t) (b))
+#else
+#define RDMA_EVENT(event, a, b) \
+    do { } while (0)
+#endif
+
 uint64_t getTime(void){
     struct timeval t;
     gettimeofday(&t, NULL);
@@ -96,10 +314,30 @@ uint64_t getTime(void){
 
 #define RDMA_RESOLVE_TIMEOUT_MS 10000
 
+/*
+ * Pre-warming of the destination (",prewarm" migration URI option).
+ * Guest RAM is faulted in by up to this many threads, in slices that
+ * never split a 2MB (huge)page between two threads.
+ */
+#define RDMA_PREWARM_MAX_THREADS 16
+#define RDMA_PREWARM_ALIGN (2 * 1024 * 1024)
+#define RDMA_PREWARM_SLICE (64 * 1024 * 1024)
+
 /* Do not merge data if larger than this. */
 #define RDMA_MERGE_MAX (2 * 1024 * 1024)
 #define RDMA_SIGNALED_SEND_MAX (RDMA_MERGE_MAX / 4096)
 
+/* Completions taken per ibv_poll_cq() call when draining on the save path. */
+#define RDMA_POLL_BATCH 16
+
+/*
+ * ",defer": a chunk that had at least half its pages re-sent in each of
+ * the last RDMA_DEFER_PASSES passes over RAM is hot, and its pages are
+ * held back until it cools down or the VM is stopped.
+ */
+#define RDMA_DEFER_PASSES 2
+#define RDMA_DEFER_MASK   ((1 << RDMA_DEFER_PASSES) - 1)
+
 #define RDMA_REG_CHUNK_SHIFT 20 /* 1 MB */
 
 /*
@@ -121,12 +359,26 @@ uint64_t getTime(void){
  * Capabilities for negotiation.
  */
 #define RDMA_CAPABILITY_PIN_ALL 0x01
+#define RDMA_CAPABILITY_PARALLEL_FINISH 0x02
+#define RDMA_CAPABILITY_HASH 0x04
+#define RDMA_CAPABILITY_LZ4 0x08
+#define RDMA_CAPABILITY_RESUME 0x10
+#define RDMA_CAPABILITY_DISCARD 0x20
+#define RDMA_CAPABILITY_DISK 0x40
 
 /*
  * Add the other flags above to this list of known capabilities
  * as they are introduced.
  */
-static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
+static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL |
+                                     RDMA_CAPABILITY_PARALLEL_FINISH |
+                                     RDMA_CAPABILITY_RESUME |
+                                     RDMA_CAPABILITY_DISCARD |
+                                     RDMA_CAPABILITY_DISK |
+#ifdef CONFIG_LZ4
+                                     RDMA_CAPABILITY_LZ4 |
+#endif
+                                     RDMA_CAPABILITY_HASH;
 
 #define CHECK_ERROR_STATE() \
     do { \
@@ -164,6 +416,9 @@ static uint32_t known_capabilities = RDMA_CAPABILITY_PIN_ALL;
 
 #define RDMA_WRID_CHUNK_MASK (~RDMA_WRID_BLOCK_MASK & ~RDMA_WRID_TYPE_MASK)
 
+/* The block index of the writes of disk chunks, see RDMADisk */
+#define RDMA_WRID_DISK_INDEX (RDMA_WRID_BLOCK_MASK >> RDMA_WRID_BLOCK_SHIFT)
+
 /*
  * RDMA migration protocol:
  * 1. RDMA Writes (data messages, i.e. RAM)
@@ -213,6 +468,21 @@ enum {
     RDMA_CONTROL_REGISTER_FINISHED,   /* current iteration finished */
     RDMA_CONTROL_UNREGISTER_REQUEST,  /* dynamic UN-registration */
     RDMA_CONTROL_UNREGISTER_FINISHED, /* unpinning finished */
+    RDMA_CONTROL_FINAL_FINISHED,      /* last iteration sent, not landed */
+    RDMA_CONTROL_BARRIER,             /* all writes have landed */
+    RDMA_CONTROL_HASH_REQUEST,        /* hashes of the dest's pages */
+    RDMA_CONTROL_HASH_RESULT,         /* ... in page order */
+    RDMA_CONTROL_KEEP,                /* dest already has these pages */
+    RDMA_CONTROL_LZ4_RING_REQUEST,    /* landing ring for LZ4 chunks */
+    RDMA_CONTROL_LZ4_RING_RESULT,     /* ... its address and key */
+    RDMA_CONTROL_LZ4_WRITTEN,         /* slots written, to decompress */
+    RDMA_CONTROL_RESUME_REQUEST,      /* reconnected: messages sent */
+    RDMA_CONTROL_RESUME_RESULT,       /* ... and received */
+    RDMA_CONTROL_RESYNC_REQUEST,      /* hashes of pages maybe not written */
+    RDMA_CONTROL_DISCARD,             /* pages the guest has free */
+    RDMA_CONTROL_DISK_RING_REQUEST,   /* landing ring for disk chunks */
+    RDMA_CONTROL_DISK_RING_RESULT,    /* ... its address and key */
+    RDMA_CONTROL_DISK_WRITTEN,        /* slots written, to write to disk */
 };
 
 const char *control_desc[] = {
@@ -228,6 +498,21 @@ const char *control_desc[] = {
     [RDMA_CONTROL_REGISTER_FINISHED] = "REGISTER FINISHED",
     [RDMA_CONTROL_UNREGISTER_REQUEST] = "UNREGISTER REQUEST",
     [RDMA_CONTROL_UNREGISTER_FINISHED] = "UNREGISTER FINISHED",
+    [RDMA_CONTROL_FINAL_FINISHED] = "FINAL FINISHED",
+    [RDMA_CONTROL_BARRIER] = "BARRIER",
+    [RDMA_CONTROL_HASH_REQUEST] = "HASH REQUEST",
+    [RDMA_CONTROL_HASH_RESULT] = "HASH RESULT",
+    [RDMA_CONTROL_KEEP] = "KEEP",
+    [RDMA_CONTROL_LZ4_RING_REQUEST] = "LZ4 RING REQUEST",
+    [RDMA_CONTROL_LZ4_RING_RESULT] = "LZ4 RING RESULT",
+    [RDMA_CONTROL_LZ4_WRITTEN] = "LZ4 WRITTEN",
+    [RDMA_CONTROL_RESUME_REQUEST] = "RESUME REQUEST",
+    [RDMA_CONTROL_RESUME_RESULT] = "RESUME RESULT",
+    [RDMA_CONTROL_RESYNC_REQUEST] = "RESYNC REQUEST",
+    [RDMA_CONTROL_DISCARD] = "DISCARD",
+    [RDMA_CONTROL_DISK_RING_REQUEST] = "DISK RING REQUEST",
+    [RDMA_CONTROL_DISK_RING_RESULT] = "DISK RING RESULT",
+    [RDMA_CONTROL_DISK_WRITTEN] = "DISK WRITTEN",
 };
 
 /*
@@ -277,6 +562,7 @@ typedef struct RDMALocalBlock {
     uint64_t length;
     struct   ibv_mr **pmr;     /* MRs for chunk-level registration */
     struct   ibv_mr *mr;       /* MR for non-chunk-level registration */
+    bool     mr_persistent;    /* 'mr' is owned by migration-ready mode */
     uint32_t *remote_keys;     /* rkeys for chunk-level registration */
     uint32_t remote_rkey;      /* rkeys for non-chunk-level registration */
     int      index;            /* which block are we */
@@ -284,6 +570,12 @@ typedef struct RDMALocalBlock {
     int      nb_chunks;
     unsigned long *transit_bitmap;
     unsigned long *unregister_bitmap;
+    unsigned long *defer_bitmap; /* ",defer": pages held back */
+    uint16_t *chunk_saved;       /* ",defer": pages saved this pass */
+    uint8_t  *chunk_hist;        /* ",defer": bit n: hot n passes ago */
+    uint64_t *remote_hash;       /* ",hash": the dest's page hashes */
+    unsigned long *hash_valid;   /* ",hash": ... until a page is written */
+    unsigned long *free_bitmap;  /* ",free-page-agent": free in the guest */
 } RDMALocalBlock;
 
 /*
@@ -345,6 +637,334 @@ typedef struct RDMALocalBlocks {
     RDMALocalBlock *block;
 } RDMALocalBlocks;
 
+/*
+ * Extra queue pairs ("rails") on other devices and ports, used on the
+ * rdmat: path to spread RAM writes over several links.
+ *
+ * Rail 0 is the main connection (rdma->verbs, pd, cq and qp), which also
+ * carries the control channel. Its entry here only holds statistics.
+ * The other rails have their own PD, CQ, QP and whole-block MRs, and only
+ * ever carry RDMA writes of RAM blocks pinned on both sides.
+ */
+#define RDMA_MAX_RAILS 8
+
+/* re-estimate a rail's throughput after this many bytes */
+#define RDMA_RAIL_RATE_WINDOW (16 * 1024 * 1024)
+
+typedef struct RDMARail {
+    struct ibv_context *verbs;
+    bool verbs_owned;           /* opened here, not by migration-ready */
+    struct ibv_pd *pd;
+    struct ibv_cq *cq;
+    struct ibv_qp *qp;
+    struct app_data data;       /* connection and link parameters */
+    struct ibv_mr **mr;         /* whole-block MRs, by local block index */
+    uint32_t *remote_rkey;      /* dest's rkeys, by local block index */
+
+    /*
+     * Writes complete in order on a queue pair, so the lengths of the
+     * outstanding ones are kept in a FIFO.
+     */
+    int nb_sent;
+    uint64_t sent_len[RDMA_SIGNALED_SEND_MAX];
+    int64_t sent_time[RDMA_SIGNALED_SEND_MAX];
+    int sent_head;
+    uint64_t inflight_bytes;    /* sum of the above */
+
+    /* throughput while busy, in bytes per ns */
+    int64_t busy_since;
+    int64_t busy_ns;
+    uint64_t done_bytes;
+    double rate;
+
+    double credit;              /* for qemu_rdma_pick_rail() */
+} RDMARail;
+
+/*
+ * Token bucket for the migrate_set_speed() limit.  The RAM bytes never
+ * go through the QEMUFile buffer, so its rate limit only catches up with
+ * them every BUFFER_DELAY; the writer is paced per work request instead,
+ * with writes no larger than RDMA_PACE_QUANTUM so that each is a small
+ * burst at line rate.
+ */
+#define RDMA_PACE_QUANTUM  (64 * 1024)
+#define RDMA_PACE_DEPTH    (100 * 1000)    /* ns of tokens the bucket holds */
+
+typedef struct RDMAPacer {
+    double rate;                /* bytes per ns, 0 for no limit */
+    double tokens;              /* bytes, negative while in debt */
+    int64_t last;               /* ns, last refill */
+} RDMAPacer;
+
+/*
+ * Timeline of a migration, written as Chrome trace / Perfetto JSON to
+ * ",timeline=PATH" when the connection is cleaned up.  Spans are added
+ * by one thread at a time: the pre-warm thread only before it is joined.
+ */
+#define RDMA_TIMELINE_MAX_SPANS (64 * 1024)
+
+typedef struct RDMASpan {
+    const char *name;
+    int64_t start;              /* ns, QEMU_CLOCK_REALTIME */
+    int64_t end;
+    int64_t arg;                /* -1 for none */
+    long tid;
+} RDMASpan;
+
+/*
+ * ",compress[=N]", RDMA_CAPABILITY_LZ4: a pool of N threads compresses
+ * the chunks the source writes into the slots of a registered staging
+ * ring, and they are written to the same slots of a landing ring on the
+ * dest, where another pool decompresses them into RAM.  The source fills
+ * one half of the ring while the dest works on the other, see
+ * qemu_rdma_lz4_flush().
+ */
+#define RDMA_LZ4_THREADS     4      /* default for ",compress" */
+#define RDMA_LZ4_MAX_THREADS 16
+
+#ifdef CONFIG_LZ4
+#define RDMA_LZ4_SLOTS       16
+#define RDMA_LZ4_SLOT_RAW    (1UL << RDMA_REG_CHUNK_SHIFT)
+#define RDMA_LZ4_SLOT_SIZE   LZ4_COMPRESSBOUND(RDMA_LZ4_SLOT_RAW)
+
+/*
+ * Batches that compress worse than this ratio make the source write
+ * the next RDMA_LZ4_RAW_WRITES writes uncompressed, straight from RAM,
+ * before it tries again.
+ */
+#define RDMA_LZ4_MAX_RATIO   0.8
+#define RDMA_LZ4_RAW_WRITES  256
+
+/* LZ4_RING_RESULT */
+typedef struct QEMU_PACKED {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t nb_slots;
+} RDMALZ4Ring;
+
+/* LZ4_WRITTEN lists these, 'repeat' of them */
+typedef struct QEMU_PACKED {
+    uint32_t slot;
+    uint32_t block_idx;
+    uint64_t offset;            /* ram_addr_t */
+    uint32_t length;
+    uint32_t csize;             /* compressed length, in the slot */
+} RDMALZ4Job;
+
+typedef struct RDMALZ4 {
+    struct RDMAContext *rdma;
+    bool dest;
+    uint8_t *ring;              /* RDMA_LZ4_SLOTS * RDMA_LZ4_SLOT_SIZE */
+    struct ibv_mr *mr;
+    uint64_t remote_addr;       /* source: the dest's ring */
+    uint32_t remote_rkey;
+
+    /*
+     * The batch the threads work on, under 'lock'.  Threads take jobs
+     * from 'next' on until 'nb_jobs', which the source raises while
+     * they run; 'done' counts the finished ones.
+     */
+    QemuMutex lock;
+    QemuCond work;
+    QemuCond finished;
+    RDMALZ4Job job[RDMA_LZ4_SLOTS / 2];
+    int nb_jobs;
+    int next;
+    int done;
+    int errors;
+    bool quit;
+    QemuThread thread[RDMA_LZ4_MAX_THREADS];
+    int nb_threads;
+
+    /* source only */
+    int half;                   /* of the ring being filled */
+    double ratio;               /* average compressed / raw */
+    int raw_writes;             /* left to write uncompressed */
+    uint64_t written;           /* control_sends after the last batch */
+} RDMALZ4;
+#endif
+
+/*
+ * Block migration, RDMA_CAPABILITY_DISK: rdma_migration_save_disk()
+ * copies the chunks blk_send() would put in the stream to the slots of
+ * a registered staging ring, and they are written to the same slots of
+ * a landing ring on the dest, which hands them to bdrv_aio_writev().
+ * As with RDMALZ4, the source fills one half of the ring while the dest
+ * works on the other: the dest waits for the disk writes of a batch to
+ * complete before it takes the next one, and before it reads any more
+ * of the stream, so that what follows disk data in the stream finds it
+ * on the disk.  See qemu_rdma_disk_write().
+ */
+#define RDMA_DISK_SLOTS      16
+#define RDMA_DISK_SLOT_SIZE  (1UL << 20)    /* block-migration.c BLOCK_SIZE */
+#define RDMA_DISK_NAME_LEN   32             /* BlockDriverState.device_name */
+
+/* DISK_RING_RESULT */
+typedef struct QEMU_PACKED {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t nb_slots;
+} RDMADiskRing;
+
+/* DISK_WRITTEN lists these, 'repeat' of them */
+typedef struct QEMU_PACKED {
+    char device[RDMA_DISK_NAME_LEN];    /* NUL terminated */
+    uint64_t sector;
+    uint32_t nb_sectors;
+    uint32_t slot;
+} RDMADiskJob;
+
+typedef struct RDMADisk {
+    struct RDMAContext *rdma;
+    uint8_t *ring;              /* RDMA_DISK_SLOTS * RDMA_DISK_SLOT_SIZE */
+    struct ibv_mr *mr;
+    uint64_t remote_addr;       /* source: the dest's ring */
+    uint32_t remote_rkey;
+
+    /* source: the batch being filled */
+    RDMADiskJob job[RDMA_DISK_SLOTS / 2];
+    int nb_jobs;
+    int half;                   /* of the ring being filled */
+    uint64_t written;           /* control_sends after the last batch */
+
+    /* dest: disk writes not completed yet, and failed, under 'lock' */
+    QemuMutex lock;
+    QemuCond done;
+    int inflight;
+    int errors;
+    struct iovec iov[RDMA_DISK_SLOTS];
+    QEMUIOVector qiov[RDMA_DISK_SLOTS];
+} RDMADisk;
+
+/*
+ * ",recv-thread", dest: the control channel is served by a thread of
+ * its own instead of the loadvm coroutine, so that a busy main loop does
+ * not hold the source up.  The thread answers registration, COMPRESS
+ * and the other requests itself, and queues the QEMU_FILE bytes and the
+ * end of every registration round for the coroutine, see
+ * qemu_rdma_recv_thread().  The thread stops taking messages while more
+ * than RDMA_RECV_QUEUE_MAX bytes wait in the queue.
+ */
+#define RDMA_RECV_QUEUE_MAX (32 * 1024 * 1024)
+
+typedef struct RDMARecvEntry {
+    struct RDMARecvEntry *next;
+    int type;                   /* QEMU_FILE, a *_FINISHED, or ERROR */
+    int ret;                    /* ERROR: what the thread failed with */
+    uint32_t len;
+    uint32_t pos;               /* bytes already read */
+    uint8_t data[];
+} RDMARecvEntry;
+
+typedef struct RDMARecv {
+    struct RDMAContext *rdma;
+    QemuThread thread;
+
+    /* the queue, under 'lock'; 'event' is signalled for every entry */
+    QemuMutex lock;
+    QemuCond room;
+    RDMARecvEntry *head;
+    RDMARecvEntry **tail;
+    uint64_t queued;
+    int event;                  /* eventfd */
+
+    int stop;                   /* eventfd, wakes the thread up */
+    bool stopping;
+    bool barrier;               /* RDMA_CONTROL_BARRIER received */
+} RDMARecv;
+
+/*
+ * ",workers[=N]", dest: a pool of N threads registers the chunks of a
+ * REGISTER_REQUEST batch, which is answered once all of them are done,
+ * and fills the ranges of COMPRESS requests.  Nothing waits for a fill:
+ * the request after it is only handled once they are all done, see
+ * qemu_rdma_handle_control(), and a chunk is not written before the
+ * source has asked for it to be registered.
+ */
+#define RDMA_WORKERS         4      /* default for ",workers" */
+#define RDMA_WORKERS_MAX     16
+
+typedef struct RDMAWorkerJob {
+    int type;                   /* REGISTER_REQUEST or COMPRESS */
+    RDMALocalBlock *block;
+    uint8_t *start;
+    uint64_t length;
+
+    /* REGISTER_REQUEST */
+    uint64_t chunk;
+    uint32_t *rkey;             /* where the answer goes */
+    struct ibv_mr *mr;
+    int64_t ns;                 /* ibv_reg_mr() took */
+
+    /* COMPRESS */
+    uint8_t value;
+    bool pinned;                /* registered, must not be madvise()d */
+} RDMAWorkerJob;
+
+typedef struct RDMAWorkers {
+    struct RDMAContext *rdma;
+
+    /* same scheme as RDMALZ4 */
+    QemuMutex lock;
+    QemuCond work;
+    QemuCond finished;
+    RDMAWorkerJob job[RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE];
+    int nb_jobs;
+    int next;
+    int done;
+    bool quit;
+    QemuThread thread[RDMA_WORKERS_MAX];
+    int nb_threads;
+} RDMAWorkers;
+
+/*
+ * ",free-page-agent=HOST:PORT", RDMA_CAPABILITY_DISCARD: an agent in the
+ * guest (scripts/free_page_agent) reports the guest physical ranges it
+ * has free.  After every dirty bitmap sync the source sends it a request
+ *     uint32_t magic, uint32_t seq
+ * and it answers with
+ *     uint32_t magic, uint32_t seq, uint64_t nb_ranges,
+ *     nb_ranges x { uint64_t gpa, uint64_t length }
+ * all big endian.  The ranges were free after the sync, so a page the
+ * guest allocates again is written after it and found dirty by the next
+ * one: until then, the pages of the answer to the latest request are not
+ * written but listed in DISCARD messages, as RDMACompress ranges whose
+ * 'value' is unused, and the dest zeroes them.  The answer is read
+ * without blocking while pages are saved.  The last iteration, with the
+ * guest stopped, sends everything.
+ */
+#define RDMA_FREE_MAGIC      0x46524545     /* "FREE" */
+#define RDMA_FREE_POLL_BYTES (1UL << RDMA_REG_CHUNK_SHIFT) /* between reads */
+
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t seq;
+} RDMAFreeRequest;
+
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t nb_ranges;
+} RDMAFreeReply;
+
+typedef struct QEMU_PACKED {
+    uint64_t gpa;
+    uint64_t length;
+} RDMAFreeRange;
+
+typedef struct RDMAFreePages {
+    int fd;                     /* -1 once the agent has gone away */
+    uint32_t seq;               /* of the latest request */
+    bool marked;                /* a free_bitmap has bits set */
+    uint64_t unread;            /* bytes saved since the last read */
+
+    /* the answer being read: 'left' ranges to go, or 0 for a header */
+    uint8_t buf[4096];
+    int len;
+    uint32_t reply_seq;
+    uint64_t left;
+} RDMAFreePages;
+
 /*
  * Main data structure for RDMA state.
  * While there is only one copy of this structure being allocated right now,
@@ -399,6 +1019,7 @@ typedef struct RDMAContext {
     struct ibv_comp_channel *comp_channel;  /* completion channel */
     struct ibv_pd *pd;                      /* protection domain */
     struct ibv_cq *cq;                      /* completion queue */
+    bool pd_persistent;                     /* pd owned by migration-ready */
 
     /*
      * If a previous write failed (perhaps because of a failed
@@ -424,12 +1045,300 @@ typedef struct RDMAContext {
     int total_registrations;
     int total_writes;
 
+    /*
+     * Options appended to the migration URI, e.g. "rdma:host:port,prewarm".
+     */
+    bool prewarm;
+
+    /*
+     * Destination pre-warming: resources are allocated and guest RAM is
+     * faulted in and registered before the source connects.
+     */
+    QemuThread prewarm_thread;
+    bool prewarm_running;
+
+    /*
+     * The dest's RAMBlock table (and rkeys, if pinning everything) was
+     * already received during connection setup, so RAM_CONTROL_SETUP
+     * does not need to ask for it.
+     */
+    bool remote_blocks_known;
+
+    /*
+     * Rails, see RDMARail. 'rails' is the number asked for with ",rails=N".
+     */
+    int rails;
+    int nb_rails;
+    RDMARail rail[RDMA_MAX_RAILS];
+
+    /*
+     * ns the source spent waiting for the dest to register a chunk,
+     * during which nothing was written.
+     */
+    int64_t stall_ns;
+
+    /*
+     * RDMA_CAPABILITY_PARALLEL_FINISH: the last iteration's writes on
+     * rail 0 are not waited for before the device state is sent, only by
+     * one RDMA_CONTROL_BARRIER at the very end.  Once the source has skipped
+     * that wait, it owes the barrier and the dest has it pending.
+     */
+    bool parallel_finish;
+    bool barrier_owed;
+    bool barrier_pending;
+
+    RDMAPacer pacer;
+
+    RDMAStats stats;
+
+    char *timeline;
+    RDMASpan *spans;
+    int nb_spans;
+    int dropped_spans;
+    int iteration;
+    int64_t iteration_start;
+    int64_t finish_start;       /* end of the RAM part of the last stop */
+
+    /* ",record=PATH", see RDMATraceRecord */
+    char *record;
+    FILE *record_file;
+    int64_t record_start;
+
+    /* ",tos=N" and ",sl=N", -1 if not given */
+    int tos;
+    int sl;
+
+    /*
+     * ",defer": pages of hot chunks are held back, see RDMA_DEFER_PASSES.
+     * ram_save_block() walks RAM in address order, so a pass ends when
+     * the saved address goes backwards, or with an iteration that saves
+     * nothing.  'ram_flags' is the RAM_CONTROL_* of the iteration.
+     */
+    bool defer;
+    uint64_t deferred_pages;
+    uint64_t ram_flags;
+    uint64_t defer_addr;        /* last ram_addr_t saved */
+    uint64_t defer_iter_pages;  /* pages saved this iteration */
+    int defer_passes;
+
+    /*
+     * ",hash", RDMA_CAPABILITY_HASH: pages the dest already has are not
+     * written.  The ranges kept are batched in 'keep'.
+     */
+    bool hash;
+    struct RDMACompress *keep;
+    int nb_keep;
+
+    /* ",compress[=N]": threads, 0 if off, see RDMALZ4 */
+    int compress;
+#ifdef CONFIG_LZ4
+    RDMALZ4 *lz4;
+#endif
+
+    /*
+     * Block migration over RDMA writes, see RDMADisk: 'disk_writes' if
+     * the dest can take them, 'disk' once the rings are set up.
+     */
+    bool disk_writes;
+    RDMADisk *disk;
+
+    /*
+     * ",resume", RDMA_CAPABILITY_RESUME: a failed connection is replaced
+     * with a new one, see qemu_rdma_recover().  'sent_msgs' and
+     * 'recv_msgs' count the control messages the source has sent and the
+     * dest has received, except the ones about resuming itself.
+     * 'in_flight' is set once the exchange under way has posted its
+     * message.
+     */
+    bool resume;
+    bool resuming;
+    bool in_flight;
+    uint64_t sent_msgs;
+    uint64_t recv_msgs;
+    uint8_t *resume_msg;        /* source: last message sent, to replay */
+    bool via_tcp;               /* "rdmat:", connected without the CM */
+    int wait_fd;                /* dest: see qemu_rdma_dest_wait(), or -1 */
+    struct rdma_cm_event *resume_event; /* dest: CONNECT_REQUEST seen */
+
+    /* ",recv-thread", see RDMARecv; 'recv' is set while it runs */
+    bool recv_thread;
+    RDMARecv *recv;
+
+    /* ",workers[=N]": threads, 0 if off, see RDMAWorkers */
+    int nb_workers;
+    RDMAWorkers *workers;
+
+    /*
+     * ",free-page-agent=HOST:PORT", see RDMAFreePages; 'free' is set once
+     * it is connected.  The ranges discarded are batched in 'discard'.
+     */
+    char *free_page_agent;
+    RDMAFreePages *free;
+    struct RDMACompress *discard;
+    int nb_discard;
+
+    /*
+     * "local:": the unix socket the stream goes over, and the fds of the
+     * RAM blocks to send along with the next bytes (source) or received
+     * so far (dest).  'local_shared' once the dest has the RAM.
+     */
+    int local_fd;
+    int *local_fds;
+    int nb_local_fds;
+    bool local_shared;
+
     int unregister_current, unregister_next;
     uint64_t unregistrations[RDMA_SIGNALED_SEND_MAX];
 
     GHashTable *blockmap;
 } RDMAContext;
 
+/*
+ * The context of the outgoing migration, if it uses RDMA.
+ * Set before the migration thread starts and cleared after it is gone.
+ */
+static RDMAContext *rdma_outgoing;
+static RDMAContext *rdma_incoming;
+
+/* The same for a "local:" migration, which only uses the RAM blocks */
+static RDMAContext *local_outgoing;
+
+static void qemu_rdma_hist_add(RDMAHistogram *hist, int64_t ns)
+{
+    int i = 0;
+
+    if (ns > 0) {
+        i = MIN(63 - clz64(ns), RDMA_STATS_BUCKETS - 1);
+        hist->sum_ns += ns;
+        hist->max_ns = MAX(hist->max_ns, ns);
+    }
+    hist->count++;
+    hist->bucket[i]++;
+}
+
+/*
+ * Add a span from 'start' to now.
+ */
+static void qemu_rdma_span(RDMAContext *rdma, const char *name,
+                           int64_t start, int64_t arg)
+{
+    RDMASpan *span;
+
+    if (!rdma->timeline) {
+        return;
+    }
+    if (rdma->nb_spans == RDMA_TIMELINE_MAX_SPANS) {
+        rdma->dropped_spans++;
+        return;
+    }
+    if (!rdma->spans) {
+        rdma->spans = g_new(RDMASpan, RDMA_TIMELINE_MAX_SPANS);
+    }
+
+    span = &rdma->spans[rdma->nb_spans++];
+    span->name = name;
+    span->start = start;
+    span->end = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    span->arg = arg;
+    span->tid = syscall(SYS_gettid);
+}
+
+/*
+ * Times are absolute, so the source's and the dest's files can be
+ * loaded together.
+ */
+static void qemu_rdma_timeline_write(RDMAContext *rdma, bool incoming)
+{
+    FILE *out;
+    int pid = getpid();
+    int i;
+
+    if (!rdma->timeline || !rdma->nb_spans) {
+        return;
+    }
+
+    out = fopen(rdma->timeline, "w");
+    if (!out) {
+        perror("rdma migration: could not write timeline");
+        return;
+    }
+
+    fprintf(out, "{\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"args\":{\"name\":\"rdma migration %s\"}}",
+            pid, incoming ? "destination" : "source");
+    for (i = 0; i < rdma->nb_spans; i++) {
+        RDMASpan *span = &rdma->spans[i];
+
+        fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"rdma\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld",
+                span->name, span->start / 1000.0,
+                (span->end - span->start) / 1000.0, pid, span->tid);
+        if (span->arg >= 0) {
+            fprintf(out, ",\"args\":{\"n\":%" PRId64 "}", span->arg);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n],\"otherData\":{\"dropped_spans\":%d}}\n",
+            rdma->dropped_spans);
+    fclose(out);
+}
+
+/*
+ * Append to the ",record=PATH" trace.  The file is created on the first
+ * record, starting with the RAM blocks known by then.
+ */
+static void qemu_rdma_record(RDMAContext *rdma, uint8_t type, uint64_t addr,
+                             uint32_t len)
+{
+    RDMATraceRecord rec = { .type = type, .len = len, .addr = addr };
+    int64_t now;
+    int i;
+
+    if (!rdma->record) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (!rdma->record_file) {
+        RDMATraceHeader head = { .magic = RDMA_TRACE_MAGIC,
+                                 .version = RDMA_TRACE_VERSION,
+                                 .page_bits = TARGET_PAGE_BITS };
+        RDMALocalBlocks *local = &rdma->local_ram_blocks;
+
+        rdma->record_file = fopen(rdma->record, "wb");
+        if (!rdma->record_file ||
+            fwrite(&head, sizeof(head), 1, rdma->record_file) != 1) {
+            goto err;
+        }
+        rdma->record_start = now;
+        for (i = 0; i < local->nb_blocks; i++) {
+            if (local->block[i].is_ram_block) {
+                qemu_rdma_record(rdma, RDMA_TRACE_BLOCK,
+                                 local->block[i].offset,
+                                 local->block[i].length >> TARGET_PAGE_BITS);
+            }
+        }
+        if (!rdma->record) {
+            return;
+        }
+    }
+
+    rec.time = now - rdma->record_start;
+    if (fwrite(&rec, sizeof(rec), 1, rdma->record_file) == 1) {
+        return;
+    }
+
+err:
+    perror("rdma migration: could not write page trace");
+    if (rdma->record_file) {
+        fclose(rdma->record_file);
+        rdma->record_file = NULL;
+    }
+    g_free(rdma->record);
+    rdma->record = NULL;
+}
+
 /*
  * Interface to the rest of the migration call stack.
  */
@@ -498,7 +1407,7 @@ static void network_to_register(RDMARegister *reg)
     reg->chunks = ntohll(reg->chunks);
 }
 
-typedef struct QEMU_PACKED {
+typedef struct QEMU_PACKED RDMACompress {
     uint32_t value;     /* if zero, we will madvise() */
     uint32_t block_idx; /* which ram block index */
     uint64_t offset;    /* where in the remote ramblock this chunk */
@@ -548,16 +1457,71 @@ static void network_to_result(RDMARegisterResult *result)
     result->host_addr = ntohll(result->host_addr);
 };
 
-const char *print_wrid(int wrid);
-static int qemu_rdma_exchange_send(RDMAContext *rdma, RDMAControlHeader *head,
-                                   uint8_t *data, RDMAControlHeader *resp,
-                                   int *resp_idx,
-                                   int (*callback)(RDMAContext *rdma));
+/*
+ * RDMA_CAPABILITY_HASH: the source asks for the hashes of 'nb_pages'
+ * pages of the dest's RAM from 'offset' into block 'block_idx', and
+ * gets them back as big endian uint64_ts in a HASH_RESULT.  Pages the
+ * source finds identical are not written, only listed in KEEP messages,
+ * as RDMACompress ranges whose 'value' is unused.
+ */
+#define RDMA_HASH_MAX_PAGES 32768
 
-static inline uint64_t ram_chunk_index(const uint8_t *start,
-                                       const uint8_t *host)
+typedef struct QEMU_PACKED {
+    uint32_t block_idx;
+    uint32_t nb_pages;
+    uint64_t offset;
+} RDMAHashRequest;
+
+static void hash_request_to_network(RDMAHashRequest *req)
 {
-    return ((uintptr_t) host - (uintptr_t) start) >> RDMA_REG_CHUNK_SHIFT;
+    req->block_idx = htonl(req->block_idx);
+    req->nb_pages = htonl(req->nb_pages);
+    req->offset = htonll(req->offset);
+}
+
+static void network_to_hash_request(RDMAHashRequest *req)
+{
+    req->block_idx = ntohl(req->block_idx);
+    req->nb_pages = ntohl(req->nb_pages);
+    req->offset = ntohll(req->offset);
+}
+
+/*
+ * RDMA_CAPABILITY_RESUME: after the connection failed, the source opens
+ * a new one and sends a RESUME_REQUEST with the number of control
+ * messages it has sent, the dest answers with the number it has
+ * received, each as a big endian uint64_t.  Then, for every chunk with
+ * a write that had not completed, a RESYNC_REQUEST asks for the hashes
+ * of its pages, as an RDMAHashRequest answered like a HASH_REQUEST.
+ * The source tries RDMA_RESUME_ATTEMPTS times, RDMA_RESUME_DELAY_MS
+ * apart, and RDMA_RESUME_ATTEMPTS times more whenever the resync got
+ * further; the dest waits for it for up to RDMA_RESUME_TIMEOUT_MS.  The
+ * resync keeps at most RDMA_RESYNC_INFLIGHT bytes of writes in flight,
+ * so that a link that fails again loses little of it.
+ */
+#define RDMA_RESUME_ATTEMPTS   10
+#define RDMA_RESUME_DELAY_MS   500
+#define RDMA_RESUME_TIMEOUT_MS 10000
+#define RDMA_RESYNC_INFLIGHT   (2 << RDMA_REG_CHUNK_SHIFT)
+
+const char *print_wrid(int wrid);
+static int qemu_rdma_exchange_send(RDMAContext *rdma, RDMAControlHeader *head,
+                                   uint8_t *data, RDMAControlHeader *resp,
+                                   int *resp_idx,
+                                   int (*callback)(RDMAContext *rdma));
+static int qemu_rdma_recover(RDMAContext *rdma, int ret, bool *lost);
+static int qemu_rdma_recover_dest(RDMAContext *rdma, int ret);
+static int qemu_rdma_send_hashes(RDMAContext *rdma, RDMAHashRequest *req);
+static int qemu_rdma_recv_read(RDMAContext *rdma, uint8_t *buf, int size);
+static int qemu_rdma_recv_stop(RDMAContext *rdma, bool barrier);
+static int qemu_rdma_workers_wait(RDMAContext *rdma);
+static int qemu_rdma_handle_control(RDMAContext *rdma,
+                                    RDMAControlHeader *head);
+
+static inline uint64_t ram_chunk_index(const uint8_t *start,
+                                       const uint8_t *host)
+{
+    return ((uintptr_t) host - (uintptr_t) start) >> RDMA_REG_CHUNK_SHIFT;
 }
 
 static inline uint8_t *ram_chunk_start(const RDMALocalBlock *rdma_ram_block,
@@ -692,8 +1656,10 @@ static int __qemu_rdma_delete_block(RDMAContext *rdma, ram_addr_t block_offset)
     }
 
     if (block->mr) {
-        ibv_dereg_mr(block->mr);
-        rdma->total_registrations--;
+        if (!block->mr_persistent) {
+            ibv_dereg_mr(block->mr);
+            rdma->total_registrations--;
+        }
         block->mr = NULL;
     }
 
@@ -703,6 +1669,21 @@ static int __qemu_rdma_delete_block(RDMAContext *rdma, ram_addr_t block_offset)
     g_free(block->unregister_bitmap);
     block->unregister_bitmap = NULL;
 
+    g_free(block->defer_bitmap);
+    block->defer_bitmap = NULL;
+    g_free(block->chunk_saved);
+    block->chunk_saved = NULL;
+    g_free(block->chunk_hist);
+    block->chunk_hist = NULL;
+
+    g_free(block->remote_hash);
+    block->remote_hash = NULL;
+    g_free(block->hash_valid);
+    block->hash_valid = NULL;
+
+    g_free(block->free_bitmap);
+    block->free_bitmap = NULL;
+
     g_free(block->remote_keys);
     block->remote_keys = NULL;
 
@@ -922,6 +1903,39 @@ static int qemu_rdma_broken_ipv6_kernel(Error **errp, struct ibv_context *verbs)
     return 0;
 }
 
+/*
+ * ",tos=N": the IP type of service on RoCE, and the QoS class the path
+ * (and so the SL) is looked up with on IB.
+ */
+static void qemu_rdma_set_cm_qos(RDMAContext *rdma, struct rdma_cm_id *id)
+{
+    uint8_t tos = rdma->tos;
+
+    if (rdma->tos >= 0 &&
+        rdma_set_option(id, RDMA_OPTION_ID, RDMA_OPTION_ID_TOS,
+                        &tos, sizeof(tos))) {
+        perror("rdma migration: could not set type of service");
+    }
+    if (rdma->sl >= 0) {
+        fprintf(stderr, "rdma migration: sl= is only used with rdmat:, "
+                        "the path record picks the SL here\n");
+    }
+}
+
+/*
+ * The same for the manually connected QPs, which also take ",sl=N".
+ */
+static void qemu_rdma_set_link_qos(RDMAContext *rdma,
+                                   struct ib_link_params *link)
+{
+    if (rdma->tos >= 0) {
+        link->traffic_class = rdma->tos;
+    }
+    if (rdma->sl >= 0) {
+        link->sl = rdma->sl;
+    }
+}
+
 /*
  * Figure out which RDMA device corresponds to the requested IP hostname
  * Also create the initial connection manager identifiers for opening
@@ -955,6 +1969,7 @@ static int qemu_rdma_resolve_host(RDMAContext *rdma, Error **errp)
         ERROR(errp, "could not create channel id");
         goto err_resolve_create_id;
     }
+    qemu_rdma_set_cm_qos(rdma, rdma->cm_id);
 
     snprintf(port_str, 16, "%d", rdma->port);
     port_str[15] = '\0';
@@ -1038,14 +2053,381 @@ err_resolve_create_id:
     return ret;
 }
 
+/*
+ * "Migration-ready" mode.
+ *
+ * Normally the source only registers guest memory once the migration has
+ * started, either all at once (rdma-pin-all) or chunk by chunk. For large
+ * guests that shows up as setup time or as stalls during the first
+ * iteration.
+ *
+ * For VMs that we know are going to be migrated, this mode registers all of
+ * guest RAM with every RDMA device in the system while the VM runs. The
+ * registrations are brought in line with the RAM block list when a
+ * migration starts, so only blocks hot-plugged since are registered then,
+ * and the source can start sending right away.
+ *
+ * The protection domains are allocated on the verbs contexts that librdmacm
+ * itself uses (rdma_get_devices()), so they can be handed to rdma_create_qp()
+ * on whatever device the connection manager resolves.
+ *
+ * This pins all of guest memory for as long as it is on, so it is opt-in
+ * per VM with the x-rdma-ready capability, which can be set before the VM
+ * is started or while it runs. Clearing it drops the registrations.
+ */
+
+#define RDMA_READY_MAX_DEVICES 8
+
+typedef struct RDMAReadyBlock {
+    void       *host_addr;
+    ram_addr_t offset;
+    ram_addr_t length;
+    bool       seen;                               /* used by the resync */
+    struct     ibv_mr *mr[RDMA_READY_MAX_DEVICES]; /* one MR per device */
+} RDMAReadyBlock;
+
+typedef struct RDMAReadyState {
+    bool       enabled;
+    int        nb_devices;
+    struct     ibv_context **verbs;                /* owned by librdmacm */
+    struct     ibv_pd *pd[RDMA_READY_MAX_DEVICES];
+    GHashTable *blockmap;                          /* offset => block */
+    QemuMutex  lock;
+    QemuThread thread;
+    bool       thread_running;
+} RDMAReadyState;
+
+static RDMAReadyState rdma_ready;
+
+static int qemu_rdma_ready_reg_block(RDMAReadyBlock *block)
+{
+    int i;
+
+    for (i = 0; i < rdma_ready.nb_devices; i++) {
+        if (block->mr[i]) {
+            continue;
+        }
+        /*
+         * These stand in for the MRs of qemu_rdma_reg_whole_ram_blocks(),
+         * and qemu_rdma_register_and_get_keys() hands out their rkey too.
+         */
+        block->mr[i] = ibv_reg_mr(rdma_ready.pd[i], block->host_addr,
+                                  block->length,
+                                  IBV_ACCESS_LOCAL_WRITE |
+                                  IBV_ACCESS_REMOTE_WRITE);
+        if (!block->mr[i]) {
+            perror("migration-ready: failed to register ram block");
+            return -1;
+        }
+    }
+
+    DDPRINTF("migration-ready: registered block offset %" PRIu64
+             " length %" PRIu64 " on %d devices\n", block->offset,
+             block->length, rdma_ready.nb_devices);
+    return 0;
+}
+
+static void qemu_rdma_ready_free_block(void *opaque)
+{
+    RDMAReadyBlock *block = opaque;
+    int i;
+
+    for (i = 0; i < rdma_ready.nb_devices; i++) {
+        if (block->mr[i]) {
+            ibv_dereg_mr(block->mr[i]);
+        }
+    }
+    g_free(block);
+}
+
+static void qemu_rdma_ready_add(void *host_addr, ram_addr_t offset,
+                                ram_addr_t length)
+{
+    RDMAReadyBlock *block = g_hash_table_lookup(rdma_ready.blockmap,
+                                                (void *) offset);
+
+    if (block && (block->host_addr != host_addr || block->length != length)) {
+        /* resized or re-allocated behind our back */
+        g_hash_table_remove(rdma_ready.blockmap, (void *) offset);
+        block = NULL;
+    }
+
+    if (!block) {
+        block = g_malloc0(sizeof(RDMAReadyBlock));
+        block->host_addr = host_addr;
+        block->offset = offset;
+        block->length = length;
+        g_hash_table_insert(rdma_ready.blockmap, (void *) offset, block);
+    }
+    block->seen = true;
+}
+
+static void qemu_rdma_ready_add_one(void *host_addr, ram_addr_t offset,
+                                    ram_addr_t length, void *opaque)
+{
+    qemu_rdma_ready_add(host_addr, offset, length);
+}
+
+static gboolean qemu_rdma_ready_unseen(void *key, void *value, void *opaque)
+{
+    RDMAReadyBlock *block = value;
+
+    if (block->seen) {
+        block->seen = false;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void qemu_rdma_ready_reg_one(void *key, void *value, void *opaque)
+{
+    int *ret = opaque;
+
+    if (qemu_rdma_ready_reg_block(value)) {
+        *ret = -1;
+    }
+}
+
+/*
+ * Bring the registrations in line with the current RAM block list and
+ * register whatever is missing. Caller holds rdma_ready.lock.
+ */
+static int qemu_rdma_ready_sync_locked(void)
+{
+    int ret = 0;
+
+    qemu_ram_foreach_block(qemu_rdma_ready_add_one, NULL);
+    g_hash_table_foreach_remove(rdma_ready.blockmap,
+                                qemu_rdma_ready_unseen, NULL);
+    g_hash_table_foreach(rdma_ready.blockmap, qemu_rdma_ready_reg_one, &ret);
+
+    return ret;
+}
+
+static void *qemu_rdma_ready_thread(void *opaque)
+{
+#ifdef DEBUG_TIME
+    uint64_t start = getTime();
+#endif
+    int ret = 0;
+
+    qemu_mutex_lock(&rdma_ready.lock);
+    g_hash_table_foreach(rdma_ready.blockmap, qemu_rdma_ready_reg_one, &ret);
+    qemu_mutex_unlock(&rdma_ready.lock);
+
+    TPRINTF("migration-ready: registering guest ram took %" PRIu64 " us%s\n",
+            getTime() - start, ret ? " (with errors)" : "");
+    return NULL;
+}
+
+static int qemu_rdma_ready_init(void)
+{
+    int i;
+
+    rdma_ready.verbs = rdma_get_devices(&rdma_ready.nb_devices);
+    if (!rdma_ready.verbs || !rdma_ready.nb_devices) {
+        fprintf(stderr, "migration-ready: no RDMA devices found\n");
+        return -1;
+    }
+
+    if (rdma_ready.nb_devices > RDMA_READY_MAX_DEVICES) {
+        rdma_ready.nb_devices = RDMA_READY_MAX_DEVICES;
+    }
+
+    for (i = 0; i < rdma_ready.nb_devices; i++) {
+        rdma_ready.pd[i] = ibv_alloc_pd(rdma_ready.verbs[i]);
+        if (!rdma_ready.pd[i]) {
+            fprintf(stderr, "migration-ready: failed to allocate pd on %s\n",
+                    rdma_ready.verbs[i]->device->name);
+            goto err_ready_init;
+        }
+    }
+
+    rdma_ready.blockmap = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                NULL,
+                                                qemu_rdma_ready_free_block);
+    qemu_mutex_init(&rdma_ready.lock);
+    rdma_ready.enabled = true;
+    return 0;
+
+err_ready_init:
+    for (i--; i >= 0; i--) {
+        ibv_dealloc_pd(rdma_ready.pd[i]);
+        rdma_ready.pd[i] = NULL;
+    }
+    rdma_free_devices(rdma_ready.verbs);
+    rdma_ready.verbs = NULL;
+    rdma_ready.nb_devices = 0;
+    return -1;
+}
+
+static void qemu_rdma_ready_fini(void)
+{
+    int i;
+
+    if (rdma_ready.thread_running) {
+        qemu_thread_join(&rdma_ready.thread);
+        rdma_ready.thread_running = false;
+    }
+
+    g_hash_table_destroy(rdma_ready.blockmap);
+    rdma_ready.blockmap = NULL;
+    qemu_mutex_destroy(&rdma_ready.lock);
+
+    for (i = 0; i < rdma_ready.nb_devices; i++) {
+        ibv_dealloc_pd(rdma_ready.pd[i]);
+        rdma_ready.pd[i] = NULL;
+    }
+    rdma_free_devices(rdma_ready.verbs);
+    rdma_ready.verbs = NULL;
+    rdma_ready.nb_devices = 0;
+    rdma_ready.enabled = false;
+}
+
+/*
+ * Snapshot the RAM block list (we hold the iothread lock here) and
+ * register it in the background.
+ */
+static void qemu_rdma_ready_start(void)
+{
+    if (qemu_rdma_ready_init()) {
+        return;
+    }
+
+    qemu_ram_foreach_block(qemu_rdma_ready_add_one, NULL);
+    rdma_ready.thread_running = true;
+    qemu_thread_create(&rdma_ready.thread, "rdma-ready",
+                       qemu_rdma_ready_thread, NULL, QEMU_THREAD_JOINABLE);
+}
+
+static void qemu_rdma_ready_vm_state_change(void *opaque, int running,
+                                            RunState state)
+{
+    if (running && migrate_rdma_ready() && !rdma_ready.enabled) {
+        qemu_rdma_ready_start();
+    }
+}
+
+static void qemu_rdma_ready_setup(void)
+{
+    qemu_add_vm_change_state_handler(qemu_rdma_ready_vm_state_change, NULL);
+}
+
+machine_init(qemu_rdma_ready_setup);
+
+void rdma_migration_ready_update(void)
+{
+    if (migrate_rdma_ready()) {
+        if (!rdma_ready.enabled && runstate_is_running()) {
+            qemu_rdma_ready_start();
+        }
+    } else if (rdma_ready.enabled) {
+        qemu_rdma_ready_fini();
+    }
+}
+
+/*
+ * Which of our pre-allocated protection domains belongs to this device?
+ */
+static int qemu_rdma_ready_device_index(struct ibv_context *verbs)
+{
+    int i;
+
+    if (!rdma_ready.enabled) {
+        return -1;
+    }
+
+    for (i = 0; i < rdma_ready.nb_devices; i++) {
+        if (rdma_ready.verbs[i] == verbs) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * The manually-connected path opens the device itself. Hand it librdmacm's
+ * context instead, so that the persistent registrations can be used.
+ */
+static struct ibv_context *qemu_rdma_ready_verbs(struct ibv_device *dev)
+{
+    int i;
+
+    if (!rdma_ready.enabled) {
+        return NULL;
+    }
+
+    for (i = 0; i < rdma_ready.nb_devices; i++) {
+        if (rdma_ready.verbs[i]->device == dev) {
+            return rdma_ready.verbs[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Called on the source once the RAM blocks have been enumerated: wait for
+ * any background registration to finish, pick up blocks that were added or
+ * removed since, and hand the whole-block MRs to the migration.
+ */
+static int qemu_rdma_ready_attach(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int dev, i, attached = 0;
+
+    dev = qemu_rdma_ready_device_index(rdma->verbs);
+    if (dev < 0 || !rdma->pd_persistent) {
+        return 0;
+    }
+
+    if (rdma_ready.thread_running) {
+        qemu_thread_join(&rdma_ready.thread);
+        rdma_ready.thread_running = false;
+    }
+
+    qemu_mutex_lock(&rdma_ready.lock);
+    if (qemu_rdma_ready_sync_locked()) {
+        fprintf(stderr, "migration-ready: some ram blocks could not be "
+                        "registered, they will be registered on demand\n");
+    }
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
+        RDMAReadyBlock *ready = g_hash_table_lookup(rdma_ready.blockmap,
+                                                    (void *) block->offset);
+
+        if (!ready || !ready->mr[dev] ||
+            ready->host_addr != (void *) block->local_host_addr ||
+            ready->length != block->length) {
+            continue;
+        }
+
+        block->mr = ready->mr[dev];
+        block->mr_persistent = true;
+        attached++;
+    }
+    qemu_mutex_unlock(&rdma_ready.lock);
+
+    DPRINTF("migration-ready: %d of %d ram blocks already registered\n",
+            attached, local->nb_blocks);
+    return 0;
+}
+
 /*
  * Create protection domain and completion queues
  */
 static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
 {
     DTPRINTF("%s\n", __func__);
+    int ready_dev = qemu_rdma_ready_device_index(rdma->verbs);
+
     /* allocate pd */
-    rdma->pd = ibv_alloc_pd(rdma->verbs);
+    if (ready_dev >= 0) {
+        rdma->pd = rdma_ready.pd[ready_dev];
+        rdma->pd_persistent = true;
+    } else {
+        rdma->pd = ibv_alloc_pd(rdma->verbs);
+    }
     if (!rdma->pd) {
         fprintf(stderr, "failed to allocate protection domain\n");
         return -1;
@@ -1074,13 +2456,14 @@ static int qemu_rdma_alloc_pd_cq(RDMAContext *rdma)
     return 0;
 
 err_alloc_pd_cq:
-    if (rdma->pd) {
+    if (rdma->pd && !rdma->pd_persistent) {
         ibv_dealloc_pd(rdma->pd);
     }
     if (rdma->comp_channel) {
         ibv_destroy_comp_channel(rdma->comp_channel);
     }
     rdma->pd = NULL;
+    rdma->pd_persistent = false;
     rdma->comp_channel = NULL;
     return -1;
 
@@ -1145,6 +2528,10 @@ static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
     RDMALocalBlocks *local = &rdma->local_ram_blocks;
 
     for (i = 0; i < local->nb_blocks; i++) {
+        if (local->block[i].mr) {
+            /* migration-ready or pre-warmed */
+            continue;
+        }
         local->block[i].mr =
             ibv_reg_mr(rdma->pd,
                     local->block[i].local_host_addr,
@@ -1164,7 +2551,11 @@ static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
     }
 
     for (i--; i >= 0; i--) {
+        if (local->block[i].mr_persistent) {
+            continue;
+        }
         ibv_dereg_mr(local->block[i].mr);
+        local->block[i].mr = NULL;
         rdma->total_registrations--;
     }
 
@@ -1173,46 +2564,222 @@ static int qemu_rdma_reg_whole_ram_blocks(RDMAContext *rdma)
 }
 
 /*
- * Find the ram block that corresponds to the page requested to be
- * transmitted by QEMU.
- *
- * Once the block is found, also identify which 'chunk' within that
- * block that the page belongs to.
+ * Destination pre-warming.
  *
- * This search cannot fail or the migration will fail.
+ * Normally the destination allocates everything only once the source has
+ * connected, and guest RAM is faulted in page by page as incoming RDMA
+ * writes land (or as registration pins it). With ",prewarm" on the
+ * incoming URI we do all of that up front, in parallel, so that the
+ * destination is never the side that paces the migration.
  */
-static int qemu_rdma_search_ram_block(RDMAContext *rdma,
-                                      uint64_t block_offset,
-                                      uint64_t offset,
-                                      uint64_t length,
-                                      uint64_t *block_index,
-                                      uint64_t *chunk_index)
+typedef struct RDMAPrewarmSlice {
+    uint8_t *start;
+    uint64_t length;
+} RDMAPrewarmSlice;
+
+typedef struct RDMAPrewarm {
+    RDMAPrewarmSlice *slices;
+    int nb_slices;
+    int next;                 /* next slice to hand out, atomic */
+} RDMAPrewarm;
+
+static void qemu_rdma_prefault(uint8_t *start, uint64_t length)
 {
-    uint64_t current_addr = block_offset + offset;
-    RDMALocalBlock *block = g_hash_table_lookup(rdma->blockmap,
-                                                (void *) block_offset);
-    assert(block);
-    assert(current_addr >= block->offset);
-    assert((current_addr + length) <= (block->offset + block->length));
+#ifdef MADV_POPULATE_WRITE
+    /*
+     * Let the kernel do it: this populates hugetlbfs and THP-backed
+     * ranges one huge page at a time.
+     */
+    if (!madvise(start, length, MADV_POPULATE_WRITE)) {
+        return;
+    }
+#endif
+    {
+        uint64_t step = getpagesize();
+        volatile uint8_t *p;
 
-    *block_index = block->index;
-    *chunk_index = ram_chunk_index(block->local_host_addr,
-                block->local_host_addr + (current_addr - block->offset));
+        /*
+         * Write-fault every page. The guest is not running yet and
+         * nothing has been received, so rewriting the same value is safe.
+         */
+        for (p = start; p < start + length; p += step) {
+            *p = *p;
+        }
+    }
+}
 
-    return 0;
+static void *qemu_rdma_prefault_thread(void *opaque)
+{
+    RDMAPrewarm *pw = opaque;
+    int i;
+
+    while ((i = atomic_fetch_add(&pw->next, 1)) < pw->nb_slices) {
+        qemu_rdma_prefault(pw->slices[i].start, pw->slices[i].length);
+    }
+
+    return NULL;
 }
 
 /*
- * Register a chunk with IB. If the chunk was already registered
- * previously, then skip.
- *
- * Also return the keys associated with the registration needed
- * to perform the actual RDMA operation.
+ * Fault in all guest RAM using a pool of threads.
  */
-static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
-        RDMALocalBlock *block, uint8_t *host_addr,
-        uint32_t *lkey, uint32_t *rkey, int chunk,
-        uint8_t *chunk_start, uint8_t *chunk_end)
+static void qemu_rdma_prefault_ram_blocks(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    QemuThread threads[RDMA_PREWARM_MAX_THREADS];
+    RDMAPrewarm pw = { 0 };
+    int nb_threads, i, max_slices = 0;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        max_slices += local->block[i].length / RDMA_PREWARM_SLICE + 2;
+    }
+    pw.slices = g_malloc0(sizeof(RDMAPrewarmSlice) * max_slices);
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        uint8_t *addr = local->block[i].local_host_addr;
+        uint8_t *end = addr + local->block[i].length;
+
+        while (addr < end) {
+            /* cut on huge page boundaries */
+            uint8_t *next = (uint8_t *) QEMU_ALIGN_UP((uintptr_t) addr + 1,
+                                                      RDMA_PREWARM_ALIGN);
+            if (next - addr < RDMA_PREWARM_SLICE) {
+                next = (uint8_t *) QEMU_ALIGN_UP((uintptr_t) addr +
+                                                 RDMA_PREWARM_SLICE,
+                                                 RDMA_PREWARM_ALIGN);
+            }
+            if (next > end) {
+                next = end;
+            }
+            pw.slices[pw.nb_slices].start = addr;
+            pw.slices[pw.nb_slices].length = next - addr;
+            pw.nb_slices++;
+            addr = next;
+        }
+    }
+
+    nb_threads = MIN(sysconf(_SC_NPROCESSORS_ONLN), RDMA_PREWARM_MAX_THREADS);
+    nb_threads = MAX(MIN(nb_threads, pw.nb_slices), 1);
+
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&threads[i], "rdma-prefault",
+                           qemu_rdma_prefault_thread, &pw,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+
+    DPRINTF("Pre-faulted %d ram slices with %d threads\n",
+            pw.nb_slices, nb_threads);
+    g_free(pw.slices);
+}
+
+static void *qemu_rdma_prewarm_thread(void *opaque)
+{
+    RDMAContext *rdma = opaque;
+#ifdef DEBUG_TIME
+    uint64_t start = getTime();
+#endif
+    int64_t span_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    qemu_rdma_prefault_ram_blocks(rdma);
+    TPRINTF("rdma prewarm: pre-faulting guest ram took %" PRIu64 " us\n",
+            getTime() - start);
+    qemu_rdma_span(rdma, "prewarm: fault", span_start, -1);
+
+    /*
+     * Pinning is cheap now that everything is resident. Whole-block MRs
+     * serve both pin-all and dynamic registration requests.
+     */
+    if (rdma->pd) {
+#ifdef DEBUG_TIME
+        start = getTime();
+#endif
+        span_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (qemu_rdma_reg_whole_ram_blocks(rdma)) {
+            fprintf(stderr, "rdma prewarm: could not pre-register guest ram,"
+                            " will register on demand\n");
+        }
+        TPRINTF("rdma prewarm: pre-registering guest ram took %" PRIu64
+                " us\n", getTime() - start);
+        qemu_rdma_span(rdma, "prewarm: register", span_start, -1);
+    }
+
+    return NULL;
+}
+
+/*
+ * Start pre-warming. Called on the destination before listening, once
+ * whatever device-level resources can be created have been created.
+ */
+static void qemu_rdma_prewarm_start(RDMAContext *rdma)
+{
+    if (!rdma->blockmap && qemu_rdma_init_ram_blocks(rdma)) {
+        fprintf(stderr, "rdma prewarm: error initializing ram blocks!\n");
+        return;
+    }
+
+    rdma->prewarm_running = true;
+    qemu_thread_create(&rdma->prewarm_thread, "rdma-prewarm",
+                       qemu_rdma_prewarm_thread, rdma, QEMU_THREAD_JOINABLE);
+}
+
+static void qemu_rdma_prewarm_wait(RDMAContext *rdma)
+{
+    if (rdma->prewarm_running) {
+#ifdef DEBUG_TIME
+        uint64_t start = getTime();
+#endif
+
+        qemu_thread_join(&rdma->prewarm_thread);
+        rdma->prewarm_running = false;
+        TPRINTF("rdma prewarm: waited %" PRIu64 " us for pre-warming\n",
+                getTime() - start);
+    }
+}
+
+/*
+ * Find the ram block that corresponds to the page requested to be
+ * transmitted by QEMU.
+ *
+ * Once the block is found, also identify which 'chunk' within that
+ * block that the page belongs to.
+ *
+ * This search cannot fail or the migration will fail.
+ */
+static int qemu_rdma_search_ram_block(RDMAContext *rdma,
+                                      uint64_t block_offset,
+                                      uint64_t offset,
+                                      uint64_t length,
+                                      uint64_t *block_index,
+                                      uint64_t *chunk_index)
+{
+    uint64_t current_addr = block_offset + offset;
+    RDMALocalBlock *block = g_hash_table_lookup(rdma->blockmap,
+                                                (void *) block_offset);
+    assert(block);
+    assert(current_addr >= block->offset);
+    assert((current_addr + length) <= (block->offset + block->length));
+
+    *block_index = block->index;
+    *chunk_index = ram_chunk_index(block->local_host_addr,
+                block->local_host_addr + (current_addr - block->offset));
+
+    return 0;
+}
+
+/*
+ * Register a chunk with IB. If the chunk was already registered
+ * previously, then skip.
+ *
+ * Also return the keys associated with the registration needed
+ * to perform the actual RDMA operation.
+ */
+static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
+        RDMALocalBlock *block, uint8_t *host_addr,
+        uint32_t *lkey, uint32_t *rkey, int chunk,
+        uint8_t *chunk_start, uint8_t *chunk_end)
 {
     if (block->mr) {
         if (lkey) {
@@ -1243,10 +2810,16 @@ static int qemu_rdma_register_and_get_keys(RDMAContext *rdma,
         DDPRINTF("Registering %" PRIu64 " bytes @ %p\n",
                  len, chunk_start);
 
+        int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
         block->pmr[chunk] = ibv_reg_mr(rdma->pd,
                 chunk_start, len,
                 (rkey ? (IBV_ACCESS_LOCAL_WRITE |
                         IBV_ACCESS_REMOTE_WRITE) : 0));
+        qemu_rdma_hist_add(&rdma->stats.registration,
+                           qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+        rdma->stats.registrations++;
+        RDMA_EVENT(REGISTER, chunk_start, len);
 
         if (!block->pmr[chunk]) {
             perror("Failed to register chunk!");
@@ -1384,6 +2957,8 @@ static int qemu_rdma_unregister_waiting(RDMAContext *rdma)
         ret = ibv_dereg_mr(block->pmr[chunk]);
         block->pmr[chunk] = NULL;
         block->remote_keys[chunk] = 0;
+        rdma->stats.unregistrations++;
+        RDMA_EVENT(UNREGISTER, index, chunk);
 
         if (ret != 0) {
             perror("unregistration chunk failed");
@@ -1447,35 +3022,98 @@ static void qemu_rdma_signal_unregister(RDMAContext *rdma, uint64_t index,
 }
 
 /*
- * Consult the connection manager to see a work request
- * (of any kind) has completed.
- * Return the work request ID that completed.
+ * Rail bookkeeping. A write of 'len' bytes was posted on 'rail'.
  */
-static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
-                               uint32_t *byte_len)
+static void qemu_rdma_rail_posted(RDMAContext *rdma, RDMARail *rail,
+                                  uint64_t len)
 {
-    int ret;
-    struct ibv_wc wc;
-    uint64_t wr_id;
+    int tail = (rail->sent_head + rail->nb_sent) % RDMA_SIGNALED_SEND_MAX;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
-    ret = ibv_poll_cq(rdma->cq, 1, &wc);
+    rdma->stats.writes++;
+    rdma->stats.write_bytes += len;
 
-    if (!ret) {
-        *wr_id_out = RDMA_WRID_NONE;
-        return 0;
+    if (rail->nb_sent == RDMA_SIGNALED_SEND_MAX) {
+        /* cannot happen, the send queue is no deeper than this */
+        return;
+    }
+    if (!rail->nb_sent) {
+        rail->busy_since = now;
     }
+    rail->sent_len[tail] = len;
+    rail->sent_time[tail] = now;
+    rail->inflight_bytes += len;
+    rail->nb_sent++;
+}
 
-    if (ret < 0) {
-        fprintf(stderr, "ibv_poll_cq return %d!\n", ret);
-        return ret;
+/*
+ * The oldest outstanding write on 'rail' completed.
+ */
+static void qemu_rdma_rail_completed(RDMAContext *rdma, RDMARail *rail)
+{
+    int64_t now;
+
+    if (!rail->nb_sent) {
+        return;
+    }
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    qemu_rdma_hist_add(&rdma->stats.write,
+                       now - rail->sent_time[rail->sent_head]);
+
+    rail->done_bytes += rail->sent_len[rail->sent_head];
+    rail->inflight_bytes -= rail->sent_len[rail->sent_head];
+    rail->sent_head = (rail->sent_head + 1) % RDMA_SIGNALED_SEND_MAX;
+    rail->nb_sent--;
+
+    if (rail->nb_sent && rail->done_bytes < RDMA_RAIL_RATE_WINDOW) {
+        return;
+    }
+
+    rail->busy_ns += now - rail->busy_since;
+    rail->busy_since = now;
+
+    if (rail->done_bytes >= RDMA_RAIL_RATE_WINDOW && rail->busy_ns > 0) {
+        double sample = (double) rail->done_bytes / rail->busy_ns;
+
+        rail->rate = rail->rate ? (rail->rate * 3 + sample) / 4 : sample;
+        rail->done_bytes = 0;
+        rail->busy_ns = 0;
+    }
+}
+
+/*
+ * Account for a completion taken off the CQ.
+ */
+/*
+ * ",resume": a write that failed may have landed in part or not at all.
+ * An earlier write to its chunk may have completed and cleared the
+ * chunk's bit, so set it again for qemu_rdma_resync().
+ */
+static void qemu_rdma_write_failed(RDMAContext *rdma, uint64_t wr_id)
+{
+    uint64_t chunk = (wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
+    uint64_t index = (wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
+
+    if (!rdma->resume ||
+        (wr_id & RDMA_WRID_TYPE_MASK) != RDMA_WRID_RDMA_WRITE ||
+        index >= rdma->local_ram_blocks.nb_blocks) {
+        return;
     }
+    set_bit(chunk, rdma->local_ram_blocks.block[index].transit_bitmap);
+}
+
+static int qemu_rdma_complete(RDMAContext *rdma, const struct ibv_wc *wc)
+{
+    uint64_t wr_id = wc->wr_id & RDMA_WRID_TYPE_MASK;
 
-    wr_id = wc.wr_id & RDMA_WRID_TYPE_MASK;
+    RDMA_EVENT(POLL, wc->wr_id, wc->status);
 
-    if (wc.status != IBV_WC_SUCCESS) {
+    if (wc->status != IBV_WC_SUCCESS) {
         fprintf(stderr, "ibv_poll_cq wc.status=%d %s!\n",
-                        wc.status, ibv_wc_status_str(wc.status));
+                        wc->status, ibv_wc_status_str(wc->status));
         fprintf(stderr, "ibv_poll_cq wrid=%s!\n", wrid_desc[wr_id]);
+        qemu_rdma_write_failed(rdma, wc->wr_id);
 
         return -1;
     }
@@ -1490,11 +3128,20 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
 
     if (wr_id == RDMA_WRID_RDMA_WRITE) {
         uint64_t chunk =
-            (wc.wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
+            (wc->wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
         uint64_t index =
-            (wc.wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
+            (wc->wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
         RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
 
+        if (index == RDMA_WRID_DISK_INDEX) {
+            DDDPRINTF("completion of a disk chunk, left %d\n", rdma->nb_sent);
+            if (rdma->nb_sent > 0) {
+                rdma->nb_sent--;
+            }
+            qemu_rdma_rail_completed(rdma, &rdma->rail[0]);
+            return 0;
+        }
+
         DDDPRINTF("completions %s (%" PRId64 ") left %d, "
                  "block %" PRIu64 ", chunk: %" PRIu64 " %p %p\n",
                  print_wrid(wr_id), wr_id, rdma->nb_sent, index, chunk,
@@ -1505,6 +3152,7 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
         if (rdma->nb_sent > 0) {
             rdma->nb_sent--;
         }
+        qemu_rdma_rail_completed(rdma, &rdma->rail[0]);
 
         if (!rdma->pin_all) {
             /*
@@ -1514,7 +3162,7 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
              * unregistered later.
              */
 #ifdef RDMA_UNREGISTRATION_EXAMPLE
-            qemu_rdma_signal_unregister(rdma, index, chunk, wc.wr_id);
+            qemu_rdma_signal_unregister(rdma, index, chunk, wc->wr_id);
 #endif
         }
     } else {
@@ -1522,6 +3170,37 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
             print_wrid(wr_id), wr_id, rdma->nb_sent);
     }
 
+    return 0;
+}
+
+/*
+ * Consult the connection manager to see a work request
+ * (of any kind) has completed.
+ * Return the work request ID that completed.
+ */
+static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
+                               uint32_t *byte_len)
+{
+    int ret;
+    struct ibv_wc wc;
+
+    ret = ibv_poll_cq(rdma->cq, 1, &wc);
+
+    if (!ret) {
+        *wr_id_out = RDMA_WRID_NONE;
+        return 0;
+    }
+
+    if (ret < 0) {
+        fprintf(stderr, "ibv_poll_cq return %d!\n", ret);
+        return ret;
+    }
+
+    ret = qemu_rdma_complete(rdma, &wc);
+    if (ret < 0) {
+        return ret;
+    }
+
     *wr_id_out = wc.wr_id;
     if (byte_len) {
         *byte_len = wc.byte_len;
@@ -1530,6 +3209,124 @@ static uint64_t qemu_rdma_poll(RDMAContext *rdma, uint64_t *wr_id_out,
     return  0;
 }
 
+/*
+ * Take whatever has completed off the CQ without blocking,
+ * RDMA_POLL_BATCH completions per ibv_poll_cq() call.  Only for
+ * the save path, which does not wait for anything in particular.
+ */
+static int qemu_rdma_poll_all(RDMAContext *rdma)
+{
+    struct ibv_wc wc[RDMA_POLL_BATCH];
+    int i, n, ret;
+
+    do {
+        n = ibv_poll_cq(rdma->cq, RDMA_POLL_BATCH, wc);
+        if (n < 0) {
+            fprintf(stderr, "ibv_poll_cq return %d!\n", n);
+            return n;
+        }
+        for (i = 0; i < n; i++) {
+            ret = qemu_rdma_complete(rdma, &wc[i]);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    } while (n == RDMA_POLL_BATCH);
+
+    return 0;
+}
+
+/*
+ * ",resume": where a source that gave up on the connection opens a new
+ * one, the CM event channel or the "rdmat:" listening socket.
+ */
+static int qemu_rdma_resume_fd(RDMAContext *rdma)
+{
+    return rdma->via_tcp ? rdma->sockfd : rdma->channel->fd;
+}
+
+/*
+ * Yield until the completion channel is readable.  With ",resume", the
+ * source may have given up on this connection and be waiting on a new
+ * one instead: -ECONNRESET.  Completions of a dead connection are not
+ * guaranteed to ever come.  The ",recv-thread" thread blocks instead of
+ * yielding, and gets -ECANCELED once it is asked to stop.
+ */
+static int qemu_rdma_dest_wait(RDMAContext *rdma)
+{
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct pollfd pfd[3];
+    struct rdma_cm_event *cm_event;
+    bool stale;
+
+    if (!rdma->resume && !rdma->recv) {
+        yield_until_fd_readable(rdma->comp_channel->fd);
+        return 0;
+    }
+
+    pfd[0] = (struct pollfd) { .fd = rdma->comp_channel->fd,
+                               .events = POLLIN };
+    pfd[1] = (struct pollfd) { .fd = rdma->resume ?
+                                     qemu_rdma_resume_fd(rdma) : -1,
+                               .events = POLLIN };
+    pfd[2] = (struct pollfd) { .fd = rdma->recv ? rdma->recv->stop : -1,
+                               .events = POLLIN };
+
+    if (!rdma->recv && rdma->wait_fd < 0) {
+        rdma->wait_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (rdma->wait_fd < 0) {
+            perror("rdma migration: epoll_create1");
+            return -errno;
+        }
+        ev.data.fd = pfd[0].fd;
+        epoll_ctl(rdma->wait_fd, EPOLL_CTL_ADD, pfd[0].fd, &ev);
+        ev.data.fd = pfd[1].fd;
+        epoll_ctl(rdma->wait_fd, EPOLL_CTL_ADD, pfd[1].fd, &ev);
+    }
+
+    for (;;) {
+        if (rdma->recv) {
+            if (poll(pfd, 3, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -errno;
+            }
+        } else {
+            yield_until_fd_readable(rdma->wait_fd);
+            if (poll(pfd, 2, 0) <= 0) {
+                continue;
+            }
+        }
+
+        if (pfd[2].revents) {
+            return -ECANCELED;
+        }
+        if (pfd[1].revents && rdma->via_tcp) {
+            return -ECONNRESET;
+        }
+        if (pfd[1].revents && !rdma_get_cm_event(rdma->channel, &cm_event)) {
+            if (cm_event->event == RDMA_CM_EVENT_CONNECT_REQUEST) {
+                if (rdma->resume_event) {
+                    rdma_ack_cm_event(rdma->resume_event);
+                }
+                rdma->resume_event = cm_event;
+                return -ECONNRESET;
+            }
+            /* events of the connections replaced already do not matter */
+            stale = cm_event->id != rdma->cm_id;
+            rdma_ack_cm_event(cm_event);
+            if (!stale) {
+                return -ECONNRESET;
+            }
+        }
+
+        if (pfd[0].revents) {
+            return 0;
+        }
+    }
+}
+
 /*
  * Block until the next work request has completed.
  *
@@ -1550,6 +3347,7 @@ static int qemu_rdma_block_for_wrid(RDMAContext *rdma, int wrid_requested,
     struct ibv_cq *cq;
     void *cq_ctx;
     uint64_t wr_id = RDMA_WRID_NONE, wr_id_in;
+    int64_t wait_start;
 
     if (ibv_req_notify_cq(rdma->cq, 0)) {
         return -1;
@@ -1577,13 +3375,17 @@ static int qemu_rdma_block_for_wrid(RDMAContext *rdma, int wrid_requested,
         return 0;
     }
 
+    wait_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     while (1) {
         /*
          * Coroutine doesn't start until process_incoming_migration()
          * so don't yield unless we know we're running inside of a coroutine.
          */
         if (rdma->migration_started_on_destination) {
-            yield_until_fd_readable(rdma->comp_channel->fd);
+            ret = qemu_rdma_dest_wait(rdma);
+            if (ret < 0) {
+                goto err_block_for_wrid;
+            }
         }
 
         if (ibv_get_cq_event(rdma->comp_channel, &cq, &cq_ctx)) {
@@ -1621,6 +3423,8 @@ static int qemu_rdma_block_for_wrid(RDMAContext *rdma, int wrid_requested,
     }
 
 success_block_for_wrid:
+    qemu_rdma_hist_add(&rdma->stats.cq_wait,
+                       qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - wait_start);
     if (num_cq_events) {
         ibv_ack_cq_events(cq, num_cq_events);
     }
@@ -1634,39 +3438,208 @@ err_block_for_wrid:
 }
 
 /*
- * Post a SEND message work request for the control channel
- * containing some data and block until the post completes.
+ * Reap write completions of an extra rail, without blocking.
+ * Returns the number reaped.
  */
-static int qemu_rdma_post_send_control(RDMAContext *rdma, uint8_t *buf,
-                                       RDMAControlHeader *head)
+static int qemu_rdma_rail_poll(RDMAContext *rdma, RDMARail *rail)
 {
+    struct ibv_wc wc[16];
+    int i, ret;
 
-    int ret = 0;
-    RDMAWorkRequestData *wr = &rdma->wr_data[RDMA_WRID_CONTROL];
-    struct ibv_send_wr *bad_wr;
-    struct ibv_sge sge = {
-                           .addr = (uint64_t)(wr->control),
-                           .length = head->len + sizeof(RDMAControlHeader),
-                           .lkey = wr->control_mr->lkey,
-                         };
-    struct ibv_send_wr send_wr = {
-                                   .wr_id = RDMA_WRID_SEND_CONTROL,
-                                   .opcode = IBV_WR_SEND,
-                                   .send_flags = IBV_SEND_SIGNALED,
-                                   .sg_list = &sge,
-                                   .num_sge = 1,
-                                };
+    ret = ibv_poll_cq(rail->cq, ARRAY_SIZE(wc), wc);
+    if (ret < 0) {
+        fprintf(stderr, "ibv_poll_cq return %d!\n", ret);
+        return ret;
+    }
 
-    DDDPRINTF("CONTROL: sending %s..\n", control_desc[head->type]);
+    for (i = 0; i < ret; i++) {
+        uint64_t chunk =
+            (wc[i].wr_id & RDMA_WRID_CHUNK_MASK) >> RDMA_WRID_CHUNK_SHIFT;
+        uint64_t index =
+            (wc[i].wr_id & RDMA_WRID_BLOCK_MASK) >> RDMA_WRID_BLOCK_SHIFT;
 
-    /*
-     * We don't actually need to do a memcpy() in here if we used
-     * the "sge" properly, but since we're only sending control messages
-     * (not RAM in a performance-critical path), then its OK for now.
-     *
-     * The copy makes the RDMAControlHeader simpler to manipulate
-     * for the time being.
-     */
+        RDMA_EVENT(POLL, wc[i].wr_id, wc[i].status);
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            fprintf(stderr, "rail ibv_poll_cq wc.status=%d %s!\n",
+                            wc[i].status, ibv_wc_status_str(wc[i].status));
+            return -1;
+        }
+
+        clear_bit(chunk, rdma->local_ram_blocks.block[index].transit_bitmap);
+        if (rdma->nb_sent > 0) {
+            rdma->nb_sent--;
+        }
+        qemu_rdma_rail_completed(rdma, rail);
+    }
+
+    return ret;
+}
+
+/*
+ * Wait for at least one outstanding write, on any rail, to complete.
+ */
+static int qemu_rdma_wait_for_write(RDMAContext *rdma)
+{
+    int i, ret, reaped = 0;
+
+    for (i = 1; i < rdma->nb_rails; i++) {
+        ret = qemu_rdma_rail_poll(rdma, &rdma->rail[i]);
+        if (ret < 0) {
+            return ret;
+        }
+        reaped += ret;
+    }
+
+    /*
+     * Only block on the main completion queue if something will come
+     * out of it, otherwise our caller just polls the rails again.
+     */
+    if (!reaped && (rdma->nb_rails < 2 || rdma->rail[0].nb_sent)) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        return qemu_rdma_recover(rdma, ret, NULL);
+    }
+
+    return 0;
+}
+
+/*
+ * Wait for all writes on the extra rails to complete.
+ */
+static int qemu_rdma_drain_rails(RDMAContext *rdma)
+{
+    int i, ret;
+
+    for (i = 1; i < rdma->nb_rails; i++) {
+        while (rdma->rail[i].nb_sent) {
+            ret = qemu_rdma_rail_poll(rdma, &rdma->rail[i]);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Choose the rail to write a chunk of local block 'index' on.
+ *
+ * Chunks are handed out by smooth weighted round-robin, each rail being
+ * weighted by its measured throughput. Rails that have not been measured
+ * yet get the weight of the fastest one so that they do get measured.
+ * Only blocks pinned on both sides can go on an extra rail.
+ */
+static int qemu_rdma_pick_rail(RDMAContext *rdma, int index)
+{
+    RDMALocalBlock *block = &rdma->local_ram_blocks.block[index];
+    double max_rate = 0, total = 0;
+    int i, best = 0;
+
+    if (rdma->nb_rails < 2 || !rdma->pin_all || !block->is_ram_block) {
+        return 0;
+    }
+
+    for (i = 0; i < rdma->nb_rails; i++) {
+        max_rate = MAX(max_rate, rdma->rail[i].rate);
+    }
+    if (max_rate == 0) {
+        max_rate = 1;
+    }
+
+    for (i = 0; i < rdma->nb_rails; i++) {
+        RDMARail *rail = &rdma->rail[i];
+
+        if (i && (!rail->remote_rkey || !rail->remote_rkey[index] ||
+                  !rail->mr[index])) {
+            continue;
+        }
+        rail->credit += rail->rate ? rail->rate : max_rate;
+        total += rail->rate ? rail->rate : max_rate;
+        if (rail->credit > rdma->rail[best].credit) {
+            best = i;
+        }
+    }
+
+    rdma->rail[best].credit -= total;
+    return best;
+}
+
+static void qemu_rdma_rail_cleanup(RDMAContext *rdma, RDMARail *rail)
+{
+    int i;
+
+    if (rail->mr) {
+        for (i = 0; i < rdma->local_ram_blocks.nb_blocks; i++) {
+            if (rail->mr[i]) {
+                ibv_dereg_mr(rail->mr[i]);
+                rdma->total_registrations--;
+            }
+        }
+    }
+    if (rail->qp) {
+        ibv_destroy_qp(rail->qp);
+    }
+    if (rail->cq) {
+        ibv_destroy_cq(rail->cq);
+    }
+    if (rail->pd) {
+        ibv_dealloc_pd(rail->pd);
+    }
+    if (rail->verbs && rail->verbs_owned) {
+        ibv_close_device(rail->verbs);
+    }
+    g_free(rail->mr);
+    g_free(rail->remote_rkey);
+    g_free(rail->data.remote_connection);
+    memset(rail, 0, sizeof(*rail));
+}
+
+static void qemu_rdma_rails_cleanup(RDMAContext *rdma)
+{
+    int i;
+
+    for (i = 1; i < rdma->nb_rails; i++) {
+        qemu_rdma_rail_cleanup(rdma, &rdma->rail[i]);
+    }
+    memset(&rdma->rail[0], 0, sizeof(rdma->rail[0]));
+    rdma->nb_rails = 1;
+}
+
+/*
+ * Post a SEND message work request for the control channel
+ * containing some data and block until the post completes.
+ */
+static int qemu_rdma_post_send_control(RDMAContext *rdma, uint8_t *buf,
+                                       RDMAControlHeader *head)
+{
+
+    int ret = 0;
+    RDMAWorkRequestData *wr = &rdma->wr_data[RDMA_WRID_CONTROL];
+    struct ibv_send_wr *bad_wr;
+    struct ibv_sge sge = {
+                           .addr = (uint64_t)(wr->control),
+                           .length = head->len + sizeof(RDMAControlHeader),
+                           .lkey = wr->control_mr->lkey,
+                         };
+    struct ibv_send_wr send_wr = {
+                                   .wr_id = RDMA_WRID_SEND_CONTROL,
+                                   .opcode = IBV_WR_SEND,
+                                   .send_flags = IBV_SEND_SIGNALED,
+                                   .sg_list = &sge,
+                                   .num_sge = 1,
+                                };
+
+    DDDPRINTF("CONTROL: sending %s..\n", control_desc[head->type]);
+    RDMA_EVENT(SEND, head->type, head->len);
+
+    /*
+     * We don't actually need to do a memcpy() in here if we used
+     * the "sge" properly, but since we're only sending control messages
+     * (not RAM in a performance-critical path), then its OK for now.
+     *
+     * The copy makes the RDMAControlHeader simpler to manipulate
+     * for the time being.
+     */
     assert(head->len <= RDMA_CONTROL_MAX_BUFFER - sizeof(*head));
     memcpy(wr->control, head, sizeof(RDMAControlHeader));
     control_to_network((void *) wr->control);
@@ -1736,6 +3709,7 @@ static int qemu_rdma_exchange_get_response(RDMAContext *rdma,
 
     network_to_control((void *) rdma->wr_data[idx].control);
     memcpy(head, rdma->wr_data[idx].control, sizeof(RDMAControlHeader));
+    RDMA_EVENT(RECV, head->type, head->len);
 
     DDDPRINTF("CONTROL: %s receiving...\n", control_desc[expecting]);
 
@@ -1792,11 +3766,13 @@ static void qemu_rdma_move_header(RDMAContext *rdma, int idx,
  * to perform an *additional* exchange of message just to provide a response by
  * instead piggy-backing on the acknowledgement.
  */
-static int qemu_rdma_exchange_send(RDMAContext *rdma, RDMAControlHeader *head,
-                                   uint8_t *data, RDMAControlHeader *resp,
-                                   int *resp_idx,
-                                   int (*callback)(RDMAContext *rdma))
+static int __qemu_rdma_exchange_send(RDMAContext *rdma,
+                                     RDMAControlHeader *head,
+                                     uint8_t *data, RDMAControlHeader *resp,
+                                     int *resp_idx,
+                                     int (*callback)(RDMAContext *rdma))
 {
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret = 0;
 
     /*
@@ -1836,6 +3812,11 @@ static int qemu_rdma_exchange_send(RDMAContext *rdma, RDMAControlHeader *head,
     /*
      * Deliver the control message that was requested.
      */
+    if (head->type != RDMA_CONTROL_RESUME_REQUEST &&
+        head->type != RDMA_CONTROL_RESYNC_REQUEST) {
+        rdma->sent_msgs++;
+        rdma->in_flight = true;
+    }
     ret = qemu_rdma_post_send_control(rdma, data, head);
 
     if (ret < 0) {
@@ -1871,22 +3852,60 @@ static int qemu_rdma_exchange_send(RDMAContext *rdma, RDMAControlHeader *head,
     }
 
     rdma->control_ready_expected = 1;
+    rdma->in_flight = false;
+    rdma->stats.control_sends++;
+    qemu_rdma_hist_add(&rdma->stats.control,
+                       qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
 
     return 0;
 }
 
+/*
+ * With ",resume", an exchange that fails is done again on a new
+ * connection, unless the dest got the message and owes no answer.
+ * Requests the dest got already are answered again.
+ */
+static int qemu_rdma_exchange_send(RDMAContext *rdma, RDMAControlHeader *head,
+                                   uint8_t *data, RDMAControlHeader *resp,
+                                   int *resp_idx,
+                                   int (*callback)(RDMAContext *rdma))
+{
+    int resp_type = resp ? resp->type : RDMA_CONTROL_NONE;
+    bool posted, lost;
+    int ret;
+
+    for (;;) {
+        rdma->in_flight = false;
+        ret = __qemu_rdma_exchange_send(rdma, head, data, resp, resp_idx,
+                                        callback);
+        if (ret >= 0) {
+            return ret;
+        }
+
+        posted = rdma->in_flight;
+        ret = qemu_rdma_recover(rdma, ret, &lost);
+        if (ret < 0 || (posted && !lost && !resp)) {
+            return ret;
+        }
+        if (resp) {
+            resp->type = resp_type;
+        }
+    }
+}
+
 /*
  * This is an 'atomic' high-level operation to receive a single, unified
  * control-channel message.
  */
-static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
-                                int expecting)
+static int __qemu_rdma_exchange_recv(RDMAContext *rdma,
+                                     RDMAControlHeader *head, int expecting)
 {
     RDMAControlHeader ready = {
                                 .len = 0,
                                 .type = RDMA_CONTROL_READY,
                                 .repeat = 1,
                               };
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     int ret;
 
     /*
@@ -1920,1835 +3939,6357 @@ static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
         return ret;
     }
 
+    rdma->stats.control_recvs++;
+    qemu_rdma_hist_add(&rdma->stats.control,
+                       qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+
     return 0;
 }
 
 /*
- * Write an actual chunk of memory using RDMA.
- *
- * If we're using dynamic registration on the dest-side, we have to
- * send a registration command first.
+ * With ",resume", the RESYNC_REQUESTs that follow a new connection are
+ * answered on the way, and if the connection fails, the message is
+ * waited for on the next one.
  */
-static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
-                               int current_index, uint64_t current_addr,
-                               uint64_t length)
+static int qemu_rdma_exchange_recv(RDMAContext *rdma, RDMAControlHeader *head,
+                                int expecting)
 {
-    struct ibv_sge sge;
-    struct ibv_send_wr send_wr = { 0 };
-    struct ibv_send_wr *bad_wr;
-    int reg_result_idx, ret, count = 0;
-    uint64_t chunk, chunks;
-    uint8_t *chunk_start, *chunk_end;
-    RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
-    RDMARegister reg;
-    RDMARegisterResult *reg_result;
-    RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
-    RDMAControlHeader head = { .len = sizeof(RDMARegister),
-                               .type = RDMA_CONTROL_REGISTER_REQUEST,
-                               .repeat = 1,
-                             };
-
-retry:
-    sge.addr = (uint64_t)(block->local_host_addr +
-                            (current_addr - block->offset));
-    sge.length = length;
+    int ret;
 
-    chunk = ram_chunk_index(block->local_host_addr, (uint8_t *) sge.addr);
-    chunk_start = ram_chunk_start(block, chunk);
+    if (!rdma->resume) {
+        return __qemu_rdma_exchange_recv(rdma, head, expecting);
+    }
 
-    if (block->is_ram_block) {
-        chunks = length / (1UL << RDMA_REG_CHUNK_SHIFT);
+    for (;;) {
+        ret = __qemu_rdma_exchange_recv(rdma, head, RDMA_CONTROL_NONE);
+        if (ret < 0) {
+            ret = qemu_rdma_recover_dest(rdma, ret);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
+        }
 
-        if (chunks && ((length % (1UL << RDMA_REG_CHUNK_SHIFT)) == 0)) {
-            chunks--;
+        if (head->type == RDMA_CONTROL_RESYNC_REQUEST) {
+            ret = qemu_rdma_workers_wait(rdma);
+            if (ret < 0) {
+                return ret;
+            }
+            ret = qemu_rdma_send_hashes(rdma, (RDMAHashRequest *)
+                            rdma->wr_data[RDMA_WRID_READY].control_curr);
+            if (ret < 0) {
+                return ret;
+            }
+            continue;
         }
-    } else {
-        chunks = block->length / (1UL << RDMA_REG_CHUNK_SHIFT);
 
-        if (chunks && ((block->length % (1UL << RDMA_REG_CHUNK_SHIFT)) == 0)) {
-            chunks--;
+        rdma->recv_msgs++;
+        if (expecting != RDMA_CONTROL_NONE && head->type != expecting) {
+            fprintf(stderr, "Was expecting a %s (%d) control message"
+                    ", but got: %s (%d), length: %d\n",
+                    control_desc[expecting], expecting,
+                    control_desc[head->type], head->type, head->len);
+            return -EIO;
         }
+        return 0;
     }
+}
 
-    DDPRINTF("Writing %" PRIu64 " chunks, (%" PRIu64 " MB)\n",
-        chunks + 1, (chunks + 1) * (1UL << RDMA_REG_CHUNK_SHIFT) / 1024 / 1024);
+/*
+ * Answer the request the dest just received.  With ",resume", if the
+ * connection fails the answer is dropped once a new one is up: the
+ * source asks again.
+ */
+static int qemu_rdma_reply(RDMAContext *rdma, uint8_t *buf,
+                           RDMAControlHeader *head)
+{
+    int ret = qemu_rdma_post_send_control(rdma, buf, head);
 
-    chunk_end = ram_chunk_end(block, chunk + chunks);
+    if (ret < 0) {
+        ret = qemu_rdma_recover_dest(rdma, ret);
+    }
+    return ret;
+}
 
-    if (!rdma->pin_all) {
-#ifdef RDMA_UNREGISTRATION_EXAMPLE
-        qemu_rdma_unregister_waiting(rdma);
-#endif
+/*
+ * Charge 'len' bytes that were just posted to the pacer and, if that
+ * put it in debt, sleep until the debt is paid off.
+ */
+static void qemu_rdma_pace(RDMAContext *rdma, uint64_t len)
+{
+    RDMAPacer *pacer = &rdma->pacer;
+    double rate = pacer->rate;
+    int64_t now;
+
+    if (!rate) {
+        return;
     }
 
-    while (test_bit(chunk, block->transit_bitmap)) {
-        (void)count;
-        DDPRINTF("(%d) Not clobbering: block: %d chunk %" PRIu64
-                " current %" PRIu64 " len %" PRIu64 " %d %d\n",
-                count++, current_index, chunk,
-                sge.addr, length, rdma->nb_sent, block->nb_chunks);
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (pacer->last) {
+        pacer->tokens += (now - pacer->last) * rate;
+        pacer->tokens = MIN(pacer->tokens,
+                            MAX(RDMA_PACE_QUANTUM, RDMA_PACE_DEPTH * rate));
+    }
+    pacer->last = now;
 
-        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+    pacer->tokens -= len;
+    if (pacer->tokens < 0) {
+        g_usleep((unsigned long) (-pacer->tokens / rate / 1000) + 1);
+    }
+}
 
-        if (ret < 0) {
-            fprintf(stderr, "Failed to Wait for previous write to complete "
-                    "block %d chunk %" PRIu64
-                    " current %" PRIu64 " len %" PRIu64 " %d\n",
-                    current_index, chunk, sge.addr, length, rdma->nb_sent);
-            return ret;
+#ifdef CONFIG_LZ4
+static void *qemu_rdma_lz4_thread(void *opaque)
+{
+    RDMALZ4 *lz4 = opaque;
+    RDMALocalBlock *block;
+    RDMALZ4Job *job;
+    char *host, *slot;
+    bool ok;
+
+    qemu_mutex_lock(&lz4->lock);
+    while (true) {
+        while (!lz4->quit && lz4->next == lz4->nb_jobs) {
+            qemu_cond_wait(&lz4->work, &lz4->lock);
+        }
+        if (lz4->quit) {
+            break;
+        }
+        job = &lz4->job[lz4->next++];
+        qemu_mutex_unlock(&lz4->lock);
+
+        block = &lz4->rdma->local_ram_blocks.block[job->block_idx];
+        host = (char *) block->local_host_addr + (job->offset - block->offset);
+        slot = (char *) lz4->ring + (uint64_t) job->slot * RDMA_LZ4_SLOT_SIZE;
+        if (lz4->dest) {
+            ok = LZ4_decompress_safe(slot, host, job->csize,
+                                     job->length) == job->length;
+        } else {
+            job->csize = LZ4_compress_default(host, slot, job->length,
+                                              RDMA_LZ4_SLOT_SIZE);
+            ok = job->csize > 0;
+        }
+
+        qemu_mutex_lock(&lz4->lock);
+        lz4->errors += !ok;
+        if (++lz4->done == lz4->nb_jobs) {
+            qemu_cond_signal(&lz4->finished);
         }
     }
+    qemu_mutex_unlock(&lz4->lock);
 
-    if (!rdma->pin_all || !block->is_ram_block) {
-        if (!block->remote_keys[chunk]) {
-            /*
-             * This chunk has not yet been registered, so first check to see
-             * if the entire chunk is zero. If so, tell the other size to
-             * memset() + madvise() the entire chunk without RDMA.
-             */
+    return NULL;
+}
 
-            if (can_use_buffer_find_nonzero_offset((void *)sge.addr, length)
-                   && buffer_find_nonzero_offset((void *)sge.addr,
-                                                    length) == length) {
-                RDMACompress comp = {
-                                        .offset = current_addr,
-                                        .value = 0,
-                                        .block_idx = current_index,
-                                        .length = length,
-                                    };
+static RDMALZ4 *qemu_rdma_lz4_new(RDMAContext *rdma, bool dest, int threads)
+{
+    RDMALZ4 *lz4 = g_new0(RDMALZ4, 1);
+    size_t size = RDMA_LZ4_SLOTS * RDMA_LZ4_SLOT_SIZE;
+    int i;
 
-                head.len = sizeof(comp);
-                head.type = RDMA_CONTROL_COMPRESS;
+    lz4->rdma = rdma;
+    lz4->dest = dest;
+    lz4->ring = g_malloc(size);
+    lz4->mr = ibv_reg_mr(rdma->pd, lz4->ring, size, dest ?
+                         IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE :
+                         IBV_ACCESS_LOCAL_WRITE);
+    if (!lz4->mr) {
+        perror("rdma migration: cannot register the LZ4 ring");
+        g_free(lz4->ring);
+        g_free(lz4);
+        return NULL;
+    }
+    rdma->total_registrations++;
 
-                DDPRINTF("Entire chunk is zero, sending compress: %"
-                    PRIu64 " for %d "
-                    "bytes, index: %d, offset: %" PRId64 "...\n",
-                    chunk, sge.length, current_index, current_addr);
+    qemu_mutex_init(&lz4->lock);
+    qemu_cond_init(&lz4->work);
+    qemu_cond_init(&lz4->finished);
+    for (i = 0; i < threads; i++) {
+        qemu_thread_create(&lz4->thread[i], "rdma lz4", qemu_rdma_lz4_thread,
+                           lz4, QEMU_THREAD_JOINABLE);
+    }
+    lz4->nb_threads = threads;
 
-                compress_to_network(&comp);
-                ret = qemu_rdma_exchange_send(rdma, &head,
-                                (uint8_t *) &comp, NULL, NULL, NULL);
+    return lz4;
+}
 
-                if (ret < 0) {
-                    return -EIO;
-                }
+static void qemu_rdma_lz4_free(RDMAContext *rdma)
+{
+    RDMALZ4 *lz4 = rdma->lz4;
+    int i;
 
-                acct_update_position(f, sge.length, true);
+    if (!lz4) {
+        return;
+    }
 
-                return 1;
-            }
+    qemu_mutex_lock(&lz4->lock);
+    lz4->quit = true;
+    qemu_cond_broadcast(&lz4->work);
+    qemu_mutex_unlock(&lz4->lock);
+    for (i = 0; i < lz4->nb_threads; i++) {
+        qemu_thread_join(&lz4->thread[i]);
+    }
 
-            /*
-             * Otherwise, tell other side to register.
-             */
-            reg.current_index = current_index;
-            if (block->is_ram_block) {
-                reg.key.current_addr = current_addr;
-            } else {
-                reg.key.chunk = chunk;
-            }
-            reg.chunks = chunks;
+    qemu_cond_destroy(&lz4->finished);
+    qemu_cond_destroy(&lz4->work);
+    qemu_mutex_destroy(&lz4->lock);
+    ibv_dereg_mr(lz4->mr);
+    rdma->total_registrations--;
+    g_free(lz4->ring);
+    g_free(lz4);
+    rdma->lz4 = NULL;
+}
 
-            DDPRINTF("Sending registration request chunk %" PRIu64 " for %d "
-                    "bytes, index: %d, offset: %" PRId64 "...\n",
-                    chunk, sge.length, current_index, current_addr);
+/*
+ * Wait for the threads to finish the batch, returns how many jobs of it
+ * failed.
+ */
+static int qemu_rdma_lz4_wait(RDMALZ4 *lz4)
+{
+    int errors;
 
-            register_to_network(&reg);
-            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
-                                    &resp, &reg_result_idx, NULL);
-            if (ret < 0) {
-                return ret;
-            }
+    qemu_mutex_lock(&lz4->lock);
+    while (lz4->done < lz4->nb_jobs) {
+        qemu_cond_wait(&lz4->finished, &lz4->lock);
+    }
+    errors = lz4->errors;
+    qemu_mutex_unlock(&lz4->lock);
 
-            /* try to overlap this single registration with the one we sent. */
-            if (qemu_rdma_register_and_get_keys(rdma, block,
-                                                (uint8_t *) sge.addr,
-                                                &sge.lkey, NULL, chunk,
-                                                chunk_start, chunk_end)) {
-                fprintf(stderr, "cannot get lkey!\n");
-                return -EINVAL;
-            }
+    return errors;
+}
 
-            reg_result = (RDMARegisterResult *)
-                    rdma->wr_data[reg_result_idx].control_curr;
+static void qemu_rdma_lz4_reset(RDMALZ4 *lz4)
+{
+    qemu_mutex_lock(&lz4->lock);
+    lz4->nb_jobs = 0;
+    lz4->next = 0;
+    lz4->done = 0;
+    lz4->errors = 0;
+    qemu_mutex_unlock(&lz4->lock);
+}
 
-            network_to_result(reg_result);
+/*
+ * Source: ask the dest for its landing ring, at RAM_CONTROL_SETUP.
+ * Compression is turned off rather than failing the migration if
+ * either side cannot set up its ring.
+ */
+static int qemu_rdma_lz4_start(RDMAContext *rdma)
+{
+    RDMAControlHeader head = { .len = 0,
+                               .type = RDMA_CONTROL_LZ4_RING_REQUEST,
+                               .repeat = 1 };
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_LZ4_RING_RESULT };
+    RDMALZ4Ring *ring;
+    int idx, ret;
+
+    if (rdma->nb_rails > 1) {
+        fprintf(stderr, "rdma: compression needs a single rail, "
+                        "will send chunks uncompressed.\n");
+        rdma->compress = 0;
+        return 0;
+    }
 
-            DDPRINTF("Received registration result:"
-                    " my key: %x their key %x, chunk %" PRIu64 "\n",
-                    block->remote_keys[chunk], reg_result->rkey, chunk);
+    rdma->lz4 = qemu_rdma_lz4_new(rdma, false, rdma->compress);
+    if (!rdma->lz4) {
+        rdma->compress = 0;
+        return 0;
+    }
 
-            block->remote_keys[chunk] = reg_result->rkey;
-            block->remote_host_addr = reg_result->host_addr;
-        } else {
-            /* already registered before */
-            if (qemu_rdma_register_and_get_keys(rdma, block,
-                                                (uint8_t *)sge.addr,
-                                                &sge.lkey, NULL, chunk,
-                                                chunk_start, chunk_end)) {
-                fprintf(stderr, "cannot get lkey!\n");
-                return -EINVAL;
-            }
-        }
+    ret = qemu_rdma_exchange_send(rdma, &head, NULL, &resp, &idx, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    if (resp.len != sizeof(RDMALZ4Ring)) {
+        return -EIO;
+    }
 
-        send_wr.wr.rdma.rkey = block->remote_keys[chunk];
-    } else {
-        send_wr.wr.rdma.rkey = block->remote_rkey;
+    ring = (RDMALZ4Ring *) rdma->wr_data[idx].control_curr;
+    if (ntohl(ring->nb_slots) != RDMA_LZ4_SLOTS) {
+        fprintf(stderr, "rdma: dest has no LZ4 ring, "
+                        "will send chunks uncompressed.\n");
+        qemu_rdma_lz4_free(rdma);
+        rdma->compress = 0;
+        return 0;
+    }
+    rdma->lz4->remote_addr = ntohll(ring->addr);
+    rdma->lz4->remote_rkey = ntohl(ring->rkey);
 
-        if (qemu_rdma_register_and_get_keys(rdma, block, (uint8_t *)sge.addr,
-                                                     &sge.lkey, NULL, chunk,
-                                                     chunk_start, chunk_end)) {
-            fprintf(stderr, "cannot get lkey!\n");
-            return -EINVAL;
-        }
+    return 0;
+}
+
+/*
+ * Source: write the batch of compressed chunks to the dest's ring and
+ * tell it which slots to decompress.  The next control message waits
+ * for the dest to be READY, i.e. done with the batch, so the half of
+ * the ring it used can be filled again once this one was sent.
+ */
+static int qemu_rdma_lz4_flush(QEMUFile *f, RDMAContext *rdma)
+{
+    RDMALZ4 *lz4 = rdma->lz4;
+    RDMAControlHeader head = { .type = RDMA_CONTROL_LZ4_WRITTEN };
+    struct ibv_send_wr send_wr = { 0 };
+    struct ibv_send_wr *bad_wr;
+    struct ibv_sge sge;
+    RDMALocalBlock *block;
+    RDMALZ4Job *job;
+    uint64_t chunk, raw = 0, compressed = 0;
+    double ratio;
+    int i, ret;
+
+    if (!lz4 || !lz4->nb_jobs) {
+        return 0;
     }
 
-    /*
-     * Encode the ram block index and chunk within this wrid.
-     * We will use this information at the time of completion
-     * to figure out which bitmap to check against and then which
-     * chunk in the bitmap to look for.
-     */
-    send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
-                                        current_index, chunk);
+    if (qemu_rdma_lz4_wait(lz4)) {
+        fprintf(stderr, "rdma migration: LZ4 compression failed!\n");
+        return -EIO;
+    }
 
     send_wr.opcode = IBV_WR_RDMA_WRITE;
     send_wr.send_flags = IBV_SEND_SIGNALED;
     send_wr.sg_list = &sge;
     send_wr.num_sge = 1;
-    send_wr.wr.rdma.remote_addr = block->remote_host_addr +
-                                (current_addr - block->offset);
-
-    DDDPRINTF("Posting chunk: %" PRIu64 ", addr: %lx"
-              " remote: %lx, bytes %" PRIu32 "\n",
-              chunk, sge.addr, send_wr.wr.rdma.remote_addr,
-              sge.length);
-
-    /*
-     * ibv_post_send() does not return negative error numbers,
-     * per the specification they are positive - no idea why.
-     */
-    ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr);
-
-    if (ret == ENOMEM) {
-        DDPRINTF("send queue is full. wait a little....\n");
-        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
-        if (ret < 0) {
-            fprintf(stderr, "rdma migration: failed to make "
-                            "room in full send queue! %d\n", ret);
-            return ret;
+    send_wr.wr.rdma.rkey = lz4->remote_rkey;
+    sge.lkey = lz4->mr->lkey;
+
+    for (i = 0; i < lz4->nb_jobs; i++) {
+        job = &lz4->job[i];
+        block = &rdma->local_ram_blocks.block[job->block_idx];
+        chunk = (job->offset - block->offset) >> RDMA_REG_CHUNK_SHIFT;
+
+        sge.addr = (uintptr_t) (lz4->ring +
+                                (uint64_t) job->slot * RDMA_LZ4_SLOT_SIZE);
+        sge.length = job->csize;
+        send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
+                                            job->block_idx, chunk);
+        send_wr.wr.rdma.remote_addr = lz4->remote_addr +
+                                (uint64_t) job->slot * RDMA_LZ4_SLOT_SIZE;
+
+        while ((ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr)) == ENOMEM) {
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+            if (ret < 0) {
+                fprintf(stderr, "rdma migration: failed to make "
+                                "room in full send queue! %d\n", ret);
+                return ret;
+            }
+        }
+        if (ret > 0) {
+            perror("rdma migration: post rdma write failed");
+            return -ret;
         }
 
-        goto retry;
-
-    } else if (ret > 0) {
-        perror("rdma migration: post rdma write failed");
-        return -ret;
+        set_bit(chunk, block->transit_bitmap);
+        qemu_rdma_rail_posted(rdma, &rdma->rail[0], job->csize);
+        acct_update_position(f, job->length, false);
+        rdma->nb_sent++;
+        rdma->total_writes++;
+        rdma->stats.lz4_writes++;
+        rdma->stats.lz4_bytes += job->length;
+        RDMA_EVENT(LZ4, job->offset, job->csize);
+        qemu_rdma_pace(rdma, job->csize);
+
+        raw += job->length;
+        compressed += job->csize;
+        job->slot = htonl(job->slot);
+        job->block_idx = htonl(job->block_idx);
+        job->offset = htonll(job->offset);
+        job->length = htonl(job->length);
+        job->csize = htonl(job->csize);
+    }
+
+    head.len = lz4->nb_jobs * sizeof(RDMALZ4Job);
+    head.repeat = lz4->nb_jobs;
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) lz4->job,
+                                  NULL, NULL, NULL);
+    if (ret < 0) {
+        return ret;
     }
+    lz4->written = rdma->stats.control_sends;
+    lz4->half ^= 1;
+    qemu_rdma_lz4_reset(lz4);
 
-    set_bit(chunk, block->transit_bitmap);
-    acct_update_position(f, sge.length, false);
-    rdma->total_writes++;
+    ratio = (double) compressed / raw;
+    lz4->ratio = lz4->ratio ? (lz4->ratio * 3 + ratio) / 4 : ratio;
+    if (lz4->ratio > RDMA_LZ4_MAX_RATIO) {
+        DDPRINTF("LZ4 ratio %.2f, writing uncompressed\n", lz4->ratio);
+        lz4->raw_writes = RDMA_LZ4_RAW_WRITES;
+        lz4->ratio = 0;
+    }
 
     return 0;
 }
 
 /*
- * Push out any unwritten RDMA operations.
- *
- * We support sending out multiple chunks at the same time.
- * Not all of them need to get signaled in the completion queue.
+ * Source: called before writing a chunk uncompressed.  Older copies of
+ * its pages may still be on their way through the dest's ring, so once
+ * the last batch was sent, wait until the dest is done with it.
  */
-static int qemu_rdma_write_flush(QEMUFile *f, RDMAContext *rdma)
+static int qemu_rdma_lz4_drain(QEMUFile *f, RDMAContext *rdma)
 {
+    RDMALZ4 *lz4 = rdma->lz4;
+    RDMAControlHeader resp;
     int ret;
 
-    if (!rdma->current_length) {
-        return 0;
-    }
-
-    ret = qemu_rdma_write_one(f, rdma,
-            rdma->current_index, rdma->current_addr, rdma->current_length);
-
+    ret = qemu_rdma_lz4_flush(f, rdma);
     if (ret < 0) {
         return ret;
     }
 
-    if (ret == 0) {
-        rdma->nb_sent++;
-        DDDPRINTF("sent total: %d\n", rdma->nb_sent);
+    if (lz4->written == rdma->stats.control_sends &&
+        rdma->control_ready_expected) {
+        ret = qemu_rdma_exchange_get_response(rdma, &resp, RDMA_CONTROL_READY,
+                                              RDMA_WRID_READY);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
-    rdma->current_length = 0;
-    rdma->current_addr = 0;
-
     return 0;
 }
 
-static inline int qemu_rdma_buffer_mergable(RDMAContext *rdma,
-                    uint64_t offset, uint64_t len)
+/*
+ * Source: queue a write for compression.  Returns 1 if it was queued,
+ * 0 if it has to be written uncompressed, or a negative errno.
+ */
+static int qemu_rdma_lz4_write(QEMUFile *f, RDMAContext *rdma,
+                               int current_index, uint64_t current_addr,
+                               uint64_t length)
 {
-    RDMALocalBlock *block;
-    uint8_t *host_addr;
-    uint8_t *chunk_end;
+    RDMALZ4 *lz4 = rdma->lz4;
+    RDMALZ4Job *job;
+    int i, ret;
 
-    if (rdma->current_index < 0) {
-        return 0;
+    if (lz4->raw_writes || length > RDMA_LZ4_SLOT_RAW) {
+        if (lz4->raw_writes) {
+            lz4->raw_writes--;
+        }
+        ret = qemu_rdma_lz4_drain(f, rdma);
+        return ret < 0 ? ret : 0;
     }
 
-    if (rdma->current_chunk < 0) {
-        return 0;
+    /*
+     * The dest decompresses a batch in any order, so it must not hold
+     * two copies of the same page.
+     */
+    for (i = 0; i < lz4->nb_jobs; i++) {
+        job = &lz4->job[i];
+        if (job->block_idx == current_index &&
+            job->offset < current_addr + length &&
+            current_addr < job->offset + job->length) {
+            break;
+        }
+    }
+    if (i < lz4->nb_jobs || lz4->nb_jobs == RDMA_LZ4_SLOTS / 2) {
+        ret = qemu_rdma_lz4_flush(f, rdma);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
-    block = &(rdma->local_ram_blocks.block[rdma->current_index]);
-    host_addr = block->local_host_addr + (offset - block->offset);
-    chunk_end = ram_chunk_end(block, rdma->current_chunk);
+    qemu_mutex_lock(&lz4->lock);
+    job = &lz4->job[lz4->nb_jobs];
+    job->slot = lz4->half * (RDMA_LZ4_SLOTS / 2) + lz4->nb_jobs;
+    job->block_idx = current_index;
+    job->offset = current_addr;
+    job->length = length;
+    job->csize = 0;
+    lz4->nb_jobs++;
+    qemu_cond_signal(&lz4->work);
+    qemu_mutex_unlock(&lz4->lock);
 
-    if (rdma->current_length == 0) {
-        return 0;
+    return 1;
+}
+
+/*
+ * Dest: LZ4_RING_REQUEST.  A ring with no slots tells the source to
+ * send uncompressed.
+ */
+static int qemu_rdma_lz4_ring(RDMAContext *rdma)
+{
+    RDMAControlHeader head = { .len = sizeof(RDMALZ4Ring),
+                               .type = RDMA_CONTROL_LZ4_RING_RESULT,
+                               .repeat = 1 };
+    RDMALZ4Ring ring = { 0 };
+
+    if (!rdma->lz4) {
+        rdma->lz4 = qemu_rdma_lz4_new(rdma, true, rdma->compress ?
+                                      rdma->compress : RDMA_LZ4_THREADS);
+    }
+    if (rdma->lz4) {
+        ring.addr = htonll((uintptr_t) rdma->lz4->ring);
+        ring.rkey = htonl(rdma->lz4->mr->rkey);
+        ring.nb_slots = htonl(RDMA_LZ4_SLOTS);
     }
 
-    /*
-     * Only merge into chunk sequentially.
-     */
-    if (offset != (rdma->current_addr + rdma->current_length)) {
-        return 0;
+    return qemu_rdma_post_send_control(rdma, (uint8_t *) &ring, &head);
+}
+
+/*
+ * Dest: LZ4_WRITTEN, decompress the slots listed in 'jobs'.
+ */
+static int qemu_rdma_lz4_decompress(RDMAContext *rdma, RDMALZ4Job *jobs,
+                                    int nb_jobs)
+{
+    RDMALZ4 *lz4 = rdma->lz4;
+    RDMALocalBlock *block;
+    RDMALZ4Job *job;
+    int i;
+
+    if (!lz4 || nb_jobs > RDMA_LZ4_SLOTS / 2) {
+        return -EINVAL;
     }
 
-    if (offset < block->offset) {
-        return 0;
+    for (i = 0; i < nb_jobs; i++) {
+        job = &lz4->job[i];
+        job->slot = ntohl(jobs[i].slot);
+        job->block_idx = ntohl(jobs[i].block_idx);
+        job->offset = ntohll(jobs[i].offset);
+        job->length = ntohl(jobs[i].length);
+        job->csize = ntohl(jobs[i].csize);
+
+        if (job->slot >= RDMA_LZ4_SLOTS ||
+            job->block_idx >= rdma->local_ram_blocks.nb_blocks ||
+            job->length > RDMA_LZ4_SLOT_RAW ||
+            job->csize > RDMA_LZ4_SLOT_SIZE) {
+            return -EINVAL;
+        }
+        block = &rdma->local_ram_blocks.block[job->block_idx];
+        if (job->offset < block->offset ||
+            job->offset - block->offset + job->length > block->length) {
+            return -EINVAL;
+        }
+        rdma->stats.lz4_writes++;
+        rdma->stats.lz4_bytes += job->length;
+        RDMA_EVENT(LZ4, job->offset, job->csize);
     }
 
-    if ((offset + len) > (block->offset + block->length)) {
-        return 0;
+    qemu_mutex_lock(&lz4->lock);
+    lz4->nb_jobs = nb_jobs;
+    qemu_cond_broadcast(&lz4->work);
+    qemu_mutex_unlock(&lz4->lock);
+
+    i = qemu_rdma_lz4_wait(lz4);
+    qemu_rdma_lz4_reset(lz4);
+    if (i) {
+        fprintf(stderr, "rdma: %d LZ4 chunks failed to decompress\n", i);
+        return -EIO;
     }
 
-    if ((host_addr + len) > chunk_end) {
-        return 0;
+    return 0;
+}
+#endif
+
+static RDMADisk *qemu_rdma_disk_new(RDMAContext *rdma, bool dest)
+{
+    RDMADisk *disk = g_new0(RDMADisk, 1);
+    size_t size = RDMA_DISK_SLOTS * RDMA_DISK_SLOT_SIZE;
+
+    disk->rdma = rdma;
+    disk->ring = g_malloc(size);
+    disk->mr = ibv_reg_mr(rdma->pd, disk->ring, size, dest ?
+                          IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE :
+                          IBV_ACCESS_LOCAL_WRITE);
+    if (!disk->mr) {
+        perror("rdma migration: cannot register the disk ring");
+        g_free(disk->ring);
+        g_free(disk);
+        return NULL;
     }
+    rdma->total_registrations++;
 
-    return 1;
+    qemu_mutex_init(&disk->lock);
+    qemu_cond_init(&disk->done);
+
+    return disk;
 }
 
 /*
- * We're not actually writing here, but doing three things:
- *
- * 1. Identify the chunk the buffer belongs to.
- * 2. If the chunk is full or the buffer doesn't belong to the current
- *    chunk, then start a new chunk and flush() the old chunk.
- * 3. To keep the hardware busy, we also group chunks into batches
- *    and only require that a batch gets acknowledged in the completion
- *    qeueue instead of each individual chunk.
+ * Dest: wait for the disk writes in flight, returns -EIO if any failed
+ * since the last call.  Their completions run in the main loop: the recv
+ * thread sleeps until they are done, the loadvm coroutine drains them.
  */
-static int qemu_rdma_write(QEMUFile *f, RDMAContext *rdma,
-                           uint64_t block_offset, uint64_t offset,
-                           uint64_t len)
+static int qemu_rdma_disk_wait(RDMAContext *rdma)
 {
-    uint64_t current_addr = block_offset + offset;
-    uint64_t index = rdma->current_index;
-    uint64_t chunk = rdma->current_chunk;
-    int ret;
+    RDMADisk *disk = rdma->disk;
+    int errors;
 
-    /* If we cannot merge it, we flush the current buffer first. */
-    if (!qemu_rdma_buffer_mergable(rdma, current_addr, len)) {
-        ret = qemu_rdma_write_flush(f, rdma);
-        if (ret) {
-            return ret;
-        }
-        rdma->current_length = 0;
-        rdma->current_addr = current_addr;
+    if (!disk) {
+        return 0;
+    }
 
-        ret = qemu_rdma_search_ram_block(rdma, block_offset,
-                                         offset, len, &index, &chunk);
-        if (ret) {
-            fprintf(stderr, "ram block search failed\n");
-            return ret;
+    qemu_mutex_lock(&disk->lock);
+    if (rdma->recv && qemu_thread_is_self(&rdma->recv->thread)) {
+        while (disk->inflight) {
+            qemu_cond_wait(&disk->done, &disk->lock);
         }
-        rdma->current_index = index;
-        rdma->current_chunk = chunk;
+    } else if (disk->inflight) {
+        qemu_mutex_unlock(&disk->lock);
+        bdrv_drain_all();
+        qemu_mutex_lock(&disk->lock);
     }
+    errors = disk->errors;
+    disk->errors = 0;
+    qemu_mutex_unlock(&disk->lock);
 
-    /* merge it */
-    rdma->current_length += len;
+    if (errors) {
+        fprintf(stderr, "rdma: %d disk chunks failed to write\n", errors);
+        return -EIO;
+    }
+    return 0;
+}
 
-    /* flush it if buffer is too large */
-    if (rdma->current_length >= RDMA_MERGE_MAX) {
-        return qemu_rdma_write_flush(f, rdma);
+static void qemu_rdma_disk_free(RDMAContext *rdma)
+{
+    RDMADisk *disk = rdma->disk;
+
+    if (!disk) {
+        return;
+    }
+
+    /* the ring must outlive the writes from it */
+    qemu_rdma_disk_wait(rdma);
+
+    qemu_cond_destroy(&disk->done);
+    qemu_mutex_destroy(&disk->lock);
+    ibv_dereg_mr(disk->mr);
+    rdma->total_registrations--;
+    g_free(disk->ring);
+    g_free(disk);
+    rdma->disk = NULL;
+}
+
+/*
+ * Source: ask the dest for its landing ring, on the first disk chunk.
+ * The chunks go in the stream rather than failing the migration if
+ * either side cannot set up its ring.
+ */
+static int qemu_rdma_disk_start(RDMAContext *rdma)
+{
+    RDMAControlHeader head = { .len = 0,
+                               .type = RDMA_CONTROL_DISK_RING_REQUEST,
+                               .repeat = 1 };
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_DISK_RING_RESULT };
+    RDMADiskRing *ring;
+    int idx, ret;
+
+    rdma->disk = qemu_rdma_disk_new(rdma, false);
+    if (!rdma->disk) {
+        rdma->disk_writes = false;
+        return 0;
     }
 
+    ret = qemu_rdma_exchange_send(rdma, &head, NULL, &resp, &idx, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    if (resp.len != sizeof(RDMADiskRing)) {
+        return -EIO;
+    }
+
+    ring = (RDMADiskRing *) rdma->wr_data[idx].control_curr;
+    if (ntohl(ring->nb_slots) != RDMA_DISK_SLOTS) {
+        fprintf(stderr, "rdma: dest has no disk ring, "
+                        "will send disk chunks in the stream.\n");
+        qemu_rdma_disk_free(rdma);
+        rdma->disk_writes = false;
+        return 0;
+    }
+    rdma->disk->remote_addr = ntohll(ring->addr);
+    rdma->disk->remote_rkey = ntohl(ring->rkey);
+
     return 0;
 }
 
-static void qemu_rdma_cleanup(RDMAContext *rdma)
+/*
+ * Source: write the batch of disk chunks to the dest's ring and tell it
+ * which slots to write to disk.  The dest is done with the other half
+ * of the ring once it is READY after this, see qemu_rdma_save_disk().
+ */
+static int qemu_rdma_disk_flush(RDMAContext *rdma)
 {
+    RDMADisk *disk = rdma->disk;
+    RDMAControlHeader head = { .type = RDMA_CONTROL_DISK_WRITTEN };
+    struct ibv_send_wr send_wr = { 0 };
+    struct ibv_send_wr *bad_wr;
+    struct ibv_sge sge;
+    RDMADiskJob *job;
+    int i, ret;
 
-    struct rdma_cm_event *cm_event;
-    int ret, idx;
+    if (!disk || !disk->nb_jobs) {
+        return 0;
+    }
 
-    if (rdma->cm_id && rdma->connected) {
-        if (rdma->error_state) {
-            RDMAControlHeader head = { .len = 0,
-                                       .type = RDMA_CONTROL_ERROR,
-                                       .repeat = 1,
-                                     };
-            fprintf(stderr, "Early error. Sending error.\n");
-            qemu_rdma_post_send_control(rdma, NULL, &head);
-        }
+    send_wr.opcode = IBV_WR_RDMA_WRITE;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.sg_list = &sge;
+    send_wr.num_sge = 1;
+    send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
+                                        RDMA_WRID_DISK_INDEX, 0);
+    send_wr.wr.rdma.rkey = disk->remote_rkey;
+    sge.lkey = disk->mr->lkey;
 
-        ret = rdma_disconnect(rdma->cm_id);
-        if (!ret) {
-            DDPRINTF("waiting for disconnect\n");
-            ret = rdma_get_cm_event(rdma->channel, &cm_event);
-            if (!ret) {
-                rdma_ack_cm_event(cm_event);
+    for (i = 0; i < disk->nb_jobs; i++) {
+        job = &disk->job[i];
+
+        sge.addr = (uintptr_t) (disk->ring +
+                                (uint64_t) job->slot * RDMA_DISK_SLOT_SIZE);
+        sge.length = job->nb_sectors * BDRV_SECTOR_SIZE;
+        send_wr.wr.rdma.remote_addr = disk->remote_addr +
+                                (uint64_t) job->slot * RDMA_DISK_SLOT_SIZE;
+
+        while ((ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr)) == ENOMEM) {
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+            if (ret < 0) {
+                fprintf(stderr, "rdma migration: failed to make "
+                                "room in full send queue! %d\n", ret);
+                return ret;
             }
         }
-        DDPRINTF("Disconnected.\n");
-        rdma->connected = false;
+        if (ret > 0) {
+            perror("rdma migration: post rdma write failed");
+            return -ret;
+        }
+
+        qemu_rdma_rail_posted(rdma, &rdma->rail[0], sge.length);
+        rdma->nb_sent++;
+        rdma->total_writes++;
+        rdma->stats.disk_writes++;
+        rdma->stats.disk_bytes += sge.length;
+        RDMA_EVENT(DISK, job->sector, sge.length);
+        qemu_rdma_pace(rdma, sge.length);
+
+        job->sector = htonll(job->sector);
+        job->nb_sectors = htonl(job->nb_sectors);
+        job->slot = htonl(job->slot);
     }
 
-    g_free(rdma->block);
-    rdma->block = NULL;
+    head.len = disk->nb_jobs * sizeof(RDMADiskJob);
+    head.repeat = disk->nb_jobs;
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) disk->job,
+                                  NULL, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    disk->written = rdma->stats.control_sends;
+    disk->half ^= 1;
+    disk->nb_jobs = 0;
 
-    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
-        if (rdma->wr_data[idx].control_mr) {
-            rdma->total_registrations--;
-            ibv_dereg_mr(rdma->wr_data[idx].control_mr);
+    return 0;
+}
+
+/*
+ * Source: queue 'nb_sectors' sectors of 'device' from 'sector' on, in
+ * 'buf', for a write to the dest's ring.
+ */
+static int qemu_rdma_save_disk(QEMUFile *f, RDMAContext *rdma,
+                               const char *device, int64_t sector,
+                               const uint8_t *buf, int nb_sectors)
+{
+    RDMADisk *disk;
+    RDMADiskJob *job;
+    RDMAControlHeader resp;
+    uint64_t len = (uint64_t) nb_sectors * BDRV_SECTOR_SIZE;
+    int ret;
+
+    CHECK_ERROR_STATE();
+
+    if (!rdma->disk) {
+        ret = qemu_rdma_disk_start(rdma);
+        if (ret < 0) {
+            goto err;
+        }
+        if (!rdma->disk_writes) {
+            return -ENOTSUP;
         }
-        rdma->wr_data[idx].control_mr = NULL;
     }
+    disk = rdma->disk;
 
-    if (rdma->local_ram_blocks.block) {
-        while (rdma->local_ram_blocks.nb_blocks) {
-            __qemu_rdma_delete_block(rdma,
-                    rdma->local_ram_blocks.block->offset);
+    if (disk->nb_jobs == RDMA_DISK_SLOTS / 2) {
+        ret = qemu_rdma_disk_flush(rdma);
+        if (ret < 0) {
+            goto err;
         }
     }
 
-    if (rdma->cq) {
-        ibv_destroy_cq(rdma->cq);
-        rdma->cq = NULL;
-    }
-    if (rdma->comp_channel) {
-        ibv_destroy_comp_channel(rdma->comp_channel);
-        rdma->comp_channel = NULL;
-    }
-    if (rdma->pd) {
-        ibv_dealloc_pd(rdma->pd);
-        rdma->pd = NULL;
-    }
-    if (rdma->listen_id) {
-        rdma_destroy_id(rdma->listen_id);
-        rdma->listen_id = NULL;
-    }
-    if (rdma->cm_id) {
-        if (rdma->qp) {
-            rdma_destroy_qp(rdma->cm_id);
-            rdma->qp = NULL;
+    /*
+     * Before filling a half of the ring again, make sure the dest took
+     * the last batch, which it only does once the writes from this half
+     * are done.  Any message sent since had to wait for that already.
+     */
+    if (!disk->nb_jobs && disk->written == rdma->stats.control_sends &&
+        rdma->control_ready_expected) {
+        ret = qemu_rdma_exchange_get_response(rdma, &resp, RDMA_CONTROL_READY,
+                                              RDMA_WRID_READY);
+        if (ret < 0) {
+            goto err;
         }
-        rdma_destroy_id(rdma->cm_id);
-        rdma->cm_id = NULL;
-    }
-    if (rdma->channel) {
-        rdma_destroy_event_channel(rdma->channel);
-        rdma->channel = NULL;
     }
-    g_free(rdma->host);
-    rdma->host = NULL;
-}
 
+    job = &disk->job[disk->nb_jobs++];
+    strncpy(job->device, device, sizeof(job->device));
+    job->sector = sector;
+    job->nb_sectors = nb_sectors;
+    job->slot = disk->half * (RDMA_DISK_SLOTS / 2) + disk->nb_jobs - 1;
+    memcpy(disk->ring + (uint64_t) job->slot * RDMA_DISK_SLOT_SIZE, buf, len);
 
-static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all)
-{
-    DTPRINTF("%s\n", __func__);
-    int ret, idx;
-    Error *local_err = NULL, **temp = &local_err;
+    /* the bytes count against the rate limit as if they were in the stream */
+    qemu_update_position(f, len);
 
-    /*
-     * Will be validated against destination's actual capabilities
-     * after the connect() completes.
-     */
-    rdma->pin_all = pin_all;
+    return 0;
 
-    ret = qemu_rdma_resolve_host(rdma, temp);
-    if (ret) {
-        goto err_rdma_source_init;
+err:
+    rdma->error_state = ret;
+    return ret;
+}
+
+/*
+ * Dest: DISK_RING_REQUEST.  A ring with no slots tells the source to
+ * send its disk chunks in the stream.
+ */
+static int qemu_rdma_disk_ring(RDMAContext *rdma)
+{
+    RDMAControlHeader head = { .len = sizeof(RDMADiskRing),
+                               .type = RDMA_CONTROL_DISK_RING_RESULT,
+                               .repeat = 1 };
+    RDMADiskRing ring = { 0 };
+
+    if (!rdma->disk) {
+        rdma->disk = qemu_rdma_disk_new(rdma, true);
+    }
+    if (rdma->disk) {
+        ring.addr = htonll((uintptr_t) rdma->disk->ring);
+        ring.rkey = htonl(rdma->disk->mr->rkey);
+        ring.nb_slots = htonl(RDMA_DISK_SLOTS);
     }
 
-    ret = qemu_rdma_alloc_pd_cq(rdma);
-    if (ret) {
-        ERROR(temp, "rdma migration: error allocating pd and cq! Your mlock()"
-                    " limits may be too low. Please check $ ulimit -a # and "
-                    "search for 'ulimit -l' in the output");
-        goto err_rdma_source_init;
+    return qemu_rdma_post_send_control(rdma, (uint8_t *) &ring, &head);
+}
+
+static void qemu_rdma_disk_complete(void *opaque, int ret)
+{
+    RDMADisk *disk = opaque;
+
+    qemu_mutex_lock(&disk->lock);
+    if (ret < 0) {
+        disk->errors++;
+    }
+    if (!--disk->inflight) {
+        qemu_cond_broadcast(&disk->done);
     }
+    qemu_mutex_unlock(&disk->lock);
+}
 
-    ret = qemu_rdma_alloc_qp(rdma);
-    if (ret) {
-        ERROR(temp, "rdma migration: error allocating qp!");
-        goto err_rdma_source_init;
+/*
+ * Dest: DISK_WRITTEN, write the slots listed in 'jobs' to disk.  The
+ * writes of the last batch, from the other half of the ring, are waited
+ * for first, so that the READY after this tells the source it can fill
+ * that half again.
+ */
+static int qemu_rdma_disk_write(RDMAContext *rdma, RDMADiskJob *jobs,
+                                int nb_jobs)
+{
+    RDMADisk *disk = rdma->disk;
+    bool on_thread = rdma->recv && qemu_thread_is_self(&rdma->recv->thread);
+    BlockDriverState *bs;
+    BlockDriverAIOCB *acb;
+    RDMADiskJob *job;
+    uint32_t slot, nb_sectors;
+    int64_t sector;
+    int i, ret;
+
+    if (!disk || nb_jobs > RDMA_DISK_SLOTS / 2) {
+        return -EINVAL;
     }
 
-    ret = qemu_rdma_init_ram_blocks(rdma);
-    if (ret) {
-        ERROR(temp, "rdma migration: error initializing ram blocks!");
-        goto err_rdma_source_init;
+    ret = qemu_rdma_disk_wait(rdma);
+    if (ret < 0) {
+        return ret;
     }
 
-    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
-        ret = qemu_rdma_reg_control(rdma, idx);
-        if (ret) {
-            ERROR(temp, "rdma migration: error registering %d control!",
-                                                            idx);
-            goto err_rdma_source_init;
+    for (i = 0; i < nb_jobs; i++) {
+        job = &jobs[i];
+        slot = ntohl(job->slot);
+        nb_sectors = ntohl(job->nb_sectors);
+        sector = ntohll(job->sector);
+        if (slot >= RDMA_DISK_SLOTS ||
+            nb_sectors > RDMA_DISK_SLOT_SIZE / BDRV_SECTOR_SIZE ||
+            !memchr(job->device, 0, sizeof(job->device))) {
+            return -EINVAL;
+        }
+
+        if (on_thread) {
+            qemu_mutex_lock_iothread();
+        }
+        bs = bdrv_find(job->device);
+        if (!bs) {
+            if (on_thread) {
+                qemu_mutex_unlock_iothread();
+            }
+            fprintf(stderr, "rdma: unknown disk %s\n", job->device);
+            return -EINVAL;
+        }
+
+        disk->iov[slot].iov_base = disk->ring +
+                                   (uint64_t) slot * RDMA_DISK_SLOT_SIZE;
+        disk->iov[slot].iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&disk->qiov[slot], &disk->iov[slot], 1);
+
+        qemu_mutex_lock(&disk->lock);
+        disk->inflight++;
+        qemu_mutex_unlock(&disk->lock);
+        acb = bdrv_aio_writev(bs, sector, &disk->qiov[slot], nb_sectors,
+                              qemu_rdma_disk_complete, disk);
+        if (on_thread) {
+            qemu_mutex_unlock_iothread();
+        }
+        if (!acb) {
+            qemu_rdma_disk_complete(disk, -EIO);
         }
+
+        rdma->stats.disk_writes++;
+        rdma->stats.disk_bytes += (uint64_t) nb_sectors * BDRV_SECTOR_SIZE;
+        RDMA_EVENT(DISK, sector, (uint64_t) nb_sectors * BDRV_SECTOR_SIZE);
     }
 
     return 0;
+}
 
-err_rdma_source_init:
-    error_propagate(errp, local_err);
-    qemu_rdma_cleanup(rdma);
-    return -1;
+/*
+ * Whether any of the chunks 'length' bytes at 'host_addr' of 'block'
+ * span is registered.
+ */
+static bool qemu_rdma_pinned(RDMALocalBlock *block, uint8_t *host_addr,
+                             uint64_t length)
+{
+    uint64_t chunk, end;
+
+    if (block->mr) {
+        return true;
+    }
+    if (block->pmr && length) {
+        end = ram_chunk_index(block->local_host_addr, host_addr + length - 1);
+        for (chunk = ram_chunk_index(block->local_host_addr, host_addr);
+             chunk <= end; chunk++) {
+            if (block->pmr[chunk]) {
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
+static void qemu_rdma_fill_range(uint8_t *start, uint64_t length,
+                                 uint8_t value, bool pinned)
 {
-    DTPRINTF("%s\n", __func__);
-    RDMACapabilities cap = {
-                                .version = RDMA_CONTROL_VERSION_CURRENT,
-                                .flags = 0,
-                           };
-    struct rdma_conn_param conn_param = { .initiator_depth = 2,
-                                          .retry_count = 5,
-                                          .private_data = &cap,
-                                          .private_data_len = sizeof(cap),
-                                        };
-    struct rdma_cm_event *cm_event;
-    int ret;
+    long pagesize = getpagesize();
 
     /*
-     * Only negotiate the capability with destination if the user
-     * on the source first requested the capability.
+     * Have the kernel drop pages that are not zero yet instead of
+     * writing zeroes over them.  ram_handle_compressed() still checks:
+     * shared mappings keep their contents.
      */
-    if (rdma->pin_all) {
-        DPRINTF("Server pin-all memory requested.\n");
-        cap.flags |= RDMA_CAPABILITY_PIN_ALL;
-    }
-
-    caps_to_network(&cap);
-
-    ret = rdma_connect(rdma->cm_id, &conn_param);
-    if (ret) {
-        perror("rdma_connect");
-        ERROR(errp, "connecting to destination!");
-        rdma_destroy_id(rdma->cm_id);
-        rdma->cm_id = NULL;
-        goto err_rdma_source_connect;
-    }
+    if (!value && !pinned &&
+        !((uintptr_t) start & (pagesize - 1)) &&
+        !(length & (pagesize - 1)) &&
+        can_use_buffer_find_nonzero_offset(start, length) &&
+        buffer_find_nonzero_offset(start, length) != length) {
+        madvise(start, length, MADV_DONTNEED);
+    }
+    ram_handle_compressed(start, value, length);
+}
 
-    ret = rdma_get_cm_event(rdma->channel, &cm_event);
-    if (ret) {
-        perror("rdma_get_cm_event after rdma_connect");
-        ERROR(errp, "connecting to destination!");
-        rdma_ack_cm_event(cm_event);
-        rdma_destroy_id(rdma->cm_id);
-        rdma->cm_id = NULL;
-        goto err_rdma_source_connect;
-    }
+static void qemu_rdma_worker_fill(RDMAWorkerJob *job)
+{
+    qemu_rdma_fill_range(job->start, job->length, job->value, job->pinned);
+}
 
-    if (cm_event->event != RDMA_CM_EVENT_ESTABLISHED) {
-        perror("rdma_get_cm_event != EVENT_ESTABLISHED after rdma_connect");
-        ERROR(errp, "connecting to destination!");
-        rdma_ack_cm_event(cm_event);
-        rdma_destroy_id(rdma->cm_id);
-        rdma->cm_id = NULL;
-        goto err_rdma_source_connect;
-    }
-    rdma->connected = true;
+static void *qemu_rdma_worker_thread(void *opaque)
+{
+    RDMAWorkers *workers = opaque;
+    RDMAWorkerJob *job;
+    int64_t start;
+
+    qemu_mutex_lock(&workers->lock);
+    while (true) {
+        while (!workers->quit && workers->next == workers->nb_jobs) {
+            qemu_cond_wait(&workers->work, &workers->lock);
+        }
+        if (workers->quit) {
+            break;
+        }
+        job = &workers->job[workers->next++];
+        qemu_mutex_unlock(&workers->lock);
 
-    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
-    network_to_caps(&cap);
+        if (job->type == RDMA_CONTROL_COMPRESS) {
+            qemu_rdma_worker_fill(job);
+        } else {
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            job->mr = ibv_reg_mr(workers->rdma->pd, job->start, job->length,
+                                 IBV_ACCESS_LOCAL_WRITE |
+                                 IBV_ACCESS_REMOTE_WRITE);
+            job->ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+        }
 
-    /*
-     * Verify that the *requested* capabilities are supported by the destination
-     * and disable them otherwise.
-     */
-    if (rdma->pin_all && !(cap.flags & RDMA_CAPABILITY_PIN_ALL)) {
-        ERROR(errp, "Server cannot support pinning all memory. "
-                        "Will register memory dynamically.");
-        rdma->pin_all = false;
+        qemu_mutex_lock(&workers->lock);
+        if (++workers->done == workers->nb_jobs) {
+            qemu_cond_signal(&workers->finished);
+        }
     }
+    qemu_mutex_unlock(&workers->lock);
 
-    DPRINTF("Pin all memory: %s\n", rdma->pin_all ? "enabled" : "disabled");
+    return NULL;
+}
 
-    rdma_ack_cm_event(cm_event);
+static RDMAWorkers *qemu_rdma_workers_new(RDMAContext *rdma, int threads)
+{
+    RDMAWorkers *workers = g_new0(RDMAWorkers, 1);
+    int i;
 
-    ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
-    if (ret) {
-        ERROR(errp, "posting second control recv!");
-        goto err_rdma_source_connect;
+    workers->rdma = rdma;
+    qemu_mutex_init(&workers->lock);
+    qemu_cond_init(&workers->work);
+    qemu_cond_init(&workers->finished);
+    for (i = 0; i < threads; i++) {
+        qemu_thread_create(&workers->thread[i], "rdma worker",
+                           qemu_rdma_worker_thread, workers,
+                           QEMU_THREAD_JOINABLE);
     }
+    workers->nb_threads = threads;
 
-    rdma->control_ready_expected = 1;
-    rdma->nb_sent = 0;
-    return 0;
-
-err_rdma_source_connect:
-    qemu_rdma_cleanup(rdma);
-    return -1;
+    return workers;
 }
 
-static int qemu_rdma_dest_init(RDMAContext *rdma, Error **errp)
+static void qemu_rdma_workers_free(RDMAContext *rdma)
 {
-    DTPRINTF("%s\n", __func__);
-    int ret = -EINVAL, idx;
-    struct rdma_cm_id *listen_id;
-    char ip[40] = "unknown";
-    struct rdma_addrinfo *res;
-    char port_str[16];
+    RDMAWorkers *workers = rdma->workers;
+    int i;
 
-    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
-        rdma->wr_data[idx].control_len = 0;
-        rdma->wr_data[idx].control_curr = NULL;
+    if (!workers) {
+        return;
     }
 
-    if (rdma->host == NULL) {
-        ERROR(errp, "RDMA host is not set!");
-        rdma->error_state = -EINVAL;
-        return -1;
-    }
-    /* create CM channel */
-    rdma->channel = rdma_create_event_channel();
-    if (!rdma->channel) {
-        ERROR(errp, "could not create rdma event channel");
-        rdma->error_state = -EINVAL;
-        return -1;
+    qemu_mutex_lock(&workers->lock);
+    workers->quit = true;
+    qemu_cond_broadcast(&workers->work);
+    qemu_mutex_unlock(&workers->lock);
+    for (i = 0; i < workers->nb_threads; i++) {
+        qemu_thread_join(&workers->thread[i]);
     }
 
-    /* create CM id */
-    ret = rdma_create_id(rdma->channel, &listen_id, NULL, RDMA_PS_TCP);
-    if (ret) {
-        ERROR(errp, "could not create cm_id!");
-        goto err_dest_init_create_listen_id;
+    /* registrations that were never handed out */
+    for (i = 0; i < workers->done; i++) {
+        if (workers->job[i].mr) {
+            ibv_dereg_mr(workers->job[i].mr);
+        }
     }
 
-    snprintf(port_str, 16, "%d", rdma->port);
-    port_str[15] = '\0';
+    qemu_cond_destroy(&workers->finished);
+    qemu_cond_destroy(&workers->work);
+    qemu_mutex_destroy(&workers->lock);
+    g_free(workers);
+    rdma->workers = NULL;
+}
 
-    if (rdma->host && strcmp("", rdma->host)) {
-        struct rdma_addrinfo *e;
+/*
+ * Wait for all the jobs handed to the workers, and record the chunks
+ * they registered.  Returns -EINVAL if one could not be.
+ */
+static int qemu_rdma_workers_wait(RDMAContext *rdma)
+{
+    RDMAWorkers *workers = rdma->workers;
+    RDMAWorkerJob *job;
+    RDMALocalBlock *block;
+    int i, ret = 0;
 
-        ret = rdma_getaddrinfo(rdma->host, port_str, NULL, &res);
-        if (ret < 0) {
-            ERROR(errp, "could not rdma_getaddrinfo address %s", rdma->host);
-            goto err_dest_init_bind_addr;
-        }
+    if (!workers) {
+        return 0;
+    }
 
-        for (e = res; e != NULL; e = e->ai_next) {
-            inet_ntop(e->ai_family,
-                &((struct sockaddr_in *) e->ai_dst_addr)->sin_addr, ip, sizeof ip);
-            DPRINTF("Trying %s => %s\n", rdma->host, ip);
-            ret = rdma_bind_addr(listen_id, e->ai_dst_addr);
-            if (!ret) {
-                if (e->ai_family == AF_INET6) {
-                    ret = qemu_rdma_broken_ipv6_kernel(errp, listen_id->verbs);
-                    if (ret) {
-                        continue;
-                    }
-                }
-                    
-                goto listen;
-            }
-        }
+    qemu_mutex_lock(&workers->lock);
+    while (workers->done < workers->nb_jobs) {
+        qemu_cond_wait(&workers->finished, &workers->lock);
+    }
 
-        ERROR(errp, "Error: could not rdma_bind_addr!");
-        goto err_dest_init_bind_addr;
-    } else {
-        ERROR(errp, "migration host and port not specified!");
-        ret = -EINVAL;
-        goto err_dest_init_bind_addr;
+    for (i = 0; i < workers->nb_jobs; i++) {
+        job = &workers->job[i];
+        if (job->type != RDMA_CONTROL_REGISTER_REQUEST) {
+            continue;
+        }
+        block = job->block;
+        qemu_rdma_hist_add(&rdma->stats.registration, job->ns);
+        rdma->stats.registrations++;
+        RDMA_EVENT(REGISTER, job->start, job->length);
+        if (!job->mr) {
+            perror("Failed to register chunk!");
+            fprintf(stderr, "Chunk details: block: %d chunk index %" PRIu64
+                            " start %p length %" PRIu64 "\n",
+                            block->index, job->chunk, job->start,
+                            job->length);
+            ret = -EINVAL;
+            continue;
+        }
+        if (block->pmr[job->chunk]) {
+            /* asked for twice in the batch */
+            ibv_dereg_mr(job->mr);
+        } else {
+            block->pmr[job->chunk] = job->mr;
+            rdma->total_registrations++;
+        }
+        job->mr = NULL;
+        *job->rkey = block->pmr[job->chunk]->rkey;
     }
-listen:
 
-    rdma->listen_id = listen_id;
-    qemu_rdma_dump_gid("dest_init", listen_id);
-    return 0;
+    workers->nb_jobs = 0;
+    workers->next = 0;
+    workers->done = 0;
+    qemu_mutex_unlock(&workers->lock);
 
-err_dest_init_bind_addr:
-    rdma_destroy_id(listen_id);
-err_dest_init_create_listen_id:
-    rdma_destroy_event_channel(rdma->channel);
-    rdma->channel = NULL;
-    rdma->error_state = ret;
     return ret;
-
 }
 
-static void *qemu_rdma_data_init(const char *host_port, Error **errp)
+static int qemu_rdma_workers_add(RDMAContext *rdma, RDMAWorkerJob *job)
 {
-    DTPRINTF("%s\n", __func__);
-    RDMAContext *rdma = NULL;
-    InetSocketAddress *addr;
-
-    if (host_port) {
-        rdma = g_malloc0(sizeof(RDMAContext));
-        memset(rdma, 0, sizeof(RDMAContext));
-        rdma->current_index = -1;
-        rdma->current_chunk = -1;
-
-        addr = inet_parse(host_port, NULL);
-        if (addr != NULL) {
-            rdma->port = atoi(addr->port);
-            rdma->host = g_strdup(addr->host);
-        } else {
-            ERROR(errp, "bad RDMA migration address '%s'", host_port);
-            g_free(rdma);
-            rdma = NULL;
-        }
+    RDMAWorkers *workers = rdma->workers;
+    int ret = 0;
 
-        qapi_free_InetSocketAddress(addr);
+    if (workers->nb_jobs == RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE) {
+        ret = qemu_rdma_workers_wait(rdma);
     }
 
-    return rdma;
+    qemu_mutex_lock(&workers->lock);
+    workers->job[workers->nb_jobs++] = *job;
+    qemu_cond_signal(&workers->work);
+    qemu_mutex_unlock(&workers->lock);
+
+    return ret;
 }
 
 /*
- * QEMUFile interface to the control channel.
- * SEND messages for control only.
- * pc.ram is handled with regular RDMA messages.
+ * Dest: fill the range of a COMPRESS request, with the workers if there
+ * are any.
  */
-static int qemu_rdma_put_buffer(void *opaque, const uint8_t *buf,
-                                int64_t pos, int size)
+static int qemu_rdma_zero_fill(RDMAContext *rdma, RDMALocalBlock *block,
+                               uint8_t *host_addr, uint8_t value,
+                               uint64_t length)
 {
-
-    QEMUFileRDMA *r = opaque;
-    QEMUFile *f = r->file;
-    RDMAContext *rdma = r->rdma;
-    size_t remaining = size;
-    uint8_t * data = (void *) buf;
-    int ret;
-
-    CHECK_ERROR_STATE();
-
-    /*
-     * Push out any writes that
-     * we're queued up for pc.ram.
-     */
-    ret = qemu_rdma_write_flush(f, rdma);
-    if (ret < 0) {
-        rdma->error_state = ret;
-        return ret;
-    }
-
-    while (remaining) {
-        RDMAControlHeader head;
-
-        r->len = MIN(remaining, RDMA_SEND_INCREMENT);
-        remaining -= r->len;
-
-        head.len = r->len;
-        head.type = RDMA_CONTROL_QEMU_FILE;
-
-        ret = qemu_rdma_exchange_send(rdma, &head, data, NULL, NULL, NULL);
-
-        if (ret < 0) {
-            rdma->error_state = ret;
-            return ret;
-        }
-
-        data += r->len;
+    RDMAWorkerJob job = { .type = RDMA_CONTROL_COMPRESS,
+                          .block = block,
+                          .start = host_addr,
+                          .length = length,
+                          .value = value };
+
+    if (!rdma->workers) {
+        ram_handle_compressed(host_addr, value, length);
+        return 0;
     }
 
-    return size;
+    job.pinned = qemu_rdma_pinned(block, host_addr, length);
+    return qemu_rdma_workers_add(rdma, &job);
 }
 
-static size_t qemu_rdma_fill(RDMAContext *rdma, uint8_t *buf,
-                             int size, int idx)
+/*
+ * Dest: register a chunk for a REGISTER_REQUEST and put its rkey in
+ * 'rkey'.  With workers, that is only done once qemu_rdma_workers_wait()
+ * returns.
+ */
+static int qemu_rdma_register_dest(RDMAContext *rdma, RDMALocalBlock *block,
+                                   uint8_t *host_addr, uint32_t *rkey,
+                                   uint64_t chunk, uint8_t *chunk_start,
+                                   uint8_t *chunk_end)
 {
-    size_t len = 0;
+    RDMAWorkerJob job = { .type = RDMA_CONTROL_REGISTER_REQUEST,
+                          .block = block,
+                          .start = chunk_start,
+                          .length = chunk_end - chunk_start,
+                          .chunk = chunk,
+                          .rkey = rkey };
 
-    if (rdma->wr_data[idx].control_len) {
-        DDDPRINTF("RDMA %" PRId64 " of %d bytes already in buffer\n",
-                    rdma->wr_data[idx].control_len, size);
+    if (!rdma->workers || block->mr) {
+        return qemu_rdma_register_and_get_keys(rdma, block, host_addr, NULL,
+                                               rkey, chunk, chunk_start,
+                                               chunk_end);
+    }
 
-        len = MIN(size, rdma->wr_data[idx].control_len);
-        memcpy(buf, rdma->wr_data[idx].control_curr, len);
-        rdma->wr_data[idx].control_curr += len;
-        rdma->wr_data[idx].control_len -= len;
+    if (!block->pmr) {
+        block->pmr = g_malloc0(block->nb_chunks * sizeof(struct ibv_mr *));
+    }
+    if (block->pmr[chunk]) {
+        *rkey = block->pmr[chunk]->rkey;
+        return 0;
     }
 
-    return len;
+    return qemu_rdma_workers_add(rdma, &job);
 }
 
 /*
- * QEMUFile interface to the control channel.
- * RDMA links don't use bytestreams, so we have to
- * return bytes to QEMUFile opportunistically.
+ * Write an actual chunk of memory using RDMA.
+ *
+ * If we're using dynamic registration on the dest-side, we have to
+ * send a registration command first.
  */
-static int qemu_rdma_get_buffer(void *opaque, uint8_t *buf,
-                                int64_t pos, int size)
+static int qemu_rdma_write_one(QEMUFile *f, RDMAContext *rdma,
+                               int current_index, uint64_t current_addr,
+                               uint64_t length)
 {
-    QEMUFileRDMA *r = opaque;
-    RDMAContext *rdma = r->rdma;
-    RDMAControlHeader head;
-    int ret = 0;
-
+    struct ibv_sge sge;
+    struct ibv_send_wr send_wr = { 0 };
+    struct ibv_send_wr *bad_wr;
+    int reg_result_idx, ret, count = 0;
+    uint64_t chunk, chunks;
+    uint8_t *chunk_start, *chunk_end;
+    RDMALocalBlock *block = &(rdma->local_ram_blocks.block[current_index]);
+    RDMARegister reg;
+    RDMARegisterResult *reg_result;
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_REGISTER_RESULT };
+    RDMAControlHeader head = { .len = sizeof(RDMARegister),
+                               .type = RDMA_CONTROL_REGISTER_REQUEST,
+                               .repeat = 1,
+                             };
+    struct ibv_qp *qp;
+    int64_t stall_start;
+    int rail;
+
+#ifdef CONFIG_LZ4
+    if (rdma->lz4) {
+        ret = qemu_rdma_lz4_write(f, rdma, current_index, current_addr,
+                                  length);
+        if (ret) {
+            return ret;
+        }
+    }
+#endif
+
+retry:
+    sge.addr = (uint64_t)(block->local_host_addr +
+                            (current_addr - block->offset));
+    sge.length = length;
+
+    chunk = ram_chunk_index(block->local_host_addr, (uint8_t *) sge.addr);
+    chunk_start = ram_chunk_start(block, chunk);
+
+    if (block->is_ram_block) {
+        chunks = length / (1UL << RDMA_REG_CHUNK_SHIFT);
+
+        if (chunks && ((length % (1UL << RDMA_REG_CHUNK_SHIFT)) == 0)) {
+            chunks--;
+        }
+    } else {
+        chunks = block->length / (1UL << RDMA_REG_CHUNK_SHIFT);
+
+        if (chunks && ((block->length % (1UL << RDMA_REG_CHUNK_SHIFT)) == 0)) {
+            chunks--;
+        }
+    }
+
+    DDPRINTF("Writing %" PRIu64 " chunks, (%" PRIu64 " MB)\n",
+        chunks + 1, (chunks + 1) * (1UL << RDMA_REG_CHUNK_SHIFT) / 1024 / 1024);
+
+    chunk_end = ram_chunk_end(block, chunk + chunks);
+
+    if (!rdma->pin_all) {
+#ifdef RDMA_UNREGISTRATION_EXAMPLE
+        qemu_rdma_unregister_waiting(rdma);
+#endif
+    }
+
+    while (test_bit(chunk, block->transit_bitmap)) {
+        (void)count;
+        DDPRINTF("(%d) Not clobbering: block: %d chunk %" PRIu64
+                " current %" PRIu64 " len %" PRIu64 " %d %d\n",
+                count++, current_index, chunk,
+                sge.addr, length, rdma->nb_sent, block->nb_chunks);
+
+        ret = qemu_rdma_wait_for_write(rdma);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to Wait for previous write to complete "
+                    "block %d chunk %" PRIu64
+                    " current %" PRIu64 " len %" PRIu64 " %d\n",
+                    current_index, chunk, sge.addr, length, rdma->nb_sent);
+            return ret;
+        }
+    }
+
+    rail = qemu_rdma_pick_rail(rdma, current_index);
+
+    if (rail) {
+        sge.lkey = rdma->rail[rail].mr[current_index]->lkey;
+        send_wr.wr.rdma.rkey = rdma->rail[rail].remote_rkey[current_index];
+    } else if (!rdma->pin_all || !block->is_ram_block) {
+        if (!block->remote_keys[chunk]) {
+            /*
+             * This chunk has not yet been registered, so first check to see
+             * if the entire chunk is zero. If so, tell the other size to
+             * memset() + madvise() the entire chunk without RDMA.
+             */
+
+            if (can_use_buffer_find_nonzero_offset((void *)sge.addr, length)
+                   && buffer_find_nonzero_offset((void *)sge.addr,
+                                                    length) == length) {
+                RDMACompress comp = {
+                                        .offset = current_addr,
+                                        .value = 0,
+                                        .block_idx = current_index,
+                                        .length = length,
+                                    };
+
+                head.len = sizeof(comp);
+                head.type = RDMA_CONTROL_COMPRESS;
+
+                DDPRINTF("Entire chunk is zero, sending compress: %"
+                    PRIu64 " for %d "
+                    "bytes, index: %d, offset: %" PRId64 "...\n",
+                    chunk, sge.length, current_index, current_addr);
+
+                compress_to_network(&comp);
+                ret = qemu_rdma_exchange_send(rdma, &head,
+                                (uint8_t *) &comp, NULL, NULL, NULL);
+
+                if (ret < 0) {
+                    return -EIO;
+                }
+
+                acct_update_position(f, sge.length, true);
+                rdma->stats.zero_chunks++;
+                RDMA_EVENT(COMPRESS, current_addr, length);
+
+                return 1;
+            }
+
+            /*
+             * Otherwise, tell other side to register.
+             */
+            reg.current_index = current_index;
+            if (block->is_ram_block) {
+                reg.key.current_addr = current_addr;
+            } else {
+                reg.key.chunk = chunk;
+            }
+            reg.chunks = chunks;
+
+            DDPRINTF("Sending registration request chunk %" PRIu64 " for %d "
+                    "bytes, index: %d, offset: %" PRId64 "...\n",
+                    chunk, sge.length, current_index, current_addr);
+
+            register_to_network(&reg);
+            stall_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &reg,
+                                    &resp, &reg_result_idx, NULL);
+            qemu_rdma_hist_add(&rdma->stats.reg_rtt,
+                        qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - stall_start);
+            qemu_rdma_span(rdma, "register", stall_start, chunk);
+            rdma->stall_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                              stall_start;
+            if (ret < 0) {
+                return ret;
+            }
+
+            /* try to overlap this single registration with the one we sent. */
+            if (qemu_rdma_register_and_get_keys(rdma, block,
+                                                (uint8_t *) sge.addr,
+                                                &sge.lkey, NULL, chunk,
+                                                chunk_start, chunk_end)) {
+                fprintf(stderr, "cannot get lkey!\n");
+                return -EINVAL;
+            }
+
+            reg_result = (RDMARegisterResult *)
+                    rdma->wr_data[reg_result_idx].control_curr;
+
+            network_to_result(reg_result);
+
+            DDPRINTF("Received registration result:"
+                    " my key: %x their key %x, chunk %" PRIu64 "\n",
+                    block->remote_keys[chunk], reg_result->rkey, chunk);
+
+            block->remote_keys[chunk] = reg_result->rkey;
+            block->remote_host_addr = reg_result->host_addr;
+        } else {
+            /* already registered before */
+            if (qemu_rdma_register_and_get_keys(rdma, block,
+                                                (uint8_t *)sge.addr,
+                                                &sge.lkey, NULL, chunk,
+                                                chunk_start, chunk_end)) {
+                fprintf(stderr, "cannot get lkey!\n");
+                return -EINVAL;
+            }
+        }
+
+        send_wr.wr.rdma.rkey = block->remote_keys[chunk];
+    } else {
+        send_wr.wr.rdma.rkey = block->remote_rkey;
+
+        if (qemu_rdma_register_and_get_keys(rdma, block, (uint8_t *)sge.addr,
+                                                     &sge.lkey, NULL, chunk,
+                                                     chunk_start, chunk_end)) {
+            fprintf(stderr, "cannot get lkey!\n");
+            return -EINVAL;
+        }
+    }
+
+    /*
+     * Encode the ram block index and chunk within this wrid.
+     * We will use this information at the time of completion
+     * to figure out which bitmap to check against and then which
+     * chunk in the bitmap to look for.
+     */
+    send_wr.wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE,
+                                        current_index, chunk);
+
+    send_wr.opcode = IBV_WR_RDMA_WRITE;
+    send_wr.send_flags = IBV_SEND_SIGNALED;
+    send_wr.sg_list = &sge;
+    send_wr.num_sge = 1;
+    send_wr.wr.rdma.remote_addr = block->remote_host_addr +
+                                (current_addr - block->offset);
+
+    DDDPRINTF("Posting chunk: %" PRIu64 ", addr: %lx"
+              " remote: %lx, bytes %" PRIu32 "\n",
+              chunk, sge.addr, send_wr.wr.rdma.remote_addr,
+              sge.length);
+
+    /*
+     * ibv_post_send() does not return negative error numbers,
+     * per the specification they are positive - no idea why.
+     * The registration above may have been resumed on a new qp.
+     */
+    qp = rail ? rdma->rail[rail].qp : rdma->qp;
+    ret = ibv_post_send(qp, &send_wr, &bad_wr);
+
+    if (ret == ENOMEM) {
+        DDPRINTF("send queue is full. wait a little....\n");
+        if (rail) {
+            do {
+                ret = qemu_rdma_rail_poll(rdma, &rdma->rail[rail]);
+            } while (ret == 0);
+        } else {
+            ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+            ret = qemu_rdma_recover(rdma, ret, NULL);
+        }
+        if (ret < 0) {
+            fprintf(stderr, "rdma migration: failed to make "
+                            "room in full send queue! %d\n", ret);
+            return ret;
+        }
+
+        goto retry;
+
+    } else if (ret > 0) {
+        perror("rdma migration: post rdma write failed");
+        if (rail || qemu_rdma_recover(rdma, -ret, NULL) < 0) {
+            return -ret;
+        }
+        goto retry;
+    }
+
+    set_bit(chunk, block->transit_bitmap);
+    qemu_rdma_rail_posted(rdma, &rdma->rail[rail], sge.length);
+    acct_update_position(f, sge.length, false);
+    rdma->total_writes++;
+    RDMA_EVENT(POST, sge.length, send_wr.wr_id);
+    qemu_rdma_pace(rdma, sge.length);
+
+    return 0;
+}
+
+/*
+ * Push out any unwritten RDMA operations.
+ *
+ * We support sending out multiple chunks at the same time.
+ * Not all of them need to get signaled in the completion queue.
+ */
+static int qemu_rdma_write_flush(QEMUFile *f, RDMAContext *rdma)
+{
+    int ret;
+
+    if (!rdma->current_length) {
+        return 0;
+    }
+
+    ret = qemu_rdma_write_one(f, rdma,
+            rdma->current_index, rdma->current_addr, rdma->current_length);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (ret == 0) {
+        rdma->nb_sent++;
+        DDDPRINTF("sent total: %d\n", rdma->nb_sent);
+    }
+
+    rdma->current_length = 0;
+    rdma->current_addr = 0;
+
+    return 0;
+}
+
+static inline int qemu_rdma_buffer_mergable(RDMAContext *rdma,
+                    uint64_t offset, uint64_t len)
+{
+    RDMALocalBlock *block;
+    uint8_t *host_addr;
+    uint8_t *chunk_end;
+
+    if (rdma->current_index < 0) {
+        return 0;
+    }
+
+    if (rdma->current_chunk < 0) {
+        return 0;
+    }
+
+    block = &(rdma->local_ram_blocks.block[rdma->current_index]);
+    host_addr = block->local_host_addr + (offset - block->offset);
+    chunk_end = ram_chunk_end(block, rdma->current_chunk);
+
+    if (rdma->current_length == 0) {
+        return 0;
+    }
+
+    /*
+     * Only merge into chunk sequentially.
+     */
+    if (offset != (rdma->current_addr + rdma->current_length)) {
+        return 0;
+    }
+
+    if (offset < block->offset) {
+        return 0;
+    }
+
+    if ((offset + len) > (block->offset + block->length)) {
+        return 0;
+    }
+
+    if ((host_addr + len) > chunk_end) {
+        return 0;
+    }
+
+    if (rdma->pacer.rate && rdma->current_length + len > RDMA_PACE_QUANTUM) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * We're not actually writing here, but doing three things:
+ *
+ * 1. Identify the chunk the buffer belongs to.
+ * 2. If the chunk is full or the buffer doesn't belong to the current
+ *    chunk, then start a new chunk and flush() the old chunk.
+ * 3. To keep the hardware busy, we also group chunks into batches
+ *    and only require that a batch gets acknowledged in the completion
+ *    qeueue instead of each individual chunk.
+ */
+static int qemu_rdma_write(QEMUFile *f, RDMAContext *rdma,
+                           uint64_t block_offset, uint64_t offset,
+                           uint64_t len)
+{
+    uint64_t current_addr = block_offset + offset;
+    uint64_t index = rdma->current_index;
+    uint64_t chunk = rdma->current_chunk;
+    int ret;
+
+    /* If we cannot merge it, we flush the current buffer first. */
+    if (!qemu_rdma_buffer_mergable(rdma, current_addr, len)) {
+        ret = qemu_rdma_write_flush(f, rdma);
+        if (ret) {
+            return ret;
+        }
+        rdma->current_length = 0;
+        rdma->current_addr = current_addr;
+
+        ret = qemu_rdma_search_ram_block(rdma, block_offset,
+                                         offset, len, &index, &chunk);
+        if (ret) {
+            fprintf(stderr, "ram block search failed\n");
+            return ret;
+        }
+        rdma->current_index = index;
+        rdma->current_chunk = chunk;
+    }
+
+    /* merge it */
+    rdma->current_length += len;
+
+    /* flush it if buffer is too large */
+    if (rdma->current_length >= RDMA_MERGE_MAX) {
+        return qemu_rdma_write_flush(f, rdma);
+    }
+
+    return 0;
+}
+
+/*
+ * The longest piece of 'len' bytes at 'offset' into a RAM block that
+ * qemu_rdma_write() can take at once: up to the end of the chunk, and
+ * no more than the pacing quantum.
+ */
+static uint64_t qemu_rdma_piece(RDMAContext *rdma, uint64_t offset,
+                                uint64_t len)
+{
+    len = MIN(len, (((offset >> RDMA_REG_CHUNK_SHIFT) + 1) <<
+                    RDMA_REG_CHUNK_SHIFT) - offset);
+    if (rdma->pacer.rate) {
+        len = MIN(len, RDMA_PACE_QUANTUM);
+    }
+    return len;
+}
+
+/*
+ * ",defer": send the pages held back in 'block', of every chunk if 'all'
+ * or else of the chunks that are not hot any more.
+ */
+static int qemu_rdma_defer_flush(QEMUFile *f, RDMAContext *rdma,
+                                 RDMALocalBlock *block, bool all)
+{
+    uint64_t shift = RDMA_REG_CHUNK_SHIFT - TARGET_PAGE_BITS;
+    uint64_t nb_pages = block->length >> TARGET_PAGE_BITS;
+    uint64_t chunk, page, end, run_end, offset, len, piece;
+    int ret;
+
+    for (chunk = 0; chunk < block->nb_chunks && rdma->deferred_pages;
+         chunk++) {
+        if (!all && (block->chunk_hist[chunk] & RDMA_DEFER_MASK) ==
+                    RDMA_DEFER_MASK) {
+            continue;
+        }
+
+        end = MIN((chunk + 1) << shift, nb_pages);
+        for (page = find_next_bit(block->defer_bitmap, end, chunk << shift);
+             page < end;
+             page = find_next_bit(block->defer_bitmap, end, run_end)) {
+            run_end = find_next_zero_bit(block->defer_bitmap, end, page);
+            bitmap_clear(block->defer_bitmap, page, run_end - page);
+            rdma->deferred_pages -= run_end - page;
+
+            offset = page << TARGET_PAGE_BITS;
+            for (len = (run_end - page) << TARGET_PAGE_BITS; len;
+                 len -= piece, offset += piece) {
+                piece = qemu_rdma_piece(rdma, offset, len);
+                ret = qemu_rdma_write(f, rdma, block->offset, offset, piece);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * ",defer": a pass over RAM is over.  Shift what it saved into the
+ * chunks' history, then send the pages of the chunks that cooled down,
+ * or all of them once the VM is stopped.
+ */
+static int qemu_rdma_defer_pass(QEMUFile *f, RDMAContext *rdma, bool stop)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    uint64_t shift = RDMA_REG_CHUNK_SHIFT - TARGET_PAGE_BITS;
+    uint64_t chunk, pages;
+    bool hot;
+    int i, ret;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
+
+        if (!block->defer_bitmap) {
+            continue;
+        }
+
+        for (chunk = 0; chunk < block->nb_chunks; chunk++) {
+            pages = MIN(1ULL << shift,
+                        (block->length >> TARGET_PAGE_BITS) -
+                        (chunk << shift));
+            hot = block->chunk_saved[chunk] * 2 >= pages;
+            block->chunk_saved[chunk] = 0;
+
+            /* the bulk pass sends everything, that says nothing */
+            if (rdma->defer_passes) {
+                block->chunk_hist[chunk] = block->chunk_hist[chunk] << 1 | hot;
+            }
+        }
+
+        ret = qemu_rdma_defer_flush(f, rdma, block, stop);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    rdma->defer_passes++;
+
+    return 0;
+}
+
+/*
+ * ",defer": 'len' bytes at 'offset' into the RAM block at 'block_offset',
+ * all in one chunk, are being saved.  Returns 1 if they belong to a hot
+ * chunk and are held back, 0 if they are to be written now, or a
+ * negative errno.
+ */
+static int qemu_rdma_defer(QEMUFile *f, RDMAContext *rdma,
+                           uint64_t block_offset, uint64_t offset,
+                           uint64_t len)
+{
+    RDMALocalBlock *block;
+    uint64_t chunk, page, end;
+    int ret;
+
+    if (!rdma->defer) {
+        return 0;
+    }
+
+    if (block_offset + offset < rdma->defer_addr) {
+        ret = qemu_rdma_defer_pass(f, rdma, false);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    rdma->defer_addr = block_offset + offset;
+
+    block = g_hash_table_lookup(rdma->blockmap, (void *) block_offset);
+    if (!block->defer_bitmap) {
+        block->defer_bitmap = bitmap_new(block->length >> TARGET_PAGE_BITS);
+        block->chunk_saved = g_new0(uint16_t, block->nb_chunks);
+        block->chunk_hist = g_new0(uint8_t, block->nb_chunks);
+    }
+
+    chunk = offset >> RDMA_REG_CHUNK_SHIFT;
+    page = offset >> TARGET_PAGE_BITS;
+    end = (offset + len + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS;
+    block->chunk_saved[chunk] += end - page;
+    rdma->defer_iter_pages += end - page;
+
+    if (rdma->ram_flags == RAM_CONTROL_FINISH ||
+        (block->chunk_hist[chunk] & RDMA_DEFER_MASK) != RDMA_DEFER_MASK) {
+        for (; page < end; page++) {
+            if (test_and_clear_bit(page, block->defer_bitmap)) {
+                rdma->deferred_pages--;
+            }
+        }
+        return 0;
+    }
+
+    for (; page < end; page++) {
+        if (test_and_set_bit(page, block->defer_bitmap)) {
+            rdma->stats.defer_saved++;
+        } else {
+            rdma->stats.deferred++;
+            rdma->deferred_pages++;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * XXH64 of a page, seed 0.  Both sides hash in host byte order, so
+ * between hosts of different endianness pages just never match.
+ */
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh64_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    return xxh64_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t qemu_rdma_hash_page(const uint8_t *p)
+{
+    const uint8_t *end = p + TARGET_PAGE_SIZE;
+    uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = XXH_PRIME64_2;
+    uint64_t v3 = 0;
+    uint64_t v4 = -XXH_PRIME64_1;
+    uint64_t lane[4], h;
+
+    /* TARGET_PAGE_SIZE is a multiple of the 32 byte stripe */
+    for (; p < end; p += sizeof(lane)) {
+        memcpy(lane, p, sizeof(lane));
+        v1 = xxh64_round(v1, lane[0]);
+        v2 = xxh64_round(v2, lane[1]);
+        v3 = xxh64_round(v3, lane[2]);
+        v4 = xxh64_round(v4, lane[3]);
+    }
+
+    h = xxh64_rotl(v1, 1) + xxh64_rotl(v2, 7) +
+        xxh64_rotl(v3, 12) + xxh64_rotl(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+    h += TARGET_PAGE_SIZE;
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/*
+ * ",hash": fetch the hashes of all of the dest's RAM, once the RAM
+ * blocks are known.
+ */
+static int qemu_rdma_fetch_hashes(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAControlHeader head = { .len = sizeof(RDMAHashRequest),
+                               .type = RDMA_CONTROL_HASH_REQUEST,
+                               .repeat = 1 };
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_HASH_RESULT };
+    RDMAHashRequest req;
+    uint64_t page, nb_pages, *hashes;
+    int i, j, idx, ret;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
+
+        nb_pages = block->length >> TARGET_PAGE_BITS;
+        g_free(block->remote_hash);
+        g_free(block->hash_valid);
+        block->remote_hash = g_new(uint64_t, nb_pages);
+        block->hash_valid = bitmap_new(nb_pages);
+
+        for (page = 0; page < nb_pages; page += req.nb_pages) {
+            req.block_idx = i;
+            req.nb_pages = MIN(nb_pages - page, RDMA_HASH_MAX_PAGES);
+            req.offset = page << TARGET_PAGE_BITS;
+            hash_request_to_network(&req);
+
+            ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &req,
+                                          &resp, &idx, NULL);
+            network_to_hash_request(&req);
+            if (ret < 0) {
+                return ret;
+            }
+            if (resp.len != req.nb_pages * sizeof(uint64_t)) {
+                fprintf(stderr, "rdma: bad hash result for %" PRIu64
+                        " pages\n", (uint64_t) req.nb_pages);
+                return -EIO;
+            }
+
+            hashes = (uint64_t *) rdma->wr_data[idx].control_curr;
+            for (j = 0; j < req.nb_pages; j++) {
+                block->remote_hash[page + j] = ntohll(hashes[j]);
+            }
+        }
+        bitmap_set(block->hash_valid, 0, nb_pages);
+    }
+
+    rdma->keep = g_new(RDMACompress, RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE);
+    rdma->nb_keep = 0;
+
+    return 0;
+}
+
+/*
+ * Dest side of qemu_rdma_fetch_hashes(), and of the RESYNC_REQUESTs of
+ * qemu_rdma_resync().
+ */
+static int qemu_rdma_send_hashes(RDMAContext *rdma, RDMAHashRequest *req)
+{
+    static uint64_t hashes[RDMA_HASH_MAX_PAGES];
+    RDMAControlHeader resp = { .type = RDMA_CONTROL_HASH_RESULT,
+                               .repeat = 1 };
+    RDMALocalBlock *block;
+    uint8_t *host_addr;
+    int i, ret;
+
+    network_to_hash_request(req);
+
+    if (req->block_idx >= rdma->local_ram_blocks.nb_blocks ||
+        req->nb_pages > RDMA_HASH_MAX_PAGES) {
+        return -EINVAL;
+    }
+    block = &(rdma->local_ram_blocks.block[req->block_idx]);
+    if (req->offset + ((uint64_t) req->nb_pages << TARGET_PAGE_BITS) >
+        block->length) {
+        return -EINVAL;
+    }
+
+    DDPRINTF("Hashing %d pages at %" PRIu64 " of block %d\n",
+             req->nb_pages, req->offset, req->block_idx);
+    host_addr = block->local_host_addr + req->offset;
+    for (i = 0; i < req->nb_pages; i++) {
+        hashes[i] = htonll(qemu_rdma_hash_page(host_addr));
+        host_addr += TARGET_PAGE_SIZE;
+    }
+
+    resp.len = req->nb_pages * sizeof(uint64_t);
+    ret = qemu_rdma_reply(rdma, (uint8_t *) hashes, &resp);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to send control buffer!\n");
+    }
+    return ret;
+}
+
+/*
+ * Send the '*nb' ranges batched in 'list' as one KEEP or DISCARD.
+ */
+static int qemu_rdma_ranges_flush(RDMAContext *rdma, uint32_t type,
+                                  RDMACompress *list, int *nb)
+{
+    RDMAControlHeader head = { .type = type };
+    int i, ret;
+
+    if (!*nb) {
+        return 0;
+    }
+
+    for (i = 0; i < *nb; i++) {
+        compress_to_network(&list[i]);
+    }
+    head.len = *nb * sizeof(RDMACompress);
+    head.repeat = *nb;
+    *nb = 0;
+
+    ret = qemu_rdma_exchange_send(rdma, &head, (uint8_t *) list,
+                                  NULL, NULL, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "rdma migration: error sending %s list!\n",
+                control_desc[type]);
+    }
+    return ret;
+}
+
+static int qemu_rdma_ranges_add(RDMAContext *rdma, uint32_t type,
+                                RDMACompress *list, int *nb,
+                                RDMALocalBlock *block, uint64_t offset,
+                                uint64_t len)
+{
+    RDMACompress *last;
+
+    if (*nb) {
+        last = &list[*nb - 1];
+        if (last->block_idx == block->index &&
+            last->offset + last->length == block->offset + offset) {
+            last->length += len;
+            return 0;
+        }
+    }
+
+    if (*nb == RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE) {
+        int ret = qemu_rdma_ranges_flush(rdma, type, list, nb);
+
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    list[(*nb)++] = (RDMACompress) {
+        .block_idx = block->index,
+        .offset = block->offset + offset,
+        .length = len,
+    };
+    return 0;
+}
+
+/*
+ * ",hash": tell the dest about the pages it kept.
+ */
+static int qemu_rdma_keep_flush(RDMAContext *rdma)
+{
+    return qemu_rdma_ranges_flush(rdma, RDMA_CONTROL_KEEP, rdma->keep,
+                                  &rdma->nb_keep);
+}
+
+static int qemu_rdma_keep(RDMAContext *rdma, RDMALocalBlock *block,
+                          uint64_t offset, uint64_t len)
+{
+    rdma->stats.kept += len >> TARGET_PAGE_BITS;
+    RDMA_EVENT(KEEP, block->offset + offset, len);
+
+    return qemu_rdma_ranges_add(rdma, RDMA_CONTROL_KEEP, rdma->keep,
+                                &rdma->nb_keep, block, offset, len);
+}
+
+/*
+ * ",free-page-agent": tell the dest about the pages the guest has free.
+ */
+static int qemu_rdma_discard_flush(RDMAContext *rdma)
+{
+    return qemu_rdma_ranges_flush(rdma, RDMA_CONTROL_DISCARD, rdma->discard,
+                                  &rdma->nb_discard);
+}
+
+static int qemu_rdma_discard(RDMAContext *rdma, RDMALocalBlock *block,
+                             uint64_t offset, uint64_t len)
+{
+    uint64_t page = offset >> TARGET_PAGE_BITS;
+    uint64_t end = (offset + len) >> TARGET_PAGE_BITS;
+
+    rdma->stats.discarded += end - page;
+    RDMA_EVENT(DISCARD, block->offset + offset, len);
+
+    /* the dest zeroes them, and what ",defer" held back is not needed */
+    if (block->hash_valid) {
+        bitmap_clear(block->hash_valid, page, end - page);
+    }
+    for (; block->defer_bitmap && page < end; page++) {
+        if (test_and_clear_bit(page, block->defer_bitmap)) {
+            rdma->deferred_pages--;
+        }
+    }
+
+    return qemu_rdma_ranges_add(rdma, RDMA_CONTROL_DISCARD, rdma->discard,
+                                &rdma->nb_discard, block, offset, len);
+}
+
+/*
+ * ",hash": how many bytes from 'offset' into 'block', up to 'end', the
+ * dest has ('*same' true) or does not have, at most.  Pages found to
+ * differ are about to be written, so the dest's hash of them goes stale.
+ */
+static uint64_t qemu_rdma_hash_run(RDMALocalBlock *block, uint64_t offset,
+                                   uint64_t end, bool *same)
+{
+    uint64_t page = offset >> TARGET_PAGE_BITS;
+    uint64_t start = offset;
+    bool match;
+
+    if ((offset | end) & (TARGET_PAGE_SIZE - 1)) {
+        /* not whole pages, cannot tell */
+        bitmap_clear(block->hash_valid, page,
+                     ((end + TARGET_PAGE_SIZE - 1) >> TARGET_PAGE_BITS) - page);
+        *same = false;
+        return end - offset;
+    }
+
+    for (; offset < end; offset += TARGET_PAGE_SIZE, page++) {
+        match = test_bit(page, block->hash_valid) &&
+                block->remote_hash[page] ==
+                    qemu_rdma_hash_page(block->local_host_addr + offset);
+        if (offset == start) {
+            *same = match;
+        } else if (match != *same) {
+            break;
+        }
+        if (!match) {
+            clear_bit(page, block->hash_valid);
+        }
+    }
+
+    return offset - start;
+}
+
+/*
+ * ",free-page-agent": connect to the agent, once the dest has agreed to
+ * RDMA_CAPABILITY_DISCARD.  Without it, free pages are sent as usual.
+ */
+static void qemu_rdma_free_connect(RDMAContext *rdma)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                              .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res, *e;
+    InetSocketAddress *addr;
+    int fd = -1;
+
+    if (!rdma->free_page_agent) {
+        return;
+    }
+
+    addr = inet_parse(rdma->free_page_agent, NULL);
+    if (addr && !getaddrinfo(addr->host, addr->port, &hints, &res)) {
+        for (e = res; e && fd < 0; e = e->ai_next) {
+            fd = socket(e->ai_family, e->ai_socktype, e->ai_protocol);
+            if (fd >= 0 && connect(fd, e->ai_addr, e->ai_addrlen)) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(res);
+    }
+    qapi_free_InetSocketAddress(addr);
+
+    if (fd < 0) {
+        fprintf(stderr, "rdma migration: cannot reach the free page agent at"
+                " %s. Will send free pages.\n", rdma->free_page_agent);
+        return;
+    }
+
+    DPRINTF("Connected to the free page agent at %s\n",
+            rdma->free_page_agent);
+    rdma->free = g_malloc0(sizeof(RDMAFreePages));
+    rdma->free->fd = fd;
+    rdma->discard = g_new(RDMACompress, RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE);
+    rdma->nb_discard = 0;
+}
+
+static void qemu_rdma_free_lost(RDMAContext *rdma)
+{
+    fprintf(stderr, "rdma migration: lost the free page agent. "
+                    "Will send free pages.\n");
+    close(rdma->free->fd);
+    rdma->free->fd = -1;
+}
+
+/*
+ * Mark what is RAM of the guest physical range 'gpa', 'length' free.
+ * Only whole pages are: the agent's may be smaller than ours.
+ */
+static void qemu_rdma_free_range(RDMAContext *rdma, uint64_t gpa,
+                                 uint64_t length)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    MemoryRegionSection section;
+    uint64_t addr, size, first, last, end;
+    int i;
+
+    while (length) {
+        section = memory_region_find(get_system_memory(), gpa, length);
+        if (!section.mr) {
+            break;
+        }
+        size = int128_get64(section.size);
+
+        if (memory_region_is_ram(section.mr) && !section.readonly) {
+            addr = memory_region_get_ram_addr(section.mr) +
+                   section.offset_within_region;
+            for (i = 0; i < local->nb_blocks; i++) {
+                RDMALocalBlock *block = &local->block[i];
+
+                if (addr - block->offset >= block->length) {
+                    continue;
+                }
+                first = QEMU_ALIGN_UP(addr - block->offset,
+                                      TARGET_PAGE_SIZE) >> TARGET_PAGE_BITS;
+                last = MIN(addr - block->offset + size, block->length) >>
+                       TARGET_PAGE_BITS;
+                if (first < last) {
+                    if (!block->free_bitmap) {
+                        block->free_bitmap =
+                            bitmap_new(block->length >> TARGET_PAGE_BITS);
+                    }
+                    bitmap_set(block->free_bitmap, first, last - first);
+                    rdma->free->marked = true;
+                }
+                break;
+            }
+        }
+
+        end = section.offset_within_address_space + size;
+        memory_region_unref(section.mr);
+        if (end <= gpa || end - gpa >= length) {
+            break;
+        }
+        length -= end - gpa;
+        gpa = end;
+    }
+}
+
+/*
+ * ",free-page-agent": take in what has arrived of the agent's answers,
+ * once 'len' more bytes make RDMA_FREE_POLL_BYTES saved.  Only while
+ * the guest runs, in ram_save_iterate(), which does not hold the
+ * iothread lock the memory map is looked up under.
+ */
+static void qemu_rdma_free_poll(RDMAContext *rdma, uint64_t len)
+{
+    RDMAFreePages *fp = rdma->free;
+    RDMAFreeReply reply;
+    RDMAFreeRange range;
+    uint8_t *p;
+    ssize_t n;
+
+    if (!fp || fp->fd < 0 || rdma->ram_flags != RAM_CONTROL_ROUND) {
+        return;
+    }
+    fp->unread += len;
+    if (fp->unread < RDMA_FREE_POLL_BYTES) {
+        return;
+    }
+    fp->unread = 0;
+
+    for (;;) {
+        n = recv(fp->fd, fp->buf + fp->len, sizeof(fp->buf) - fp->len,
+                 MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (!n || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                qemu_rdma_free_lost(rdma);
+            }
+            return;
+        }
+        fp->len += n;
+
+        p = fp->buf;
+        while (fp->buf + fp->len - p >=
+               (fp->left ? sizeof(range) : sizeof(reply))) {
+            if (!fp->left) {
+                memcpy(&reply, p, sizeof(reply));
+                p += sizeof(reply);
+                if (ntohl(reply.magic) != RDMA_FREE_MAGIC) {
+                    qemu_rdma_free_lost(rdma);
+                    return;
+                }
+                fp->reply_seq = ntohl(reply.seq);
+                fp->left = ntohll(reply.nb_ranges);
+                continue;
+            }
+
+            memcpy(&range, p, sizeof(range));
+            p += sizeof(range);
+            fp->left--;
+            /* an answer to an older request may be out of date */
+            if (fp->reply_seq == fp->seq) {
+                qemu_mutex_lock_iothread();
+                qemu_rdma_free_range(rdma, ntohll(range.gpa),
+                                     ntohll(range.length));
+                qemu_mutex_unlock_iothread();
+            }
+        }
+        fp->len -= p - fp->buf;
+        memmove(fp->buf, p, fp->len);
+    }
+}
+
+/*
+ * ",free-page-agent": how many bytes from 'offset' into 'block', up to
+ * 'end', the guest has free ('*is_free' true) or not, at most.
+ */
+static uint64_t qemu_rdma_free_run(RDMALocalBlock *block, uint64_t offset,
+                                   uint64_t end, bool *is_free)
+{
+    uint64_t page = offset >> TARGET_PAGE_BITS;
+    uint64_t last = end >> TARGET_PAGE_BITS;
+
+    if (!block->free_bitmap || ((offset | end) & (TARGET_PAGE_SIZE - 1))) {
+        *is_free = false;
+        return end - offset;
+    }
+
+    *is_free = test_bit(page, block->free_bitmap);
+    if (*is_free) {
+        last = find_next_zero_bit(block->free_bitmap, last, page);
+    } else {
+        last = find_next_bit(block->free_bitmap, last, page);
+    }
+    return (last - page) << TARGET_PAGE_BITS;
+}
+
+/*
+ * ",free-page-agent": forget the pages marked free, at a bitmap sync and
+ * when the guest is stopped.
+ */
+static void qemu_rdma_free_drop(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i;
+
+    if (!rdma->free || !rdma->free->marked) {
+        return;
+    }
+    for (i = 0; i < local->nb_blocks; i++) {
+        if (local->block[i].free_bitmap) {
+            bitmap_zero(local->block[i].free_bitmap,
+                        local->block[i].length >> TARGET_PAGE_BITS);
+        }
+    }
+    rdma->free->marked = false;
+}
+
+/*
+ * Save 'len' bytes at 'offset' into the RAM block at 'block_offset', all
+ * in one chunk: skip what the guest has free (",free-page-agent") and
+ * what the dest has already (",hash"), hold back the pages of hot chunks
+ * (",defer") and add the rest to the current chunk.
+ */
+static int qemu_rdma_save_piece(QEMUFile *f, RDMAContext *rdma,
+                                uint64_t block_offset, uint64_t offset,
+                                uint64_t len)
+{
+    RDMALocalBlock *block = NULL;
+    uint64_t end = offset + len, run;
+    bool same = false, is_free = false;
+    int ret;
+
+    qemu_rdma_free_poll(rdma, len);
+    if (rdma->keep || (rdma->free && rdma->free->marked)) {
+        block = g_hash_table_lookup(rdma->blockmap, (void *) block_offset);
+    }
+
+    for (; offset < end; offset += run) {
+        run = end - offset;
+        if (block && rdma->free) {
+            run = qemu_rdma_free_run(block, offset, end, &is_free);
+        }
+        if (block && rdma->keep && !is_free) {
+            run = qemu_rdma_hash_run(block, offset, offset + run, &same);
+        }
+
+        if (is_free) {
+            ret = qemu_rdma_discard(rdma, block, offset, run);
+        } else if (same) {
+            ret = qemu_rdma_keep(rdma, block, offset, run);
+        } else {
+            ret = qemu_rdma_defer(f, rdma, block_offset, offset, run);
+            if (!ret) {
+                ret = qemu_rdma_write(f, rdma, block_offset, offset, run);
+            }
+        }
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * "local:": close the RAM block fds not sent or not mapped yet.
+ */
+static void qemu_local_close_fds(RDMAContext *rdma)
+{
+    int i;
+
+    for (i = 0; i < rdma->nb_local_fds; i++) {
+        close(rdma->local_fds[i]);
+    }
+    g_free(rdma->local_fds);
+    rdma->local_fds = NULL;
+    rdma->nb_local_fds = 0;
+}
+
+static void qemu_rdma_cleanup(RDMAContext *rdma)
+{
+
+    struct rdma_cm_event *cm_event;
+    int ret, idx;
+
+    qemu_rdma_prewarm_wait(rdma);
+    qemu_rdma_recv_stop(rdma, false);
+
+#ifdef DEBUG_RDMA
+    if (rdma_outgoing == rdma || rdma_incoming == rdma) {
+        char *stats = rdma_migration_stats_format(&rdma->stats);
+
+        DPRINTF("Migration stats:\n%s", stats);
+        g_free(stats);
+    }
+#endif
+
+    qemu_rdma_timeline_write(rdma, rdma_outgoing != rdma);
+    g_free(rdma->spans);
+    rdma->spans = NULL;
+    rdma->nb_spans = 0;
+    g_free(rdma->timeline);
+    rdma->timeline = NULL;
+    if (rdma->record_file) {
+        fclose(rdma->record_file);
+        rdma->record_file = NULL;
+    }
+    g_free(rdma->record);
+    rdma->record = NULL;
+    g_free(rdma->keep);
+    rdma->keep = NULL;
+    if (rdma->free) {
+        if (rdma->free->fd >= 0) {
+            close(rdma->free->fd);
+        }
+        g_free(rdma->free);
+        rdma->free = NULL;
+    }
+    g_free(rdma->free_page_agent);
+    rdma->free_page_agent = NULL;
+    g_free(rdma->discard);
+    rdma->discard = NULL;
+    g_free(rdma->resume_msg);
+    rdma->resume_msg = NULL;
+    if (rdma->resume_event) {
+        rdma_ack_cm_event(rdma->resume_event);
+        rdma->resume_event = NULL;
+    }
+    if (rdma->wait_fd >= 0) {
+        close(rdma->wait_fd);
+        rdma->wait_fd = -1;
+    }
+    qemu_local_close_fds(rdma);
+    if (rdma->local_fd >= 0) {
+        close(rdma->local_fd);
+        rdma->local_fd = -1;
+    }
+
+    if (rdma_outgoing == rdma) {
+        rdma_outgoing = NULL;
+    }
+    if (rdma_incoming == rdma) {
+        rdma_incoming = NULL;
+    }
+    if (local_outgoing == rdma) {
+        local_outgoing = NULL;
+    }
+
+    if (rdma->cm_id && rdma->connected) {
+        if (rdma->error_state) {
+            RDMAControlHeader head = { .len = 0,
+                                       .type = RDMA_CONTROL_ERROR,
+                                       .repeat = 1,
+                                     };
+            fprintf(stderr, "Early error. Sending error.\n");
+            qemu_rdma_post_send_control(rdma, NULL, &head);
+        }
+
+        ret = rdma_disconnect(rdma->cm_id);
+        if (!ret) {
+            DDPRINTF("waiting for disconnect\n");
+            ret = rdma_get_cm_event(rdma->channel, &cm_event);
+            if (!ret) {
+                rdma_ack_cm_event(cm_event);
+            }
+        }
+        DDPRINTF("Disconnected.\n");
+        rdma->connected = false;
+    }
+
+    qemu_rdma_rails_cleanup(rdma);
+    qemu_rdma_workers_free(rdma);
+#ifdef CONFIG_LZ4
+    qemu_rdma_lz4_free(rdma);
+#endif
+    qemu_rdma_disk_free(rdma);
+
+    g_free(rdma->block);
+    rdma->block = NULL;
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        if (rdma->wr_data[idx].control_mr) {
+            rdma->total_registrations--;
+            ibv_dereg_mr(rdma->wr_data[idx].control_mr);
+        }
+        rdma->wr_data[idx].control_mr = NULL;
+    }
+
+    if (rdma->local_ram_blocks.block) {
+        while (rdma->local_ram_blocks.nb_blocks) {
+            __qemu_rdma_delete_block(rdma,
+                    rdma->local_ram_blocks.block->offset);
+        }
+    }
+
+    if (rdma->qp && !rdma->cm_id) {
+        /* rdmat: not created through the CM, and still using the CQ */
+        ibv_destroy_qp(rdma->qp);
+        rdma->qp = NULL;
+    }
+    if (rdma->cq) {
+        ibv_destroy_cq(rdma->cq);
+        rdma->cq = NULL;
+    }
+    if (rdma->comp_channel) {
+        ibv_destroy_comp_channel(rdma->comp_channel);
+        rdma->comp_channel = NULL;
+    }
+    if (rdma->pd) {
+        if (!rdma->pd_persistent) {
+            ibv_dealloc_pd(rdma->pd);
+        }
+        rdma->pd = NULL;
+        rdma->pd_persistent = false;
+    }
+    if (rdma->listen_id) {
+        rdma_destroy_id(rdma->listen_id);
+        rdma->listen_id = NULL;
+    }
+    if (rdma->cm_id) {
+        if (rdma->qp) {
+            rdma_destroy_qp(rdma->cm_id);
+            rdma->qp = NULL;
+        }
+        rdma_destroy_id(rdma->cm_id);
+        rdma->cm_id = NULL;
+    }
+    if (rdma->channel) {
+        rdma_destroy_event_channel(rdma->channel);
+        rdma->channel = NULL;
+    }
+    g_free(rdma->host);
+    rdma->host = NULL;
+}
+
+
+static int qemu_rdma_source_init(RDMAContext *rdma, Error **errp, bool pin_all)
+{
+    DTPRINTF("%s\n", __func__);
+    int ret, idx;
+    Error *local_err = NULL, **temp = &local_err;
+
+    /*
+     * Will be validated against destination's actual capabilities
+     * after the connect() completes.
+     */
+    rdma->pin_all = pin_all;
+
+    ret = qemu_rdma_resolve_host(rdma, temp);
+    if (ret) {
+        goto err_rdma_source_init;
+    }
+
+    ret = qemu_rdma_alloc_pd_cq(rdma);
+    if (ret) {
+        ERROR(temp, "rdma migration: error allocating pd and cq! Your mlock()"
+                    " limits may be too low. Please check $ ulimit -a # and "
+                    "search for 'ulimit -l' in the output");
+        goto err_rdma_source_init;
+    }
+
+    ret = qemu_rdma_alloc_qp(rdma);
+    if (ret) {
+        ERROR(temp, "rdma migration: error allocating qp!");
+        goto err_rdma_source_init;
+    }
+
+    ret = qemu_rdma_init_ram_blocks(rdma);
+    if (ret) {
+        ERROR(temp, "rdma migration: error initializing ram blocks!");
+        goto err_rdma_source_init;
+    }
+
+    qemu_rdma_ready_attach(rdma);
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        ret = qemu_rdma_reg_control(rdma, idx);
+        if (ret) {
+            ERROR(temp, "rdma migration: error registering %d control!",
+                                                            idx);
+            goto err_rdma_source_init;
+        }
+    }
+
+    return 0;
+
+err_rdma_source_init:
+    error_propagate(errp, local_err);
+    qemu_rdma_cleanup(rdma);
+    return -1;
+}
+
+/*
+ * ",resume" only knows how to make up for writes of the main connection,
+ * written as they are.
+ */
+static void qemu_rdma_resume_check(RDMAContext *rdma)
+{
+    if (rdma->resume && (rdma->nb_rails > 1 || rdma->compress)) {
+        fprintf(stderr, "rdma migration: cannot resume with several rails "
+                        "or compression, disabling \",resume\"\n");
+        rdma->resume = false;
+    }
+}
+
+static int qemu_rdma_connect(RDMAContext *rdma, Error **errp)
+{
+    DTPRINTF("%s\n", __func__);
+    RDMACapabilities cap = {
+                                .version = RDMA_CONTROL_VERSION_CURRENT,
+                                .flags = 0,
+                           };
+    struct rdma_conn_param conn_param = { .initiator_depth = 2,
+                                          .retry_count = 5,
+                                          .private_data = &cap,
+                                          .private_data_len = sizeof(cap),
+                                        };
+    struct rdma_cm_event *cm_event;
+    int ret;
+
+    /*
+     * Only negotiate the capability with destination if the user
+     * on the source first requested the capability.
+     */
+    if (rdma->pin_all) {
+        DPRINTF("Server pin-all memory requested.\n");
+        cap.flags |= RDMA_CAPABILITY_PIN_ALL;
+    }
+    if (rdma->hash) {
+        cap.flags |= RDMA_CAPABILITY_HASH;
+    }
+    if (rdma->compress) {
+        cap.flags |= RDMA_CAPABILITY_LZ4;
+    }
+    if (rdma->free_page_agent) {
+        cap.flags |= RDMA_CAPABILITY_DISCARD;
+    }
+    qemu_rdma_resume_check(rdma);
+    if (rdma->resume) {
+        cap.flags |= RDMA_CAPABILITY_RESUME;
+    } else {
+        /* disk chunks in flight are not replayed, see RDMADisk */
+        cap.flags |= RDMA_CAPABILITY_DISK;
+    }
+    cap.flags |= RDMA_CAPABILITY_PARALLEL_FINISH;
+
+    caps_to_network(&cap);
+
+    ret = rdma_connect(rdma->cm_id, &conn_param);
+    if (ret) {
+        perror("rdma_connect");
+        ERROR(errp, "connecting to destination!");
+        rdma_destroy_id(rdma->cm_id);
+        rdma->cm_id = NULL;
+        goto err_rdma_source_connect;
+    }
+
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
+    if (ret) {
+        perror("rdma_get_cm_event after rdma_connect");
+        ERROR(errp, "connecting to destination!");
+        rdma_ack_cm_event(cm_event);
+        rdma_destroy_id(rdma->cm_id);
+        rdma->cm_id = NULL;
+        goto err_rdma_source_connect;
+    }
+
+    if (cm_event->event != RDMA_CM_EVENT_ESTABLISHED) {
+        perror("rdma_get_cm_event != EVENT_ESTABLISHED after rdma_connect");
+        ERROR(errp, "connecting to destination!");
+        rdma_ack_cm_event(cm_event);
+        rdma_destroy_id(rdma->cm_id);
+        rdma->cm_id = NULL;
+        goto err_rdma_source_connect;
+    }
+    rdma->connected = true;
+
+    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    network_to_caps(&cap);
+
+    /*
+     * Verify that the *requested* capabilities are supported by the destination
+     * and disable them otherwise.
+     */
+    if (rdma->pin_all && !(cap.flags & RDMA_CAPABILITY_PIN_ALL)) {
+        ERROR(errp, "Server cannot support pinning all memory. "
+                        "Will register memory dynamically.");
+        rdma->pin_all = false;
+    }
+    if (rdma->hash && !(cap.flags & RDMA_CAPABILITY_HASH)) {
+        fprintf(stderr, "Server cannot hash its memory. "
+                        "Will send every page.\n");
+        rdma->hash = false;
+    }
+    if (rdma->compress && !(cap.flags & RDMA_CAPABILITY_LZ4)) {
+        fprintf(stderr, "Server cannot decompress LZ4. "
+                        "Will send chunks uncompressed.\n");
+        rdma->compress = 0;
+    }
+    if (rdma->resume && !(cap.flags & RDMA_CAPABILITY_RESUME)) {
+        fprintf(stderr, "Server cannot resume. "
+                        "Will fail with the connection.\n");
+        rdma->resume = false;
+    }
+    if (rdma->free_page_agent && !(cap.flags & RDMA_CAPABILITY_DISCARD)) {
+        fprintf(stderr, "Server cannot discard pages. "
+                        "Will send free pages.\n");
+        g_free(rdma->free_page_agent);
+        rdma->free_page_agent = NULL;
+    }
+    rdma->parallel_finish = cap.flags & RDMA_CAPABILITY_PARALLEL_FINISH;
+    rdma->disk_writes = cap.flags & RDMA_CAPABILITY_DISK;
+
+    DPRINTF("Pin all memory: %s\n", rdma->pin_all ? "enabled" : "disabled");
+
+    rdma_ack_cm_event(cm_event);
+
+    ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
+    if (ret) {
+        ERROR(errp, "posting second control recv!");
+        goto err_rdma_source_connect;
+    }
+
+    rdma->control_ready_expected = 1;
+    rdma->nb_sent = 0;
+    return 0;
+
+err_rdma_source_connect:
+    qemu_rdma_cleanup(rdma);
+    return -1;
+}
+
+static int qemu_rdma_dest_init(RDMAContext *rdma, Error **errp)
+{
+    DTPRINTF("%s\n", __func__);
+    int ret = -EINVAL, idx;
+    struct rdma_cm_id *listen_id;
+    char ip[40] = "unknown";
+    struct rdma_addrinfo *res;
+    char port_str[16];
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        rdma->wr_data[idx].control_len = 0;
+        rdma->wr_data[idx].control_curr = NULL;
+    }
+
+    if (rdma->host == NULL) {
+        ERROR(errp, "RDMA host is not set!");
+        rdma->error_state = -EINVAL;
+        return -1;
+    }
+    /* create CM channel */
+    rdma->channel = rdma_create_event_channel();
+    if (!rdma->channel) {
+        ERROR(errp, "could not create rdma event channel");
+        rdma->error_state = -EINVAL;
+        return -1;
+    }
+
+    /* create CM id */
+    ret = rdma_create_id(rdma->channel, &listen_id, NULL, RDMA_PS_TCP);
+    if (ret) {
+        ERROR(errp, "could not create cm_id!");
+        goto err_dest_init_create_listen_id;
+    }
+    qemu_rdma_set_cm_qos(rdma, listen_id);
+
+    snprintf(port_str, 16, "%d", rdma->port);
+    port_str[15] = '\0';
+
+    if (rdma->host && strcmp("", rdma->host)) {
+        struct rdma_addrinfo *e;
+
+        ret = rdma_getaddrinfo(rdma->host, port_str, NULL, &res);
+        if (ret < 0) {
+            ERROR(errp, "could not rdma_getaddrinfo address %s", rdma->host);
+            goto err_dest_init_bind_addr;
+        }
+
+        for (e = res; e != NULL; e = e->ai_next) {
+            inet_ntop(e->ai_family,
+                &((struct sockaddr_in *) e->ai_dst_addr)->sin_addr, ip, sizeof ip);
+            DPRINTF("Trying %s => %s\n", rdma->host, ip);
+            ret = rdma_bind_addr(listen_id, e->ai_dst_addr);
+            if (!ret) {
+                if (e->ai_family == AF_INET6) {
+                    ret = qemu_rdma_broken_ipv6_kernel(errp, listen_id->verbs);
+                    if (ret) {
+                        continue;
+                    }
+                }
+                    
+                goto listen;
+            }
+        }
+
+        ERROR(errp, "Error: could not rdma_bind_addr!");
+        goto err_dest_init_bind_addr;
+    } else {
+        ERROR(errp, "migration host and port not specified!");
+        ret = -EINVAL;
+        goto err_dest_init_bind_addr;
+    }
+listen:
+
+    rdma->listen_id = listen_id;
+    qemu_rdma_dump_gid("dest_init", listen_id);
+    return 0;
+
+err_dest_init_bind_addr:
+    rdma_destroy_id(listen_id);
+err_dest_init_create_listen_id:
+    rdma_destroy_event_channel(rdma->channel);
+    rdma->channel = NULL;
+    rdma->error_state = ret;
+    return ret;
+
+}
+
+/*
+ * Options are appended to the address, comma separated, after any of the
+ * ones inet_parse() understands: "rdma:host:port[,option...]".
+ */
+static void qemu_rdma_parse_options(RDMAContext *rdma, const char *host_port)
+{
+    const char *opt = strchr(host_port, ',');
+
+    while (opt) {
+        opt++;
+        if (!strncmp(opt, "prewarm", 7) && (opt[7] == ',' || !opt[7])) {
+            rdma->prewarm = true;
+        } else if (!strncmp(opt, "defer", 5) && (opt[5] == ',' || !opt[5])) {
+            rdma->defer = true;
+        } else if (!strncmp(opt, "hash", 4) && (opt[4] == ',' || !opt[4])) {
+            rdma->hash = true;
+        } else if (!strncmp(opt, "resume", 6) && (opt[6] == ',' || !opt[6])) {
+            rdma->resume = true;
+        } else if (!strncmp(opt, "recv-thread", 11) &&
+                   (opt[11] == ',' || !opt[11])) {
+            rdma->recv_thread = true;
+        } else if (!strncmp(opt, "workers", 7) &&
+                   (opt[7] == ',' || opt[7] == '=' || !opt[7])) {
+            rdma->nb_workers = opt[7] != '=' ? RDMA_WORKERS :
+                               MAX(1, MIN(atoi(opt + 8), RDMA_WORKERS_MAX));
+        } else if (!strncmp(opt, "compress", 8) &&
+                   (opt[8] == ',' || opt[8] == '=' || !opt[8])) {
+#ifdef CONFIG_LZ4
+            rdma->compress = opt[8] != '=' ? RDMA_LZ4_THREADS :
+                             MAX(1, MIN(atoi(opt + 9), RDMA_LZ4_MAX_THREADS));
+#else
+            fprintf(stderr, "rdma: built without LZ4, ignoring compress\n");
+#endif
+        } else if (!strncmp(opt, "rails=", 6)) {
+            rdma->rails = MAX(1, MIN(atoi(opt + 6), RDMA_MAX_RAILS));
+        } else if (!strncmp(opt, "tos=", 4)) {
+            rdma->tos = MAX(0, MIN(atoi(opt + 4), 255));
+        } else if (!strncmp(opt, "sl=", 3)) {
+            rdma->sl = MAX(0, MIN(atoi(opt + 3), 15));
+        } else if (!strncmp(opt, "timeline=", 9)) {
+            const char *end = strchr(opt, ',');
+
+            g_free(rdma->timeline);
+            rdma->timeline = end ? g_strndup(opt + 9, end - opt - 9)
+                                 : g_strdup(opt + 9);
+        } else if (!strncmp(opt, "record=", 7)) {
+            const char *end = strchr(opt, ',');
+
+            g_free(rdma->record);
+            rdma->record = end ? g_strndup(opt + 7, end - opt - 7)
+                               : g_strdup(opt + 7);
+        } else if (!strncmp(opt, "free-page-agent=", 16)) {
+            const char *end = strchr(opt, ',');
+
+            g_free(rdma->free_page_agent);
+            rdma->free_page_agent = end ? g_strndup(opt + 16, end - opt - 16)
+                                        : g_strdup(opt + 16);
+        }
+        opt = strchr(opt, ',');
+    }
+}
+
+static RDMAContext *qemu_rdma_context_new(void)
+{
+    RDMAContext *rdma = g_malloc0(sizeof(RDMAContext));
+
+    rdma->current_index = -1;
+    rdma->current_chunk = -1;
+    rdma->rails = 1;
+    rdma->nb_rails = 1;
+    rdma->tos = -1;
+    rdma->sl = -1;
+    rdma->wait_fd = -1;
+    rdma->local_fd = -1;
+
+    return rdma;
+}
+
+static void *qemu_rdma_data_init(const char *host_port, Error **errp)
+{
+    DTPRINTF("%s\n", __func__);
+    RDMAContext *rdma = NULL;
+    InetSocketAddress *addr;
+
+    if (host_port) {
+        rdma = qemu_rdma_context_new();
+
+        addr = inet_parse(host_port, NULL);
+        if (addr != NULL) {
+            rdma->port = atoi(addr->port);
+            rdma->host = g_strdup(addr->host);
+            qemu_rdma_parse_options(rdma, host_port);
+        } else {
+            ERROR(errp, "bad RDMA migration address '%s'", host_port);
+            g_free(rdma);
+            rdma = NULL;
+        }
+
+        qapi_free_InetSocketAddress(addr);
+    }
+
+    return rdma;
+}
+
+/*
+ * QEMUFile interface to the control channel.
+ * SEND messages for control only.
+ * pc.ram is handled with regular RDMA messages.
+ */
+static int qemu_rdma_put_buffer(void *opaque, const uint8_t *buf,
+                                int64_t pos, int size)
+{
+
+    QEMUFileRDMA *r = opaque;
+    QEMUFile *f = r->file;
+    RDMAContext *rdma = r->rdma;
+    size_t remaining = size;
+    uint8_t * data = (void *) buf;
+    int ret;
+
+    CHECK_ERROR_STATE();
+
+    /*
+     * Push out any writes that
+     * we're queued up for pc.ram.
+     */
+    ret = qemu_rdma_write_flush(f, rdma);
+    if (ret < 0) {
+        rdma->error_state = ret;
+        return ret;
+    }
+
+    /* and the disk chunks, which must land before what follows them */
+    ret = qemu_rdma_disk_flush(rdma);
+    if (ret < 0) {
+        rdma->error_state = ret;
+        return ret;
+    }
+
+    while (remaining) {
+        RDMAControlHeader head;
+
+        r->len = MIN(remaining, RDMA_SEND_INCREMENT);
+        remaining -= r->len;
+
+        head.len = r->len;
+        head.type = RDMA_CONTROL_QEMU_FILE;
+
+        ret = qemu_rdma_exchange_send(rdma, &head, data, NULL, NULL, NULL);
+
+        if (ret < 0) {
+            rdma->error_state = ret;
+            return ret;
+        }
+        qemu_rdma_pace(rdma, r->len);
+
+        data += r->len;
+    }
+
+    return size;
+}
+
+static size_t qemu_rdma_fill(RDMAContext *rdma, uint8_t *buf,
+                             int size, int idx)
+{
+    size_t len = 0;
+
+    if (rdma->wr_data[idx].control_len) {
+        DDDPRINTF("RDMA %" PRId64 " of %d bytes already in buffer\n",
+                    rdma->wr_data[idx].control_len, size);
+
+        len = MIN(size, rdma->wr_data[idx].control_len);
+        memcpy(buf, rdma->wr_data[idx].control_curr, len);
+        rdma->wr_data[idx].control_curr += len;
+        rdma->wr_data[idx].control_len -= len;
+    }
+
+    return len;
+}
+
+/*
+ * QEMUFile interface to the control channel.
+ * RDMA links don't use bytestreams, so we have to
+ * return bytes to QEMUFile opportunistically.
+ */
+static int qemu_rdma_get_buffer(void *opaque, uint8_t *buf,
+                                int64_t pos, int size)
+{
+    QEMUFileRDMA *r = opaque;
+    RDMAContext *rdma = r->rdma;
+    RDMAControlHeader head;
+    int ret = 0;
+
+    CHECK_ERROR_STATE();
+
+    if (rdma->recv) {
+        return qemu_rdma_recv_read(rdma, buf, size);
+    }
+
+    /*
+     * First, we hold on to the last SEND message we
+     * were given and dish out the bytes until we run
+     * out of bytes.
+     */
+    r->len = qemu_rdma_fill(r->rdma, buf, size, 0);
+    if (r->len) {
+        return r->len;
+    }
+
+    /*
+     * Once we run out, we block and wait for another
+     * SEND message to arrive.  Block migration sends its disk chunks
+     * in between, outside of any registration round.
+     */
+    for (;;) {
+        ret = qemu_rdma_exchange_recv(rdma, &head, RDMA_CONTROL_NONE);
+        if (ret < 0 || (head.type != RDMA_CONTROL_DISK_RING_REQUEST &&
+                        head.type != RDMA_CONTROL_DISK_WRITTEN)) {
+            break;
+        }
+        ret = qemu_rdma_handle_control(rdma, &head);
+        if (ret < 0) {
+            break;
+        }
+    }
+    if (!ret && head.type != RDMA_CONTROL_QEMU_FILE) {
+        fprintf(stderr, "Was expecting a %s (%d) control message"
+                ", but got: %s (%d), length: %d\n",
+                control_desc[RDMA_CONTROL_QEMU_FILE], RDMA_CONTROL_QEMU_FILE,
+                control_desc[head.type], head.type, head.len);
+        ret = -EIO;
+    }
+    if (!ret) {
+        ret = qemu_rdma_disk_wait(rdma);
+    }
+
+    if (ret < 0) {
+        rdma->error_state = ret;
+        return ret;
+    }
+
+    /*
+     * SEND was received with new bytes, now try again.
+     */
+    return qemu_rdma_fill(r->rdma, buf, size, 0);
+}
+
+/*
+ * Block until all the outstanding chunks have been delivered by the hardware.
+ */
+static int qemu_rdma_drain_cq(QEMUFile *f, RDMAContext *rdma)
+{
+    int ret;
+
+    if (qemu_rdma_write_flush(f, rdma) < 0) {
+        return -EIO;
+    }
+
+    if (qemu_rdma_drain_rails(rdma) < 0) {
+        fprintf(stderr, "rdma migration: rail polling error!\n");
+        return -EIO;
+    }
+
+    while (rdma->nb_sent) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        ret = qemu_rdma_recover(rdma, ret, NULL);
+        if (ret < 0) {
+            fprintf(stderr, "rdma migration: complete polling error!\n");
+            return -EIO;
+        }
+    }
+
+    qemu_rdma_unregister_waiting(rdma);
+
+    return 0;
+}
+
+/*
+ * The dest must not let the guest run before the writes the source
+ * did not wait for have landed.  Called before disconnecting, which the
+ * incoming side does before starting the VM.
+ */
+static void qemu_rdma_wait_barrier(RDMAContext *rdma)
+{
+    RDMAControlHeader head;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (rdma->finish_start) {
+        qemu_rdma_span(rdma, "device state", rdma->finish_start, -1);
+    }
+    if (rdma->barrier_pending && !rdma->error_state) {
+        if (rdma->recv ? qemu_rdma_recv_stop(rdma, true) < 0 :
+            qemu_rdma_exchange_recv(rdma, &head, RDMA_CONTROL_BARRIER) < 0) {
+            fprintf(stderr, "rdma migration: error receiving barrier!\n");
+        }
+        qemu_rdma_span(rdma, "barrier", start, -1);
+    }
+    qemu_rdma_recv_stop(rdma, false);
+    rdma->barrier_pending = false;
+}
+
+static int qemu_rdma_close(void *opaque)
+{
+    DTPRINTF("%s\n", __func__);
+    DPRINTF("Shutting down connection.\n");
+    QEMUFileRDMA *r = opaque;
+    if (r->rdma) {
+        qemu_rdma_wait_barrier(r->rdma);
+        qemu_rdma_cleanup(r->rdma);
+        g_free(r->rdma);
+    }
+    g_free(r);
+    return 0;
+}
+
+/*
+ * Parameters:
+ *    @offset == 0 :
+ *        This means that 'block_offset' is a full virtual address that does not
+ *        belong to a RAMBlock of the virtual machine and instead
+ *        represents a private malloc'd memory area that the caller wishes to
+ *        transfer.
+ *
+ *    @offset != 0 :
+ *        Offset is an offset to be added to block_offset and used
+ *        to also lookup the corresponding RAMBlock.
+ *
+ *    @size > 0 :
+ *        Initiate an transfer this size.
+ *
+ *    @size == 0 :
+ *        A 'hint' or 'advice' that means that we wish to speculatively
+ *        and asynchronously unregister this memory. In this case, there is no
+ *        guarantee that the unregister will actually happen, for example,
+ *        if the memory is being actively transmitted. Additionally, the memory
+ *        may be re-registered at any future time if a write within the same
+ *        chunk was requested again, even if you attempted to unregister it
+ *        here.
+ *
+ *    @size < 0 : TODO, not yet supported
+ *        Unregister the memory NOW. This means that the caller does not
+ *        expect there to be any future RDMA transfers and we just want to clean
+ *        things up. This is used in case the upper layer owns the memory and
+ *        cannot wait for qemu_fclose() to occur.
+ *
+ *    @bytes_sent : User-specificed pointer to indicate how many bytes were
+ *                  sent. Usually, this will not be more than a few bytes of
+ *                  the protocol because most transfers are sent asynchronously.
+ */
+static size_t qemu_rdma_save_page(QEMUFile *f, void *opaque,
+                                  ram_addr_t block_offset, ram_addr_t offset,
+                                  size_t size, int *bytes_sent)
+{
+    QEMUFileRDMA *rfile = opaque;
+    RDMAContext *rdma = rfile->rdma;
+    int ret;
+
+    CHECK_ERROR_STATE();
+
+    qemu_rdma_record(rdma, RDMA_TRACE_PAGE, block_offset + offset, size);
+    qemu_fflush(f);
+
+    if (size > 0) {
+        /*
+         * Add this page to the current 'chunk'. If the chunk
+         * is full, or the page doen't belong to the current chunk,
+         * an actual RDMA write will occur and a new chunk will be formed.
+         */
+        ret = qemu_rdma_save_piece(f, rdma, block_offset, offset, size);
+        if (ret < 0) {
+            fprintf(stderr, "rdma migration: write error! %d\n", ret);
+            goto err;
+        }
+
+        /*
+         * We always return 1 bytes because the RDMA
+         * protocol is completely asynchronous. We do not yet know
+         * whether an  identified chunk is zero or not because we're
+         * waiting for other pages to potentially be merged with
+         * the current chunk. So, we have to call qemu_update_position()
+         * later on when the actual write occurs.
+         */
+        if (bytes_sent) {
+            *bytes_sent = 1;
+        }
+    } else {
+        uint64_t index, chunk;
+
+        /* TODO: Change QEMUFileOps prototype to be signed: size_t => long
+        if (size < 0) {
+            ret = qemu_rdma_drain_cq(f, rdma);
+            if (ret < 0) {
+                fprintf(stderr, "rdma: failed to synchronously drain"
+                                " completion queue before unregistration.\n");
+                goto err;
+            }
+        }
+        */
+
+        ret = qemu_rdma_search_ram_block(rdma, block_offset,
+                                         offset, size, &index, &chunk);
+
+        if (ret) {
+            fprintf(stderr, "ram block search failed\n");
+            goto err;
+        }
+
+        qemu_rdma_signal_unregister(rdma, index, chunk, 0);
+
+        /*
+         * TODO: Synchronous, guaranteed unregistration (should not occur during
+         * fast-path). Otherwise, unregisters will process on the next call to
+         * qemu_rdma_drain_cq()
+        if (size < 0) {
+            qemu_rdma_unregister_waiting(rdma);
+        }
+        */
+    }
+
+    /*
+     * Drain the Completion Queue if possible, but do not block,
+     * just poll.
+     *
+     * If nothing to poll, the end of the iteration will do this
+     * again to make sure we don't overflow the request queue.
+     */
+    ret = qemu_rdma_recover(rdma, qemu_rdma_poll_all(rdma), NULL);
+    if (ret < 0) {
+        fprintf(stderr, "rdma migration: polling error! %d\n", ret);
+        goto err;
+    }
+
+    return RAM_SAVE_CONTROL_DELAYED;
+err:
+    rdma->error_state = ret;
+    return ret;
+}
+
+/*
+ * qemu_rdma_save_page() for every page of RAM block 'block_offset' set
+ * in 'bitmap' between 'start' and 'end': each run of dirty pages is
+ * added to the current chunk in as few pieces as the chunk boundaries
+ * (and the pacing quantum) allow, and the QEMUFile flush and the CQ
+ * drain happen once for the whole batch.
+ */
+static long qemu_rdma_save_pages(QEMUFile *f, RDMAContext *rdma,
+                                 ram_addr_t block_offset,
+                                 const unsigned long *bitmap,
+                                 uint64_t start, uint64_t end)
+{
+    uint64_t first = block_offset >> TARGET_PAGE_BITS;
+    uint64_t page, run_end;
+    long pages = 0;
+    int ret;
+
+    CHECK_ERROR_STATE();
+
+    qemu_fflush(f);
+
+    for (page = find_next_bit(bitmap, end, start); page < end;
+         page = find_next_bit(bitmap, end, run_end)) {
+        ram_addr_t offset, piece;
+
+        run_end = find_next_zero_bit(bitmap, end, page);
+        offset = (page - first) << TARGET_PAGE_BITS;
+        pages += run_end - page;
+
+        while (page < run_end) {
+            piece = qemu_rdma_piece(rdma, offset,
+                                    (run_end - page) << TARGET_PAGE_BITS);
+
+            qemu_rdma_record(rdma, RDMA_TRACE_PAGE, block_offset + offset,
+                             piece);
+            ret = qemu_rdma_save_piece(f, rdma, block_offset, offset, piece);
+            if (ret < 0) {
+                fprintf(stderr, "rdma migration: write error! %d\n", ret);
+                goto err;
+            }
+
+            offset += piece;
+            page += piece >> TARGET_PAGE_BITS;
+        }
+    }
+
+    ret = qemu_rdma_recover(rdma, qemu_rdma_poll_all(rdma), NULL);
+    if (ret < 0) {
+        fprintf(stderr, "rdma migration: polling error! %d\n", ret);
+        goto err;
+    }
+
+    return pages;
+err:
+    rdma->error_state = ret;
+    return ret;
+}
+
+static int qemu_rdma_accept(RDMAContext *rdma)
+{
+    DTPRINTF("%s\n", __func__);
+    RDMACapabilities cap;
+    struct rdma_conn_param conn_param = {
+                                            .responder_resources = 2,
+                                            .private_data = &cap,
+                                            .private_data_len = sizeof(cap),
+                                         };
+    struct rdma_cm_event *cm_event;
+    struct ibv_context *verbs;
+    int ret = -EINVAL;
+    int idx;
+
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
+    if (ret) {
+        goto err_rdma_dest_wait;
+    }
+
+    if (cm_event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+        rdma_ack_cm_event(cm_event);
+        goto err_rdma_dest_wait;
+    }
+
+    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+
+    network_to_caps(&cap);
+
+    if (cap.version < 1 || cap.version > RDMA_CONTROL_VERSION_CURRENT) {
+            fprintf(stderr, "Unknown source RDMA version: %d, bailing...\n",
+                            cap.version);
+            rdma_ack_cm_event(cm_event);
+            goto err_rdma_dest_wait;
+    }
+
+    /*
+     * Respond with only the capabilities this version of QEMU knows about.
+     */
+    cap.flags &= known_capabilities;
+
+    /*
+     * Enable the ones that we do know about.
+     * Add other checks here as new ones are introduced.
+     */
+    if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
+        rdma->pin_all = true;
+    }
+    rdma->resume = cap.flags & RDMA_CAPABILITY_RESUME;
+    rdma->parallel_finish = cap.flags & RDMA_CAPABILITY_PARALLEL_FINISH;
+
+    rdma->cm_id = cm_event->id;
+    verbs = cm_event->id->verbs;
+
+    rdma_ack_cm_event(cm_event);
+
+    DPRINTF("Memory pin all: %s\n", rdma->pin_all ? "enabled" : "disabled");
+
+    caps_to_network(&cap);
+
+    DPRINTF("verbs context after listen: %p\n", verbs);
+
+    if (!rdma->verbs) {
+        rdma->verbs = verbs;
+    } else if (rdma->verbs != verbs) {
+            fprintf(stderr, "ibv context not matching %p, %p!\n",
+                    rdma->verbs, verbs);
+            goto err_rdma_dest_wait;
+    }
+
+    qemu_rdma_dump_id("dest_init", verbs);
+
+    qemu_rdma_prewarm_wait(rdma);
+
+    if (!rdma->pd) {
+        ret = qemu_rdma_alloc_pd_cq(rdma);
+        if (ret) {
+            fprintf(stderr, "rdma migration: error allocating pd and cq!\n");
+            goto err_rdma_dest_wait;
+        }
+    }
+
+    ret = qemu_rdma_alloc_qp(rdma);
+    if (ret) {
+        fprintf(stderr, "rdma migration: error allocating qp!\n");
+        goto err_rdma_dest_wait;
+    }
+
+    if (!rdma->blockmap) {
+        ret = qemu_rdma_init_ram_blocks(rdma);
+        if (ret) {
+            fprintf(stderr, "rdma migration: error initializing ram blocks!\n");
+            goto err_rdma_dest_wait;
+        }
+    }
+
+    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+        if (rdma->wr_data[idx].control_mr) {
+            continue;
+        }
+        ret = qemu_rdma_reg_control(rdma, idx);
+        if (ret) {
+            fprintf(stderr, "rdma: error registering %d control!\n", idx);
+            goto err_rdma_dest_wait;
+        }
+    }
+
+    qemu_set_fd_handler2(rdma->channel->fd, NULL, NULL, NULL, NULL);
+
+    ret = rdma_accept(rdma->cm_id, &conn_param);
+    if (ret) {
+        fprintf(stderr, "rdma_accept returns %d!\n", ret);
+        goto err_rdma_dest_wait;
+    }
+
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
+    if (ret) {
+        fprintf(stderr, "rdma_accept get_cm_event failed %d!\n", ret);
+        goto err_rdma_dest_wait;
+    }
+
+    if (cm_event->event != RDMA_CM_EVENT_ESTABLISHED) {
+        fprintf(stderr, "rdma_accept not event established!\n");
+        rdma_ack_cm_event(cm_event);
+        goto err_rdma_dest_wait;
+    }
+
+    rdma_ack_cm_event(cm_event);
+    rdma->connected = true;
+
+    ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
+    if (ret) {
+        fprintf(stderr, "rdma migration: error posting second control recv!\n");
+        goto err_rdma_dest_wait;
+    }
+
+    qemu_rdma_dump_gid("dest_connect", rdma->cm_id);
+
+    return 0;
+
+err_rdma_dest_wait:
+    rdma->error_state = ret;
+    qemu_rdma_cleanup(rdma);
+    return ret;
+}
+
+/*
+ * During each iteration of the migration, we listen for instructions
+ * by the source VM to perform dynamic page registrations before they
+ * can perform RDMA operations.
+ *
+ * We respond with the 'rkey'.
+ *
+ * Keep doing this until the source tells us to stop.
+ */
+/*
+ * Dest uses this to prepare to transmit the RAMBlock descriptions
+ * to the source VM after connection setup.
+ * Both sides use the "remote" structure to communicate and update
+ * their "local" descriptions with what was sent.
+ */
+static void qemu_rdma_prepare_remote_blocks(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        rdma->block[i].remote_host_addr =
+            (uint64_t)(local->block[i].local_host_addr);
+
+        if (rdma->pin_all) {
+            rdma->block[i].remote_rkey = local->block[i].mr->rkey;
+        }
+
+        rdma->block[i].offset = local->block[i].offset;
+        rdma->block[i].length = local->block[i].length;
+
+        remote_block_to_network(&rdma->block[i]);
+    }
+}
+
+/*
+ * Source uses this to propagate the dest's RAMBlock descriptions,
+ * as received in 'remote', to its local copy.
+ *
+ * The protocol uses two different sets of rkeys (mutually exclusive):
+ * 1. One key to represent the virtual address of the entire ram block.
+ *    (dynamic chunk registration disabled - pin everything with one rkey.)
+ * 2. One to represent individual chunks within a ram block.
+ *    (dynamic chunk registration enabled - pin individual chunks.)
+ *
+ * Once the capability is successfully negotiated, the destination transmits
+ * the keys to use (or sends them later) including the virtual addresses
+ * and then propagates the remote ram block descriptions to his local copy.
+ */
+static int qemu_rdma_process_remote_blocks(RDMAContext *rdma,
+                                           const void *remote,
+                                           int nb_remote_blocks, Error **errp)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i, j;
+
+    if (local->nb_blocks != nb_remote_blocks) {
+        ERROR(errp, "ram blocks mismatch #1! "
+                    "Your QEMU command line parameters are probably "
+                    "not identical on both the source and destination.");
+        return -EINVAL;
+    }
+
+    memcpy(rdma->block, remote, nb_remote_blocks * sizeof(RDMARemoteBlock));
+    for (i = 0; i < nb_remote_blocks; i++) {
+        network_to_remote_block(&rdma->block[i]);
+
+        /* search local ram blocks */
+        for (j = 0; j < local->nb_blocks; j++) {
+            if (rdma->block[i].offset != local->block[j].offset) {
+                continue;
+            }
+
+            if (rdma->block[i].length != local->block[j].length) {
+                ERROR(errp, "ram blocks mismatch #2! "
+                    "Your QEMU command line parameters are probably "
+                    "not identical on both the source and destination.");
+                return -EINVAL;
+            }
+            local->block[j].remote_host_addr =
+                    rdma->block[i].remote_host_addr;
+            local->block[j].remote_rkey = rdma->block[i].remote_rkey;
+            break;
+        }
+
+        if (j >= local->nb_blocks) {
+            ERROR(errp, "ram blocks mismatch #3! "
+                    "Your QEMU command line parameters are probably "
+                    "not identical on both the source and destination.");
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Handle one control message the dest received, other than QEMU_FILE.
+ * Returns 1 once the source said the registration round is over, with
+ * a REGISTER_FINISHED or FINAL_FINISHED, and 0 if more are to come.
+ * With ",workers", the COMPRESS fills in progress are waited for before
+ * anything but another COMPRESS or a REGISTER_REQUEST.
+ */
+static int qemu_rdma_handle_control(RDMAContext *rdma,
+                                    RDMAControlHeader *head)
+{
+    RDMAControlHeader reg_resp = { .len = sizeof(RDMARegisterResult),
+                               .type = RDMA_CONTROL_REGISTER_RESULT,
+                               .repeat = 0,
+                             };
+    RDMAControlHeader unreg_resp = { .len = 0,
+                               .type = RDMA_CONTROL_UNREGISTER_FINISHED,
+                               .repeat = 0,
+                             };
+    RDMAControlHeader blocks = { .type = RDMA_CONTROL_RAM_BLOCKS_RESULT,
+                                 .repeat = 1 };
+    RDMARegister *reg, *registers;
+    RDMACompress *comp;
+    RDMARegisterResult *reg_result;
+    static RDMARegisterResult results[RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE];
+    RDMALocalBlock *block;
+    void *host_addr;
+    int ret = 0;
+    int idx = 0;
+    int count = 0;
+    int64_t reg_start;
+
+    if (head->repeat > RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE) {
+        fprintf(stderr, "rdma: Too many requests in this message (%d)."
+                        "Bailing.\n", head->repeat);
+        return -EIO;
+    }
+
+    if (rdma->nb_workers && !rdma->workers) {
+        rdma->workers = qemu_rdma_workers_new(rdma, rdma->nb_workers);
+    }
+    if (head->type != RDMA_CONTROL_COMPRESS &&
+        head->type != RDMA_CONTROL_REGISTER_REQUEST) {
+        ret = qemu_rdma_workers_wait(rdma);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    switch (head->type) {
+    case RDMA_CONTROL_COMPRESS:
+        comp = (RDMACompress *) rdma->wr_data[idx].control_curr;
+        network_to_compress(comp);
+
+        DDPRINTF("Zapping zero chunk: %" PRId64
+                " bytes, index %d, offset %" PRId64 "\n",
+                comp->length, comp->block_idx, comp->offset);
+        block = &(rdma->local_ram_blocks.block[comp->block_idx]);
+
+        host_addr = block->local_host_addr +
+                        (comp->offset - block->offset);
+
+        ret = qemu_rdma_zero_fill(rdma, block, host_addr, comp->value,
+                                  comp->length);
+        if (ret < 0) {
+            return ret;
+        }
+        rdma->stats.zero_chunks++;
+        RDMA_EVENT(COMPRESS, comp->offset, comp->length);
+        break;
+
+    case RDMA_CONTROL_KEEP:
+        comp = (RDMACompress *) rdma->wr_data[idx].control_curr;
+
+        /* nothing to do, the pages are already what they should be */
+        for (count = 0; count < head->repeat; count++) {
+            network_to_compress(&comp[count]);
+            rdma->stats.kept += comp[count].length >> TARGET_PAGE_BITS;
+            RDMA_EVENT(KEEP, comp[count].offset, comp[count].length);
+        }
+        break;
+
+    case RDMA_CONTROL_DISCARD:
+        comp = (RDMACompress *) rdma->wr_data[idx].control_curr;
+
+        /*
+         * Whatever the guest left in them, zero is as good.  Not on the
+         * workers: a REGISTER_REQUEST for the rest of a chunk may come
+         * next, and must not pin pages being madvise()d away.
+         */
+        for (count = 0; count < head->repeat; count++) {
+            network_to_compress(&comp[count]);
+            if (comp[count].block_idx >= rdma->local_ram_blocks.nb_blocks) {
+                return -EINVAL;
+            }
+            block = &(rdma->local_ram_blocks.block[comp[count].block_idx]);
+            if (comp[count].offset - block->offset > block->length ||
+                comp[count].length >
+                    block->length - (comp[count].offset - block->offset)) {
+                return -EINVAL;
+            }
+
+            host_addr = block->local_host_addr +
+                            (comp[count].offset - block->offset);
+            qemu_rdma_fill_range(host_addr, comp[count].length, 0,
+                                 qemu_rdma_pinned(block, host_addr,
+                                                  comp[count].length));
+            rdma->stats.discarded += comp[count].length >> TARGET_PAGE_BITS;
+            RDMA_EVENT(DISCARD, comp[count].offset, comp[count].length);
+        }
+        break;
+
+    case RDMA_CONTROL_HASH_REQUEST:
+        return qemu_rdma_send_hashes(rdma,
+                    (RDMAHashRequest *) rdma->wr_data[idx].control_curr);
+
+#ifdef CONFIG_LZ4
+    case RDMA_CONTROL_LZ4_RING_REQUEST:
+        ret = qemu_rdma_lz4_ring(rdma);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to send control buffer!\n");
+        }
+        return ret;
+
+    case RDMA_CONTROL_LZ4_WRITTEN:
+        return qemu_rdma_lz4_decompress(rdma,
+                    (RDMALZ4Job *) rdma->wr_data[idx].control_curr,
+                    head->repeat);
+#endif
+
+    case RDMA_CONTROL_DISK_RING_REQUEST:
+        ret = qemu_rdma_disk_ring(rdma);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to send control buffer!\n");
+        }
+        return ret;
+
+    case RDMA_CONTROL_DISK_WRITTEN:
+        return qemu_rdma_disk_write(rdma,
+                    (RDMADiskJob *) rdma->wr_data[idx].control_curr,
+                    head->repeat);
+
+    case RDMA_CONTROL_REGISTER_FINISHED:
+        DDDPRINTF("Current registrations complete.\n");
+        return 1;
+
+    case RDMA_CONTROL_FINAL_FINISHED:
+        DDDPRINTF("Last iteration sent, barrier pending.\n");
+        return 1;
+
+    case RDMA_CONTROL_RAM_BLOCKS_REQUEST:
+        DPRINTF("Initial setup info requested.\n");
+
+        if (rdma->pin_all) {
+            ret = qemu_rdma_reg_whole_ram_blocks(rdma);
+            if (ret) {
+                fprintf(stderr, "rdma migration: error dest "
+                                "registering ram blocks!\n");
+                return ret;
+            }
+        }
+
+        qemu_rdma_prepare_remote_blocks(rdma);
+
+        blocks.len = rdma->local_ram_blocks.nb_blocks
+                                            * sizeof(RDMARemoteBlock);
+
+
+        ret = qemu_rdma_reply(rdma, (uint8_t *) rdma->block, &blocks);
+
+        if (ret < 0) {
+            fprintf(stderr, "rdma migration: error sending remote info!\n");
+            return ret;
+        }
+
+        break;
+    case RDMA_CONTROL_REGISTER_REQUEST:
+        DDPRINTF("There are %d registration requests\n", head->repeat);
+
+        reg_resp.repeat = head->repeat;
+        registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
+        reg_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        for (count = 0; count < head->repeat; count++) {
+            uint64_t chunk;
+            uint8_t *chunk_start, *chunk_end;
+
+            reg = &registers[count];
+            network_to_register(reg);
+
+            reg_result = &results[count];
+
+            DDPRINTF("Registration request (%d): index %d, current_addr %"
+                     PRIu64 " chunks: %" PRIu64 "\n", count,
+                     reg->current_index, reg->key.current_addr, reg->chunks);
+
+            block = &(rdma->local_ram_blocks.block[reg->current_index]);
+            if (block->is_ram_block) {
+                host_addr = (block->local_host_addr +
+                            (reg->key.current_addr - block->offset));
+                chunk = ram_chunk_index(block->local_host_addr,
+                                        (uint8_t *) host_addr);
+            } else {
+                chunk = reg->key.chunk;
+                host_addr = block->local_host_addr +
+                    (reg->key.chunk * (1UL << RDMA_REG_CHUNK_SHIFT));
+            }
+            chunk_start = ram_chunk_start(block, chunk);
+            chunk_end = ram_chunk_end(block, chunk + reg->chunks);
+            if (qemu_rdma_register_dest(rdma, block, (uint8_t *) host_addr,
+                        &reg_result->rkey, chunk, chunk_start, chunk_end)) {
+                fprintf(stderr, "cannot get rkey!\n");
+                return -EINVAL;
+            }
+
+            reg_result->host_addr = (uint64_t) block->local_host_addr;
+        }
+
+        if (qemu_rdma_workers_wait(rdma)) {
+            fprintf(stderr, "cannot get rkey!\n");
+            return -EINVAL;
+        }
+        for (count = 0; count < head->repeat; count++) {
+            DDPRINTF("Registered rkey for this request: %x\n",
+                            results[count].rkey);
+            result_to_network(&results[count]);
+        }
+
+        ret = qemu_rdma_reply(rdma, (uint8_t *) results, &reg_resp);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to send control buffer!\n");
+            return ret;
+        }
+        qemu_rdma_span(rdma, "register", reg_start, head->repeat);
+        break;
+    case RDMA_CONTROL_UNREGISTER_REQUEST:
+        DDPRINTF("There are %d unregistration requests\n", head->repeat);
+        unreg_resp.repeat = head->repeat;
+        registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
+
+        for (count = 0; count < head->repeat; count++) {
+            reg = &registers[count];
+            network_to_register(reg);
+
+            DDPRINTF("Unregistration request (%d): "
+                     " index %d, chunk %" PRIu64 "\n",
+                     count, reg->current_index, reg->key.chunk);
+
+            block = &(rdma->local_ram_blocks.block[reg->current_index]);
+
+            if (block->mr) {
+                /* pre-registered as a whole, nothing to do */
+                continue;
+            }
+            if (!block->pmr || !block->pmr[reg->key.chunk]) {
+                /* asked again on a new connection, see ",resume" */
+                continue;
+            }
+
+            ret = ibv_dereg_mr(block->pmr[reg->key.chunk]);
+            block->pmr[reg->key.chunk] = NULL;
+            rdma->stats.unregistrations++;
+            RDMA_EVENT(UNREGISTER, reg->current_index, reg->key.chunk);
+
+            if (ret != 0) {
+                perror("rdma unregistration chunk failed");
+                return -ret;
+            }
+
+            rdma->total_registrations--;
+
+            DDPRINTF("Unregistered chunk %" PRIu64 " successfully.\n",
+                        reg->key.chunk);
+        }
+
+        ret = qemu_rdma_reply(rdma, NULL, &unreg_resp);
+
+        if (ret < 0) {
+            fprintf(stderr, "Failed to send control buffer!\n");
+            return ret;
+        }
+        break;
+    case RDMA_CONTROL_REGISTER_RESULT:
+    case RDMA_CONTROL_HASH_RESULT:
+    case RDMA_CONTROL_LZ4_RING_RESULT:
+        fprintf(stderr, "Invalid RESULT message at dest.\n");
+        return -EIO;
+    default:
+        fprintf(stderr, "Unknown control message %s\n",
+                            control_desc[head->type]);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * The end of a registration round was handled, 'type' says which.
+ */
+static void qemu_rdma_round_done(RDMAContext *rdma, int type)
+{
+    if (type == RDMA_CONTROL_FINAL_FINISHED) {
+        rdma->barrier_pending = true;
+        rdma->finish_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+}
+
+/*
+ * ",recv-thread": queue an entry for the coroutine.  'data' is copied.
+ */
+static void qemu_rdma_recv_push(RDMARecv *recv, int type, int ret,
+                                const uint8_t *data, uint32_t len)
+{
+    RDMARecvEntry *entry = g_malloc(sizeof(*entry) + len);
+    uint64_t one = 1;
+
+    entry->next = NULL;
+    entry->type = type;
+    entry->ret = ret;
+    entry->len = len;
+    entry->pos = 0;
+    if (len) {
+        memcpy(entry->data, data, len);
+    }
+
+    qemu_mutex_lock(&recv->lock);
+    *recv->tail = entry;
+    recv->tail = &entry->next;
+    recv->queued += len;
+    qemu_mutex_unlock(&recv->lock);
+
+    if (write(recv->event, &one, sizeof(one)) != sizeof(one)) {
+        perror("rdma migration: cannot signal the loadvm coroutine");
+    }
+}
+
+/*
+ * The oldest entry of the queue, yielding until there is one.  It stays
+ * queued until qemu_rdma_recv_pop().
+ */
+static RDMARecvEntry *qemu_rdma_recv_peek(RDMARecv *recv)
+{
+    RDMARecvEntry *entry;
+    uint64_t count;
+
+    for (;;) {
+        qemu_mutex_lock(&recv->lock);
+        entry = recv->head;
+        qemu_mutex_unlock(&recv->lock);
+        if (entry) {
+            return entry;
+        }
+
+        yield_until_fd_readable(recv->event);
+        if (read(recv->event, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN) {
+            perror("rdma migration: cannot read the recv thread's eventfd");
+        }
+    }
+}
+
+static void qemu_rdma_recv_pop(RDMARecv *recv)
+{
+    RDMARecvEntry *entry;
+
+    qemu_mutex_lock(&recv->lock);
+    entry = recv->head;
+    recv->head = entry->next;
+    if (!recv->head) {
+        recv->tail = &recv->head;
+    }
+    recv->queued -= entry->len;
+    qemu_cond_signal(&recv->room);
+    qemu_mutex_unlock(&recv->lock);
+
+    g_free(entry);
+}
+
+/*
+ * An entry that is not what the coroutine waits for: the thread's
+ * error, or a protocol error.  Either stops the migration.
+ */
+static int qemu_rdma_recv_unexpected(RDMAContext *rdma, RDMARecvEntry *entry,
+                                     int expecting)
+{
+    int ret = entry->ret;
+
+    if (entry->type != RDMA_CONTROL_ERROR) {
+        fprintf(stderr, "Was expecting a %s (%d) control message"
+                ", but got: %s (%d), length: %d\n",
+                control_desc[expecting], expecting,
+                control_desc[entry->type], entry->type, entry->len);
+        ret = -EIO;
+    }
+    rdma->error_state = ret;
+    return ret;
+}
+
+/*
+ * get_buffer() of ",recv-thread": the bytes of the oldest QEMU_FILE.
+ */
+static int qemu_rdma_recv_read(RDMAContext *rdma, uint8_t *buf, int size)
+{
+    RDMARecvEntry *entry = qemu_rdma_recv_peek(rdma->recv);
+    int len;
+
+    if (entry->type != RDMA_CONTROL_QEMU_FILE) {
+        return qemu_rdma_recv_unexpected(rdma, entry,
+                                         RDMA_CONTROL_QEMU_FILE);
+    }
+
+    len = MIN(size, entry->len - entry->pos);
+    memcpy(buf, entry->data + entry->pos, len);
+    entry->pos += len;
+    if (entry->pos == entry->len) {
+        qemu_rdma_recv_pop(rdma->recv);
+    }
+
+    return len;
+}
+
+/*
+ * hook_ram_load() of ",recv-thread": the thread handled the round
+ * already, wait for it to say so.
+ */
+static int qemu_rdma_recv_round(RDMAContext *rdma)
+{
+    RDMARecvEntry *entry = qemu_rdma_recv_peek(rdma->recv);
+
+    if (entry->type != RDMA_CONTROL_REGISTER_FINISHED &&
+        entry->type != RDMA_CONTROL_FINAL_FINISHED) {
+        return qemu_rdma_recv_unexpected(rdma, entry,
+                                         RDMA_CONTROL_REGISTER_FINISHED);
+    }
+
+    qemu_rdma_round_done(rdma, entry->type);
+    qemu_rdma_recv_pop(rdma->recv);
+    return 0;
+}
+
+static bool qemu_rdma_recv_stopping(RDMAContext *rdma)
+{
+    return rdma->recv && atomic_read(&rdma->recv->stopping);
+}
+
+/*
+ * Take control messages until the BARRIER, or until asked to stop.
+ * READY goes out as soon as a message is handled, not when the loadvm
+ * coroutine gets around to asking for more.
+ */
+static void *qemu_rdma_recv_thread(void *opaque)
+{
+    RDMARecv *recv = opaque;
+    RDMAContext *rdma = recv->rdma;
+    RDMAControlHeader head;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    for (;;) {
+        qemu_mutex_lock(&recv->lock);
+        while (!recv->stopping && recv->queued > RDMA_RECV_QUEUE_MAX) {
+            qemu_cond_wait(&recv->room, &recv->lock);
+        }
+        qemu_mutex_unlock(&recv->lock);
+        if (qemu_rdma_recv_stopping(rdma)) {
+            break;
+        }
+
+        ret = qemu_rdma_exchange_recv(rdma, &head, RDMA_CONTROL_NONE);
+        if (ret < 0) {
+            goto err;
+        }
+
+        if (head.type == RDMA_CONTROL_QEMU_FILE) {
+            ret = qemu_rdma_disk_wait(rdma);
+            if (ret < 0) {
+                goto err;
+            }
+            qemu_rdma_recv_push(recv, head.type, 0,
+                                rdma->wr_data[RDMA_WRID_READY].control_curr,
+                                head.len);
+            continue;
+        }
+        if (head.type == RDMA_CONTROL_BARRIER) {
+            recv->barrier = true;
+            break;
+        }
+
+        ret = qemu_rdma_handle_control(rdma, &head);
+        if (ret < 0) {
+            goto err;
+        }
+        if (ret > 0) {
+            qemu_rdma_span(rdma, "load ram", start, rdma->iteration++);
+            qemu_rdma_recv_push(recv, head.type, 0, NULL, 0);
+            start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        }
+    }
+
+    return NULL;
+
+err:
+    if (!qemu_rdma_recv_stopping(rdma)) {
+        qemu_rdma_recv_push(recv, RDMA_CONTROL_ERROR, ret, NULL, 0);
+    }
+    return NULL;
+}
+
+/*
+ * Called once the loadvm coroutine is about to start, on an accepted
+ * connection.  Without the thread, the coroutine serves the channel.
+ */
+static void qemu_rdma_recv_start(RDMAContext *rdma)
+{
+    RDMARecv *recv;
+
+    if (!rdma->recv_thread) {
+        return;
+    }
+
+    recv = g_new0(RDMARecv, 1);
+    recv->rdma = rdma;
+    recv->tail = &recv->head;
+    recv->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    recv->stop = eventfd(0, EFD_CLOEXEC);
+    if (recv->event < 0 || recv->stop < 0) {
+        perror("rdma migration: cannot start the recv thread, eventfd");
+        if (recv->event >= 0) {
+            close(recv->event);
+        }
+        if (recv->stop >= 0) {
+            close(recv->stop);
+        }
+        g_free(recv);
+        return;
+    }
+
+    qemu_mutex_init(&recv->lock);
+    qemu_cond_init(&recv->room);
+    rdma->recv = recv;
+    qemu_thread_create(&recv->thread, "rdma recv", qemu_rdma_recv_thread,
+                       recv, QEMU_THREAD_JOINABLE);
+}
+
+/*
+ * Stop the thread and drop what it queued.  With 'barrier', wait for it
+ * to receive the BARRIER instead, and return whether it did.
+ */
+static int qemu_rdma_recv_stop(RDMAContext *rdma, bool barrier)
+{
+    RDMARecv *recv = rdma->recv;
+    RDMARecvEntry *entry;
+    uint64_t one = 1;
+    int ret;
+
+    if (!recv) {
+        return 0;
+    }
+
+    if (!barrier) {
+        qemu_mutex_lock(&recv->lock);
+        atomic_set(&recv->stopping, true);
+        qemu_cond_broadcast(&recv->room);
+        qemu_mutex_unlock(&recv->lock);
+        if (write(recv->stop, &one, sizeof(one)) != sizeof(one)) {
+            perror("rdma migration: cannot stop the recv thread");
+        }
+    }
+    qemu_thread_join(&recv->thread);
+    ret = recv->barrier ? 0 : -EIO;
+
+    while ((entry = recv->head)) {
+        recv->head = entry->next;
+        g_free(entry);
+    }
+    qemu_cond_destroy(&recv->room);
+    qemu_mutex_destroy(&recv->lock);
+    close(recv->event);
+    close(recv->stop);
+    g_free(recv);
+    rdma->recv = NULL;
+
+    return ret;
+}
+
+static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque,
+                                         uint64_t flags)
+{
+    QEMUFileRDMA *rfile = opaque;
+    RDMAContext *rdma = rfile->rdma;
+    RDMAControlHeader head;
+    int ret = 0;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    CHECK_ERROR_STATE();
+
+    if (rdma->recv) {
+        return qemu_rdma_recv_round(rdma);
+    }
+
+    do {
+        DDDPRINTF("Waiting for next request %" PRIu64 "...\n", flags);
+
+        ret = qemu_rdma_exchange_recv(rdma, &head, RDMA_CONTROL_NONE);
+
+        if (ret < 0) {
+            break;
+        }
+
+        ret = qemu_rdma_handle_control(rdma, &head);
+    } while (!ret);
+
+    if (ret < 0) {
+        rdma->error_state = ret;
+    } else {
+        qemu_rdma_round_done(rdma, head.type);
+        ret = 0;
+    }
+    qemu_rdma_span(rdma, "load ram", start, rdma->iteration++);
+    return ret;
+}
+
+static int qemu_rdma_registration_start(QEMUFile *f, void *opaque,
+                                        uint64_t flags)
+{
+
+    QEMUFileRDMA *rfile = opaque;
+    RDMAContext *rdma = rfile->rdma;
+
+    CHECK_ERROR_STATE();
+
+    rdma->iteration_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    rdma->ram_flags = flags;
+    rdma->defer_iter_pages = 0;
+    if (flags == RAM_CONTROL_FINISH) {
+        qemu_rdma_free_drop(rdma);
+    }
+    qemu_rdma_record(rdma, RDMA_TRACE_BEGIN, flags, 0);
+    DDDPRINTF("start section: %" PRIu64 "\n", flags);
+    qemu_put_be64(f, RAM_SAVE_FLAG_HOOK);
+    qemu_fflush(f);
+
+    return 0;
+}
+
+static void qemu_rdma_iteration_done(RDMAContext *rdma, uint64_t flags)
+{
+    qemu_rdma_record(rdma, RDMA_TRACE_END, flags, 0);
+
+    switch (flags) {
+    case RAM_CONTROL_SETUP:
+        qemu_rdma_span(rdma, "ram setup", rdma->iteration_start, -1);
+        break;
+    case RAM_CONTROL_FINISH:
+        qemu_rdma_span(rdma, "stop: ram", rdma->iteration_start, -1);
+        rdma->finish_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        break;
+    default:
+        qemu_rdma_span(rdma, "iteration", rdma->iteration_start,
+                       rdma->iteration++);
+        break;
+    }
+}
+
+/*
+ * Inform dest that dynamic registrations are done for now.
+ * First, flush writes, if any.
+ */
+static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
+                                       uint64_t flags)
+{
+
+    Error *local_err = NULL, **errp = &local_err;
+    QEMUFileRDMA *rfile = opaque;
+    RDMAContext *rdma = rfile->rdma;
+    RDMAControlHeader head = { .len = 0, .repeat = 1 };
+    int ret = 0;
+
     CHECK_ERROR_STATE();
 
-    /*
-     * First, we hold on to the last SEND message we
-     * were given and dish out the bytes until we run
-     * out of bytes.
-     */
-    r->len = qemu_rdma_fill(r->rdma, buf, size, 0);
-    if (r->len) {
-        return r->len;
+    qemu_fflush(f);
+
+    if (rdma->defer && flags != RAM_CONTROL_SETUP &&
+        (flags == RAM_CONTROL_FINISH || !rdma->defer_iter_pages)) {
+        ret = qemu_rdma_defer_pass(f, rdma, flags == RAM_CONTROL_FINISH);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
+    ret = qemu_rdma_keep_flush(rdma);
+    if (ret < 0) {
+        goto err;
+    }
+    ret = qemu_rdma_discard_flush(rdma);
+    if (ret < 0) {
+        goto err;
+    }
+
+#ifdef CONFIG_LZ4
+    ret = qemu_rdma_write_flush(f, rdma);
+    if (ret < 0) {
+        goto err;
+    }
+    ret = qemu_rdma_lz4_flush(f, rdma);
+    if (ret < 0) {
+        goto err;
+    }
+#endif
+
+    /*
+     * The last iteration's writes on rail 0 can land while the device
+     * state is sent: RC orders them before FINAL_FINISHED on the same QP,
+     * so the dest sees them before it loads any device section.  The
+     * other rails are not ordered with it and are drained first.
+     */
+    if (flags == RAM_CONTROL_FINISH && rdma->parallel_finish) {
+        ret = qemu_rdma_write_flush(f, rdma);
+        if (ret < 0) {
+            goto err;
+        }
+        ret = qemu_rdma_drain_rails(rdma);
+        if (ret < 0) {
+            goto err;
+        }
+        rdma->barrier_owed = true;
+        head.type = RDMA_CONTROL_FINAL_FINISHED;
+        ret = qemu_rdma_exchange_send(rdma, &head, NULL, NULL, NULL, NULL);
+        if (ret < 0) {
+            goto err;
+        }
+        qemu_rdma_iteration_done(rdma, flags);
+        return 0;
+    }
+
+    ret = qemu_rdma_drain_cq(f, rdma);
+
+    if (ret < 0) {
+        goto err;
+    }
+
+    if (flags == RAM_CONTROL_SETUP && !rdma->remote_blocks_known) {
+        RDMAControlHeader resp = {.type = RDMA_CONTROL_RAM_BLOCKS_RESULT };
+        int reg_result_idx;
+
+        head.type = RDMA_CONTROL_RAM_BLOCKS_REQUEST;
+        DPRINTF("Sending registration setup for ram blocks...\n");
+
+        /*
+         * Make sure that we parallelize the pinning on both sides.
+         * For very large guests, doing this serially takes a really
+         * long time, so we have to 'interleave' the pinning locally
+         * with the control messages by performing the pinning on this
+         * side before we receive the control response from the other
+         * side that the pinning has completed.
+         */
+        ret = qemu_rdma_exchange_send(rdma, &head, NULL, &resp,
+                    &reg_result_idx, rdma->pin_all ?
+                    qemu_rdma_reg_whole_ram_blocks : NULL);
+        if (ret < 0) {
+            ERROR(errp, "receiving remote info!");
+            return ret;
+        }
+
+        qemu_rdma_move_header(rdma, reg_result_idx, &resp);
+        ret = qemu_rdma_process_remote_blocks(rdma,
+                                rdma->wr_data[reg_result_idx].control_curr,
+                                resp.len / sizeof(RDMARemoteBlock), errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (flags == RAM_CONTROL_SETUP && rdma->hash) {
+        ret = qemu_rdma_fetch_hashes(rdma);
+        if (ret < 0) {
+            ERROR(errp, "receiving the dest's page hashes!");
+            goto err;
+        }
+    }
+
+#ifdef CONFIG_LZ4
+    if (flags == RAM_CONTROL_SETUP && rdma->compress) {
+        ret = qemu_rdma_lz4_start(rdma);
+        if (ret < 0) {
+            ERROR(errp, "setting up LZ4 compression!");
+            goto err;
+        }
+    }
+#endif
+
+    DDDPRINTF("Sending registration finish %" PRIu64 "...\n", flags);
+
+    head.type = RDMA_CONTROL_REGISTER_FINISHED;
+    ret = qemu_rdma_exchange_send(rdma, &head, NULL, NULL, NULL, NULL);
+
+    if (ret < 0) {
+        goto err;
+    }
+    qemu_rdma_iteration_done(rdma, flags);
+
+    return 0;
+err:
+    rdma->error_state = ret;
+    return ret;
+}
+
+static int qemu_rdma_get_fd(void *opaque)
+{
+
+    QEMUFileRDMA *rfile = opaque;
+    RDMAContext *rdma = rfile->rdma;
+
+    return rdma->recv ? rdma->recv->event : rdma->comp_channel->fd;
+}
+
+const QEMUFileOps rdma_read_ops = {
+    .get_buffer    = qemu_rdma_get_buffer,
+    .get_fd        = qemu_rdma_get_fd,
+    .close         = qemu_rdma_close,
+    .hook_ram_load = qemu_rdma_registration_handle,
+};
+
+const QEMUFileOps rdma_write_ops = {
+    .put_buffer         = qemu_rdma_put_buffer,
+    .close              = qemu_rdma_close,
+    .before_ram_iterate = qemu_rdma_registration_start,
+    .after_ram_iterate  = qemu_rdma_registration_stop,
+    .save_page          = qemu_rdma_save_page,
+};
+
+int64_t rdma_migration_inflight_bytes(void)
+{
+    RDMAContext *rdma = rdma_outgoing;
+    int64_t bytes = 0;
+    int i;
+
+    if (rdma) {
+        for (i = 0; i < rdma->nb_rails; i++) {
+            bytes += rdma->rail[i].inflight_bytes;
+        }
+    }
+
+    return bytes;
+}
+
+double rdma_migration_link_rate(void)
+{
+    RDMAContext *rdma = rdma_outgoing;
+    double rate = 0;
+    int i;
+
+    if (rdma) {
+        for (i = 0; i < rdma->nb_rails; i++) {
+            rate += rdma->rail[i].rate;
+        }
+    }
+
+    return rate;
+}
+
+int64_t rdma_migration_stall_ns(void)
+{
+    return rdma_outgoing ? rdma_outgoing->stall_ns : 0;
+}
+
+bool rdma_migration_get_stats(bool incoming, RDMAStats *stats)
+{
+    RDMAContext *rdma = incoming ? rdma_incoming : rdma_outgoing;
+    int i;
+
+    if (!rdma) {
+        return false;
+    }
+
+    *stats = rdma->stats;
+    stats->inflight = 0;
+    for (i = 0; i < rdma->nb_rails; i++) {
+        stats->inflight += rdma->rail[i].nb_sent;
+    }
+
+    return true;
+}
+
+static void rdma_stats_format_hist(GString *str, const char *name,
+                                   const RDMAHistogram *hist)
+{
+    int i, last = 0;
+
+    if (!hist->count) {
+        return;
+    }
+
+    g_string_append_printf(str, "%s: count %" PRIu64 " avg %" PRIu64
+                           " ns max %" PRIu64 " ns\n", name, hist->count,
+                           hist->sum_ns / hist->count, hist->max_ns);
+    for (i = 0; i < RDMA_STATS_BUCKETS; i++) {
+        if (hist->bucket[i]) {
+            last = i;
+        }
+    }
+    for (i = 0; i <= last; i++) {
+        if (hist->bucket[i]) {
+            g_string_append_printf(str, "  < %" PRIu64 " ns: %" PRIu64 "\n",
+                                   (uint64_t) 2 << i, hist->bucket[i]);
+        }
+    }
+}
+
+char *rdma_migration_stats_format(const RDMAStats *stats)
+{
+    GString *str = g_string_new(NULL);
+
+    g_string_append_printf(str,
+                           "writes: %" PRIu64 " (%" PRIu64 " bytes)"
+                           " inflight %" PRIu64 "\n"
+                           "registrations: %" PRIu64 " unregistrations: %"
+                           PRIu64 " zero chunks: %" PRIu64 "\n"
+                           "control sends: %" PRIu64 " recvs: %" PRIu64 "\n"
+                           "deferred pages: %" PRIu64 " sends saved: %"
+                           PRIu64 "\n"
+                           "pages kept: %" PRIu64 " discarded: %" PRIu64 "\n"
+                           "lz4 writes: %" PRIu64 " (%" PRIu64 " bytes)\n"
+                           "disk writes: %" PRIu64 " (%" PRIu64 " bytes)\n"
+                           "resumes: %" PRIu64 "\n",
+                           stats->writes, stats->write_bytes, stats->inflight,
+                           stats->registrations, stats->unregistrations,
+                           stats->zero_chunks,
+                           stats->control_sends, stats->control_recvs,
+                           stats->deferred, stats->defer_saved,
+                           stats->kept, stats->discarded,
+                           stats->lz4_writes, stats->lz4_bytes,
+                           stats->disk_writes, stats->disk_bytes,
+                           stats->resumes);
+    rdma_stats_format_hist(str, "registration", &stats->registration);
+    rdma_stats_format_hist(str, "registration round trip", &stats->reg_rtt);
+    rdma_stats_format_hist(str, "write completion", &stats->write);
+    rdma_stats_format_hist(str, "control exchange", &stats->control);
+    rdma_stats_format_hist(str, "cq wait", &stats->cq_wait);
+
+    return g_string_free(str, false);
+}
+
+bool rdma_migration_set_speed(int64_t bytes_per_sec)
+{
+    RDMAContext *rdma = rdma_outgoing;
+
+    if (!rdma) {
+        return false;
+    }
+
+    rdma->pacer.rate = bytes_per_sec / 1e9;
+    return true;
+}
+
+void rdma_migration_bitmap_synced(void)
+{
+    RDMAContext *rdma = rdma_outgoing;
+    RDMAFreePages *fp = rdma ? rdma->free : NULL;
+    RDMAFreeRequest req;
+    ssize_t n;
+
+    if (!fp) {
+        return;
+    }
+
+    qemu_rdma_free_drop(rdma);
+    fp->seq++;
+    if (fp->fd < 0) {
+        return;
+    }
+
+    req.magic = htonl(RDMA_FREE_MAGIC);
+    req.seq = htonl(fp->seq);
+    do {
+        n = send(fp->fd, &req, sizeof(req), MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    /* if the agent is too far behind to take it, skip this round */
+    if (n != sizeof(req) &&
+        (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))) {
+        qemu_rdma_free_lost(rdma);
+    }
+}
+
+int64_t rdma_migration_deferred_bytes(void)
+{
+    RDMAContext *rdma = rdma_outgoing;
+
+    return rdma ? rdma->deferred_pages << TARGET_PAGE_BITS : 0;
+}
+
+long rdma_migration_save_pages(QEMUFile *f, ram_addr_t block_offset,
+                               const unsigned long *bitmap,
+                               uint64_t start, uint64_t end)
+{
+    RDMAContext *rdma = rdma_outgoing;
+    uint64_t page, run_end;
+    long pages = 0;
+
+    if (local_outgoing && local_outgoing->local_shared) {
+        /* "local:": the dest maps this RAM, there is nothing to send */
+        for (page = find_next_bit(bitmap, end, start); page < end;
+             page = find_next_bit(bitmap, end, run_end)) {
+            run_end = find_next_zero_bit(bitmap, end, page);
+            pages += run_end - page;
+        }
+        return pages;
+    }
+
+    if (!rdma) {
+        return -ENOTSUP;
+    }
+
+    return qemu_rdma_save_pages(f, rdma, block_offset, bitmap, start, end);
+}
+
+int rdma_migration_save_disk(QEMUFile *f, const char *device, int64_t sector,
+                             const uint8_t *buf, int nb_sectors)
+{
+    RDMAContext *rdma = rdma_outgoing;
+
+    if (!rdma || !rdma->disk_writes || nb_sectors <= 0 ||
+        nb_sectors > RDMA_DISK_SLOT_SIZE / BDRV_SECTOR_SIZE ||
+        strlen(device) >= RDMA_DISK_NAME_LEN) {
+        return -ENOTSUP;
+    }
+
+    return qemu_rdma_save_disk(f, rdma, device, sector, buf, nb_sectors);
+}
+
+int rdma_migration_finish(void)
+{
+    RDMAContext *rdma = rdma_outgoing;
+    RDMAControlHeader head = { .len = 0, .type = RDMA_CONTROL_BARRIER,
+                               .repeat = 1 };
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    if (rdma && rdma->finish_start) {
+        qemu_rdma_span(rdma, "stop: device state", rdma->finish_start, -1);
+    }
+    if (!rdma || !rdma->barrier_owed) {
+        return 0;
+    }
+    if (rdma->error_state) {
+        return rdma->error_state;
+    }
+    rdma->barrier_owed = false;
+
+    ret = qemu_rdma_drain_rails(rdma);
+    while (ret >= 0 && rdma->nb_sent) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        ret = qemu_rdma_recover(rdma, ret, NULL);
+    }
+    if (ret >= 0) {
+        ret = qemu_rdma_exchange_send(rdma, &head, NULL, NULL, NULL, NULL);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "rdma migration: error sending barrier!\n");
+        rdma->error_state = ret;
+    }
+    qemu_rdma_span(rdma, "stop: barrier", start, -1);
+
+    return ret;
+}
+
+static void *qemu_fopen_rdma(RDMAContext *rdma, const char *mode)
+{
+
+    QEMUFileRDMA *r = g_malloc0(sizeof(QEMUFileRDMA));
+
+    if (qemu_file_mode_is_not_valid(mode)) {
+        return NULL;
+    }
+
+    r->rdma = rdma;
+
+    if (mode[0] == 'w') {
+        r->file = qemu_fopen_ops(r, &rdma_write_ops);
+        rdma_outgoing = rdma;
+    } else {
+        r->file = qemu_fopen_ops(r, &rdma_read_ops);
+        rdma_incoming = rdma;
+    }
+
+    return r->file;
+}
+
+static void rdma_accept_incoming_migration(void *opaque)
+{
+    DTPRINTF("%s\n", __func__);
+    RDMAContext *rdma = opaque;
+    int ret;
+    QEMUFile *f;
+    Error *local_err = NULL, **errp = &local_err;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    DPRINTF("Accepting rdma connection...\n");
+    ret = qemu_rdma_accept(rdma);
+
+    if (ret) {
+        ERROR(errp, "RDMA Migration initialization failed!");
+        return;
     }
+    qemu_rdma_span(rdma, "accept", start, -1);
 
-    /*
-     * Once we run out, we block and wait for another
-     * SEND message to arrive.
-     */
-    ret = qemu_rdma_exchange_recv(rdma, &head, RDMA_CONTROL_QEMU_FILE);
+    DPRINTF("Accepted migration\n");
 
-    if (ret < 0) {
-        rdma->error_state = ret;
-        return ret;
+    f = qemu_fopen_rdma(rdma, "rb");
+    if (f == NULL) {
+        ERROR(errp, "could not qemu_fopen_rdma!");
+        qemu_rdma_cleanup(rdma);
+        return;
     }
 
-    /*
-     * SEND was received with new bytes, now try again.
-     */
-    return qemu_rdma_fill(r->rdma, buf, size, 0);
+    rdma->migration_started_on_destination = 1;
+    qemu_rdma_recv_start(rdma);
+    process_incoming_migration(f);
 }
 
-/*
- * Block until all the outstanding chunks have been delivered by the hardware.
- */
-static int qemu_rdma_drain_cq(QEMUFile *f, RDMAContext *rdma)
+void rdma_start_incoming_migration(const char *host_port, Error **errp)
 {
-    int ret;
+    DTPRINTF("%s\n", __func__);
+    int ret, idx;
+    RDMAContext *rdma;
+    Error *local_err = NULL;
 
-    if (qemu_rdma_write_flush(f, rdma) < 0) {
-        return -EIO;
+    DPRINTF("Starting RDMA-based incoming migration\n");
+    rdma = qemu_rdma_data_init(host_port, &local_err);
+
+    if (rdma == NULL) {
+        goto err;
     }
 
-    while (rdma->nb_sent) {
-        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
-        if (ret < 0) {
-            fprintf(stderr, "rdma migration: complete polling error!\n");
-            return -EIO;
+    ret = qemu_rdma_dest_init(rdma, &local_err);
+
+    if (ret) {
+        goto err;
+    }
+
+    DPRINTF("qemu_rdma_dest_init success\n");
+
+    if (rdma->prewarm) {
+        /*
+         * The device is only known if we bound to a specific address.
+         * The queue pair itself can only be created on the connection's
+         * own cm_id, so that is left to qemu_rdma_accept().
+         */
+        rdma->verbs = rdma->listen_id->verbs;
+        if (!rdma->verbs) {
+            fprintf(stderr, "rdma prewarm: listening on a wildcard address,"
+                            " only pre-faulting guest ram\n");
+        } else if (qemu_rdma_alloc_pd_cq(rdma)) {
+            fprintf(stderr, "rdma prewarm: error allocating pd and cq!\n");
+        } else {
+            for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
+                if (qemu_rdma_reg_control(rdma, idx)) {
+                    fprintf(stderr, "rdma prewarm: error registering %d "
+                                    "control!\n", idx);
+                    break;
+                }
+            }
         }
+        qemu_rdma_prewarm_start(rdma);
     }
 
-    qemu_rdma_unregister_waiting(rdma);
+    ret = rdma_listen(rdma->listen_id, 5);
 
-    return 0;
+    if (ret) {
+        ERROR(errp, "listening on socket!");
+        goto err;
+    }
+
+    DPRINTF("rdma_listen success\n");
+
+    qemu_set_fd_handler2(rdma->channel->fd, NULL,
+                         rdma_accept_incoming_migration, NULL,
+                            (void *)(intptr_t) rdma);
+    return;
+err:
+    error_propagate(errp, local_err);
+    g_free(rdma);
 }
 
-static int qemu_rdma_close(void *opaque)
+
+void rdma_start_outgoing_migration(void *opaque,
+                            const char *host_port, Error **errp)
 {
     DTPRINTF("%s\n", __func__);
-    DPRINTF("Shutting down connection.\n");
-    QEMUFileRDMA *r = opaque;
-    if (r->rdma) {
-        qemu_rdma_cleanup(r->rdma);
-        g_free(r->rdma);
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    MigrationState *s = opaque;
+    Error *local_err = NULL, **temp = &local_err;
+    RDMAContext *rdma = qemu_rdma_data_init(host_port, &local_err);
+    int ret = 0;
+
+    if (rdma == NULL) {
+        ERROR(temp, "Failed to initialize RDMA data structures! %d", ret);
+        goto err;
     }
-    g_free(r);
-    return 0;
+
+    ret = qemu_rdma_source_init(rdma, &local_err,
+        s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL]);
+
+    if (ret) {
+        goto err;
+    }
+
+    DPRINTF("qemu_rdma_source_init success\n");
+    ret = qemu_rdma_connect(rdma, &local_err);
+
+    if (ret) {
+        goto err;
+    }
+
+    DPRINTF("qemu_rdma_source_connect success\n");
+    qemu_rdma_span(rdma, "setup", start, -1);
+    qemu_rdma_free_connect(rdma);
+
+    s->file = qemu_fopen_rdma(rdma, "wb");
+    migrate_fd_connect(s);
+    TPRINTF("rdma connection took: %" PRId64 " ms\n",
+            (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / SCALE_MS);
+    return;
+err:
+    error_propagate(errp, local_err);
+    g_free(rdma);
+    migrate_fd_error(s);
+}
+
+static int qemu_qp_change_state_init(struct ibv_qp *qp, int port){
+	
+	struct ibv_qp_attr *attr;
+	int err = 0;
+	
+    attr =  malloc(sizeof *attr);
+    memset(attr, 0, sizeof *attr);
+
+    attr->qp_state        	= IBV_QPS_INIT;
+    attr->pkey_index      	= 0;
+    attr->port_num        	= port;
+    attr->qp_access_flags	= IBV_ACCESS_REMOTE_WRITE;
+
+    err = ibv_modify_qp(qp, attr,
+                            IBV_QP_STATE        |
+                            IBV_QP_PKEY_INDEX   |
+                            IBV_QP_PORT         |
+                            IBV_QP_ACCESS_FLAGS);
+	if (err) {
+		fprintf(stderr, "Could not modify QP to INIT, ibv_modify_qp, err: %d\n", err);
+	}
+
+	return err;
 }
 
 /*
- * Parameters:
- *    @offset == 0 :
- *        This means that 'block_offset' is a full virtual address that does not
- *        belong to a RAMBlock of the virtual machine and instead
- *        represents a private malloc'd memory area that the caller wishes to
- *        transfer.
- *
- *    @offset != 0 :
- *        Offset is an offset to be added to block_offset and used
- *        to also lookup the corresponding RAMBlock.
- *
- *    @size > 0 :
- *        Initiate an transfer this size.
- *
- *    @size == 0 :
- *        A 'hint' or 'advice' that means that we wish to speculatively
- *        and asynchronously unregister this memory. In this case, there is no
- *        guarantee that the unregister will actually happen, for example,
- *        if the memory is being actively transmitted. Additionally, the memory
- *        may be re-registered at any future time if a write within the same
- *        chunk was requested again, even if you attempted to unregister it
- *        here.
- *
- *    @size < 0 : TODO, not yet supported
- *        Unregister the memory NOW. This means that the caller does not
- *        expect there to be any future RDMA transfers and we just want to clean
- *        things up. This is used in case the upper layer owns the memory and
- *        cannot wait for qemu_fclose() to occur.
+ * Rail selection.
  *
- *    @bytes_sent : User-specificed pointer to indicate how many bytes were
- *                  sent. Usually, this will not be more than a few bytes of
- *                  the protocol because most transfers are sent asynchronously.
+ * Active ports whose device sits on the NUMA node holding guest memory
+ * come first. Among equals, devices are spread over before their second
+ * ports, as the ports of one NIC share its PCIe link.
  */
-static size_t qemu_rdma_save_page(QEMUFile *f, void *opaque,
-                                  ram_addr_t block_offset, ram_addr_t offset,
-                                  size_t size, int *bytes_sent)
+typedef struct RDMARailCandidate {
+    struct ibv_device *dev;
+    int dev_index;
+    int port;
+    int numa_node;
+    int score;                  /* 0: local, 1: unknown, 2: remote node */
+} RDMARailCandidate;
+
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+#endif
+
+typedef struct RDMALargestBlock {
+    void *host_addr;
+    ram_addr_t length;
+} RDMALargestBlock;
+
+static void qemu_rdma_largest_block(void *host_addr,
+    ram_addr_t block_offset, ram_addr_t length, void *opaque)
 {
-    QEMUFileRDMA *rfile = opaque;
-    RDMAContext *rdma = rfile->rdma;
-    int ret;
+    RDMALargestBlock *largest = opaque;
 
-    CHECK_ERROR_STATE();
+    if (length > largest->length) {
+        largest->host_addr = host_addr;
+        largest->length = length;
+    }
+}
 
-    qemu_fflush(f);
+/*
+ * NUMA node of (the start of) the largest RAM block, or -1.
+ */
+static int qemu_rdma_guest_numa_node(void)
+{
+#ifdef __NR_get_mempolicy
+    RDMALargestBlock largest = { NULL, 0 };
+    int node = -1;
 
-    if (size > 0) {
-        /*
-         * Add this page to the current 'chunk'. If the chunk
-         * is full, or the page doen't belong to the current chunk,
-         * an actual RDMA write will occur and a new chunk will be formed.
-         */
-        ret = qemu_rdma_write(f, rdma, block_offset, offset, size);
-        if (ret < 0) {
-            fprintf(stderr, "rdma migration: write error! %d\n", ret);
-            goto err;
-        }
+    qemu_ram_foreach_block(qemu_rdma_largest_block, &largest);
+    if (largest.host_addr &&
+        !syscall(__NR_get_mempolicy, &node, NULL, 0, largest.host_addr,
+                 MPOL_F_NODE | MPOL_F_ADDR)) {
+        return node;
+    }
+#endif
+    return -1;
+}
 
-        /*
-         * We always return 1 bytes because the RDMA
-         * protocol is completely asynchronous. We do not yet know
-         * whether an  identified chunk is zero or not because we're
-         * waiting for other pages to potentially be merged with
-         * the current chunk. So, we have to call qemu_update_position()
-         * later on when the actual write occurs.
-         */
-        if (bytes_sent) {
-            *bytes_sent = 1;
+static int qemu_rdma_device_numa_node(struct ibv_device *dev)
+{
+    char path[PATH_MAX];
+    FILE *f;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "%s/device/numa_node", dev->ibdev_path);
+    f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%d", &node) != 1) {
+            node = -1;
         }
-    } else {
-        uint64_t index, chunk;
+        fclose(f);
+    }
 
-        /* TODO: Change QEMUFileOps prototype to be signed: size_t => long
-        if (size < 0) {
-            ret = qemu_rdma_drain_cq(f, rdma);
-            if (ret < 0) {
-                fprintf(stderr, "rdma: failed to synchronously drain"
-                                " completion queue before unregistration.\n");
-                goto err;
-            }
+    return node;
+}
+
+static int qemu_rdma_rail_cmp(const void *a, const void *b)
+{
+    const RDMARailCandidate *ca = a, *cb = b;
+
+    if (ca->score != cb->score) {
+        return ca->score - cb->score;
+    }
+    if (ca->port != cb->port) {
+        return ca->port - cb->port;
+    }
+    return ca->dev_index - cb->dev_index;
+}
+
+/*
+ * List the active ports of all devices, best first.
+ */
+static int qemu_rdma_rail_candidates(struct ibv_device **dev_list,
+                                     RDMARailCandidate *cand, int max)
+{
+    int guest_node = qemu_rdma_guest_numa_node();
+    int i, port, nb = 0;
+
+    for (i = 0; dev_list[i] && nb < max; i++) {
+        struct ibv_context *verbs = qemu_rdma_ready_verbs(dev_list[i]);
+        struct ibv_device_attr dev_attr;
+        int node = qemu_rdma_device_numa_node(dev_list[i]);
+        bool opened = false;
+
+        if (!verbs) {
+            verbs = ibv_open_device(dev_list[i]);
+            opened = true;
+        }
+        if (!verbs) {
+            continue;
         }
-        */
 
-        ret = qemu_rdma_search_ram_block(rdma, block_offset,
-                                         offset, size, &index, &chunk);
+        if (!ibv_query_device(verbs, &dev_attr)) {
+            for (port = 1; port <= dev_attr.phys_port_cnt && nb < max; port++) {
+                struct ibv_port_attr attr;
 
-        if (ret) {
-            fprintf(stderr, "ram block search failed\n");
-            goto err;
+                if (ibv_query_port(verbs, port, &attr) ||
+                    attr.state != IBV_PORT_ACTIVE) {
+                    continue;
+                }
+                cand[nb].dev = dev_list[i];
+                cand[nb].dev_index = i;
+                cand[nb].port = port;
+                cand[nb].numa_node = node;
+                cand[nb].score = (node < 0 || guest_node < 0) ? 1 :
+                                 (node == guest_node ? 0 : 2);
+                nb++;
+            }
         }
 
-        qemu_rdma_signal_unregister(rdma, index, chunk, 0);
-
-        /*
-         * TODO: Synchronous, guaranteed unregistration (should not occur during
-         * fast-path). Otherwise, unregisters will process on the next call to
-         * qemu_rdma_drain_cq()
-        if (size < 0) {
-            qemu_rdma_unregister_waiting(rdma);
+        if (opened) {
+            ibv_close_device(verbs);
         }
-        */
     }
 
-    /*
-     * Drain the Completion Queue if possible, but do not block,
-     * just poll.
-     *
-     * If nothing to poll, the end of the iteration will do this
-     * again to make sure we don't overflow the request queue.
-     */
-    while (1) {
-        uint64_t wr_id, wr_id_in;
-        int ret = qemu_rdma_poll(rdma, &wr_id_in, NULL);
-        if (ret < 0) {
-            fprintf(stderr, "rdma migration: polling error! %d\n", ret);
-            goto err;
-        }
-
-        wr_id = wr_id_in & RDMA_WRID_TYPE_MASK;
+    qsort(cand, nb, sizeof(*cand), qemu_rdma_rail_cmp);
 
-        if (wr_id == RDMA_WRID_NONE) {
-            break;
-        }
+    for (i = 0; i < nb; i++) {
+        DPRINTF("Rail candidate %d: %s port %d, numa node %d (guest %d)\n",
+                i, ibv_get_device_name(cand[i].dev), cand[i].port,
+                cand[i].numa_node, guest_node);
     }
 
-    return RAM_SAVE_CONTROL_DELAYED;
-err:
-    rdma->error_state = ret;
-    return ret;
+    return nb;
 }
 
-static int qemu_rdma_accept(RDMAContext *rdma)
+static int qemu_rdma_rail_init(RDMAContext *rdma, RDMARail *rail,
+                               RDMARailCandidate *cand)
 {
-    DTPRINTF("%s\n", __func__);
-    RDMACapabilities cap;
-    struct rdma_conn_param conn_param = {
-                                            .responder_resources = 2,
-                                            .private_data = &cap,
-                                            .private_data_len = sizeof(cap),
-                                         };
-    struct rdma_cm_event *cm_event;
-    struct ibv_context *verbs;
-    int ret = -EINVAL;
-    int idx;
+    struct ibv_qp_init_attr attr = { 0 };
+    int nb_blocks = rdma->local_ram_blocks.nb_blocks;
 
-    ret = rdma_get_cm_event(rdma->channel, &cm_event);
-    if (ret) {
-        goto err_rdma_dest_wait;
+    rail->verbs = qemu_rdma_ready_verbs(cand->dev);
+    if (!rail->verbs) {
+        rail->verbs = ibv_open_device(cand->dev);
+        rail->verbs_owned = true;
+    }
+    if (!rail->verbs) {
+        fprintf(stderr, "rdma rail: could not open %s\n",
+                        ibv_get_device_name(cand->dev));
+        return -1;
     }
 
-    if (cm_event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
-        rdma_ack_cm_event(cm_event);
-        goto err_rdma_dest_wait;
+    rail->pd = ibv_alloc_pd(rail->verbs);
+    if (!rail->pd) {
+        fprintf(stderr, "rdma rail: failed to allocate protection domain\n");
+        return -1;
     }
 
-    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    rail->cq = ibv_create_cq(rail->verbs, RDMA_SIGNALED_SEND_MAX,
+                             NULL, NULL, 0);
+    if (!rail->cq) {
+        fprintf(stderr, "rdma rail: failed to allocate completion queue\n");
+        return -1;
+    }
 
-    network_to_caps(&cap);
+    attr.cap.max_send_wr = RDMA_SIGNALED_SEND_MAX;
+    attr.cap.max_recv_wr = 1;
+    attr.cap.max_send_sge = 1;
+    attr.cap.max_recv_sge = 1;
+    attr.send_cq = rail->cq;
+    attr.recv_cq = rail->cq;
+    attr.qp_type = IBV_QPT_RC;
 
-    if (cap.version < 1 || cap.version > RDMA_CONTROL_VERSION_CURRENT) {
-            fprintf(stderr, "Unknown source RDMA version: %d, bailing...\n",
-                            cap.version);
-            rdma_ack_cm_event(cm_event);
-            goto err_rdma_dest_wait;
+    rail->qp = ibv_create_qp(rail->pd, &attr);
+    if (!rail->qp) {
+        fprintf(stderr, "rdma rail: could not create queue pair\n");
+        return -1;
     }
 
-    /*
-     * Respond with only the capabilities this version of QEMU knows about.
-     */
-    cap.flags &= known_capabilities;
+    if (qemu_qp_change_state_init(rail->qp, cand->port)) {
+        return -1;
+    }
 
-    /*
-     * Enable the ones that we do know about.
-     * Add other checks here as new ones are introduced.
-     */
-    if (cap.flags & RDMA_CAPABILITY_PIN_ALL) {
-        rdma->pin_all = true;
+    if (ib_query_link_params(rail->verbs, cand->port,
+                             &rail->data.local_connection)) {
+        return -1;
     }
+    qemu_rdma_set_link_qos(rdma, &rail->data.local_connection.link);
+    rail->data.local_connection.qpn = rail->qp->qp_num;
+    rail->data.local_connection.psn = lrand48() & 0xffffff;
 
-    rdma->cm_id = cm_event->id;
-    verbs = cm_event->id->verbs;
+    rail->mr = g_new0(struct ibv_mr *, nb_blocks);
+    rail->remote_rkey = g_new0(uint32_t, nb_blocks);
 
-    rdma_ack_cm_event(cm_event);
+    return 0;
+}
 
-    DPRINTF("Memory pin all: %s\n", rdma->pin_all ? "enabled" : "disabled");
+/*
+ * Open up to 'nb_wanted' rails in total, rail 0 ('main') included.
+ */
+static void qemu_rdma_rails_init(RDMAContext *rdma, int nb_wanted,
+                                 struct app_data *main)
+{
+    RDMARailCandidate cand[RDMA_MAX_RAILS * 2];
+    struct ibv_device **dev_list;
+    int i, nb_cand;
 
-    caps_to_network(&cap);
+    dev_list = ibv_get_device_list(NULL);
+    if (!dev_list) {
+        return;
+    }
+    nb_cand = qemu_rdma_rail_candidates(dev_list, cand, ARRAY_SIZE(cand));
 
-    DPRINTF("verbs context after listen: %p\n", verbs);
+    for (i = 0; i < nb_cand && rdma->nb_rails < nb_wanted; i++) {
+        RDMARail *rail = &rdma->rail[rdma->nb_rails];
 
-    if (!rdma->verbs) {
-        rdma->verbs = verbs;
-    } else if (rdma->verbs != verbs) {
-            fprintf(stderr, "ibv context not matching %p, %p!\n",
-                    rdma->verbs, verbs);
-            goto err_rdma_dest_wait;
+        if (cand[i].dev == rdma->verbs->device &&
+            cand[i].port == main->local_connection.link.port) {
+            continue;
+        }
+        if (qemu_rdma_rail_init(rdma, rail, &cand[i])) {
+            qemu_rdma_rail_cleanup(rdma, rail);
+            continue;
+        }
+        DPRINTF("Rail %d: %s port %d\n", rdma->nb_rails,
+                ibv_get_device_name(cand[i].dev), cand[i].port);
+        rdma->nb_rails++;
     }
 
-    qemu_rdma_dump_id("dest_init", verbs);
+    ibv_free_device_list(dev_list);
 
-    ret = qemu_rdma_alloc_pd_cq(rdma);
-    if (ret) {
-        fprintf(stderr, "rdma migration: error allocating pd and cq!\n");
-        goto err_rdma_dest_wait;
+    if (rdma->nb_rails < nb_wanted) {
+        fprintf(stderr, "rdma migration: only %d of %d rails available\n",
+                        rdma->nb_rails, nb_wanted);
     }
+}
 
-    ret = qemu_rdma_alloc_qp(rdma);
+static int qemu_rdma_rail_reg_ram_blocks(RDMAContext *rdma, RDMARail *rail)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    int i;
+
+    for (i = 0; i < local->nb_blocks; i++) {
+        if (rail->mr[i] || !local->block[i].is_ram_block) {
+            continue;
+        }
+        rail->mr[i] = ibv_reg_mr(rail->pd, local->block[i].local_host_addr,
+                                 local->block[i].length,
+                                 IBV_ACCESS_LOCAL_WRITE |
+                                 IBV_ACCESS_REMOTE_WRITE);
+        if (!rail->mr[i]) {
+            perror("rdma rail: failed to register ram block");
+            return -1;
+        }
+        rdma->total_registrations++;
+    }
+
+    return 0;
+}
+
+static void rdma_via_tcp_init(RDMAContext *rdma, struct app_data *data)
+{
+    DTPRINTF("%s\n", __func__);
+    struct ibv_device **dev_list;
+    struct ibv_device *dev;
+    RDMARailCandidate cand[RDMA_MAX_RAILS * 2];
+    int ret = 0;
+    Error *local_err = NULL, **temp = &local_err;
+    int idx, nb_cand, port;
+
+    rdma->via_tcp = true;
+	dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		fprintf(stderr, "No IB-device available. get_device_list returned NULL\n");
+		return -1;
+	}
+
+    /* the best placed port, see qemu_rdma_rail_candidates() */
+    nb_cand = qemu_rdma_rail_candidates(dev_list, cand, ARRAY_SIZE(cand));
+    dev = nb_cand ? cand[0].dev : dev_list[0];
+    port = nb_cand ? cand[0].port : DEFAULT_IB_PORT;
+
+    rdma->verbs = qemu_rdma_ready_verbs(dev);
+    if (!rdma->verbs) {
+        rdma->verbs = ibv_open_device(dev);
+    }
+
+    ret = qemu_rdma_alloc_pd_cq(rdma);
     if (ret) {
-        fprintf(stderr, "rdma migration: error allocating qp!\n");
-        goto err_rdma_dest_wait;
+        ERROR(temp, "rdma migration: error allocating pd and cq! Your mlock()"
+                    " limits may be too low. Please check $ ulimit -a # and "
+                    "search for 'ulimit -l' in the output");
+        goto err_rdma_source_init;
     }
 
-    ret = qemu_rdma_init_ram_blocks(rdma);
+    ret = qemu_rdma_alloc_qp2(rdma);
     if (ret) {
-        fprintf(stderr, "rdma migration: error initializing ram blocks!\n");
-        goto err_rdma_dest_wait;
+        ERROR(temp, "rdma migration: error allocating qp!");
+        goto err_rdma_source_init;
     }
 
+
     for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
         ret = qemu_rdma_reg_control(rdma, idx);
         if (ret) {
             fprintf(stderr, "rdma: error registering %d control!\n", idx);
-            goto err_rdma_dest_wait;
+            //goto err_rdma_dest_wait;
         }
     }
 
-    qemu_set_fd_handler2(rdma->channel->fd, NULL, NULL, NULL, NULL);
 
-    ret = rdma_accept(rdma->cm_id, &conn_param);
-    if (ret) {
-        fprintf(stderr, "rdma_accept returns %d!\n", ret);
-        goto err_rdma_dest_wait;
-    }
+	int err = qemu_qp_change_state_init(rdma->qp, port);
+	if (err) {
+		fprintf(stderr, "qp_change_state_init failed: %d\n", err);
+		return err;
+	}	
+
+    /* lid, gid, mtu etc. */
+    err = ib_query_link_params(rdma->verbs, port, &data->local_connection);
+    if (err) {
+        return err;
+    }
+    qemu_rdma_set_link_qos(rdma, &data->local_connection.link);
+	data->local_connection.qpn = rdma->qp->qp_num;
+	data->local_connection.psn = lrand48() & 0xffffff;
+	data->local_connection.rkey = 0;//rdma->block->mr->rkey;
+	data->local_connection.vaddr = 0;//(uintptr_t)context->buf + DEFAULT_BUF_SIZE;
+
+    return 0;
+err_rdma_source_init:
+    qemu_rdma_cleanup(rdma);
+    return -1;
+
+
+}
+static void print_ib_connection(char *conn_name, struct ib_connection *conn) {
+	printf("%s: LID %#04x, QPN %#06x, PSN %#06x RKey %#08x VAddr %#016Lx gid %#016Lx%#016Lx\n", 
+			conn_name, conn->lid, conn->qpn, conn->psn, conn->rkey, conn->vaddr, conn->gid.global.interface_id, conn->gid.global.subnet_prefix);
+
+}
+
+
+
+/*
+ *  qp_change_state_rtr
+ * **********************
+ *  Changes Queue Pair status to RTR (Ready to receive)
+ */
+static int qemu_qp_change_state_rtr(struct ibv_qp *qp, struct app_data *data) {
+	
+	struct ibv_qp_attr *attr;
+	int err = 0;
+	
+    attr =  malloc(sizeof *attr);
+	if (!attr) {
+		fprintf(stderr, "Could not allocate memory for ibv_qp_attr\n");
+		return -ENOMEM;		
+	}
+    memset(attr, 0, sizeof *attr);
+
+    attr->qp_state              = IBV_QPS_RTR;
+    attr->path_mtu              = data->link.mtu;
+    attr->dest_qp_num           = data->remote_connection->qpn;
+    attr->rq_psn                = data->remote_connection->psn;
+    attr->max_dest_rd_atomic    = data->link.rd_atomic;
+    attr->min_rnr_timer         = 2;
+    attr->ah_attr.is_global     = 1;
+    attr->ah_attr.dlid          = data->remote_connection->lid;
+    attr->ah_attr.sl            = data->link.sl;
+    attr->ah_attr.src_path_bits = 0;
+    attr->ah_attr.port_num      = data->link.port;
+	
+	attr->ah_attr.grh.dgid = data->remote_connection->gid;
+	attr->ah_attr.grh.flow_label = 0;
+	attr->ah_attr.grh.sgid_index = data->link.gid_index;
+	attr->ah_attr.grh.hop_limit = data->link.hop_limit;
+	attr->ah_attr.grh.traffic_class = data->link.traffic_class;
+
+    err = ibv_modify_qp(qp, attr,
+                IBV_QP_STATE                |
+                IBV_QP_AV                   |
+                IBV_QP_PATH_MTU             |
+                IBV_QP_DEST_QPN             |
+                IBV_QP_RQ_PSN               |
+                IBV_QP_MAX_DEST_RD_ATOMIC   |
+                IBV_QP_MIN_RNR_TIMER);
+	if (err) {
+		fprintf(stderr, "Could not modify QP to RTR state: %d\n", err);
+		return err;		
+	}	
+
+	free(attr);
+	
+	return err;
+}
+
+/*
+ *  qp_change_state_rts
+ * **********************
+ *  Changes Queue Pair status to RTS (Ready to send)
+ *	QP status has to be RTR before changing it to RTS
+ */
+static int qemu_qp_change_state_rts(struct ibv_qp *qp, struct app_data *data) {
+	struct ibv_qp_attr *attr;
+	int err = 0;
+	
+    attr =  malloc(sizeof *attr);
+    memset(attr, 0, sizeof *attr);
+
+	attr->qp_state              = IBV_QPS_RTS;
+    attr->timeout               = data->link.timeout;
+    attr->retry_cnt             = DEFAULT_RETRY_CNT;
+    attr->rnr_retry             = DEFAULT_RNR_RETRY;
+    attr->sq_psn                = data->local_connection.psn;
+    attr->max_rd_atomic         = data->link.rd_atomic;
+
+    err = ibv_modify_qp(qp, attr,
+                IBV_QP_STATE            |
+                IBV_QP_TIMEOUT          |
+                IBV_QP_RETRY_CNT        |
+                IBV_QP_RNR_RETRY        |
+                IBV_QP_SQ_PSN           |
+                IBV_QP_MAX_QP_RD_ATOMIC);
+	if (err) {
+		fprintf(stderr, "Could not modify QP to RTS state: %d\n", err);
+		return err;		
+	}	
+
+	free(attr);
+	
+	return err;
+}
 
-    ret = rdma_get_cm_event(rdma->channel, &cm_event);
-    if (ret) {
-        fprintf(stderr, "rdma_accept get_cm_event failed %d!\n", ret);
-        goto err_rdma_dest_wait;
-    }
 
-    if (cm_event->event != RDMA_CM_EVENT_ESTABLISHED) {
-        fprintf(stderr, "rdma_accept not event established!\n");
-        rdma_ack_cm_event(cm_event);
-        goto err_rdma_dest_wait;
-    }
 
-    rdma_ack_cm_event(cm_event);
-    rdma->connected = true;
+/*
+ * Move the extra rails to RTR, and to RTS if 'rts'.
+ */
+static int qemu_rdma_rails_connect(RDMAContext *rdma, bool rts)
+{
+    int i, ret;
 
-    ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
-    if (ret) {
-        fprintf(stderr, "rdma migration: error posting second control recv!\n");
-        goto err_rdma_dest_wait;
+    for (i = 1; i < rdma->nb_rails; i++) {
+        ret = qemu_qp_change_state_rtr(rdma->rail[i].qp, &rdma->rail[i].data);
+        if (!ret && rts) {
+            ret = qemu_qp_change_state_rts(rdma->rail[i].qp,
+                                           &rdma->rail[i].data);
+        }
+        if (ret) {
+            fprintf(stderr, "rdma rail %d: connect failed: %d\n", i, ret);
+            return ret;
+        }
     }
 
-    qemu_rdma_dump_gid("dest_connect", rdma->cm_id);
-
     return 0;
-
-err_rdma_dest_wait:
-    rdma->error_state = ret;
-    qemu_rdma_cleanup(rdma);
-    return ret;
 }
 
 /*
- * During each iteration of the migration, we listen for instructions
- * by the source VM to perform dynamic page registrations before they
- * can perform RDMA operations.
+ * Connection setup for the "rdmat:" path.
  *
- * We respond with the 'rkey'.
+ * Everything both sides need before the queue pairs can go to RTS is
+ * exchanged over the bootstrap TCP socket in a single round trip:
  *
- * Keep doing this until the source tells us to stop.
+ *   source -> dest: RDMATcpHello, nb_qps * RDMAQPParams
+ *   dest -> source: RDMATcpHello, nb_qps * RDMAQPParams,
+ *                   nb_blocks * RDMARemoteBlock,
+ *                   (nb_qps - 1) * nb_blocks rkeys (pin-all only)
+ *
+ * The dest's reply carries the negotiated capabilities and its RAMBlock
+ * table (with the rkeys if everything is pinned), so the source can skip
+ * the RAM_BLOCKS_REQUEST exchange at RAM_CONTROL_SETUP.
+ * Queue pair 0 is the main connection, the others are rails (RDMARail),
+ * of which the dest opens as many as it can, up to what the source has.
+ * Everything is in network byte order.
  */
-static int qemu_rdma_registration_handle(QEMUFile *f, void *opaque,
-                                         uint64_t flags)
-{
-    RDMAControlHeader reg_resp = { .len = sizeof(RDMARegisterResult),
-                               .type = RDMA_CONTROL_REGISTER_RESULT,
-                               .repeat = 0,
-                             };
-    RDMAControlHeader unreg_resp = { .len = 0,
-                               .type = RDMA_CONTROL_UNREGISTER_FINISHED,
-                               .repeat = 0,
-                             };
-    RDMAControlHeader blocks = { .type = RDMA_CONTROL_RAM_BLOCKS_RESULT,
-                                 .repeat = 1 };
-    QEMUFileRDMA *rfile = opaque;
-    RDMAContext *rdma = rfile->rdma;
-    RDMALocalBlocks *local = &rdma->local_ram_blocks;
-    RDMAControlHeader head;
-    RDMARegister *reg, *registers;
-    RDMACompress *comp;
-    RDMARegisterResult *reg_result;
-    static RDMARegisterResult results[RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE];
-    RDMALocalBlock *block;
-    void *host_addr;
-    int ret = 0;
-    int idx = 0;
-    int count = 0;
-    int i = 0;
-
-    CHECK_ERROR_STATE();
-
-    do {
-        DDDPRINTF("Waiting for next request %" PRIu64 "...\n", flags);
-
-        ret = qemu_rdma_exchange_recv(rdma, &head, RDMA_CONTROL_NONE);
-
-        if (ret < 0) {
-            break;
-        }
-
-        if (head.repeat > RDMA_CONTROL_MAX_COMMANDS_PER_MESSAGE) {
-            fprintf(stderr, "rdma: Too many requests in this message (%d)."
-                            "Bailing.\n", head.repeat);
-            ret = -EIO;
-            break;
-        }
-
-        switch (head.type) {
-        case RDMA_CONTROL_COMPRESS:
-            comp = (RDMACompress *) rdma->wr_data[idx].control_curr;
-            network_to_compress(comp);
-
-            DDPRINTF("Zapping zero chunk: %" PRId64
-                    " bytes, index %d, offset %" PRId64 "\n",
-                    comp->length, comp->block_idx, comp->offset);
-            block = &(rdma->local_ram_blocks.block[comp->block_idx]);
+#define RDMA_TCP_HANDSHAKE_MAGIC   0x52444d54 /* "RDMT" */
+#define RDMA_TCP_HANDSHAKE_VERSION 3
+#define RDMA_TCP_MAX_QPS RDMA_MAX_RAILS
 
-            host_addr = block->local_host_addr +
-                            (comp->offset - block->offset);
-
-            ram_handle_compressed(host_addr, comp->value, comp->length);
-            break;
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;         /* RDMA_CAPABILITY_* */
+    uint32_t nb_qps;
+    uint32_t nb_blocks;     /* always 0 from the source */
+    uint32_t padding;
+} RDMATcpHello;
 
-        case RDMA_CONTROL_REGISTER_FINISHED:
-            DDDPRINTF("Current registrations complete.\n");
-            goto out;
+typedef struct QEMU_PACKED {
+    uint32_t qpn;
+    uint32_t psn;
+    uint16_t lid;
+    uint16_t padding;
+    uint8_t  gid[16];       /* already in network order */
+    /* version 2: link parameters, see ib_query_link_params() */
+    uint8_t  mtu;           /* enum ibv_mtu */
+    uint8_t  rd_atomic;
+    uint8_t  timeout;
+    uint8_t  padding2;
+} RDMAQPParams;
+
+static size_t qp_params_size(uint32_t version)
+{
+    return version < 2 ? offsetof(RDMAQPParams, mtu) : sizeof(RDMAQPParams);
+}
 
-        case RDMA_CONTROL_RAM_BLOCKS_REQUEST:
-            DPRINTF("Initial setup info requested.\n");
+static void hello_to_network(RDMATcpHello *hello)
+{
+    hello->magic = htonl(hello->magic);
+    hello->version = htonl(hello->version);
+    hello->flags = htonl(hello->flags);
+    hello->nb_qps = htonl(hello->nb_qps);
+    hello->nb_blocks = htonl(hello->nb_blocks);
+}
 
-            if (rdma->pin_all) {
-                ret = qemu_rdma_reg_whole_ram_blocks(rdma);
-                if (ret) {
-                    fprintf(stderr, "rdma migration: error dest "
-                                    "registering ram blocks!\n");
-                    goto out;
-                }
-            }
+static void network_to_hello(RDMATcpHello *hello)
+{
+    hello->magic = ntohl(hello->magic);
+    hello->version = ntohl(hello->version);
+    hello->flags = ntohl(hello->flags);
+    hello->nb_qps = ntohl(hello->nb_qps);
+    hello->nb_blocks = ntohl(hello->nb_blocks);
+}
 
-            /*
-             * Dest uses this to prepare to transmit the RAMBlock descriptions
-             * to the source VM after connection setup.
-             * Both sides use the "remote" structure to communicate and update
-             * their "local" descriptions with what was sent.
-             */
-            for (i = 0; i < local->nb_blocks; i++) {
-                rdma->block[i].remote_host_addr =
-                    (uint64_t)(local->block[i].local_host_addr);
+static void qp_params_from_connection(RDMAQPParams *qp,
+                                      struct ib_connection *conn)
+{
+    memset(qp, 0, sizeof(*qp));
+    qp->qpn = htonl(conn->qpn);
+    qp->psn = htonl(conn->psn);
+    qp->lid = htons(conn->lid);
+    memcpy(qp->gid, conn->gid.raw, sizeof(qp->gid));
+    qp->mtu = conn->link.mtu;
+    qp->rd_atomic = conn->link.rd_atomic;
+    qp->timeout = conn->link.timeout;
+}
 
-                if (rdma->pin_all) {
-                    rdma->block[i].remote_rkey = local->block[i].mr->rkey;
-                }
+static void qp_params_to_connection(struct ib_connection *conn,
+                                    RDMAQPParams *qp)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->qpn = ntohl(qp->qpn);
+    conn->psn = ntohl(qp->psn);
+    conn->lid = ntohs(qp->lid);
+    memcpy(conn->gid.raw, qp->gid, sizeof(qp->gid));
+    conn->link.mtu = qp->mtu;
+    conn->link.rd_atomic = qp->rd_atomic;
+    conn->link.timeout = qp->timeout;
+}
 
-                rdma->block[i].offset = local->block[i].offset;
-                rdma->block[i].length = local->block[i].length;
+/*
+ * Blocking socket I/O that copes with short reads/writes and signals.
+ */
+static int qemu_rdma_tcp_read_full(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
 
-                remote_block_to_network(&rdma->block[i]);
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return -errno;
+        }
+        if (n == 0) {
+            return -ECONNRESET;
+        }
+        p += n;
+        len -= n;
+    }
 
-            blocks.len = rdma->local_ram_blocks.nb_blocks
-                                                * sizeof(RDMARemoteBlock);
-
+    return 0;
+}
 
-            ret = qemu_rdma_post_send_control(rdma,
-                                        (uint8_t *) rdma->block, &blocks);
+static int qemu_rdma_tcp_write_full(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
 
-            if (ret < 0) {
-                fprintf(stderr, "rdma migration: error sending remote info!\n");
-                goto out;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
             }
+            return -errno;
+        }
+        p += n;
+        len -= n;
+    }
 
-            break;
-        case RDMA_CONTROL_REGISTER_REQUEST:
-            DDPRINTF("There are %d registration requests\n", head.repeat);
-
-            reg_resp.repeat = head.repeat;
-            registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
-
-            for (count = 0; count < head.repeat; count++) {
-                uint64_t chunk;
-                uint8_t *chunk_start, *chunk_end;
-
-                reg = &registers[count];
-                network_to_register(reg);
-
-                reg_result = &results[count];
-
-                DDPRINTF("Registration request (%d): index %d, current_addr %"
-                         PRIu64 " chunks: %" PRIu64 "\n", count,
-                         reg->current_index, reg->key.current_addr, reg->chunks);
-
-                block = &(rdma->local_ram_blocks.block[reg->current_index]);
-                if (block->is_ram_block) {
-                    host_addr = (block->local_host_addr +
-                                (reg->key.current_addr - block->offset));
-                    chunk = ram_chunk_index(block->local_host_addr,
-                                            (uint8_t *) host_addr);
-                } else {
-                    chunk = reg->key.chunk;
-                    host_addr = block->local_host_addr +
-                        (reg->key.chunk * (1UL << RDMA_REG_CHUNK_SHIFT));
-                }
-                chunk_start = ram_chunk_start(block, chunk);
-                chunk_end = ram_chunk_end(block, chunk + reg->chunks);
-                if (qemu_rdma_register_and_get_keys(rdma, block,
-                            (uint8_t *)host_addr, NULL, &reg_result->rkey,
-                            chunk, chunk_start, chunk_end)) {
-                    fprintf(stderr, "cannot get rkey!\n");
-                    ret = -EINVAL;
-                    goto out;
-                }
+    return 0;
+}
 
-                reg_result->host_addr = (uint64_t) block->local_host_addr;
+/*
+ * Read and validate the other side's hello and queue pair parameters,
+ * and negotiate the main connection's link parameters with it.
+ * The parameters of the other queue pairs are left in 'qps'.
+ */
+static int qemu_rdma_tcp_read_hello(int fd, RDMATcpHello *hello,
+                                    RDMAQPParams *qps, struct app_data *data)
+{
+    size_t size;
+    int ret, i;
 
-                DDPRINTF("Registered rkey for this request: %x\n",
-                                reg_result->rkey);
+    ret = qemu_rdma_tcp_read_full(fd, hello, sizeof(*hello));
+    if (ret) {
+        return ret;
+    }
+    network_to_hello(hello);
 
-                result_to_network(reg_result);
-            }
+    if (hello->magic != RDMA_TCP_HANDSHAKE_MAGIC) {
+        fprintf(stderr, "rdma migration: bad handshake magic %#x\n",
+                        hello->magic);
+        return -EINVAL;
+    }
+    if (hello->version < 1 || hello->version > RDMA_TCP_HANDSHAKE_VERSION) {
+        fprintf(stderr, "Unknown RDMA handshake version: %d, bailing...\n",
+                        hello->version);
+        return -EINVAL;
+    }
+    if (hello->nb_qps < 1 || hello->nb_qps > RDMA_TCP_MAX_QPS) {
+        fprintf(stderr, "rdma migration: bad number of queue pairs: %d\n",
+                        hello->nb_qps);
+        return -EINVAL;
+    }
 
-            ret = qemu_rdma_post_send_control(rdma,
-                            (uint8_t *) results, &reg_resp);
+    /* older versions send shorter queue pair parameters */
+    memset(qps, 0, hello->nb_qps * sizeof(RDMAQPParams));
+    size = qp_params_size(hello->version);
+    for (i = 0; i < hello->nb_qps; i++) {
+        ret = qemu_rdma_tcp_read_full(fd, &qps[i], size);
+        if (ret) {
+            return ret;
+        }
+    }
 
-            if (ret < 0) {
-                fprintf(stderr, "Failed to send control buffer!\n");
-                goto out;
-            }
-            break;
-        case RDMA_CONTROL_UNREGISTER_REQUEST:
-            DDPRINTF("There are %d unregistration requests\n", head.repeat);
-            unreg_resp.repeat = head.repeat;
-            registers = (RDMARegister *) rdma->wr_data[idx].control_curr;
+    if (!data->remote_connection) {
+        data->remote_connection = g_malloc0(sizeof(struct ib_connection));
+    }
+    qp_params_to_connection(data->remote_connection, &qps[0]);
+    ib_negotiate_link_params(data);
 
-            for (count = 0; count < head.repeat; count++) {
-                reg = &registers[count];
-                network_to_register(reg);
+    DPRINTF("Link: mtu %d gid index %d rd_atomic %d timeout %d%s\n",
+            128 << data->link.mtu, data->link.gid_index,
+            data->link.rd_atomic, data->link.timeout,
+            data->link.is_roce ? " (RoCE)" : "");
 
-                DDPRINTF("Unregistration request (%d): "
-                         " index %d, chunk %" PRIu64 "\n",
-                         count, reg->current_index, reg->key.chunk);
+    return 0;
+}
 
-                block = &(rdma->local_ram_blocks.block[reg->current_index]);
+static int qemu_rdma_tcp_write_hello(RDMAContext *rdma, int fd,
+                                     uint32_t version, uint32_t flags,
+                                     int nb_blocks, struct app_data *data)
+{
+    RDMATcpHello hello = {
+        .magic = RDMA_TCP_HANDSHAKE_MAGIC,
+        .version = version,
+        .flags = flags,
+        .nb_qps = version < 3 ? 1 : rdma->nb_rails,
+        .nb_blocks = nb_blocks,
+    };
+    RDMAQPParams qp;
+    int ret, i;
 
-                ret = ibv_dereg_mr(block->pmr[reg->key.chunk]);
-                block->pmr[reg->key.chunk] = NULL;
+    hello_to_network(&hello);
+    ret = qemu_rdma_tcp_write_full(fd, &hello, sizeof(hello));
+    if (ret) {
+        return ret;
+    }
 
-                if (ret != 0) {
-                    perror("rdma unregistration chunk failed");
-                    ret = -ret;
-                    goto out;
-                }
+    for (i = 0; i < ntohl(hello.nb_qps); i++) {
+        qp_params_from_connection(&qp, i ? &rdma->rail[i].data.local_connection
+                                         : &data->local_connection);
+        ret = qemu_rdma_tcp_write_full(fd, &qp, qp_params_size(version));
+        if (ret) {
+            return ret;
+        }
+    }
 
-                rdma->total_registrations--;
+    return 0;
+}
 
-                DDPRINTF("Unregistered chunk %" PRIu64 " successfully.\n",
-                            reg->key.chunk);
-            }
+/*
+ * Take the peer's parameters for rails 1..nb_rails - 1.
+ */
+static void qemu_rdma_rails_set_remote(RDMAContext *rdma, RDMAQPParams *qps)
+{
+    int i;
 
-            ret = qemu_rdma_post_send_control(rdma, NULL, &unreg_resp);
+    for (i = 1; i < rdma->nb_rails; i++) {
+        RDMARail *rail = &rdma->rail[i];
 
-            if (ret < 0) {
-                fprintf(stderr, "Failed to send control buffer!\n");
-                goto out;
-            }
-            break;
-        case RDMA_CONTROL_REGISTER_RESULT:
-            fprintf(stderr, "Invalid RESULT message at dest.\n");
-            ret = -EIO;
-            goto out;
-        default:
-            fprintf(stderr, "Unknown control message %s\n",
-                                control_desc[head.type]);
-            ret = -EIO;
-            goto out;
-        }
-    } while (1);
-out:
-    if (ret < 0) {
-        rdma->error_state = ret;
+        rail->data.remote_connection = g_malloc0(sizeof(struct ib_connection));
+        qp_params_to_connection(rail->data.remote_connection, &qps[i]);
+        ib_negotiate_link_params(&rail->data);
     }
-    return ret;
 }
 
-static int qemu_rdma_registration_start(QEMUFile *f, void *opaque,
-                                        uint64_t flags)
+static int qemu_rdma_tcp_handshake_source(RDMAContext *rdma,
+                                          struct app_data *data, Error **errp)
 {
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAQPParams qps[RDMA_TCP_MAX_QPS];
+    RDMARemoteBlock *remote;
+    RDMATcpHello hello;
+    uint32_t *rkeys;
+    int ret, i, j, r;
+
+    qemu_rdma_resume_check(rdma);
+    ret = qemu_rdma_tcp_write_hello(rdma, data->sockfd,
+                        RDMA_TCP_HANDSHAKE_VERSION,
+                        (rdma->pin_all ? RDMA_CAPABILITY_PIN_ALL : 0) |
+                        (rdma->hash ? RDMA_CAPABILITY_HASH : 0) |
+                        (rdma->compress ? RDMA_CAPABILITY_LZ4 : 0) |
+                        (rdma->resume ? RDMA_CAPABILITY_RESUME : 0) |
+                        (rdma->free_page_agent ? RDMA_CAPABILITY_DISCARD : 0) |
+                        (rdma->resume ? 0 : RDMA_CAPABILITY_DISK) |
+                        RDMA_CAPABILITY_PARALLEL_FINISH, 0, data);
+    if (ret) {
+        ERROR(errp, "sending rdma handshake: %s", strerror(-ret));
+        return ret;
+    }
 
-    QEMUFileRDMA *rfile = opaque;
-    RDMAContext *rdma = rfile->rdma;
-
-    CHECK_ERROR_STATE();
-
-    DDDPRINTF("start section: %" PRIu64 "\n", flags);
-    qemu_put_be64(f, RAM_SAVE_FLAG_HOOK);
-    qemu_fflush(f);
+    /*
+     * Pin locally while the dest does the same, as in
+     * qemu_rdma_registration_stop().
+     */
+    if (rdma->pin_all) {
+        ret = qemu_rdma_reg_whole_ram_blocks(rdma);
+        for (i = 1; i < rdma->nb_rails && !ret; i++) {
+            ret = qemu_rdma_rail_reg_ram_blocks(rdma, &rdma->rail[i]);
+        }
+        if (ret) {
+            ERROR(errp, "rdma migration: error registering ram blocks!");
+            return ret;
+        }
+    }
 
-    return 0;
-}
+    ret = qemu_rdma_tcp_read_hello(data->sockfd, &hello, qps, data);
+    if (ret) {
+        ERROR(errp, "receiving rdma handshake: %s", strerror(-ret));
+        return ret;
+    }
 
-/*
- * Inform dest that dynamic registrations are done for now.
- * First, flush writes, if any.
- */
-static int qemu_rdma_registration_stop(QEMUFile *f, void *opaque,
-                                       uint64_t flags)
-{
+    /* the dest may have opened fewer rails than we asked for */
+    while (rdma->nb_rails > hello.nb_qps) {
+        qemu_rdma_rail_cleanup(rdma, &rdma->rail[--rdma->nb_rails]);
+    }
+    qemu_rdma_rails_set_remote(rdma, qps);
 
-    Error *local_err = NULL, **errp = &local_err;
-    QEMUFileRDMA *rfile = opaque;
-    RDMAContext *rdma = rfile->rdma;
-    RDMAControlHeader head = { .len = 0, .repeat = 1 };
-    int ret = 0;
+    if (rdma->pin_all && !(hello.flags & RDMA_CAPABILITY_PIN_ALL)) {
+        fprintf(stderr, "Server cannot support pinning all memory. "
+                        "Will register memory dynamically.\n");
+        rdma->pin_all = false;
+    }
+    if (rdma->hash && !(hello.flags & RDMA_CAPABILITY_HASH)) {
+        fprintf(stderr, "Server cannot hash its memory. "
+                        "Will send every page.\n");
+        rdma->hash = false;
+    }
+    if (rdma->compress && !(hello.flags & RDMA_CAPABILITY_LZ4)) {
+        fprintf(stderr, "Server cannot decompress LZ4. "
+                        "Will send chunks uncompressed.\n");
+        rdma->compress = 0;
+    }
+    if (rdma->resume && !(hello.flags & RDMA_CAPABILITY_RESUME)) {
+        fprintf(stderr, "Server cannot resume. "
+                        "Will fail with the connection.\n");
+        rdma->resume = false;
+    }
+    if (rdma->free_page_agent && !(hello.flags & RDMA_CAPABILITY_DISCARD)) {
+        fprintf(stderr, "Server cannot discard pages. "
+                        "Will send free pages.\n");
+        g_free(rdma->free_page_agent);
+        rdma->free_page_agent = NULL;
+    }
+    rdma->parallel_finish = hello.flags & RDMA_CAPABILITY_PARALLEL_FINISH;
+    rdma->disk_writes = hello.flags & RDMA_CAPABILITY_DISK;
 
-    CHECK_ERROR_STATE();
+    DPRINTF("Pin all memory: %s\n", rdma->pin_all ? "enabled" : "disabled");
 
-    qemu_fflush(f);
-    ret = qemu_rdma_drain_cq(f, rdma);
+    if (hello.nb_blocks != local->nb_blocks) {
+        ERROR(errp, "ram blocks mismatch #1! "
+                    "Your QEMU command line parameters are probably "
+                    "not identical on both the source and destination.");
+        return -EINVAL;
+    }
 
-    if (ret < 0) {
-        goto err;
+    remote = g_malloc(hello.nb_blocks * sizeof(RDMARemoteBlock));
+    ret = qemu_rdma_tcp_read_full(data->sockfd, remote,
+                                  hello.nb_blocks * sizeof(RDMARemoteBlock));
+    if (ret) {
+        ERROR(errp, "receiving remote info: %s", strerror(-ret));
+    } else {
+        ret = qemu_rdma_process_remote_blocks(rdma, remote,
+                                              hello.nb_blocks, errp);
     }
+    g_free(remote);
 
-    if (flags == RAM_CONTROL_SETUP) {
-        RDMAControlHeader resp = {.type = RDMA_CONTROL_RAM_BLOCKS_RESULT };
-        RDMALocalBlocks *local = &rdma->local_ram_blocks;
-        int reg_result_idx, i, j, nb_remote_blocks;
+    if (ret) {
+        return ret;
+    }
+    rdma->remote_blocks_known = true;
 
-        head.type = RDMA_CONTROL_RAM_BLOCKS_REQUEST;
-        DPRINTF("Sending registration setup for ram blocks...\n");
+    if (!(hello.flags & RDMA_CAPABILITY_PIN_ALL) || rdma->nb_rails < 2) {
+        return 0;
+    }
 
-        /*
-         * Make sure that we parallelize the pinning on both sides.
-         * For very large guests, doing this serially takes a really
-         * long time, so we have to 'interleave' the pinning locally
-         * with the control messages by performing the pinning on this
-         * side before we receive the control response from the other
-         * side that the pinning has completed.
-         */
-        ret = qemu_rdma_exchange_send(rdma, &head, NULL, &resp,
-                    &reg_result_idx, rdma->pin_all ?
-                    qemu_rdma_reg_whole_ram_blocks : NULL);
-        if (ret < 0) {
-            ERROR(errp, "receiving remote info!");
-            return ret;
+    /*
+     * Rail rkeys, in the order of the dest's RAMBlock table, which
+     * qemu_rdma_process_remote_blocks() left in rdma->block.
+     */
+    rkeys = g_new(uint32_t, hello.nb_blocks);
+    for (r = 1; r < rdma->nb_rails && !ret; r++) {
+        ret = qemu_rdma_tcp_read_full(data->sockfd, rkeys,
+                                      hello.nb_blocks * sizeof(uint32_t));
+        for (i = 0; i < hello.nb_blocks && !ret; i++) {
+            for (j = 0; j < local->nb_blocks; j++) {
+                if (rdma->block[i].offset == local->block[j].offset) {
+                    rdma->rail[r].remote_rkey[j] = ntohl(rkeys[i]);
+                    break;
+                }
+            }
         }
+    }
+    g_free(rkeys);
 
-        nb_remote_blocks = resp.len / sizeof(RDMARemoteBlock);
+    if (ret) {
+        ERROR(errp, "receiving rail keys: %s", strerror(-ret));
+    }
+    return ret;
+}
 
-        /*
-         * The protocol uses two different sets of rkeys (mutually exclusive):
-         * 1. One key to represent the virtual address of the entire ram block.
-         *    (dynamic chunk registration disabled - pin everything with one rkey.)
-         * 2. One to represent individual chunks within a ram block.
-         *    (dynamic chunk registration enabled - pin individual chunks.)
-         *
-         * Once the capability is successfully negotiated, the destination transmits
-         * the keys to use (or sends them later) including the virtual addresses
-         * and then propagates the remote ram block descriptions to his local copy.
-         */
+static int qemu_rdma_tcp_handshake_dest(RDMAContext *rdma,
+                                        struct app_data *data)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAQPParams qps[RDMA_TCP_MAX_QPS];
+    RDMATcpHello hello;
+    uint32_t *rkeys;
+    int ret, i, r;
 
-        if (local->nb_blocks != nb_remote_blocks) {
-            ERROR(errp, "ram blocks mismatch #1! "
-                        "Your QEMU command line parameters are probably "
-                        "not identical on both the source and destination.");
-            return -EINVAL;
-        }
+    ret = qemu_rdma_tcp_read_hello(data->sockfd, &hello, qps, data);
+    if (ret) {
+        return ret;
+    }
 
-        qemu_rdma_move_header(rdma, reg_result_idx, &resp);
-        memcpy(rdma->block,
-            rdma->wr_data[reg_result_idx].control_curr, resp.len);
-        for (i = 0; i < nb_remote_blocks; i++) {
-            network_to_remote_block(&rdma->block[i]);
+    /*
+     * Respond with only the capabilities this version of QEMU knows about.
+     */
+    hello.flags &= known_capabilities;
 
-            /* search local ram blocks */
-            for (j = 0; j < local->nb_blocks; j++) {
-                if (rdma->block[i].offset != local->block[j].offset) {
-                    continue;
-                }
+    /*
+     * Enable the ones that we do know about.
+     * Add other checks here as new ones are introduced.
+     */
+    if (hello.flags & RDMA_CAPABILITY_PIN_ALL) {
+        rdma->pin_all = true;
+    }
+    rdma->resume = hello.flags & RDMA_CAPABILITY_RESUME;
+    rdma->parallel_finish = hello.flags & RDMA_CAPABILITY_PARALLEL_FINISH;
 
-                if (rdma->block[i].length != local->block[j].length) {
-                    ERROR(errp, "ram blocks mismatch #2! "
-                        "Your QEMU command line parameters are probably "
-                        "not identical on both the source and destination.");
-                    return -EINVAL;
-                }
-                local->block[j].remote_host_addr =
-                        rdma->block[i].remote_host_addr;
-                local->block[j].remote_rkey = rdma->block[i].remote_rkey;
-                break;
-            }
+    DPRINTF("Memory pin all: %s\n", rdma->pin_all ? "enabled" : "disabled");
 
-            if (j >= local->nb_blocks) {
-                ERROR(errp, "ram blocks mismatch #3! "
-                        "Your QEMU command line parameters are probably "
-                        "not identical on both the source and destination.");
-                return -EINVAL;
+    /*
+     * Rails are only used to write pinned memory, so only open them
+     * then. They must be ready to receive before the source learns
+     * about them.
+     */
+    if (rdma->pin_all && hello.nb_qps > 1) {
+        qemu_rdma_rails_init(rdma, hello.nb_qps, data);
+        qemu_rdma_rails_set_remote(rdma, qps);
+        for (i = 1; i < rdma->nb_rails; i++) {
+            if (qemu_rdma_rail_reg_ram_blocks(rdma, &rdma->rail[i])) {
+                return -ENOMEM;
             }
         }
+        ret = qemu_rdma_rails_connect(rdma, false);
+        if (ret) {
+            return ret;
+        }
     }
 
-    DDDPRINTF("Sending registration finish %" PRIu64 "...\n", flags);
+    if (rdma->pin_all) {
+        ret = qemu_rdma_reg_whole_ram_blocks(rdma);
+        if (ret) {
+            fprintf(stderr, "rdma migration: error dest "
+                            "registering ram blocks!\n");
+            return ret;
+        }
+    }
 
-    head.type = RDMA_CONTROL_REGISTER_FINISHED;
-    ret = qemu_rdma_exchange_send(rdma, &head, NULL, NULL, NULL, NULL);
+    qemu_rdma_prepare_remote_blocks(rdma);
 
-    if (ret < 0) {
-        goto err;
+    /* reply in the source's version */
+    ret = qemu_rdma_tcp_write_hello(rdma, data->sockfd, hello.version,
+                                    hello.flags, local->nb_blocks, data);
+    if (ret) {
+        return ret;
+    }
+    ret = qemu_rdma_tcp_write_full(data->sockfd, rdma->block,
+                                local->nb_blocks * sizeof(RDMARemoteBlock));
+    if (ret || rdma->nb_rails < 2) {
+        return ret;
     }
 
-    return 0;
-err:
-    rdma->error_state = ret;
+    rkeys = g_new(uint32_t, local->nb_blocks);
+    for (r = 1; r < rdma->nb_rails && !ret; r++) {
+        for (i = 0; i < local->nb_blocks; i++) {
+            rkeys[i] = htonl(rdma->rail[r].mr[i] ?
+                             rdma->rail[r].mr[i]->rkey : 0);
+        }
+        ret = qemu_rdma_tcp_write_full(data->sockfd, rkeys,
+                                       local->nb_blocks * sizeof(uint32_t));
+    }
+    g_free(rkeys);
+
     return ret;
 }
 
-static int qemu_rdma_get_fd(void *opaque)
+/*
+ * ",resume": take what the old connection left on the CQ.  Writes that
+ * completed are accounted for, the others keep or get back their chunk's
+ * bit in the transit bitmap for qemu_rdma_resync().
+ */
+static void qemu_rdma_resume_drain(RDMAContext *rdma)
 {
+    struct ibv_wc wc;
 
-    QEMUFileRDMA *rfile = opaque;
-    RDMAContext *rdma = rfile->rdma;
+    while (ibv_poll_cq(rdma->cq, 1, &wc) > 0) {
+        if (wc.status == IBV_WC_SUCCESS) {
+            qemu_rdma_complete(rdma, &wc);
+        } else {
+            qemu_rdma_write_failed(rdma, wc.wr_id);
+        }
+    }
 
-    return rdma->comp_channel->fd;
+    rdma->nb_sent = 0;
+    rdma->rail[0].nb_sent = 0;
+    rdma->rail[0].inflight_bytes = 0;
 }
 
-const QEMUFileOps rdma_read_ops = {
-    .get_buffer    = qemu_rdma_get_buffer,
-    .get_fd        = qemu_rdma_get_fd,
-    .close         = qemu_rdma_close,
-    .hook_ram_load = qemu_rdma_registration_handle,
-};
+/*
+ * ",resume", source: replace the failed connection with a new one, the
+ * way it was made at first, on the same device, pd and CQ.  Registered
+ * memory stays valid on both sides.
+ */
+static int qemu_rdma_reconnect(RDMAContext *rdma)
+{
+    RDMACapabilities cap = {
+                                .version = RDMA_CONTROL_VERSION_CURRENT,
+                                .flags = RDMA_CAPABILITY_RESUME,
+                           };
+    struct rdma_conn_param conn_param = { .initiator_depth = 2,
+                                          .retry_count = 5,
+                                          .private_data = &cap,
+                                          .private_data_len = sizeof(cap),
+                                        };
+    struct ibv_context *verbs = rdma->verbs;
+    struct rdma_cm_event *cm_event;
+    RDMAQPParams qps[RDMA_TCP_MAX_QPS];
+    RDMATcpHello hello;
+    int ret;
 
-const QEMUFileOps rdma_write_ops = {
-    .put_buffer         = qemu_rdma_put_buffer,
-    .close              = qemu_rdma_close,
-    .before_ram_iterate = qemu_rdma_registration_start,
-    .after_ram_iterate  = qemu_rdma_registration_stop,
-    .save_page          = qemu_rdma_save_page,
-};
+    rdma->connected = false;
 
-static void *qemu_fopen_rdma(RDMAContext *rdma, const char *mode)
-{
+    if (rdma->via_tcp) {
+        close(rdma->data.sockfd);
+        rdma->data.sockfd = -1;
+        ibv_destroy_qp(rdma->qp);
+        rdma->qp = NULL;
+        qemu_rdma_resume_drain(rdma);
 
-    QEMUFileRDMA *r = g_malloc0(sizeof(QEMUFileRDMA));
+        if (qemu_rdma_alloc_qp2(rdma)) {
+            return -ENOMEM;
+        }
+        ret = qemu_qp_change_state_init(rdma->qp,
+                                        rdma->data.local_connection.link.port);
+        if (ret) {
+            return -ret;
+        }
+        rdma->data.local_connection.qpn = rdma->qp->qp_num;
+        rdma->data.local_connection.psn = lrand48() & 0xffffff;
 
-    if (qemu_file_mode_is_not_valid(mode)) {
-        return NULL;
-    }
+        rdma->data.sockfd = tcp_client_connect(&rdma->data);
+        if (rdma->data.sockfd < 0) {
+            return -ECONNREFUSED;
+        }
+        ret = qemu_rdma_tcp_write_hello(rdma, rdma->data.sockfd,
+                                        RDMA_TCP_HANDSHAKE_VERSION,
+                                        RDMA_CAPABILITY_RESUME, 0, &rdma->data);
+        if (!ret) {
+            ret = qemu_rdma_tcp_read_hello(rdma->data.sockfd, &hello, qps,
+                                           &rdma->data);
+        }
+        if (ret) {
+            return ret;
+        }
+        if (!(hello.flags & RDMA_CAPABILITY_RESUME)) {
+            fprintf(stderr, "rdma migration: dest will not resume\n");
+            return -EPROTO;
+        }
+        ret = qemu_qp_change_state_rtr(rdma->qp, &rdma->data);
+        if (!ret) {
+            ret = qemu_qp_change_state_rts(rdma->qp, &rdma->data);
+        }
+        if (ret) {
+            return -ret;
+        }
 
-    r->rdma = rdma;
+        rdma->connected = true;
+        return 0;
+    }
 
-    if (mode[0] == 'w') {
-        r->file = qemu_fopen_ops(r, &rdma_write_ops);
-    } else {
-        r->file = qemu_fopen_ops(r, &rdma_read_ops);
+    if (rdma->cm_id) {
+        if (rdma->qp) {
+            rdma_destroy_qp(rdma->cm_id);
+            rdma->qp = NULL;
+        }
+        rdma_destroy_id(rdma->cm_id);
+        rdma->cm_id = NULL;
+    }
+    if (rdma->channel) {
+        rdma_destroy_event_channel(rdma->channel);
+        rdma->channel = NULL;
     }
+    qemu_rdma_resume_drain(rdma);
 
-    return r->file;
-}
+    ret = qemu_rdma_resolve_host(rdma, NULL);
+    if (ret) {
+        return ret;
+    }
+    if (rdma->verbs != verbs) {
+        fprintf(stderr, "rdma migration: cannot resume on another device\n");
+        rdma->verbs = verbs;
+        return -ENODEV;
+    }
 
-static void rdma_accept_incoming_migration(void *opaque)
-{
-    DTPRINTF("%s\n", __func__);
-    RDMAContext *rdma = opaque;
-    int ret;
-    QEMUFile *f;
-    Error *local_err = NULL, **errp = &local_err;
+    if (qemu_rdma_alloc_qp(rdma)) {
+        return -ENOMEM;
+    }
 
-    DPRINTF("Accepting rdma connection...\n");
-    ret = qemu_rdma_accept(rdma);
+    caps_to_network(&cap);
+    ret = rdma_connect(rdma->cm_id, &conn_param);
+    if (ret) {
+        perror("rdma_connect");
+        return -ECONNREFUSED;
+    }
 
+    ret = rdma_get_cm_event(rdma->channel, &cm_event);
     if (ret) {
-        ERROR(errp, "RDMA Migration initialization failed!");
-        return;
+        perror("rdma_get_cm_event after rdma_connect");
+        return -ECONNREFUSED;
+    }
+    if (cm_event->event != RDMA_CM_EVENT_ESTABLISHED) {
+        fprintf(stderr, "rdma migration: resuming: %s\n",
+                        rdma_event_str(cm_event->event));
+        rdma_ack_cm_event(cm_event);
+        return -ECONNREFUSED;
     }
 
-    DPRINTF("Accepted migration\n");
+    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    network_to_caps(&cap);
+    rdma_ack_cm_event(cm_event);
 
-    f = qemu_fopen_rdma(rdma, "rb");
-    if (f == NULL) {
-        ERROR(errp, "could not qemu_fopen_rdma!");
-        qemu_rdma_cleanup(rdma);
-        return;
+    if (!(cap.flags & RDMA_CAPABILITY_RESUME)) {
+        fprintf(stderr, "rdma migration: dest will not resume\n");
+        return -EPROTO;
     }
 
-    rdma->migration_started_on_destination = 1;
-    process_incoming_migration(f);
+    rdma->connected = true;
+    return 0;
 }
 
-void rdma_start_incoming_migration(const char *host_port, Error **errp)
+/*
+ * ",resume", dest: accept the source's new connection, if it comes
+ * before 'deadline', and have a READY recv posted on it before the
+ * source can send.
+ */
+static int qemu_rdma_accept_resume(RDMAContext *rdma, int64_t deadline)
 {
-    DTPRINTF("%s\n", __func__);
-    int ret;
-    RDMAContext *rdma;
-    Error *local_err = NULL;
+    RDMACapabilities cap;
+    struct rdma_conn_param conn_param = {
+                                            .responder_resources = 2,
+                                            .private_data = &cap,
+                                            .private_data_len = sizeof(cap),
+                                         };
+    struct rdma_cm_event *cm_event = rdma->resume_event;
+    struct rdma_cm_id *old_id = rdma->cm_id;
+    RDMAQPParams qps[RDMA_TCP_MAX_QPS];
+    RDMATcpHello hello;
+    struct pollfd pfd[2] = {
+        { .fd = qemu_rdma_resume_fd(rdma), .events = POLLIN },
+        { .fd = rdma->recv ? rdma->recv->stop : -1, .events = POLLIN },
+    };
+    int64_t timeout;
+    int fd, ret;
+
+    rdma->resume_event = NULL;
+    rdma->connected = false;
+
+    while (!cm_event) {
+        timeout = deadline - qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        if (timeout <= 0) {
+            return -ETIMEDOUT;
+        }
+        if (poll(pfd, 2, timeout) <= 0) {
+            continue;
+        }
+        if (pfd[1].revents) {
+            return -ECANCELED;
+        }
+        if (rdma->via_tcp) {
+            break;
+        }
+        if (rdma_get_cm_event(rdma->channel, &cm_event)) {
+            return -errno;
+        }
+        if (cm_event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+            rdma_ack_cm_event(cm_event);
+            cm_event = NULL;
+        }
+    }
+
+    if (rdma->via_tcp) {
+        fd = accept(rdma->sockfd, NULL, 0);
+        if (fd < 0) {
+            return -errno;
+        }
+        ibv_destroy_qp(rdma->qp);
+        rdma->qp = NULL;
+        qemu_rdma_resume_drain(rdma);
+
+        ret = qemu_rdma_alloc_qp2(rdma) ? -ENOMEM :
+              -qemu_qp_change_state_init(rdma->qp,
+                                    rdma->data.local_connection.link.port);
+        if (!ret) {
+            rdma->data.local_connection.qpn = rdma->qp->qp_num;
+            rdma->data.local_connection.psn = lrand48() & 0xffffff;
+            ret = qemu_rdma_tcp_read_hello(fd, &hello, qps, &rdma->data);
+        }
+        if (!ret && !(hello.flags & RDMA_CAPABILITY_RESUME)) {
+            fprintf(stderr, "rdma migration: source cannot resume\n");
+            ret = -EPROTO;
+        }
+        if (!ret) {
+            ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
+        }
+        if (!ret) {
+            ret = -qemu_qp_change_state_rtr(rdma->qp, &rdma->data);
+        }
+        if (!ret) {
+            ret = qemu_rdma_tcp_write_hello(rdma, fd, hello.version,
+                                            hello.flags & known_capabilities,
+                                            0, &rdma->data);
+        }
+        if (!ret) {
+            ret = -qemu_qp_change_state_rts(rdma->qp, &rdma->data);
+        }
+        if (ret) {
+            close(fd);
+            return ret;
+        }
+
+        close(rdma->data.sockfd);
+        rdma->data.sockfd = fd;
+        rdma->connected = true;
+        return 0;
+    }
+
+    memcpy(&cap, cm_event->param.conn.private_data, sizeof(cap));
+    network_to_caps(&cap);
+    if (!(cap.flags & RDMA_CAPABILITY_RESUME)) {
+        fprintf(stderr, "rdma migration: source cannot resume\n");
+        rdma_reject(cm_event->id, NULL, 0);
+        rdma_ack_cm_event(cm_event);
+        return -EPROTO;
+    }
+    cap.flags &= known_capabilities;
+    caps_to_network(&cap);
 
-    DPRINTF("Starting RDMA-based incoming migration\n");
-    rdma = qemu_rdma_data_init(host_port, &local_err);
+    rdma->cm_id = cm_event->id;
+    rdma_ack_cm_event(cm_event);
 
-    if (rdma == NULL) {
-        goto err;
+    if (old_id) {
+        if (rdma->qp) {
+            rdma_destroy_qp(old_id);
+            rdma->qp = NULL;
+        }
+        rdma_destroy_id(old_id);
     }
+    qemu_rdma_resume_drain(rdma);
 
-    ret = qemu_rdma_dest_init(rdma, &local_err);
-
+    if (qemu_rdma_alloc_qp(rdma)) {
+        return -ENOMEM;
+    }
+    ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
     if (ret) {
-        goto err;
+        return ret;
     }
 
-    DPRINTF("qemu_rdma_dest_init success\n");
-
-    ret = rdma_listen(rdma->listen_id, 5);
-
+    ret = rdma_accept(rdma->cm_id, &conn_param);
     if (ret) {
-        ERROR(errp, "listening on socket!");
-        goto err;
+        fprintf(stderr, "rdma_accept returns %d!\n", ret);
+        return -ECONNABORTED;
     }
 
-    DPRINTF("rdma_listen success\n");
+    /* late events of the connection replaced do not matter */
+    for (;;) {
+        ret = rdma_get_cm_event(rdma->channel, &cm_event);
+        if (ret) {
+            return -errno;
+        }
+        if (cm_event->id == rdma->cm_id) {
+            break;
+        }
+        rdma_ack_cm_event(cm_event);
+    }
+    ret = cm_event->event == RDMA_CM_EVENT_ESTABLISHED ? 0 : -ECONNABORTED;
+    rdma_ack_cm_event(cm_event);
+    if (ret) {
+        return ret;
+    }
 
-    qemu_set_fd_handler2(rdma->channel->fd, NULL,
-                         rdma_accept_incoming_migration, NULL,
-                            (void *)(intptr_t) rdma);
-    return;
-err:
-    error_propagate(errp, local_err);
-    g_free(rdma);
+    rdma->connected = true;
+    return 0;
 }
 
-
-void rdma_start_outgoing_migration(void *opaque,
-                            const char *host_port, Error **errp)
+/*
+ * ",resume": RDMA-write the pages of chunk 'chunk' of block 'index' the
+ * dest turned out not to have, 'len' bytes from 'offset' into the block.
+ */
+static int qemu_rdma_resync_write(RDMAContext *rdma, int index, uint64_t chunk,
+                                  uint64_t offset, uint64_t len)
 {
-    DTPRINTF("%s\n", __func__);
-    //uint64_t start = getTime(), diff;
-    uint64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME), diff;
-    MigrationState *s = opaque;
-    Error *local_err = NULL, **temp = &local_err;
-    RDMAContext *rdma = qemu_rdma_data_init(host_port, &local_err);
-    int ret = 0;
+    RDMALocalBlock *block = &(rdma->local_ram_blocks.block[index]);
+    struct ibv_sge sge = {
+        .addr = (uint64_t)(block->local_host_addr + offset),
+        .length = len,
+    };
+    struct ibv_send_wr send_wr = {
+        .wr_id = qemu_rdma_make_wrid(RDMA_WRID_RDMA_WRITE, index, chunk),
+        .opcode = IBV_WR_RDMA_WRITE,
+        .send_flags = IBV_SEND_SIGNALED,
+        .sg_list = &sge,
+        .num_sge = 1,
+    };
+    struct ibv_send_wr *bad_wr;
+    int ret;
 
-    if (rdma == NULL) {
-        ERROR(temp, "Failed to initialize RDMA data structures! %d", ret);
-        goto err;
+    if (qemu_rdma_register_and_get_keys(rdma, block, (uint8_t *) sge.addr,
+                                        &sge.lkey, NULL, chunk,
+                                        ram_chunk_start(block, chunk),
+                                        ram_chunk_end(block, chunk))) {
+        fprintf(stderr, "cannot get lkey!\n");
+        return -EINVAL;
     }
-
-    ret = qemu_rdma_source_init(rdma, &local_err,
-        s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL]);
-
-    if (ret) {
-        goto err;
+    send_wr.wr.rdma.rkey = (!rdma->pin_all || !block->is_ram_block) ?
+                           block->remote_keys[chunk] : block->remote_rkey;
+    send_wr.wr.rdma.remote_addr = block->remote_host_addr + offset;
+    if (!send_wr.wr.rdma.rkey) {
+        return -EINVAL;
     }
 
-    DPRINTF("qemu_rdma_source_init success\n");
-    ret = qemu_rdma_connect(rdma, &local_err);
+    while (rdma->rail[0].nb_sent &&
+           rdma->rail[0].inflight_bytes + len > RDMA_RESYNC_INFLIGHT) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
-    if (ret) {
-        goto err;
+    while ((ret = ibv_post_send(rdma->qp, &send_wr, &bad_wr)) == ENOMEM) {
+        ret = qemu_rdma_block_for_wrid(rdma, RDMA_WRID_RDMA_WRITE, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (ret > 0) {
+        return -ret;
     }
 
-    DPRINTF("qemu_rdma_source_connect success\n");
+    set_bit(chunk, block->transit_bitmap);
+    qemu_rdma_rail_posted(rdma, &rdma->rail[0], len);
+    rdma->nb_sent++;
+    rdma->total_writes++;
+    RDMA_EVENT(POST, len, send_wr.wr_id);
 
-    s->file = qemu_fopen_rdma(rdma, "wb");
-    migrate_fd_connect(s);
-    //diff = getTime() - start;
-    diff = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
-    TPRINTF("rdma connection took: %llu ms\n", diff);
-    return;
-err:
-    error_propagate(errp, local_err);
-    g_free(rdma);
-    migrate_fd_error(s);
+    if (block->hash_valid) {
+        bitmap_clear(block->hash_valid, offset >> TARGET_PAGE_BITS,
+                     len >> TARGET_PAGE_BITS);
+    }
+    return 0;
 }
 
-static int qemu_qp_change_state_init(struct ibv_qp *qp){
-	
-	struct ibv_qp_attr *attr;
-	int err = 0;
-	
-    attr =  malloc(sizeof *attr);
-    memset(attr, 0, sizeof *attr);
-
-    attr->qp_state        	= IBV_QPS_INIT;
-    attr->pkey_index      	= 0;
-    attr->port_num        	= DEFAULT_IB_PORT;
-    attr->qp_access_flags	= IBV_ACCESS_REMOTE_WRITE;
+/* ",resume": how many chunks qemu_rdma_resync() has left to check */
+static uint64_t qemu_rdma_transit_chunks(RDMAContext *rdma)
+{
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    uint64_t chunk, count = 0;
+    int i;
 
-    err = ibv_modify_qp(qp, attr,
-                            IBV_QP_STATE        |
-                            IBV_QP_PKEY_INDEX   |
-                            IBV_QP_PORT         |
-                            IBV_QP_ACCESS_FLAGS);
-	if (err) {
-		fprintf(stderr, "Could not modify QP to INIT, ibv_modify_qp, err: %d\n", err);
-	}
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
 
-	return err;
+        for (chunk = find_next_bit(block->transit_bitmap, block->nb_chunks, 0);
+             chunk < block->nb_chunks;
+             chunk = find_next_bit(block->transit_bitmap, block->nb_chunks,
+                                   chunk + 1)) {
+            count++;
+        }
+    }
+    return count;
 }
 
-static void rdma_via_tcp_init(RDMAContext *rdma, struct app_data *data)
+/*
+ * ",resume": the writes that did not complete may or may not have
+ * landed.  Ask the dest for the hashes of their chunks and write again
+ * the pages that differ.
+ */
+static int qemu_rdma_resync(RDMAContext *rdma)
 {
-    DTPRINTF("%s\n", __func__);
-    struct ibv_device **dev_list;
-    int ret = 0;
-    Error *local_err = NULL, **temp = &local_err;
-    int idx;
-
-	dev_list = ibv_get_device_list(NULL);
-	if (!dev_list) {
-		fprintf(stderr, "No IB-device available. get_device_list returned NULL\n");
-		return -1;
-	}
-    rdma->verbs = ibv_open_device(dev_list[0]);
-
-    ret = qemu_rdma_alloc_pd_cq(rdma);
-    if (ret) {
-        ERROR(temp, "rdma migration: error allocating pd and cq! Your mlock()"
-                    " limits may be too low. Please check $ ulimit -a # and "
-                    "search for 'ulimit -l' in the output");
-        goto err_rdma_source_init;
-    }
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    RDMAControlHeader head = { .len = sizeof(RDMAHashRequest),
+                               .type = RDMA_CONTROL_RESYNC_REQUEST,
+                               .repeat = 1 };
+    RDMAControlHeader resp;
+    RDMAHashRequest req;
+    uint64_t chunk, offset, end, *hashes;
+    int i, j, run, idx, ret;
+    bool differs;
 
-    ret = qemu_rdma_alloc_qp2(rdma);
-    if (ret) {
-        ERROR(temp, "rdma migration: error allocating qp!");
-        goto err_rdma_source_init;
-    }
+    for (i = 0; i < local->nb_blocks; i++) {
+        RDMALocalBlock *block = &local->block[i];
+
+        for (chunk = find_next_bit(block->transit_bitmap, block->nb_chunks, 0);
+             chunk < block->nb_chunks;
+             chunk = find_next_bit(block->transit_bitmap, block->nb_chunks,
+                                   chunk + 1)) {
+            offset = ram_chunk_start(block, chunk) - block->local_host_addr;
+            end = ram_chunk_end(block, chunk) - block->local_host_addr;
+            if (end <= offset) {
+                clear_bit(chunk, block->transit_bitmap);
+                continue;
+            }
 
+            req.block_idx = i;
+            req.nb_pages = (end - offset) >> TARGET_PAGE_BITS;
+            req.offset = offset;
+            hash_request_to_network(&req);
 
-    for (idx = 0; idx < RDMA_WRID_MAX; idx++) {
-        ret = qemu_rdma_reg_control(rdma, idx);
-        if (ret) {
-            fprintf(stderr, "rdma: error registering %d control!\n", idx);
-            //goto err_rdma_dest_wait;
+            resp.type = RDMA_CONTROL_HASH_RESULT;
+            ret = __qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &req,
+                                            &resp, &idx, NULL);
+            network_to_hash_request(&req);
+            if (ret < 0) {
+                return ret;
+            }
+            if (resp.len != req.nb_pages * sizeof(uint64_t)) {
+                fprintf(stderr, "rdma: bad hash result for %" PRIu64
+                        " pages\n", (uint64_t) req.nb_pages);
+                return -EIO;
+            }
+            clear_bit(chunk, block->transit_bitmap);
+
+            hashes = (uint64_t *) rdma->wr_data[idx].control_curr;
+            for (j = 0, run = -1; j <= req.nb_pages; j++) {
+                differs = j < req.nb_pages &&
+                          ntohll(hashes[j]) != qemu_rdma_hash_page(
+                              block->local_host_addr + offset +
+                              ((uint64_t) j << TARGET_PAGE_BITS));
+                if (differs && run < 0) {
+                    run = j;
+                } else if (!differs && run >= 0) {
+                    ret = qemu_rdma_resync_write(rdma, i, chunk,
+                            offset + ((uint64_t) run << TARGET_PAGE_BITS),
+                            (uint64_t) (j - run) << TARGET_PAGE_BITS);
+                    if (ret < 0) {
+                        return ret;
+                    }
+                    run = -1;
+                }
+            }
         }
     }
 
-
-	int err = qemu_qp_change_state_init(rdma->qp);
-	if (err) {
-		fprintf(stderr, "qp_change_state_init failed: %d\n", err);
-		return err;
-	}	
-
-	struct ibv_port_attr attr;
-	err = ibv_query_port(rdma->verbs, 1, &attr);
-	if (err) {
-		fprintf(stderr, "Could not get port attributes, ibv_query_port\n");
-		return err;
-	}
-	
-	union ibv_gid gid;
-	err = ibv_query_gid(rdma->verbs, 1, 0, &gid);
-	if (err) {
-		fprintf(stderr, "Could not get port gid, ibv_query_gid\n");
-		return err;
-	}
-    data->local_connection.lid = attr.lid;
-	data->local_connection.qpn = rdma->qp->qp_num;
-	data->local_connection.psn = lrand48() & 0xffffff;
-	data->local_connection.rkey = 0;//rdma->block->mr->rkey;
-	data->local_connection.vaddr = 0;//(uintptr_t)context->buf + DEFAULT_BUF_SIZE;
-	data->local_connection.gid = gid;
-
     return 0;
-err_rdma_source_init:
-    qemu_rdma_cleanup(rdma);
-    return -1;
+}
+
+/*
+ * ",resume", source: called with what the connection just failed with,
+ * 'ret'.  Open a new connection, agree with the dest on the control
+ * messages it got, and make up for the writes that did not complete.
+ * If the dest missed the last message sent, and it was not part of the
+ * exchange under way, it is sent again here, otherwise '*lost' tells the
+ * caller to.  Returns 0 once the migration can go on, 'ret' without
+ * ",resume".
+ */
+static int qemu_rdma_recover(RDMAContext *rdma, int ret, bool *lost)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    RDMAControlHeader head = { .len = sizeof(uint64_t),
+                               .type = RDMA_CONTROL_RESUME_REQUEST,
+                               .repeat = 1 };
+    RDMAControlHeader resp, last;
+    uint8_t *control = rdma->wr_data[RDMA_WRID_CONTROL].control;
+    bool replay = !rdma->in_flight, missed = false;
+    uint64_t count, left, fewest = UINT64_MAX;
+    int attempt, progress = 0, idx;
+
+    if (ret >= 0 || !rdma->resume || rdma->resuming) {
+        return ret;
+    }
 
+    /* the last message sent, unless the last resume already sent more */
+    memcpy(&last, control, sizeof(last));
+    network_to_control(&last);
+    if (rdma->sent_msgs && last.type != RDMA_CONTROL_RESUME_REQUEST &&
+        last.type != RDMA_CONTROL_RESYNC_REQUEST &&
+        last.len <= RDMA_CONTROL_MAX_BUFFER - sizeof(last)) {
+        g_free(rdma->resume_msg);
+        rdma->resume_msg = g_malloc(sizeof(last) + last.len);
+        memcpy(rdma->resume_msg, control, sizeof(last) + last.len);
+    }
 
-}
-static void print_ib_connection(char *conn_name, struct ib_connection *conn) {
-	printf("%s: LID %#04x, QPN %#06x, PSN %#06x RKey %#08x VAddr %#016Lx gid %#016Lx%#016Lx\n", 
-			conn_name, conn->lid, conn->qpn, conn->psn, conn->rkey, conn->vaddr, conn->gid.global.interface_id, conn->gid.global.subnet_prefix);
+    fprintf(stderr, "rdma migration: connection failed (%d), resuming...\n",
+                    ret);
+    rdma->resuming = true;
 
-}
+    for (attempt = 0; attempt < progress + RDMA_RESUME_ATTEMPTS; attempt++) {
+        if (attempt) {
+            g_usleep(RDMA_RESUME_DELAY_MS * 1000);
+        }
 
+        ret = qemu_rdma_reconnect(rdma);
+        if (ret < 0) {
+            continue;
+        }
 
+        /* nothing posted yet: the response comes in the first recv */
+        rdma->control_ready_expected = 0;
+        count = htonll(rdma->sent_msgs);
+        resp.type = RDMA_CONTROL_RESUME_RESULT;
+        ret = __qemu_rdma_exchange_send(rdma, &head, (uint8_t *) &count,
+                                        &resp, &idx, NULL);
+        if (ret < 0) {
+            continue;
+        }
+        if (resp.len != sizeof(count)) {
+            ret = -EPROTO;
+            break;
+        }
+        memcpy(&count, rdma->wr_data[idx].control_curr, sizeof(count));
+        count = ntohll(count);
+        /* counted here, as the dest does once it has answered */
+        rdma->stats.resumes++;
+
+        if (count + 1 == rdma->sent_msgs && (!replay || rdma->resume_msg)) {
+            rdma->sent_msgs = count;
+            missed = true;
+        } else if (count != rdma->sent_msgs) {
+            fprintf(stderr, "rdma migration: dest got %" PRIu64 " of %"
+                    PRIu64 " messages, cannot resume\n",
+                    count, rdma->sent_msgs);
+            ret = -EPROTO;
+            break;
+        }
 
-/*
- *  qp_change_state_rtr
- * **********************
- *  Changes Queue Pair status to RTR (Ready to receive)
- */
-static int qemu_qp_change_state_rtr(struct ibv_qp *qp, struct app_data *data) {
-	
-	struct ibv_qp_attr *attr;
-	int err = 0;
-	
-    attr =  malloc(sizeof *attr);
-	if (!attr) {
-		fprintf(stderr, "Could not allocate memory for ibv_qp_attr\n");
-		return -ENOMEM;		
-	}
-    memset(attr, 0, sizeof *attr);
+        if (missed && replay) {
+            memcpy(&last, rdma->resume_msg, sizeof(last));
+            network_to_control(&last);
+            rdma->in_flight = false;
+            ret = __qemu_rdma_exchange_send(rdma, &last,
+                                            rdma->resume_msg + sizeof(last),
+                                            NULL, NULL, NULL);
+            if (ret >= 0 || rdma->in_flight) {
+                /* sent: the next attempt finds out whether it got there */
+                missed = false;
+            }
+            if (ret < 0) {
+                continue;
+            }
+        }
 
-    attr->qp_state              = IBV_QPS_RTR;
-    attr->path_mtu              = IBV_MTU_1024;
-    attr->dest_qp_num           = data->remote_connection->qpn;
-    attr->rq_psn                = data->remote_connection->psn;
-    attr->max_dest_rd_atomic    = 0;
-    attr->min_rnr_timer         = 2;
-    attr->ah_attr.is_global     = 1;
-    attr->ah_attr.dlid          = data->remote_connection->lid;
-    attr->ah_attr.sl            = DEFAULT_SL;
-    attr->ah_attr.src_path_bits = 0;
-    attr->ah_attr.port_num      = DEFAULT_IB_PORT;
-	
-	attr->ah_attr.grh.dgid = data->remote_connection->gid;
-	attr->ah_attr.grh.flow_label = 0;
-	attr->ah_attr.grh.sgid_index = 0;
-	attr->ah_attr.grh.hop_limit = 1;
-	attr->ah_attr.grh.traffic_class = 0;
+        /* what the last resync got through stays done */
+        left = qemu_rdma_transit_chunks(rdma);
+        if (left < fewest) {
+            progress = fewest == UINT64_MAX ? 0 : attempt;
+            fewest = left;
+        }
 
-    err = ibv_modify_qp(qp, attr,
-                IBV_QP_STATE                |
-                IBV_QP_AV                   |
-                IBV_QP_PATH_MTU             |
-                IBV_QP_DEST_QPN             |
-                IBV_QP_RQ_PSN               |
-                IBV_QP_MAX_DEST_RD_ATOMIC   |
-                IBV_QP_MIN_RNR_TIMER);
-	if (err) {
-		fprintf(stderr, "Could not modify QP to RTR state: %d\n", err);
-		return err;		
-	}	
+        ret = qemu_rdma_resync(rdma);
+        if (ret >= 0) {
+            break;
+        }
+    }
 
-	free(attr);
-	
-	return err;
+    rdma->resuming = false;
+    rdma->in_flight = false;
+    if (ret < 0) {
+        fprintf(stderr, "rdma migration: could not resume: %d\n", ret);
+        return ret;
+    }
+
+    fprintf(stderr, "rdma migration: resumed\n");
+    qemu_rdma_span(rdma, "resume", start, attempt);
+    if (lost) {
+        *lost = missed && !replay;
+    }
+    return 0;
 }
 
 /*
- *  qp_change_state_rts
- * **********************
- *  Changes Queue Pair status to RTS (Ready to send)
- *	QP status has to be RTR before changing it to RTS
+ * ",resume", dest: called with what the connection just failed with,
+ * 'ret'.  Wait for the source's new connection and tell it how many
+ * control messages got here.  Returns 0 once the migration can go on,
+ * 'ret' without ",resume".
  */
-static int qemu_qp_change_state_rts(struct ibv_qp *qp, struct app_data *data) {
-	struct ibv_qp_attr *attr;
-	int err = 0;
-	
-    attr =  malloc(sizeof *attr);
-    memset(attr, 0, sizeof *attr);
+static int qemu_rdma_recover_dest(RDMAContext *rdma, int ret)
+{
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                       RDMA_RESUME_TIMEOUT_MS;
+    RDMAControlHeader head;
+    RDMAControlHeader resp = { .len = sizeof(uint64_t),
+                               .type = RDMA_CONTROL_RESUME_RESULT,
+                               .repeat = 1 };
+    uint64_t count;
 
-	attr->qp_state              = IBV_QPS_RTS;
-    attr->timeout               = 14;
-    attr->retry_cnt             = 7;
-    attr->rnr_retry             = 7;    /* infinite retry */
-    attr->sq_psn                = data->local_connection.psn;
-    attr->max_rd_atomic         = 1;
+    if (!rdma->resume || rdma->resuming || qemu_rdma_recv_stopping(rdma)) {
+        return ret;
+    }
 
-    err = ibv_modify_qp(qp, attr,
-                IBV_QP_STATE            |
-                IBV_QP_TIMEOUT          |
-                IBV_QP_RETRY_CNT        |
-                IBV_QP_RNR_RETRY        |
-                IBV_QP_SQ_PSN           |
-                IBV_QP_MAX_QP_RD_ATOMIC);
-	if (err) {
-		fprintf(stderr, "Could not modify QP to RTS state: %d\n", err);
-		return err;		
-	}	
+    fprintf(stderr, "rdma migration: connection failed (%d), waiting for "
+                    "the source to resume...\n", ret);
+    rdma->resuming = true;
 
-	free(attr);
-	
-	return err;
-}
+    while (!qemu_rdma_recv_stopping(rdma) &&
+           qemu_clock_get_ms(QEMU_CLOCK_REALTIME) < deadline) {
+        ret = qemu_rdma_accept_resume(rdma, deadline);
+        if (ret < 0) {
+            continue;
+        }
+
+        ret = qemu_rdma_exchange_get_response(rdma, &head,
+                    RDMA_CONTROL_RESUME_REQUEST, RDMA_WRID_READY);
+        if (ret < 0) {
+            continue;
+        }
+
+        count = htonll(rdma->recv_msgs);
+        ret = qemu_rdma_post_send_control(rdma, (uint8_t *) &count, &resp);
+        if (ret < 0) {
+            continue;
+        }
+        ret = qemu_rdma_post_recv_control(rdma, RDMA_WRID_READY);
+        if (!ret) {
+            break;
+        }
+    }
 
+    rdma->resuming = false;
+    if (ret < 0) {
+        fprintf(stderr, "rdma migration: source did not resume: %d\n", ret);
+        return ret;
+    }
 
+    fprintf(stderr, "rdma migration: resumed\n");
+    rdma->stats.resumes++;
+    qemu_rdma_span(rdma, "resume", start, -1);
+    return 0;
+}
 
 void rdma_start_outgoing_migration2(void *opaque,
                             const char *host_port, Error **errp)
 {
     DTPRINTF("%s\n", __func__);
-    //uint64_t start = getTime(), diff;
-    int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME), diff;
+    int64_t start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     MigrationState *s = opaque;
     Error *local_err = NULL, **temp = &local_err;
     RDMAContext *rdma = qemu_rdma_data_init(host_port, &local_err);
@@ -3787,14 +10328,18 @@ void rdma_start_outgoing_migration2(void *opaque,
         //goto err_rdma_dest_wait;
     }
 
+    qemu_rdma_ready_attach(rdma);
 
+    rdma->pin_all = migrate_rdma_pin_all();
+    if (rdma->rails > 1 && rdma->pin_all) {
+        qemu_rdma_rails_init(rdma, rdma->rails, &data);
+    }
 
     data.sockfd = tcp_client_connect(&data);
-	ret = tcp_exch_ib_connection_info(&data);
-	if (ret) {
-		fprintf(stderr, "Could not exchange connection, tcp_exch_ib_connection\n");
+    ret = qemu_rdma_tcp_handshake_source(rdma, &data, temp);
+    if (ret) {
         goto err;
-	}
+    }
     DPRINTF("exchange successful\n");
 	print_ib_connection("Local  Connection", &data.local_connection);
 	print_ib_connection("Remote Connection", data.remote_connection);	
@@ -3814,6 +10359,10 @@ void rdma_start_outgoing_migration2(void *opaque,
         fprintf(stderr, "qp modify to rtr failed: %d\n", ret);
         goto err;
     }
+    ret = qemu_rdma_rails_connect(rdma, true);
+    if (ret) {
+        goto err;
+    }
 //    ret = qemu_rdma_init_ram_blocks(rdma);
 //    if (ret) {
 //        fprintf(stderr, "rdma migration: error initializing ram blocks!\n");
@@ -3839,13 +10388,15 @@ void rdma_start_outgoing_migration2(void *opaque,
 
 
     rdma->connected = true;
+    rdma->data = data;          /* for qemu_rdma_reconnect() */
     DPRINTF("qemu_rdma_source_connect success\n");
+    qemu_rdma_span(rdma, "setup", start, -1);
+    qemu_rdma_free_connect(rdma);
 
     s->file = qemu_fopen_rdma(rdma, "wb");
     migrate_fd_connect(s);
-//    diff = qemu_get_ - start;
-    diff = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start;
-    TPRINTF("rdma connection took: %llu ms\n", diff);
+    TPRINTF("rdma connection took: %" PRId64 " ms\n",
+            (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start) / SCALE_MS);
     return;
 err:
     error_propagate(errp, local_err);
@@ -3861,20 +10412,30 @@ static void rdma_accept_incoming_migration2(void *opaque)
 
     int er = 0;
     int ret = 0;
+    int64_t start;
     
 //    rdma_via_tcp_init(rdma, &data);	
 //    data.sockfd = accept(rdma->sockfd, NULL, 0);
     rdma->data.sockfd = accept(rdma->sockfd, NULL, 0);
-    ret = qemu_rdma_init_ram_blocks(rdma);
-    if (ret) {
-        fprintf(stderr, "rdma migration: error initializing ram blocks!\n");
-        //goto err_rdma_dest_wait;
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    /* a later connection can only be the source resuming */
+    qemu_set_fd_handler2(rdma->sockfd, NULL, NULL, NULL, NULL);
+    qemu_rdma_prewarm_wait(rdma);
+    if (!rdma->blockmap) {
+        ret = qemu_rdma_init_ram_blocks(rdma);
+        if (ret) {
+            fprintf(stderr, "rdma migration: error initializing ram blocks!\n");
+            //goto err_rdma_dest_wait;
+        }
     }
 
-	er = tcp_exch_ib_connection_info(&(rdma->data));
-	if (er) {
-		fprintf(stderr, "Could not exchange connection, tcp_exch_ib_connection\n");
-	}
+    er = qemu_rdma_tcp_handshake_dest(rdma, &(rdma->data));
+    if (er) {
+        fprintf(stderr, "rdma migration: connection handshake failed: %d\n",
+                        er);
+        qemu_rdma_cleanup(rdma);
+        return;
+    }
 
     //er = qemu_qp_change_state_rtr(rdma->qp, &data);
     er = qemu_qp_change_state_rtr(rdma->qp, &(rdma->data));
@@ -3904,6 +10465,7 @@ static void rdma_accept_incoming_migration2(void *opaque)
     
 
     DPRINTF("Accepted migration\n");
+    qemu_rdma_span(rdma, "accept", start, -1);
 
     QEMUFile *f;
     f = qemu_fopen_rdma(rdma, "rb");
@@ -3915,6 +10477,7 @@ static void rdma_accept_incoming_migration2(void *opaque)
     DPRINTF("fopen_rdma success\n");
 
     rdma->migration_started_on_destination = 1;
+    qemu_rdma_recv_start(rdma);
     process_incoming_migration(f);
 
 
@@ -3936,6 +10499,13 @@ void rdma_start_incoming_migration2(const char *host_port, Error **errp)
 
     rdma_via_tcp_init(rdma, &(rdma->data));	
 
+    /*
+     * On this path the device, pd, cq and qp all exist already.
+     */
+    if (rdma->prewarm) {
+        qemu_rdma_prewarm_start(rdma);
+    }
+
     int er = 0;
 //    data.sockfd = tcp_server_listen(&data);
     struct addrinfo *res;//, *t;
@@ -3995,3 +10565,436 @@ err:
     error_propagate(errp, local_err);
     g_free(rdma);
 }
+
+/*
+ * "local:PATH": migration between two QEMUs on the same host, over the
+ * unix socket at PATH.  Guest RAM is not copied: in the setup iteration
+ * the source sends the RDMARemoteBlock list of its RAM blocks, with the
+ * fd of the shared file each one is mapped from passed along as
+ * SCM_RIGHTS, and the dest maps those over its own RAM blocks.  From
+ * then on both sides see the same pages, so the iterations have nothing
+ * to send and only the device state goes over the stream, whatever the
+ * size of the guest.
+ *
+ * The source's RAM has to be a MAP_SHARED mapping of a file, such as a
+ * memfd or -mem-path on tmpfs or hugetlbfs with -mem-prealloc.  The
+ * handoff message, after the RAM_SAVE_FLAG_HOOK, is
+ *     uint32_t nb_blocks, nb_blocks x RDMARemoteBlock,
+ *     nb_blocks x uint64_t offset of the block into its file
+ * in network byte order, with the fds in the same order.
+ */
+#define RDMA_LOCAL_MAX_FDS 253      /* SCM_MAX_FD */
+
+/*
+ * An fd of the file that 'block' is a shared mapping of, with the offset
+ * of the block into it in '*file_offset', or -1.  The file is reopened
+ * through /proc/self/map_files, or else through an fd of this process
+ * that has it open already.
+ */
+static int qemu_local_ram_fd(RDMALocalBlock *block, uint64_t *file_offset)
+{
+    uintptr_t addr = (uintptr_t) block->local_host_addr, start, end;
+    unsigned long long offset, inode;
+    unsigned int dev_major, dev_minor;
+    char line[PATH_MAX + 128], perms[5], path[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    FILE *maps;
+    DIR *dir;
+    int fd = -1;
+
+    maps = fopen("/proc/self/maps", "r");
+    if (!maps) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), maps)) {
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %4s %llx %x:%x %llu",
+                   &start, &end, perms, &offset, &dev_major, &dev_minor,
+                   &inode) != 7 || addr < start || addr >= end) {
+            continue;
+        }
+        if (perms[3] == 's' && inode && addr + block->length <= end) {
+            *file_offset = offset + (addr - start);
+            snprintf(path, sizeof(path), "/proc/self/map_files/%" PRIxPTR
+                     "-%" PRIxPTR, start, end);
+            fd = open(path, O_RDWR | O_CLOEXEC);
+        } else {
+            inode = 0;
+        }
+        break;
+    }
+    fclose(maps);
+
+    /* map_files wants CAP_SYS_ADMIN on older kernels */
+    if (fd >= 0 || !inode || !(dir = opendir("/proc/self/fd"))) {
+        return fd;
+    }
+    while ((entry = readdir(dir))) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%s", entry->d_name);
+        if (!stat(path, &st) && st.st_ino == inode &&
+            major(st.st_dev) == dev_major && minor(st.st_dev) == dev_minor) {
+            fd = open(path, O_RDWR | O_CLOEXEC);
+            break;
+        }
+    }
+    closedir(dir);
+    return fd;
+}
+
+/*
+ * QEMUFile interface to the unix socket.  The RAM block fds queued in
+ * 'local_fds' go with the first bytes written after them.
+ */
+static int qemu_local_put_buffer(void *opaque, const uint8_t *buf,
+                                 int64_t pos, int size)
+{
+    QEMUFileRDMA *r = opaque;
+    RDMAContext *rdma = r->rdma;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * RDMA_LOCAL_MAX_FDS)];
+    } control;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t n;
+    int done = 0;
+
+    while (done < size) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = (uint8_t *) buf + done;
+        iov.iov_len = size - done;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (rdma->nb_local_fds) {
+            msg.msg_control = control.buf;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * rdma->nb_local_fds);
+            cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * rdma->nb_local_fds);
+            memcpy(CMSG_DATA(cmsg), rdma->local_fds,
+                   sizeof(int) * rdma->nb_local_fds);
+        }
+
+        n = sendmsg(rdma->local_fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+
+        /* the dest holds its own references now */
+        qemu_local_close_fds(rdma);
+        done += n;
+    }
+
+    return size;
+}
+
+static int qemu_local_get_buffer(void *opaque, uint8_t *buf,
+                                 int64_t pos, int size)
+{
+    QEMUFileRDMA *r = opaque;
+    RDMAContext *rdma = r->rdma;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * RDMA_LOCAL_MAX_FDS)];
+    } control;
+    struct cmsghdr *cmsg;
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct msghdr msg;
+    ssize_t n;
+    int nb;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        n = recvmsg(rdma->local_fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n >= 0) {
+            break;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            yield_until_fd_readable(rdma->local_fd);
+        } else if (errno != EINTR) {
+            return -errno;
+        }
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        nb = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        rdma->local_fds = g_renew(int, rdma->local_fds,
+                                  rdma->nb_local_fds + nb);
+        memcpy(rdma->local_fds + rdma->nb_local_fds, CMSG_DATA(cmsg),
+               sizeof(int) * nb);
+        rdma->nb_local_fds += nb;
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        fprintf(stderr, "local migration: RAM block fds lost!\n");
+        return -EMSGSIZE;
+    }
+
+    return n;
+}
+
+static int qemu_local_get_fd(void *opaque)
+{
+    QEMUFileRDMA *r = opaque;
+
+    return r->rdma->local_fd;
+}
+
+static int qemu_local_close(void *opaque)
+{
+    QEMUFileRDMA *r = opaque;
+
+    DPRINTF("Shutting down local migration.\n");
+    qemu_rdma_cleanup(r->rdma);
+    g_free(r->rdma);
+    g_free(r);
+    return 0;
+}
+
+static int qemu_local_registration_start(QEMUFile *f, void *opaque,
+                                         uint64_t flags)
+{
+    if (flags == RAM_CONTROL_SETUP) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_HOOK);
+    }
+    return 0;
+}
+
+/*
+ * Source: hand the RAM blocks over at the end of the setup iteration.
+ */
+static int qemu_local_registration_stop(QEMUFile *f, void *opaque,
+                                        uint64_t flags)
+{
+    QEMUFileRDMA *r = opaque;
+    RDMAContext *rdma = r->rdma;
+    RDMALocalBlocks *local = &rdma->local_ram_blocks;
+    uint64_t *offsets;
+    int i, fd, ret = 0;
+
+    if (flags != RAM_CONTROL_SETUP) {
+        return 0;
+    }
+    if (local->nb_blocks > RDMA_LOCAL_MAX_FDS) {
+        fprintf(stderr, "local migration: %d RAM blocks, at most %d can "
+                "be handed over!\n", local->nb_blocks, RDMA_LOCAL_MAX_FDS);
+        return -E2BIG;
+    }
+
+    /* the fds must not go with what is buffered already */
+    qemu_fflush(f);
+
+    offsets = g_new(uint64_t, local->nb_blocks);
+    rdma->local_fds = g_new(int, local->nb_blocks);
+    for (i = 0; i < local->nb_blocks; i++) {
+        fd = qemu_local_ram_fd(&local->block[i], &offsets[i]);
+        if (fd < 0) {
+            fprintf(stderr, "local migration: RAM block at %" PRIx64
+                    " is not a shared mapping of a file, start QEMU with "
+                    "-mem-path and -mem-prealloc\n", local->block[i].offset);
+            ret = -EINVAL;
+            goto out;
+        }
+        rdma->local_fds[rdma->nb_local_fds++] = fd;
+        offsets[i] = htonll(offsets[i]);
+    }
+
+    qemu_rdma_prepare_remote_blocks(rdma);
+    qemu_put_be32(f, local->nb_blocks);
+    qemu_put_buffer(f, (uint8_t *) rdma->block,
+                    local->nb_blocks * sizeof(RDMARemoteBlock));
+    qemu_put_buffer(f, (uint8_t *) offsets,
+                    local->nb_blocks * sizeof(uint64_t));
+    qemu_fflush(f);
+
+    ret = qemu_file_get_error(f);
+    if (!ret) {
+        rdma->local_shared = true;
+        DPRINTF("Handed %d RAM blocks over\n", local->nb_blocks);
+    }
+out:
+    qemu_local_close_fds(rdma);
+    g_free(offsets);
+    return ret;
+}
+
+/*
+ * The RAM is the dest's already: nothing to send for a page.
+ */
+static size_t qemu_local_save_page(QEMUFile *f, void *opaque,
+                                   ram_addr_t block_offset,
+                                   ram_addr_t offset, size_t size,
+                                   int *bytes_sent)
+{
+    if (bytes_sent) {
+        *bytes_sent = 0;
+    }
+    return RAM_SAVE_CONTROL_DELAYED;
+}
+
+/*
+ * Dest: map the source's RAM blocks over ours.  The guest has not run
+ * here, so nothing of the old contents is needed.
+ */
+static int qemu_local_registration_handle(QEMUFile *f, void *opaque,
+                                          uint64_t flags)
+{
+    Error *local_err = NULL;
+    QEMUFileRDMA *r = opaque;
+    RDMAContext *rdma = r->rdma;
+    RDMARemoteBlock *remote = NULL;
+    RDMALocalBlock *block;
+    uint64_t *offsets = NULL;
+    uint32_t nb;
+    void *addr;
+    int i, ret;
+
+    nb = qemu_get_be32(f);
+    if (nb > RDMA_LOCAL_MAX_FDS) {
+        fprintf(stderr, "local migration: %u RAM blocks handed over!\n", nb);
+        return -EINVAL;
+    }
+    remote = g_new(RDMARemoteBlock, nb);
+    offsets = g_new(uint64_t, nb);
+    qemu_get_buffer(f, (uint8_t *) remote, nb * sizeof(RDMARemoteBlock));
+    qemu_get_buffer(f, (uint8_t *) offsets, nb * sizeof(uint64_t));
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        goto out;
+    }
+    ret = qemu_rdma_process_remote_blocks(rdma, remote, nb, &local_err);
+    if (ret < 0) {
+        error_free(local_err);
+        goto out;
+    }
+    if (rdma->nb_local_fds != nb) {
+        fprintf(stderr, "local migration: %d fds for %u RAM blocks!\n",
+                rdma->nb_local_fds, nb);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    for (i = 0; i < nb; i++) {
+        block = g_hash_table_lookup(rdma->blockmap,
+                                    (void *) rdma->block[i].offset);
+        addr = mmap(block->local_host_addr, block->length,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                    rdma->local_fds[i], ntohll(offsets[i]));
+        if (addr == MAP_FAILED) {
+            ret = -errno;
+            fprintf(stderr, "local migration: cannot map RAM block at %"
+                    PRIx64 ": %s\n", block->offset, strerror(errno));
+            goto out;
+        }
+    }
+    DPRINTF("Mapped %u RAM blocks of the source\n", nb);
+    rdma->local_shared = true;
+
+out:
+    qemu_local_close_fds(rdma);
+    g_free(remote);
+    g_free(offsets);
+    return ret;
+}
+
+static const QEMUFileOps local_read_ops = {
+    .get_buffer    = qemu_local_get_buffer,
+    .get_fd        = qemu_local_get_fd,
+    .close         = qemu_local_close,
+    .hook_ram_load = qemu_local_registration_handle,
+};
+
+static const QEMUFileOps local_write_ops = {
+    .put_buffer         = qemu_local_put_buffer,
+    .get_fd             = qemu_local_get_fd,
+    .close              = qemu_local_close,
+    .before_ram_iterate = qemu_local_registration_start,
+    .after_ram_iterate  = qemu_local_registration_stop,
+    .save_page          = qemu_local_save_page,
+};
+
+static QEMUFile *qemu_fopen_local(int fd, const char *mode)
+{
+    QEMUFileRDMA *r = g_malloc0(sizeof(QEMUFileRDMA));
+
+    r->rdma = qemu_rdma_context_new();
+    r->rdma->local_fd = fd;
+    qemu_rdma_init_ram_blocks(r->rdma);
+
+    if (mode[0] == 'w') {
+        r->file = qemu_fopen_ops(r, &local_write_ops);
+        local_outgoing = r->rdma;
+    } else {
+        r->file = qemu_fopen_ops(r, &local_read_ops);
+    }
+
+    return r->file;
+}
+
+bool local_migration_shares_ram(void)
+{
+    return local_outgoing && local_outgoing->local_shared;
+}
+
+void local_start_outgoing_migration(void *opaque, const char *path,
+                                    Error **errp)
+{
+    MigrationState *s = opaque;
+    int fd;
+
+    fd = unix_connect(path, errp);
+    if (fd < 0) {
+        return;
+    }
+
+    s->file = qemu_fopen_local(fd, "wb");
+    migrate_fd_connect(s);
+}
+
+static void local_accept_incoming_migration(void *opaque)
+{
+    int s = (intptr_t) opaque, fd;
+
+    do {
+        fd = accept(s, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
+    close(s);
+
+    if (fd < 0) {
+        fprintf(stderr, "local migration: could not accept: %s\n",
+                strerror(errno));
+        return;
+    }
+
+    DPRINTF("Accepted local migration\n");
+    process_incoming_migration(qemu_fopen_local(fd, "rb"));
+}
+
+void local_start_incoming_migration(const char *path, Error **errp)
+{
+    int s;
+
+    s = unix_listen(path, NULL, 0, errp);
+    if (s < 0) {
+        return;
+    }
+
+    qemu_set_fd_handler2(s, NULL, local_accept_incoming_migration, NULL,
+                         (void *)(intptr_t) s);
+}
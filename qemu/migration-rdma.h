@@ -0,0 +1,203 @@
+/*
+ * RDMA migration interfaces shared with the rest of QEMU
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_RDMA_H
+#define QEMU_MIGRATION_RDMA_H
+
+#include "qemu-common.h"
+
+/*
+ * "Migration-ready" mode: called when the migration capabilities change,
+ * registers guest RAM now if x-rdma-ready was set while the VM runs, or
+ * drops the registrations if it was cleared.
+ */
+void rdma_migration_ready_update(void);
+
+/*
+ * Bytes of the outgoing migration stream that have been posted as RDMA
+ * writes but not completed yet, 0 if the migration does not use RDMA.
+ * qemu_ftell() counts them as transferred already.
+ */
+int64_t rdma_migration_inflight_bytes(void);
+
+/*
+ * What the outgoing RDMA connection could carry: the sum of the rails'
+ * write throughput while busy, in bytes per ns.  0 if the migration does
+ * not use RDMA or nothing has been measured yet.
+ */
+double rdma_migration_link_rate(void);
+
+/*
+ * Total ns the outgoing migration spent waiting for the dest to register
+ * memory, with the link idle.
+ */
+int64_t rdma_migration_stall_ns(void);
+
+/*
+ * Bytes of RAM that ",defer" holds back until their chunks cool down or
+ * the VM is stopped, 0 if the migration does not use RDMA.  They are
+ * not in the dirty bitmap any more but still have to be sent.
+ */
+int64_t rdma_migration_deferred_bytes(void);
+
+/*
+ * Called by migration_bitmap_sync() once it has the dirty log: the pages
+ * the ",free-page-agent" reported free are only skipped until the next
+ * sync, and the agent is asked again.
+ *
+ * migration_bitmap_sync() is in arch_init.c, not in this tree.  Until it
+ * calls this, the agent is never asked and every page is sent.  RdmaBench
+ * calls it where ram_save_setup() and ram_save_pending() sync.
+ */
+void rdma_migration_bitmap_synced(void);
+
+/*
+ * Pace the outgoing RDMA writes to 'bytes_per_sec', 0 for no limit.
+ * Returns false if the migration does not use RDMA, true if the pacing
+ * replaces the QEMUFile rate limit.
+ */
+bool rdma_migration_set_speed(int64_t bytes_per_sec);
+
+/*
+ * Wait for the RAM writes still in flight after
+ * qemu_savevm_state_complete() and tell the dest they have landed.
+ * Returns 0 or a negative errno.
+ */
+int rdma_migration_finish(void);
+
+/*
+ * Save the pages of the RAM block at 'block_offset' whose bits are set
+ * in 'bitmap' (indexed by ram_addr_t >> TARGET_PAGE_BITS, like the
+ * migration bitmap) from page 'start' up to 'end', in one call instead
+ * of one ram_control_save_page() per page.  The writes complete
+ * asynchronously, as with RAM_SAVE_CONTROL_DELAYED; the caller clears
+ * the bits.  Returns the number of pages queued, -ENOTSUP if the
+ * migration does not use RDMA, or a negative errno.
+ *
+ * To be called by ram_save_block() (arch_init.c, not in this tree) for
+ * the block it is in, before it walks the bitmap page by page; on
+ * -ENOTSUP it goes on as before.  RdmaBench --batch calls it that way.
+ */
+long rdma_migration_save_pages(QEMUFile *f, ram_addr_t block_offset,
+                               const unsigned long *bitmap,
+                               uint64_t start, uint64_t end);
+
+/*
+ * Block migration: send 'nb_sectors' sectors of 'device' from 'sector'
+ * on, read into 'buf', as an RDMA write instead of in the stream, up to
+ * one BLOCK_SIZE chunk at a time.  The dest writes them to its disk with
+ * bdrv_aio_writev(), and has them there before it reads the stream bytes
+ * put after them.  Returns 0, -ENOTSUP if they have to go in the stream,
+ * or a negative errno.
+ *
+ * To be called by blk_send() (block-migration.c, not in this tree) for
+ * each block that block_save_iterate() flushes, which puts the block in
+ * the stream as before on -ENOTSUP.  RdmaBench -D calls it that way.
+ */
+int rdma_migration_save_disk(QEMUFile *f, const char *device, int64_t sector,
+                             const uint8_t *buf, int nb_sectors);
+
+/*
+ * "local:PATH" migration to a QEMU on the same host: guest RAM is handed
+ * over as the fds of the shared files it is mapped from, so only the
+ * device state is sent.  It never touches verbs, but it shares
+ * RDMAContext and its RAM block list with the RDMA transport, so it is
+ * only built with CONFIG_RDMA.
+ */
+void local_start_outgoing_migration(void *opaque, const char *path,
+                                    Error **errp);
+void local_start_incoming_migration(const char *path, Error **errp);
+
+/*
+ * True once an outgoing "local:" migration has handed guest RAM over:
+ * the dest maps the same pages, so none of them is pending.
+ */
+bool local_migration_shares_ram(void);
+
+/*
+ * Counters and log2-scaled latency histograms of an RDMA migration,
+ * kept on both sides.  bucket[i] counts latencies in [2^i, 2^(i+1)) ns,
+ * the last one everything longer.
+ */
+#define RDMA_STATS_BUCKETS 32
+
+typedef struct RDMAHistogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t bucket[RDMA_STATS_BUCKETS];
+} RDMAHistogram;
+
+typedef struct RDMAStats {
+    uint64_t writes;            /* RDMA writes posted */
+    uint64_t write_bytes;
+    uint64_t registrations;     /* ibv_reg_mr() calls */
+    uint64_t unregistrations;
+    uint64_t zero_chunks;       /* chunks sent/received as COMPRESS */
+    uint64_t control_sends;
+    uint64_t control_recvs;
+    uint64_t inflight;          /* writes not completed yet */
+    uint64_t deferred;          /* pages held back by ",defer" */
+    uint64_t defer_saved;       /* ... and saved again while held back */
+    uint64_t kept;              /* pages the dest had already, ",hash" */
+    uint64_t discarded;         /* pages free in the guest, not sent */
+    uint64_t lz4_writes;        /* writes sent compressed, ",compress" */
+    uint64_t lz4_bytes;         /* ... and the RAM bytes they carried */
+    uint64_t disk_writes;       /* block migration chunks written */
+    uint64_t disk_bytes;
+    uint64_t resumes;           /* connections replaced, ",resume" */
+    RDMAHistogram registration; /* ibv_reg_mr() */
+    RDMAHistogram reg_rtt;      /* REGISTER request to result, source */
+    RDMAHistogram write;        /* write posted to completed, source */
+    RDMAHistogram control;      /* control message exchanges */
+    RDMAHistogram cq_wait;      /* blocked on the completion channel */
+} RDMAStats;
+
+/*
+ * Copy the stats of the current outgoing or incoming RDMA migration.
+ * Returns false if there is none.  Taken without locking, so values may
+ * be one update apart from each other.
+ */
+bool rdma_migration_get_stats(bool incoming, RDMAStats *stats);
+
+/*
+ * Human readable form of 'stats', to be freed with g_free().
+ */
+char *rdma_migration_stats_format(const RDMAStats *stats);
+
+/*
+ * ",record=PATH" trace of the pages an outgoing migration saved, for
+ * RdmaBench --replay: an RDMATraceHeader, then RDMATraceRecords until
+ * EOF, in host byte order.  The RAM blocks come first, then every
+ * iteration as BEGIN, its PAGEs in the order they were saved, END.
+ */
+#define RDMA_TRACE_MAGIC   0x51524d54   /* "TMRQ" on little endian */
+#define RDMA_TRACE_VERSION 1
+
+enum {
+    RDMA_TRACE_BLOCK,   /* addr: block offset, len: length in pages */
+    RDMA_TRACE_BEGIN,   /* addr: RAM_CONTROL_* */
+    RDMA_TRACE_PAGE,    /* addr: ram_addr_t, len: bytes, 0 for a hint */
+    RDMA_TRACE_END,     /* addr: RAM_CONTROL_* */
+};
+
+typedef struct RDMATraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_bits;
+    uint32_t padding;
+} RDMATraceHeader;
+
+typedef struct RDMATraceRecord {
+    uint8_t type;
+    uint8_t padding[3];
+    uint32_t len;
+    uint64_t time;      /* ns since the header was written */
+    uint64_t addr;
+} RDMATraceRecord;
+
+#endif
@@ -13,6 +13,7 @@
  * GNU GPL, version 2 or (at your option) any later version.
  */
 
+#include <math.h>
 #include "qemu-common.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
@@ -24,7 +25,11 @@
 #include "migration/block.h"
 #include "qemu/thread.h"
 #include "qmp-commands.h"
+#include "qom/cpu.h"
 #include "trace.h"
+#ifdef CONFIG_RDMA
+#include "migration-rdma.h"
+#endif
 
 enum {
     MIG_STATE_ERROR = -1,
@@ -76,6 +81,12 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         rdma_start_incoming_migration(p, errp);
     else if (strstart(uri, "rdmat:", &p))
         rdma_start_incoming_migration2(p, errp);
+    else if (strstart(uri, "local:", &p))
+        local_start_incoming_migration(p, errp);
+#else
+    /* local: reuses the RAM block handling of migration-rdma.c */
+    else if (strstart(uri, "local:", &p))
+        error_setg(errp, "local: migration needs QEMU built with RDMA");
 #endif
 #if !defined(WIN32)
     else if (strstart(uri, "exec:", &p))
@@ -180,6 +191,39 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
     }
 }
 
+#ifdef CONFIG_RDMA
+/* Taken when an RDMA migration completes, its context is gone after that */
+static RDMAStats rdma_stats;
+static bool rdma_stats_valid;
+
+static void get_rdma_stats(MigrationInfo *info, bool completed)
+{
+    RDMAStats live;
+    const RDMAStats *st = &live;
+
+    if (completed) {
+        if (!rdma_stats_valid) {
+            return;
+        }
+        st = &rdma_stats;
+    } else if (!rdma_migration_get_stats(false, &live)) {
+        return;
+    }
+
+    info->has_rdma = true;
+    info->rdma = g_malloc0(sizeof(*info->rdma));
+    info->rdma->writes = st->writes;
+    info->rdma->write_bytes = st->write_bytes;
+    info->rdma->inflight = st->inflight;
+    info->rdma->registrations = st->registrations;
+    info->rdma->unregistrations = st->unregistrations;
+    info->rdma->zero_chunks = st->zero_chunks;
+    info->rdma->control_sends = st->control_sends;
+    info->rdma->control_recvs = st->control_recvs;
+    info->rdma->resumes = st->resumes;
+}
+#endif
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -227,9 +271,15 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+#ifdef CONFIG_RDMA
+        get_rdma_stats(info, false);
+#endif
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+#ifdef CONFIG_RDMA
+        get_rdma_stats(info, true);
+#endif
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -278,6 +328,9 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     for (cap = params; cap; cap = cap->next) {
         s->enabled_capabilities[cap->value->capability] = cap->value->state;
     }
+#ifdef CONFIG_RDMA
+    rdma_migration_ready_update();
+#endif
 }
 
 /* shared migration helpers */
@@ -384,6 +437,9 @@ static MigrationState *migrate_init(const MigrationParams *params)
     s->xbzrle_cache_size = xbzrle_cache_size;
 
     s->bandwidth_limit = bandwidth_limit;
+#ifdef CONFIG_RDMA
+    rdma_stats_valid = false;
+#endif
     s->state = MIG_STATE_SETUP;
     trace_migrate_set_state(MIG_STATE_SETUP);
 
@@ -439,6 +495,20 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         rdma_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "rdmat:", &p)) {
         rdma_start_outgoing_migration2(s, p, &local_err);
+    } else if (strstart(uri, "local:", &p)) {
+        if (params.blk) {
+            error_setg(errp, "local: migration shares the disks, "
+                       "it cannot migrate them");
+            s->state = MIG_STATE_ERROR;
+            return;
+        }
+        local_start_outgoing_migration(s, p, &local_err);
+#else
+    } else if (strstart(uri, "local:", &p)) {
+        /* local: reuses the RAM block handling of migration-rdma.c */
+        error_setg(errp, "local: migration needs QEMU built with RDMA");
+        s->state = MIG_STATE_ERROR;
+        return;
 #endif
 #if !defined(WIN32)
     } else if (strstart(uri, "exec:", &p)) {
@@ -500,6 +570,28 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+/*
+ * Set once migrate_set_speed has been called.  The file limit does not
+ * see the RAM an RDMA migration writes, so until then the default
+ * MAX_THROTTLE never applied to it and must not start to.
+ */
+static bool bandwidth_limit_set;
+
+static void migrate_set_rate_limit(MigrationState *s)
+{
+    int64_t limit = s->bandwidth_limit / XFER_LIMIT_RATIO;
+
+#ifdef CONFIG_RDMA
+    /* RDMA paces its own writes, the file limit would only add bursts */
+    if (rdma_migration_set_speed(bandwidth_limit_set ?
+                                 s->bandwidth_limit : 0) &&
+        bandwidth_limit_set) {
+        limit = INT64_MAX;
+    }
+#endif
+    qemu_file_set_rate_limit(s->file, limit);
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -513,8 +605,9 @@ void qmp_migrate_set_speed(int64_t value, Error **errp)
 
     s = migrate_get_current();
     s->bandwidth_limit = value;
+    bandwidth_limit_set = true;
     if (s->file) {
-        qemu_file_set_rate_limit(s->file, s->bandwidth_limit / XFER_LIMIT_RATIO);
+        migrate_set_rate_limit(s);
     }
 }
 
@@ -534,6 +627,15 @@ bool migrate_rdma_pin_all(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_RDMA_PIN_ALL];
 }
 
+bool migrate_rdma_ready(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_RDMA_READY];
+}
+
 bool migrate_auto_converge(void)
 {
     MigrationState *s;
@@ -572,6 +674,245 @@ int64_t migrate_xbzrle_cache_size(void)
 
 /* migration thread support */
 
+/*
+ * Transfer estimates, updated every ESTIMATE_INTERVAL (ns) rather than
+ * every BUFFER_DELAY, so that max_size follows the link closely enough to
+ * switch to stop-and-copy as soon as the remaining data fits the downtime.
+ *
+ * Bandwidth is measured on completed bytes: with RDMA qemu_ftell() counts
+ * writes when they are posted, not when they land.
+ * The dirty rate is measured per iteration, from how much a dirty bitmap
+ * sync adds to the pending data.
+ */
+#define ESTIMATE_INTERVAL (10 * 1000 * 1000)
+#define ESTIMATE_WEIGHT   0.25      /* EWMA weight of a new sample */
+
+typedef struct MigrationEstimate {
+    int64_t last_time;          /* ns */
+    uint64_t last_bytes;        /* completed bytes at last_time */
+    double bandwidth;           /* bytes per ns */
+    int64_t sync_time;          /* ns, last dirty bitmap sync seen */
+    uint64_t last_pending;
+    double dirty_rate;          /* bytes per ns */
+    unsigned int syncs;         /* dirty rate samples taken */
+    int64_t remaining;          /* ns until completion, -1 if not converging */
+} MigrationEstimate;
+
+static MigrationEstimate estimate;
+
+static double ewma(double avg, double sample)
+{
+    return avg ? avg * (1 - ESTIMATE_WEIGHT) + sample * ESTIMATE_WEIGHT
+               : sample;
+}
+
+static uint64_t migration_completed_bytes(MigrationState *s)
+{
+    uint64_t bytes = qemu_ftell(s->file);
+
+#ifdef CONFIG_RDMA
+    bytes -= rdma_migration_inflight_bytes();
+#endif
+    return bytes;
+}
+
+static void migration_estimate_init(MigrationState *s)
+{
+    memset(&estimate, 0, sizeof(estimate));
+    estimate.last_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    estimate.last_bytes = migration_completed_bytes(s);
+    estimate.remaining = -1;
+}
+
+/*
+ * Called with every pending size the iteration loop sees.
+ */
+static void migration_estimate_pending(uint64_t pending)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    if (!estimate.sync_time) {
+        estimate.sync_time = now;
+    } else if (pending > estimate.last_pending) {
+        /* a sync added what the guest dirtied since the previous one */
+        if (now > estimate.sync_time) {
+            estimate.dirty_rate = ewma(estimate.dirty_rate,
+                                       (double) (pending - estimate.last_pending)
+                                       / (now - estimate.sync_time));
+            estimate.syncs++;
+        }
+        estimate.sync_time = now;
+    }
+    estimate.last_pending = pending;
+}
+
+/*
+ * Returns true if the estimates were updated.
+ */
+static bool migration_estimate_update(MigrationState *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    uint64_t bytes, max_size;
+    double net;
+
+    if (now - estimate.last_time < ESTIMATE_INTERVAL) {
+        return false;
+    }
+
+    bytes = migration_completed_bytes(s);
+    if (bytes > estimate.last_bytes) {
+        estimate.bandwidth = ewma(estimate.bandwidth,
+                                  (double) (bytes - estimate.last_bytes)
+                                  / (now - estimate.last_time));
+    }
+    estimate.last_time = now;
+    estimate.last_bytes = bytes;
+
+    if (!estimate.bandwidth) {
+        return false;
+    }
+
+    /*
+     * The pending data shrinks at bandwidth - dirty rate until it fits
+     * in max_size, which then takes the downtime to send.
+     */
+    max_size = estimate.bandwidth * migrate_max_downtime();
+    net = estimate.bandwidth - estimate.dirty_rate;
+    if (estimate.last_pending <= max_size) {
+        estimate.remaining = estimate.last_pending / estimate.bandwidth;
+    } else if (net > 0) {
+        estimate.remaining = (estimate.last_pending - max_size) / net +
+                             migrate_max_downtime();
+    } else {
+        estimate.remaining = -1;
+    }
+
+    return true;
+}
+
+/*
+ * Auto-converge for RDMA migrations.  Once per dirty rate sample a PI
+ * controller picks the fraction of time the vCPUs sleep, aiming for the
+ * smallest throttle that shrinks the pending data to max_size within
+ * THROTTLE_ITERATIONS iterations.
+ *
+ * The measured dirty rate already includes the current throttle; it is
+ * compared with what the link carries when busy: completed bandwidth
+ * without the time spent waiting on dest registrations, which are not
+ * repeated once a chunk is registered, and no more than the rails' rate.
+ */
+#define THROTTLE_PERIOD     (20 * 1000)     /* us */
+#define THROTTLE_ITERATIONS 4
+#define THROTTLE_MIN_RATIO  0.05
+#define THROTTLE_MAX        0.95
+#define THROTTLE_KP         0.3
+#define THROTTLE_KI         0.5
+
+typedef struct MigrationThrottle {
+    double level;               /* fraction of THROTTLE_PERIOD asleep */
+    double last_error;
+    unsigned int syncs;         /* estimate.syncs last acted on */
+    int64_t last_time;          /* ns */
+    int64_t last_stall;         /* rdma_migration_stall_ns() at last_time */
+    int64_t last_kick;          /* ns */
+    unsigned long sleep_us;
+} MigrationThrottle;
+
+static MigrationThrottle throttle;
+
+static void migration_throttle_init(void)
+{
+    memset(&throttle, 0, sizeof(throttle));
+    throttle.last_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+#ifdef CONFIG_RDMA
+    throttle.last_stall = rdma_migration_stall_ns();
+#endif
+}
+
+static void migration_throttle_update(uint64_t max_size)
+{
+#ifdef CONFIG_RDMA
+    int64_t now, stall;
+    double link, idle = 0, bw, ratio, target, error;
+
+    if (!migrate_auto_converge() || throttle.syncs == estimate.syncs) {
+        return;
+    }
+    link = rdma_migration_link_rate();
+    if (!link) {
+        return;
+    }
+    throttle.syncs = estimate.syncs;
+
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    stall = rdma_migration_stall_ns();
+    if (now > throttle.last_time) {
+        idle = (double) (stall - throttle.last_stall) /
+               (now - throttle.last_time);
+    }
+    throttle.last_time = now;
+    throttle.last_stall = stall;
+    bw = MIN(estimate.bandwidth / (1 - MIN(idle, 0.9)), link);
+
+    /*
+     * An iteration leaves dirty_rate / bw of what it sent to be sent
+     * again, so the pending data shrinks by that ratio per iteration.
+     */
+    ratio = estimate.dirty_rate / bw;
+    if (estimate.last_pending > max_size) {
+        target = pow((double) max_size / estimate.last_pending,
+                     1.0 / THROTTLE_ITERATIONS);
+        target = MAX(target, THROTTLE_MIN_RATIO);
+    } else {
+        target = 1;
+    }
+
+    /*
+     * If the dirty rate scales with the time the vCPUs run, this is how
+     * much more of it to take away to hit the target.  Applied in
+     * velocity form, so the level saturating cannot wind the integral up.
+     */
+    error = ratio > 0 ? (1 - throttle.level) * (1 - target / ratio) : -1;
+    error = MAX(error, -1);
+    throttle.level += THROTTLE_KP * (error - throttle.last_error) +
+                      THROTTLE_KI * error;
+    throttle.level = MIN(MAX(throttle.level, 0), THROTTLE_MAX);
+    throttle.last_error = error;
+#endif
+}
+
+static void migration_throttle_cpu(void *opaque)
+{
+    qemu_mutex_unlock_iothread();
+    g_usleep(throttle.sleep_us);
+    qemu_mutex_lock_iothread();
+}
+
+/*
+ * Put every vCPU to sleep for its share of THROTTLE_PERIOD.
+ */
+static void migration_throttle_kick(void)
+{
+    CPUState *cpu;
+    int64_t now;
+
+    if (throttle.level <= 0) {
+        return;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (now - throttle.last_kick < THROTTLE_PERIOD * 1000LL) {
+        return;
+    }
+    throttle.last_kick = now;
+    throttle.sleep_us = throttle.level * THROTTLE_PERIOD;
+
+    qemu_mutex_lock_iothread();
+    CPU_FOREACH(cpu) {
+        async_run_on_cpu(cpu, migration_throttle_cpu, NULL);
+    }
+    qemu_mutex_unlock_iothread();
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -583,6 +924,8 @@ static void *migration_thread(void *opaque)
     bool old_vm_running = false;
 
     qemu_savevm_state_begin(s->file, &s->params);
+    migration_estimate_init(s);
+    migration_throttle_init();
 
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ACTIVE);
@@ -593,7 +936,15 @@ static void *migration_thread(void *opaque)
 
         if (!qemu_file_rate_limit(s->file)) {
             pending_size = qemu_savevm_state_pending(s->file, max_size);
+#ifdef CONFIG_RDMA
+            pending_size += rdma_migration_deferred_bytes();
+            /* local: the dest has the RAM already, stop right away */
+            if (local_migration_shares_ram()) {
+                pending_size = 0;
+            }
+#endif
             trace_migrate_pending(pending_size, max_size);
+            migration_estimate_pending(pending_size);
             if (pending_size && pending_size >= max_size) {
                 qemu_savevm_state_iterate(s->file);
             } else {
@@ -607,7 +958,16 @@ static void *migration_thread(void *opaque)
                 ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
                 if (ret >= 0) {
                     qemu_file_set_rate_limit(s->file, INT64_MAX);
+#ifdef CONFIG_RDMA
+                    /* nor pace the last writes, they add to the downtime */
+                    rdma_migration_set_speed(0);
+#endif
                     qemu_savevm_state_complete(s->file);
+#ifdef CONFIG_RDMA
+                    ret = rdma_migration_finish();
+                    rdma_stats_valid = rdma_migration_get_stats(false,
+                                                                &rdma_stats);
+#endif
                 }
                 qemu_mutex_unlock_iothread();
 
@@ -627,23 +987,28 @@ static void *migration_thread(void *opaque)
             migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
             break;
         }
+        if (migration_estimate_update(s)) {
+            max_size = estimate.bandwidth * migrate_max_downtime();
+
+            /*
+             * What stopping would cost: the data pending then, which is
+             * no more than max_size once we converge.
+             */
+            s->expected_downtime = (estimate.remaining < 0 ?
+                                    estimate.last_pending :
+                                    MIN(estimate.last_pending, max_size))
+                                   / estimate.bandwidth / 1000000;
+            s->mbps = estimate.bandwidth * 8.0 * 1000.0;
+            migration_throttle_update(max_size);
+        }
+        migration_throttle_kick();
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         if (current_time >= initial_time + BUFFER_DELAY) {
             uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
             uint64_t time_spent = current_time - initial_time;
-            double bandwidth = transferred_bytes / time_spent;
-            max_size = bandwidth * migrate_max_downtime() / 1000000;
-
-            s->mbps = time_spent ? (((double) transferred_bytes * 8.0) /
-                    ((double) time_spent / 1000.0)) / 1000.0 / 1000.0 : -1;
 
             trace_migrate_transferred(transferred_bytes, time_spent,
-                                      bandwidth, max_size);
-            /* if we haven't sent anything, we don't want to recalculate
-               10000 is a small enough number for our purposes */
-            if (s->dirty_bytes_rate && transferred_bytes > 10000) {
-                s->expected_downtime = s->dirty_bytes_rate / bandwidth;
-            }
+                                      estimate.bandwidth * 1000000, max_size);
 
             qemu_file_reset_rate_limit(s->file);
             initial_time = current_time;
@@ -681,8 +1046,7 @@ void migrate_fd_connect(MigrationState *s)
     s->expected_downtime = max_downtime/1000000;
     s->cleanup_bh = qemu_bh_new(migrate_fd_cleanup, s);
 
-    qemu_file_set_rate_limit(s->file,
-                             s->bandwidth_limit / XFER_LIMIT_RATIO);
+    migrate_set_rate_limit(s);
 
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Runs inside the guest, as root, and tells the migration source which
+// guest physical pages are free, so that ",free-page-agent=HOST:PORT"
+// migrations do not send them.
+//
+// The source sends a request after every dirty bitmap sync:
+//     uint32_t magic, uint32_t seq
+// and the agent answers with the free ranges it finds now:
+//     uint32_t magic, uint32_t seq, uint64_t nb_ranges
+//     nb_ranges x { uint64_t gpa, uint64_t length }
+// all big endian. A page that is allocated again after the scan is
+// written before it is used, so the source sees it dirty and sends it
+// in a later round.
+//
+// Free pages are the ones /proc/kpageflags marks KPF_BUDDY, which Linux
+// 4.6 and later sets on every page of a free buddy block, not only the
+// first one.
+
+/******** SETTINGS *********/
+// Port the source connects to
+#define DEFAULT_PORT (4445)
+// Shortest run of free pages reported, to keep replies small
+#define DEFAULT_MIN_PAGES (16)
+/******** SETTINGS *********/
+
+#define AGENT_MAGIC (0x46524545)    // "FREE"
+#define KPF_BUDDY (10)
+// Page frames read from /proc/kpageflags at once
+#define SCAN_BATCH (65536)
+
+int port = DEFAULT_PORT;
+int minPages = DEFAULT_MIN_PAGES;
+long pageSize;
+
+uint64_t flags[SCAN_BATCH];
+// The reply header, then the ranges, so that a reply is written at once
+// and does not wait for the delayed ACK of its header
+uint64_t* reply;
+uint64_t nbRanges, maxRanges;
+
+// The dest zeroes the pages it is told are free. With page poisoning the
+// guest checks on allocation that free pages still hold the poison.
+int poisoned() {
+    char cmdline[4096];
+    FILE* f = fopen("/proc/cmdline", "r");
+    size_t n;
+
+    if (!f) {
+        return 0;
+    }
+    n = fread(cmdline, 1, sizeof(cmdline) - 1, f);
+    fclose(f);
+    cmdline[n] = 0;
+
+    return strstr(cmdline, "page_poison=1") ||
+           strstr(cmdline, "page_poison=on") ||
+           strstr(cmdline, "page_poison=y");
+}
+
+void addRange(uint64_t pfn, uint64_t pages) {
+    if (pages < minPages) {
+        return;
+    }
+    if (nbRanges == maxRanges) {
+        maxRanges = maxRanges ? maxRanges * 2 : 4096;
+        reply = realloc(reply, (maxRanges + 1) * 2 * sizeof(uint64_t));
+        if (!reply) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    reply[(nbRanges + 1) * 2] = htobe64(pfn * pageSize);
+    reply[(nbRanges + 1) * 2 + 1] = htobe64(pages * pageSize);
+    nbRanges++;
+}
+
+// Fill 'reply' with the runs of free pages. Returns -1 if
+// /proc/kpageflags cannot be read.
+int scan() {
+    int fd = open("/proc/kpageflags", O_RDONLY);
+    uint64_t pfn = 0, runStart = 0, runPages = 0;
+    ssize_t n;
+    int i;
+
+    if (fd < 0) {
+        perror("/proc/kpageflags");
+        return -1;
+    }
+
+    nbRanges = 0;
+    while ((n = pread(fd, flags, sizeof(flags), pfn * sizeof(uint64_t))) > 0) {
+        for (i = 0; i < n / sizeof(uint64_t); i++, pfn++) {
+            if (flags[i] & (1ULL << KPF_BUDDY)) {
+                if (!runPages) {
+                    runStart = pfn;
+                }
+                runPages++;
+            } else if (runPages) {
+                addRange(runStart, runPages);
+                runPages = 0;
+            }
+        }
+    }
+    if (runPages) {
+        addRange(runStart, runPages);
+    }
+
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+int writeAll(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int readAll(int fd, void* buf, size_t len) {
+    char* p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Answer the requests of one migration until the source goes away
+void serve(int conn) {
+    uint32_t req[2];
+
+    while (!readAll(conn, req, sizeof(req))) {
+        if (be32toh(req[0]) != AGENT_MAGIC) {
+            fprintf(stderr, "bad request, closing\n");
+            return;
+        }
+
+        if (scan() < 0) {
+            nbRanges = 0;
+        }
+
+        ((uint32_t*)reply)[0] = htobe32(AGENT_MAGIC);
+        ((uint32_t*)reply)[1] = req[1];
+        reply[1] = htobe64(nbRanges);
+        if (writeAll(conn, reply, (nbRanges + 1) * 2 * sizeof(uint64_t))) {
+            return;
+        }
+    }
+}
+
+int main(int argc, const char* argv[]) {
+    struct sockaddr_in addr;
+    int sock, conn, one = 1;
+
+    if (argc > 1) {
+        port = atoi(argv[1]);
+    }
+    if (argc > 2) {
+        minPages = atoi(argv[2]);
+    }
+    pageSize = sysconf(_SC_PAGESIZE);
+    reply = malloc(2 * sizeof(uint64_t));
+    if (!reply) {
+        perror("malloc");
+        exit(1);
+    }
+
+    if (poisoned()) {
+        printf("Free pages are poisoned (page_poison=1), refusing to run\n");
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) || listen(sock, 1)) {
+        perror("bind");
+        exit(1);
+    }
+
+    printf("Reporting free pages on port %d\n", port);
+    fflush(stdout);
+
+    while (1) {
+        conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            continue;
+        }
+        serve(conn);
+        close(conn);
+    }
+}